@@ -2,6 +2,7 @@ Import("env", "projenv")
 
 import os
 import re
+import zlib
 
 with open(os.path.join('src', 'firmware_basename'), 'r') as f:
     firmware_basename = f.read().strip()
@@ -47,3 +48,22 @@ env.AddPostAction(
         "0x10000", "$BUILD_DIR/${PROGNAME}.bin"
     ]), "Merging firmware.bin")
 )
+
+# The window has to match GZIP_DECODER_WINDOW_BITS in modules/backend/firmware_update/gzip_decoder.h:
+# The firmware only keeps the last 2^12 bytes while decompressing.
+def compress_merged_firmware(target, source, env):
+    merged = "build/{}_merged.bin".format(firmware_basename)
+
+    with open(merged, 'rb') as f:
+        data = f.read()
+
+    compressor = zlib.compressobj(9, zlib.DEFLATED, 16 + 12, 9)
+
+    with open(merged + ".gz", 'wb') as f:
+        f.write(compressor.compress(data))
+        f.write(compressor.flush())
+
+env.AddPostAction(
+    "$BUILD_DIR/${PROGNAME}.bin",
+    env.VerboseAction(compress_merged_firmware, "Compressing merged firmware")
+)
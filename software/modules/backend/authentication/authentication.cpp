@@ -25,6 +25,7 @@
 #include "event_log.h"
 #include "web_server.h"
 #include "build.h"
+#include "session_auth.h"
 
 #include "login.html.h"
 
@@ -38,6 +39,7 @@ Authentication::Authentication()
         {"enable_auth", Config::Bool(false)},
         {"username", Config::Str("", 64)},
         {"password", Config::Str("", 64)},
+        {"session_lifetime", Config::Uint(60, 0, 10080)},
     }, [](Config::ConfObject &update) {
         if (update.get("enable_auth")->asBool() && update.get("password")->asString() == "")
             return String("Authentication can not be enabled if no password is set.");
@@ -50,6 +52,25 @@ Authentication::Authentication()
 
         return String("");
     });
+
+    authentication_revoke_sessions = Config::Null();
+}
+
+// Sends body and a new session token as cookie. Subsequent requests with the cookie
+// skip the digest authentication.
+static void send_with_session_cookie(WebServerRequest &request, const char *body)
+{
+    char token[SESSION_TOKEN_LEN + 1];
+    // Has to live until the response is sent.
+    char cookie[sizeof(SESSION_COOKIE_NAME "=; Max-Age=4294967295; Path=/; HttpOnly; SameSite=Strict") + SESSION_TOKEN_LEN];
+
+    if (createSessionToken(token)) {
+        snprintf(cookie, sizeof(cookie), SESSION_COOKIE_NAME "=%s; Max-Age=%u; Path=/; HttpOnly; SameSite=Strict", token, getSessionLifetime());
+        request.addResponseHeader("Set-Cookie", cookie);
+        request.addResponseHeader("Cache-Control", "no-store");
+    }
+
+    request.send(200, "text/plain", body);
 }
 
 void Authentication::setup()
@@ -61,6 +82,7 @@ void Authentication::setup()
         String pass = authentication_config.get("password")->asString();
 
         server.setAuthentication(user.c_str(), pass.c_str());
+        setSessionLifetime(authentication_config.get("session_lifetime")->asUint() * 60);
         logger.printfln("Web interface authentication enabled.");
     }
 
@@ -83,8 +105,12 @@ void Authentication::register_urls()
                 return;
             }
 
+            // The main page is served under the same URL, so the login page needs its own ETag.
+            request.addResponseHeader("Cache-Control", "no-cache");
+            if (request.checkETag("\"" BUILD_TIMESTAMP_HEX_STR "-login\""))
+                return;
+
             request.addResponseHeader("Content-Encoding", "gzip");
-            request.addResponseHeader("ETag", BUILD_TIMESTAMP_HEX_STR);
             request.send(200, "text/html", login_html_gz, login_html_gz_len);
         } else if (request.uri() == "/login_state") {
             // Same reasoning as above. If we don't force Safari, it does not send credentials, which breaks the login_state check.
@@ -102,12 +128,29 @@ void Authentication::register_urls()
         }
     });
 
+    api.addCommand("authentication/revoke_sessions", &authentication_revoke_sessions, {}, [](){
+        revokeAllSessionTokens();
+        logger.printfln("Revoked all login sessions.");
+    }, true);
+
     server.on("/credential_check", HTTP_GET, [](WebServerRequest request) {
-        request.send(200, "text/plain", "Credentials okay");
+        send_with_session_cookie(request, "Credentials okay");
     });
 
     server.on("/login_state", HTTP_GET, [](WebServerRequest request) {
-        request.send(200, "text/plain", "Logged in");
+        send_with_session_cookie(request, "Logged in");
+    });
+
+    server.on("/logout", HTTP_GET, [](WebServerRequest request) {
+        char buf[512];
+        const char *token;
+        int token_len = getSessionToken(request, buf, sizeof(buf), &token);
+        if (token_len > 0)
+            revokeSessionToken(token, token_len);
+
+        request.addResponseHeader("Set-Cookie", SESSION_COOKIE_NAME "=; Max-Age=0; Path=/; HttpOnly; SameSite=Strict");
+        request.addResponseHeader("Cache-Control", "no-store");
+        request.send(200, "text/plain", "Logged out");
     });
 }
 
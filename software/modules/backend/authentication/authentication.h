@@ -32,4 +32,5 @@ public:
 
 private:
     Config authentication_config;
+    Config authentication_revoke_sessions;
 };
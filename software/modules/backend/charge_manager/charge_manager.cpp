@@ -41,6 +41,8 @@ extern API api;
 extern TaskScheduler task_scheduler;
 extern char uid[7];
 
+static EventLogModule log_module{"charge_manager"};
+
 // Keep in sync with cm_networing.h
 #define MAX_CLIENTS 10
 
@@ -149,7 +151,7 @@ uint8_t get_charge_state(uint8_t vehicle_state, uint8_t iec61851_state, uint8_t
     if (charge_release == 3 && target_allocated_current > 0)
         return 3;
 
-    logger.printfln("Unknown state!");
+    logger.printfln_at(EventLogLevel::ERROR, &log_module, "Unknown state!");
     return 5;
 }
 
@@ -181,7 +183,7 @@ void ChargeManager::start_manager_task()
             // is not working. As last_update will now hang too,
             // the management will stop all charging after some time.
             if(target.get("uptime")->asUint() == uptime) {
-                logger.printfln("Received stale charger state from %s (%s). Reported EVSE uptime (%u) is the same as in the last state. Is the EVSE still reachable?",
+                LOG_RATE_LIMITED(&log_module, EventLogLevel::WARNING, "Received stale charger state from %s (%s). Reported EVSE uptime (%u) is the same as in the last state. Is the EVSE still reachable?",
                     chargers[client_id].get("name")->asString().c_str(), chargers[client_id].get("host")->asString().c_str(),
                     uptime);
                 if (deadline_elapsed(target.get("last_update")->asUint() + 10000)) {
@@ -287,7 +289,7 @@ void ChargeManager::check_watchdog()
 
     uint32_t default_available_current = this->charge_manager_config_in_use.get("default_available_current")->asUint();
 
-    logger.printfln("Charge manager watchdog triggered! Received no available current update for %d ms. Setting available current to %u mA", WATCHDOG_TIMEOUT_MS, default_available_current);
+    logger.printfln_at(EventLogLevel::WARNING, &log_module, "Charge manager watchdog triggered! Received no available current update for %d ms. Setting available current to %u mA", WATCHDOG_TIMEOUT_MS, default_available_current);
 
     this->charge_manager_available_current.get("current")->updateUint(default_available_current);
 
@@ -25,6 +25,8 @@
 
 extern TaskScheduler task_scheduler;
 
+static EventLogModule log_module{"cm_networking"};
+
 CMNetworking::CMNetworking()
 {
 
@@ -55,25 +57,25 @@ int CMNetworking::create_socket(uint16_t port) {
 
     sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
     if (sock < 0) {
-        logger.printfln("Unable to create socket: errno %d", errno);
+        logger.printfln_at(EventLogLevel::ERROR, &log_module, "Unable to create socket: errno %d", errno);
         return -1;
     }
 
     int err = bind(sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
     if (err < 0) {
-        logger.printfln("Socket unable to bind: errno %d", errno);
+        logger.printfln_at(EventLogLevel::ERROR, &log_module, "Socket unable to bind: errno %d", errno);
         return -1;
     }
 
     int flags = fcntl(sock, F_GETFL, 0);
     if (flags < 0) {
-        logger.printfln("Failed to get flags from socket: errno %d", errno);
+        logger.printfln_at(EventLogLevel::ERROR, &log_module, "Failed to get flags from socket: errno %d", errno);
         return -1;
     }
 
     err = fcntl(sock, F_SETFL, flags | O_NONBLOCK);
     if (err < 0) {
-        logger.printfln("Failed to set O_NONBLOCK flag: errno %d", errno);
+        logger.printfln_at(EventLogLevel::ERROR, &log_module, "Failed to set O_NONBLOCK flag: errno %d", errno);
         return -1;
     }
 
@@ -120,12 +122,12 @@ void CMNetworking::register_manager(const std::vector<String> &hosts,
 
         if (len < 0) {
             if (errno != EAGAIN && errno != EWOULDBLOCK)
-                logger.printfln("recvfrom failed: errno %d", errno);
+                LOG_RATE_LIMITED(&log_module, EventLogLevel::ERROR, "recvfrom failed: errno %d", errno);
             return;
         }
 
         if (len != sizeof(response_packet)) {
-            logger.printfln("Received datagram of wrong size %d from %s", len, inet_ntoa(source_addr.sin_addr));
+            logger.printfln_at(EventLogLevel::WARNING, &log_module, "Received datagram of wrong size %d from %s", len, inet_ntoa(source_addr.sin_addr));
             return;
         }
 
@@ -139,7 +141,7 @@ void CMNetworking::register_manager(const std::vector<String> &hosts,
             }
 
         if (charger_idx == -1) {
-            logger.printfln("Received packet from unknown %s. Is the configuration complete?", inet_ntoa(source_addr.sin_addr));
+            logger.printfln_at(EventLogLevel::WARNING, &log_module, "Received packet from unknown %s. Is the configuration complete?", inet_ntoa(source_addr.sin_addr));
             return;
         }
 
@@ -147,7 +149,7 @@ void CMNetworking::register_manager(const std::vector<String> &hosts,
         memcpy(&response, recv_buf, sizeof(response));
 
         if (response.header.seq_num <= last_seen_seq_num[charger_idx] && last_seen_seq_num[charger_idx] - response.header.seq_num < 5) {
-            logger.printfln("Received stale (out of order?) packet from %s (%s). Last seen seq_num is %u, Received seq_num is %u",
+            logger.printfln_at(EventLogLevel::WARNING, &log_module, "Received stale (out of order?) packet from %s (%s). Last seen seq_num is %u, Received seq_num is %u",
                 names[charger_idx].c_str(),
                 inet_ntoa(source_addr.sin_addr),
                 last_seen_seq_num[charger_idx],
@@ -157,7 +159,7 @@ void CMNetworking::register_manager(const std::vector<String> &hosts,
 
         if (response.header.version != PROTOCOL_VERSION) {
             manager_error_callback(charger_idx, CM_NETWORKING_ERROR_FW_MISMATCH);
-            logger.printfln("Received packet from %s (%s) with incompatible firmware. Our protocol version is %u, received packet had %u",
+            logger.printfln_at(EventLogLevel::ERROR, &log_module, "Received packet from %s (%s) with incompatible firmware. Our protocol version is %u, received packet had %u",
                 names[charger_idx].c_str(),
                 inet_ntoa(source_addr.sin_addr),
                 PROTOCOL_VERSION,
@@ -169,7 +171,7 @@ void CMNetworking::register_manager(const std::vector<String> &hosts,
 
         if (!response.managed) {
             manager_error_callback(charger_idx, CM_NETWORKING_ERROR_NOT_MANAGED);
-            logger.printfln("%s (%s) reports managed is not activated!",
+            logger.printfln_at(EventLogLevel::WARNING, &log_module, "%s (%s) reports managed is not activated!",
                 names[charger_idx].c_str(),
                 inet_ntoa(source_addr.sin_addr));
             return;
@@ -212,11 +214,11 @@ bool CMNetworking::send_manager_update(uint8_t client_id, uint16_t allocated_cur
             return true;
         }
 
-        logger.printfln("Failed to send: %s %d", strerror(errno), errno);
+        logger.printfln_at(EventLogLevel::ERROR, &log_module, "Failed to send: %s %d", strerror(errno), errno);
         return true;
     }
     if (err != sizeof(request)) {
-        logger.printfln("Failed to send. sendto truncated request (of %u bytes) to %d bytes.", sizeof(request), err);
+        logger.printfln_at(EventLogLevel::ERROR, &log_module, "Failed to send. sendto truncated request (of %u bytes) to %d bytes.", sizeof(request), err);
         return true;
     }
     return true;
@@ -241,12 +243,12 @@ void CMNetworking::register_client(std::function<void(uint16_t)> client_callback
 
         if (len < 0) {
             if (errno != EAGAIN && errno != EWOULDBLOCK)
-                logger.printfln("recvfrom failed: errno %d", errno);
+                LOG_RATE_LIMITED(&log_module, EventLogLevel::ERROR, "recvfrom failed: errno %d", errno);
             return;
         }
 
         if (len != sizeof(request_packet)) {
-            logger.printfln("received datagram of wrong size %d", len);
+            logger.printfln_at(EventLogLevel::WARNING, &log_module, "received datagram of wrong size %d", len);
             return;
         }
 
@@ -254,12 +256,12 @@ void CMNetworking::register_client(std::function<void(uint16_t)> client_callback
         memcpy(&request, recv_buf, sizeof(request));
 
         if (request.header.seq_num <= last_seen_seq_num && last_seen_seq_num - request.header.seq_num < 5) {
-            logger.printfln("received stale (out of order?) packet. last seen seq_num is %u, received seq_num is %u", last_seen_seq_num, request.header.seq_num);
+            logger.printfln_at(EventLogLevel::WARNING, &log_module, "received stale (out of order?) packet. last seen seq_num is %u, received seq_num is %u", last_seen_seq_num, request.header.seq_num);
             return;
         }
 
         if (request.header.version != PROTOCOL_VERSION) {
-            logger.printfln("received packet from box with incompatible firmware. Our protocol version is %u, received packet had %u",
+            logger.printfln_at(EventLogLevel::ERROR, &log_module, "received packet from box with incompatible firmware. Our protocol version is %u, received packet had %u",
                 PROTOCOL_VERSION,
                 request.header.version);
             return;
@@ -313,11 +315,11 @@ bool CMNetworking::send_client_update(uint8_t iec61851_state,
     int err = sendto(client_sock, &response, sizeof(response), 0, (sockaddr *)&source_addr, sizeof(source_addr));
     if (err < 0) {
         if (errno != EAGAIN && errno != EWOULDBLOCK)
-            logger.printfln("sendto failed: errno %d", errno);
+            logger.printfln_at(EventLogLevel::ERROR, &log_module, "sendto failed: errno %d", errno);
         return false;
     }
     if (err != sizeof(response)) {
-        logger.printfln("sendto truncated the response (of size %u bytes) to %d bytes.", sizeof(response), err);
+        logger.printfln_at(EventLogLevel::ERROR, &log_module, "sendto truncated the response (of size %u bytes) to %d bytes.", sizeof(response), err);
         return false;
     }
 
@@ -31,6 +31,11 @@ extern TaskScheduler task_scheduler;
 #define BLUE_LED 32
 #define BUTTON 0
 
+// The main loop sleeps while no task is due, so the button is polled by a task.
+#ifndef BUTTON_POLL_INTERVAL_MS
+#define BUTTON_POLL_INTERVAL_MS 50
+#endif
+
 TF_HAL hal;
 extern uint32_t uid_numeric;
 extern char uid[7];
@@ -65,6 +70,27 @@ void ESP32Brick::setup()
         led_blink_state = !led_blink_state;
         digitalWrite(BLUE_LED, led_blink_state ? HIGH : LOW);
     }, 0, 1000);
+
+    task_scheduler.scheduleWithFixedDelay("button_poll", [](){
+        static bool last_btn_value = false;
+        static uint32_t last_btn_change = 0;
+
+        bool btn = digitalRead(BUTTON);
+        if (!factory_reset_requested)
+            digitalWrite(GREEN_LED, btn);
+
+        if (btn != last_btn_value) {
+            last_btn_change = millis();
+        }
+
+        last_btn_value = btn;
+
+        if (!btn && deadline_elapsed(last_btn_change + 10000)) {
+            logger.printfln("IO0 button was pressed for 10 seconds. Resetting to factory defaults.");
+            last_btn_change = millis();
+            factory_reset_requested = true;
+        }
+    }, 0, BUTTON_POLL_INTERVAL_MS);
 }
 
 void ESP32Brick::register_urls()
@@ -74,22 +100,5 @@ void ESP32Brick::register_urls()
 
 void ESP32Brick::loop()
 {
-    static bool last_btn_value = false;
-    static uint32_t last_btn_change = 0;
-
-    bool btn = digitalRead(BUTTON);
-    if (!factory_reset_requested)
-        digitalWrite(GREEN_LED, btn);
-
-    if (btn != last_btn_value) {
-        last_btn_change = millis();
-    }
-
-    last_btn_value = btn;
 
-    if (!btn && deadline_elapsed(last_btn_change + 10000)) {
-        logger.printfln("IO0 button was pressed for 10 seconds. Resetting to factory defaults.");
-        last_btn_change = millis();
-        factory_reset_requested = true;
-    }
 }
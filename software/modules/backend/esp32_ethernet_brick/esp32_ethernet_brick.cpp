@@ -23,11 +23,19 @@
 
 #include "tools.h"
 #include "hal_arduino_esp32_ethernet_brick/hal_arduino_esp32_ethernet_brick.h"
+#include "task_scheduler.h"
+
+extern TaskScheduler task_scheduler;
 
 #define GREEN_LED 2
 #define BLUE_LED 15
 #define BUTTON 0
 
+// The main loop sleeps while no task is due, so the LED is updated by a task.
+#ifndef LED_BLINK_INTERVAL_MS
+#define LED_BLINK_INTERVAL_MS 100
+#endif
+
 TF_HAL hal;
 extern uint32_t uid_numeric;
 extern char uid[7];
@@ -41,6 +49,22 @@ ESP32EthernetBrick::ESP32EthernetBrick()
 
 }
 
+void ledBlink(int8_t led_pin, int interval, int blinks_per_interval, int off_time_ms)
+{
+    int t_in_second = millis() % interval;
+    if (off_time_ms != 0 && (interval - t_in_second <= off_time_ms)) {
+        digitalWrite(led_pin, 1);
+        return;
+    }
+
+    // We want blinks_per_interval blinks and blinks_per_interval pauses between them. The off_time counts as pause.
+    int state_count = ((2 * blinks_per_interval) - (off_time_ms != 0 ? 1 : 0));
+    int state_interval = (interval - off_time_ms) / state_count;
+    bool led = (t_in_second / state_interval) % 2 != 0;
+
+    digitalWrite(led_pin, led);
+}
+
 void ESP32EthernetBrick::setup()
 {
     check(tf_hal_create(&hal), "hal create");
@@ -56,6 +80,9 @@ void ESP32EthernetBrick::setup()
     blue_led_pin = BLUE_LED;
     button_pin = BUTTON;
 
+    task_scheduler.scheduleWithFixedDelay("led_blink", [](){
+        ledBlink(BLUE_LED, 2000, 1, 0);
+    }, 0, LED_BLINK_INTERVAL_MS);
 }
 
 void ESP32EthernetBrick::register_urls()
@@ -63,27 +90,11 @@ void ESP32EthernetBrick::register_urls()
 
 }
 
-void ledBlink(int8_t led_pin, int interval, int blinks_per_interval, int off_time_ms)
-{
-    int t_in_second = millis() % interval;
-    if (off_time_ms != 0 && (interval - t_in_second <= off_time_ms)) {
-        digitalWrite(led_pin, 1);
-        return;
-    }
-
-    // We want blinks_per_interval blinks and blinks_per_interval pauses between them. The off_time counts as pause.
-    int state_count = ((2 * blinks_per_interval) - (off_time_ms != 0 ? 1 : 0));
-    int state_interval = (interval - off_time_ms) / state_count;
-    bool led = (t_in_second / state_interval) % 2 != 0;
-
-    digitalWrite(led_pin, led);
-}
-
 /*
 The ESP Ethernet Brick can not trigger a factory reset itself,
 as the ethernet phy clock disturbs any IO0 button reading.
 */
 void ESP32EthernetBrick::loop()
 {
-    ledBlink(BLUE_LED, 2000, 1, 0);
+
 }
@@ -81,8 +81,8 @@ void EVSEV2Meter::setupEVSE(bool update_module_initialized)
 
     for (int i = 0; i < power_history.size(); ++i) {
         //float f = 5000.0 * sin(PI/120.0 * i) + 5000.0;
-        // Use negative state to mark that these are pre-filled.
-        power_history.push(-1);
+        // Use NAN to mark that these are pre-filled.
+        power_history.push(NAN);
     }
 
     for (int i = 0; i < DETAILED_VALUES_COUNT; ++i) {
@@ -105,20 +105,20 @@ void EVSEV2Meter::setupEVSE(bool update_module_initialized)
         for(int i = 0; i < 3; ++i)
             state.get("phases_connected")->get(i)->updateBool(phases_connected[i]);
 
-        int16_t val = (int16_t)min((float)INT16_MAX, power);
-        interval_samples.push(val);
+        interval_samples.push(power);
         ++samples_last_interval;
     }, 500, 500);
 
     task_scheduler.scheduleWithFixedDelay("update_evse_meter_history", [this](){
         float interval_sum = 0;
-        int16_t val;
-        for(int i = 0; i < samples_last_interval; ++i) {
-            interval_samples.peek_offset(&val, interval_samples.used() - 1 - i);
-            interval_sum += val;
-        }
-
-        power_history.push((int16_t)(interval_sum / samples_last_interval));
+        size_t samples = min((size_t)samples_last_interval, interval_samples.used());
+        decltype(interval_samples)::Span spans[2];
+        interval_samples.peek_spans(interval_samples.used() - samples, samples, spans);
+        for (const auto &span : spans)
+            for (size_t i = 0; i < span.len; ++i)
+                interval_sum += span.data[i];
+
+        power_history.push(interval_sum / samples_last_interval);
         samples_per_interval = samples_last_interval;
         samples_last_interval = 0;
     }, 1000 * 60 * HISTORY_MINUTE_INTERVAL, 1000 * 60 * HISTORY_MINUTE_INTERVAL);
@@ -173,30 +173,17 @@ void EVSEV2Meter::register_urls()
             return;
         }
 
-        const size_t buf_size = RING_BUF_SIZE * 6 + 100;
-        char buf[buf_size] = {0};
-        size_t buf_written = 0;
-
-        int16_t val;
-        power_history.peek(&val);
-        // Negative values are prefilled, because the ESP was booted less than 48 hours ago.
-        if (val < 0)
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%s", "[null");
-        else
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "[%d", (int)val);
-
-        for (int i = 1; i < power_history.used() && power_history.peek_offset(&val, i) && buf_written < buf_size; ++i) {
-            // Negative values are prefilled, because the ESP was booted less than 48 hours ago.
-            if (val < 0)
-                buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%s", ",null");
-            else
-                buf_written += snprintf(buf + buf_written, buf_size - buf_written, ",%d", (int)val);
-        }
-
-        if (buf_written < buf_size)
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%c", ']');
-
-        request.send(200, "application/json; charset=utf-8", buf, buf_written);
+        decltype(power_history)::Span spans[2];
+        power_history.peek_spans(0, power_history.used(), spans);
+
+        // NAN values are prefilled, because the ESP was booted less than 48 hours ago. They are sent as null.
+        bool first = true;
+        request.beginChunkedResponse(200, "application/json; charset=utf-8");
+        request.sendChunk("[", 1);
+        for (const auto &span : spans)
+            request.sendJsonIntegers(span.data, span.len, &first);
+        request.sendChunk("]", 1);
+        request.endChunkedResponse();
     });
 
     server.on("/meter/live", HTTP_GET, [this](WebServerRequest request) {
@@ -205,26 +192,30 @@ void EVSEV2Meter::register_urls()
             return;
         }
 
-        const size_t buf_size = RING_BUF_SIZE * 6 + 100;
-        char buf[buf_size] = {0};
-        size_t buf_written = 0;
-
-        int16_t val;
-        interval_samples.peek(&val);
         float samples_per_second = 0;
         if (this->samples_per_interval > 0) {
             samples_per_second = ((float)this->samples_per_interval) / (60 * HISTORY_MINUTE_INTERVAL);
         } else {
             samples_per_second = (float)this->samples_last_interval / millis() * 1000;
         }
-        buf_written += snprintf(buf + buf_written, buf_size - buf_written, "{\"samples_per_second\":%f,\"samples\":[%d", samples_per_second, val);
 
-        for(int i = 1; (i < interval_samples.used() - 1) && interval_samples.peek_offset(&val, i) && buf_written < buf_size; ++i) {
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, ",%d", val);
+        char buf[64];
+        int buf_written = snprintf(buf, sizeof(buf), "{\"samples_per_second\":%f,\"samples\":[", isfinite(samples_per_second) ? samples_per_second : 0.0f);
+        if (buf_written < 0 || (size_t)buf_written >= sizeof(buf)) {
+            request.send(500, "text/plain", "failed to format samples");
+            return;
         }
-        if (buf_written < buf_size)
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%s", "]}");
-        request.send(200, "application/json; charset=utf-8", buf, buf_written);
+
+        decltype(interval_samples)::Span spans[2];
+        interval_samples.peek_spans(0, interval_samples.used() - 1, spans);
+
+        bool first = true;
+        request.beginChunkedResponse(200, "application/json; charset=utf-8");
+        request.sendChunk(buf, buf_written);
+        for (const auto &span : spans)
+            request.sendJsonIntegers(span.data, span.len, &first);
+        request.sendChunk("]}", 2);
+        request.endChunkedResponse();
     });
 }
 
@@ -55,9 +55,9 @@ private:
 
     int samples_last_interval = 0;
     int samples_per_interval = -1;
-    TF_Ringbuffer<int16_t, 3 * 60 * HISTORY_MINUTE_INTERVAL, uint32_t, malloc_32bit_addressed, heap_caps_free> interval_samples;
+    TF_GenericRingbuffer<float, 3 * 60 * HISTORY_MINUTE_INTERVAL - 1, malloc_32bit_addressed, heap_caps_free> interval_samples;
 
-    TF_Ringbuffer<int16_t, HISTORY_HOURS * (60 / HISTORY_MINUTE_INTERVAL) + 1, uint32_t, malloc_32bit_addressed, heap_caps_free> power_history;
+    TF_GenericRingbuffer<float, HISTORY_HOURS * (60 / HISTORY_MINUTE_INTERVAL), malloc_32bit_addressed, heap_caps_free> power_history;
 
     char uid[7] = {0};
 };
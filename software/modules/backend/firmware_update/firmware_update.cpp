@@ -35,6 +35,8 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 
+#include <new>
+
 extern const char *DISPLAY_NAME;
 
 extern EventLog logger;
@@ -50,6 +52,14 @@ extern int8_t green_led_pin;
 #define FW_INFO_OFFSET 0xd000 - 0x1000
 #define FW_INFO_LENGTH 0x1000
 
+// Resumable uploads are received in chunks of at most this size. Each chunk is checked before it is written.
+#define RESUMABLE_CHUNK_SIZE 16384
+
+// An upload that received no data for this long is aborted, which frees Update, the flash pipeline and the decoder.
+#ifndef UPLOAD_IDLE_TIMEOUT_MS
+#define UPLOAD_IDLE_TIMEOUT_MS 60000
+#endif
+
 TaskHandle_t xTaskBuffer;
 
 void blinky(void *arg)
@@ -78,6 +88,9 @@ void factory_reset()
             tskIDLE_PRIORITY,
             &xTaskBuffer);
 
+    // Don't let pending config writes race the format.
+    task_scheduler.waitForJobs(WORKER_DRAIN_TIMEOUT_MS);
+
     LittleFS.end();
     LittleFS.format();
     ESP.restart();
@@ -119,7 +132,6 @@ bool FirmwareUpdate::handle_fw_info_chunk(size_t chunk_index, uint8_t *data, siz
         info_offset += to_write;
     }
 
-    logger.printfln("chunk index %u data %p len %u", chunk_index, data, chunk_length);
     crc32_ieee_802_3_recalculate(start, length, &calculated_checksum);
 
     const size_t checksum_start = FW_INFO_OFFSET + FW_INFO_LENGTH - 4;
@@ -191,7 +203,18 @@ bool FirmwareUpdate::handle_update_chunk(int command, WebServerRequest request,
 
     static bool fw_info_found = false;
 
-    if (chunk_index == 0 && !Update.begin(complete_length - firmware_offset, command)) {
+    // A previous upload could have been interrupted by a lost connection.
+    if (chunk_index == 0)
+        flash_pipeline.abort();
+
+    // The size of compressed images is only known once they are decompressed.
+    size_t update_size = complete_length == UPDATE_SIZE_UNKNOWN ? UPDATE_SIZE_UNKNOWN : complete_length - firmware_offset;
+
+    // An interrupted upload leaves Update running.
+    if (chunk_index == 0 && Update.isRunning())
+        Update.abort();
+
+    if (chunk_index == 0 && !Update.begin(update_size, command)) {
         logger.printfln("Failed to start update: %s", Update.errorString());
         request.send(400, "text/plain", Update.errorString());
         Update.abort();
@@ -201,6 +224,15 @@ bool FirmwareUpdate::handle_update_chunk(int command, WebServerRequest request,
     if (chunk_index == 0) {
         reset_fw_info();
         fw_info_found = false;
+
+        // Write to flash while the next data is received.
+        if (!flash_pipeline.begin([](const uint8_t *data, size_t len) {
+                return Update.write(const_cast<uint8_t *>(data), len) == len;
+            })) {
+            logger.printfln("Not enough memory to write the update while receiving it. Falling back to slower update.");
+        }
+
+        update_start_ms = millis();
     }
 
     if (update_aborted)
@@ -214,6 +246,7 @@ bool FirmwareUpdate::handle_update_chunk(int command, WebServerRequest request,
         String error = this->check_fw_info(fw_info_found, false, true);
         if (error != "") {
             request.send(400, "text/plain", error.c_str());
+            flash_pipeline.abort();
             Update.abort();
             update_aborted = true;
             return true;
@@ -233,15 +266,26 @@ bool FirmwareUpdate::handle_update_chunk(int command, WebServerRequest request,
         length -= to_skip;
     }
 
-    auto written = Update.write(start, length);
-    if (written != length) {
-        logger.printfln("Failed to write update chunk with length %d; written %d, error: %s", length, written, Update.errorString());
+    bool written = flash_pipeline.isRunning() ? flash_pipeline.push(start, length) : Update.write(start, length) == length;
+    if (written && final && flash_pipeline.isRunning())
+        written = flash_pipeline.finish();
+
+    if (!written) {
+        logger.printfln("Failed to write update: %s", Update.errorString());
+        flash_pipeline.abort();
         request.send(400, "text/plain", (String("Failed to write update: ") + Update.errorString()).c_str());
         this->firmware_update_running = false;
         Update.abort();
         return false;
     }
 
+    if (final) {
+        uint32_t duration_ms = millis() - update_start_ms;
+        size_t image_length = chunk_index + chunk_length;
+        uint32_t kib_per_s = duration_ms == 0 ? 0 : (uint32_t)((uint64_t)image_length * 1000 / 1024 / duration_ms);
+        logger.printfln("Received and wrote update of %u KiB in %u ms (%u KiB/s)", image_length / 1024, duration_ms, kib_per_s);
+    }
+
     if (final && !Update.end(true)) {
         logger.printfln("Failed to apply update: %s", Update.errorString());
         request.send(400, "text/plain", (String("Failed to apply update: ") + Update.errorString()).c_str());
@@ -253,11 +297,217 @@ bool FirmwareUpdate::handle_update_chunk(int command, WebServerRequest request,
     return true;
 }
 
+void FirmwareUpdate::free_decoder()
+{
+    delete decoder;
+    decoder = nullptr;
+}
+
+bool FirmwareUpdate::upload_pending()
+{
+    return Update.isRunning() || flash_pipeline.isRunning() || decoder != nullptr;
+}
+
+void FirmwareUpdate::abort_upload()
+{
+    free_decoder();
+    flash_pipeline.abort();
+    if (Update.isRunning())
+        Update.abort();
+
+    resumable_offset = 0;
+    resumable_length = 0;
+    this->firmware_update_running = false;
+}
+
+// Images compressed by merge_firmware_hook.py are decompressed while they are received.
+// The decompressed image is handled exactly like an uncompressed upload.
+bool FirmwareUpdate::handle_upload_chunk(int command, WebServerRequest request, size_t chunk_index, uint8_t *data, size_t chunk_length, bool final, size_t complete_length)
+{
+    last_upload_chunk_ms = millis();
+
+    if (chunk_index == 0) {
+        free_decoder();
+
+        // Uncompressed images start with the ESP32 image magic byte 0xE9.
+        if (chunk_length >= 2 && data[0] == 0x1F && data[1] == 0x8B) {
+            decompressed_length = 0;
+            decompressed_write_ok = true;
+            // Might still be set by a previous upload. handle_update_chunk only resets it once the decoder produced output.
+            update_aborted = false;
+            // Resumed uploads send the remaining chunks with other requests: Only use the request of the current chunk.
+            decoder = new (std::nothrow) GzipDecoder([this, command](const uint8_t *decompressed, size_t len) {
+                decompressed_write_ok = handle_update_chunk(command, *decoder_request, decompressed_length, const_cast<uint8_t *>(decompressed), len, false, UPDATE_SIZE_UNKNOWN);
+                decompressed_length += len;
+                return decompressed_write_ok && !update_aborted;
+            });
+
+            if (decoder == nullptr) {
+                logger.printfln("Not enough memory to decompress the update.");
+                request.send(400, "text/plain", "Not enough memory to decompress the update");
+                this->firmware_update_running = false;
+                return false;
+            }
+        }
+    }
+
+    if (decoder == nullptr)
+        return handle_update_chunk(command, request, chunk_index, data, chunk_length, final, complete_length);
+
+    decoder_request = &request;
+    bool decoded = decoder->write(data, chunk_length) && (!final || decoder->finish());
+    decoder_request = nullptr;
+
+    // handle_update_chunk already sent the response.
+    if (!decompressed_write_ok || update_aborted) {
+        free_decoder();
+        return decompressed_write_ok;
+    }
+
+    if (!decoded) {
+        logger.printfln("Failed to decompress update: %s", decoder->error());
+        request.send(400, "text/plain", (String("Failed to decompress update: ") + decoder->error()).c_str());
+        free_decoder();
+        flash_pipeline.abort();
+        this->firmware_update_running = false;
+        Update.abort();
+        return false;
+    }
+
+    if (!final)
+        return true;
+
+    free_decoder();
+    logger.printfln("Decompressed update from %u KiB to %u KiB", (chunk_index + chunk_length) / 1024, decompressed_length / 1024);
+
+    return handle_update_chunk(command, request, decompressed_length, nullptr, 0, true, UPDATE_SIZE_UNKNOWN);
+}
+
+void FirmwareUpdate::send_resumable_state(WebServerRequest &request, uint16_t code)
+{
+    char buf[96];
+    snprintf(buf, sizeof(buf), "{\"offset\":%u,\"length\":%u,\"max_chunk_length\":%u}", resumable_offset, resumable_length, RESUMABLE_CHUNK_SIZE);
+    request.send(code, "application/json", buf);
+}
+
+static bool read_header_u32(WebServerRequest &request, const char *name, int base, uint32_t *value)
+{
+    char buf[16];
+    if (request.header(name, buf, sizeof(buf)) <= 0)
+        return false;
+
+    char *end;
+    *value = strtoul(buf, &end, base);
+    return *end == '\0';
+}
+
+// Continues a /flash_firmware upload that was interrupted by a lost connection. The client asks for
+// the offset that was already written and sends the rest in chunks that each carry their offset and CRC32.
+// Update keeps running between the requests, so the info page checks and Update.end
+// apply to the whole image as with /flash_firmware. Uploads that receive no data for
+// UPLOAD_IDLE_TIMEOUT_MS are aborted.
+void FirmwareUpdate::register_resumable_urls()
+{
+    server.on("/flash_firmware_resumable", HTTP_GET, [this](WebServerRequest request) {
+        std::lock_guard<std::mutex> lock{upload_mutex};
+        send_resumable_state(request, 200);
+    });
+
+    server.on("/flash_firmware_resumable", HTTP_PUT, [this](WebServerRequest request) {
+        if (!firmware_update_allowed) {
+            request.send(423, "text/plain", "vehicle connected");
+            return;
+        }
+
+        uint32_t offset, length, crc;
+        if (!read_header_u32(request, "X-Upload-Offset", 10, &offset)
+         || !read_header_u32(request, "X-Upload-Length", 10, &length)
+         || !read_header_u32(request, "X-Chunk-CRC32", 16, &crc)) {
+            request.send(400, "text/plain", "Missing or invalid X-Upload-Offset, X-Upload-Length or X-Chunk-CRC32 header");
+            return;
+        }
+
+        size_t chunk_length = request.contentLength();
+        if (chunk_length == 0 || chunk_length > RESUMABLE_CHUNK_SIZE || offset + chunk_length > length) {
+            request.send(400, "text/plain", "Invalid chunk length");
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock{upload_mutex};
+
+        // Offset 0 (re)starts the upload. Other chunks have to continue where the last written chunk ended.
+        if (offset != 0 && (offset != resumable_offset || length != resumable_length)) {
+            send_resumable_state(request, 409);
+            return;
+        }
+
+        uint8_t *chunk = (uint8_t *)malloc(chunk_length);
+        if (chunk == nullptr) {
+            request.send(503, "text/plain", "Not enough memory to receive chunk");
+            return;
+        }
+
+        size_t received = 0;
+        while (received < chunk_length) {
+            int result = request.readBody((char *)chunk + received, chunk_length - received);
+            if (result <= 0) {
+                // Nothing was written, the client can resend the chunk.
+                free(chunk);
+                request.send(400, "text/plain", "Failed to receive chunk");
+                return;
+            }
+            received += result;
+        }
+
+        if (crc32_ieee_802_3(chunk, chunk_length) != crc) {
+            free(chunk);
+            send_resumable_state(request, 400);
+            return;
+        }
+
+        if (offset == 0) {
+            resumable_offset = 0;
+            resumable_length = length;
+        }
+
+        bool final = offset + chunk_length == length;
+        this->firmware_update_running = true;
+        bool written = handle_upload_chunk(U_FLASH, request, offset, chunk, chunk_length, final, length);
+        free(chunk);
+
+        // handle_upload_chunk already sent the error.
+        if (!written || update_aborted) {
+            abort_upload();
+            return;
+        }
+
+        resumable_offset = offset + chunk_length;
+
+        if (!final) {
+            send_resumable_state(request, 200);
+            return;
+        }
+
+        this->firmware_update_running = false;
+        resumable_offset = 0;
+        resumable_length = 0;
+
+        task_scheduler.scheduleOnce("flash_firmware_reboot", [](){
+            task_scheduler.waitForJobs(WORKER_DRAIN_TIMEOUT_MS);
+            ESP.restart();
+        }, 1000);
+        request.send(200, "text/plain", "Update OK");
+    });
+}
+
 void FirmwareUpdate::register_urls()
 {
     server.on("/recovery", HTTP_GET, [](WebServerRequest req) {
+        req.addResponseHeader("Cache-Control", "no-cache");
+        if (req.checkETag("\"" BUILD_TIMESTAMP_HEX_STR "-recovery\""))
+            return;
+
         req.addResponseHeader("Content-Encoding", "gzip");
-        req.addResponseHeader("ETag", BUILD_TIMESTAMP_HEX_STR);
         req.send(200, "text/html", recovery_page, recovery_page_len);
     });
 
@@ -299,28 +549,53 @@ void FirmwareUpdate::register_urls()
         }
 
         if(!Update.hasError()) {
-            task_scheduler.scheduleOnce("flash_firmware_reboot", [](){ESP.restart();}, 1000);
+            task_scheduler.scheduleOnce("flash_firmware_reboot", [](){
+                task_scheduler.waitForJobs(WORKER_DRAIN_TIMEOUT_MS);
+                ESP.restart();
+            }, 1000);
         }
 
         request.send(Update.hasError() ? 400: 200, "text/plain", Update.hasError() ? Update.errorString() : "Update OK");
     },[this](WebServerRequest request, String filename, size_t index, uint8_t *data, size_t len, bool final){
+        std::lock_guard<std::mutex> lock{upload_mutex};
+
         if (!firmware_update_allowed) {
             request.send(423, "text/plain", "vehicle connected");
-            this->firmware_update_running = false;
+            abort_upload();
             return false;
         }
         this->firmware_update_running = true;
-        return handle_update_chunk(U_FLASH, request, index, data, len, final, request.contentLength());
+
+        bool written = handle_upload_chunk(U_FLASH, request, index, data, len, final, request.contentLength());
+
+        // handle_upload_chunk already sent the error.
+        if (!written || update_aborted) {
+            abort_upload();
+            return written;
+        }
+
+        // If the connection drops, the client continues with /flash_firmware_resumable from here.
+        // The body is the image, so its length is the image length.
+        resumable_offset = final ? 0 : index + len;
+        resumable_length = final ? 0 : request.contentLength();
+
+        return true;
     });
 
+    register_resumable_urls();
+
     server.on("/flash_spiffs", HTTP_POST, [this](WebServerRequest request){
         if(!Update.hasError()) {
-            task_scheduler.scheduleOnce("flash_spiffs_reboot", [](){ESP.restart();}, 1000);
+            task_scheduler.scheduleOnce("flash_spiffs_reboot", [](){
+                task_scheduler.waitForJobs(WORKER_DRAIN_TIMEOUT_MS);
+                ESP.restart();
+            }, 1000);
         }
 
         request.send(Update.hasError() ? 400: 200, "text/plain", Update.hasError() ? Update.errorString() : "Update OK");
     },[this](WebServerRequest request, String filename, size_t index, uint8_t *data, size_t len, bool final){
-        return handle_update_chunk(U_SPIFFS, request, index, data, len, final, request.contentLength());
+        std::lock_guard<std::mutex> lock{upload_mutex};
+        return handle_upload_chunk(U_SPIFFS, request, index, data, len, final, request.contentLength());
     });
 
     server.on("/factory_reset", HTTP_PUT, [this](WebServerRequest request) {
@@ -360,4 +635,13 @@ void FirmwareUpdate::loop()
 {
     if (factory_reset_requested)
         factory_reset();
+
+    // Don't wait for an upload handler, the next iteration checks again.
+    std::unique_lock<std::mutex> lock{upload_mutex, std::try_to_lock};
+    if (!lock.owns_lock() || !upload_pending() || !deadline_elapsed(last_upload_chunk_ms + UPLOAD_IDLE_TIMEOUT_MS))
+        return;
+
+    // The client went away without finishing its upload.
+    logger.printfln("Received no update data for %u seconds. Aborting update.", UPLOAD_IDLE_TIMEOUT_MS / 1000);
+    abort_upload();
 }
@@ -22,6 +22,11 @@
 #include <stdint.h>
 #include "web_server.h"
 
+#include <mutex>
+
+#include "flash_pipeline.h"
+#include "gzip_decoder.h"
+
 class FirmwareUpdate {
 public:
     FirmwareUpdate();
@@ -34,6 +39,12 @@ public:
     bool firmware_update_running = false;
 
 private:
+    void register_resumable_urls();
+    void send_resumable_state(WebServerRequest &request, uint16_t code);
+    bool handle_upload_chunk(int command, WebServerRequest request, size_t chunk_index, uint8_t *data, size_t chunk_length, bool final, size_t complete_length);
+    void free_decoder();
+    bool upload_pending();
+    void abort_upload();
     bool handle_update_chunk(int command, WebServerRequest request, size_t chunk_index, uint8_t *data, size_t chunk_length, bool final, size_t complete_length);
     void reset_fw_info();
     bool handle_fw_info_chunk(size_t chunk_index, uint8_t *data, size_t chunk_length);
@@ -51,4 +62,23 @@ private:
     uint32_t checksum = 0;
     uint32_t checksum_offset = 0;
     bool update_aborted = false;
+
+    FlashPipeline flash_pipeline;
+    uint32_t update_start_ms = 0;
+
+    // Held by the upload handlers while they handle a chunk and by loop while it checks for abandoned uploads.
+    std::mutex upload_mutex;
+    uint32_t last_upload_chunk_ms = 0;
+
+    // Only allocated while a compressed image is uploaded.
+    GzipDecoder *decoder = nullptr;
+    // The request whose chunk the decoder is writing. Only set during decoder->write and decoder->finish.
+    WebServerRequest *decoder_request = nullptr;
+    size_t decompressed_length = 0;
+    bool decompressed_write_ok = true;
+
+    // Upload offset up to which the current upload was handed to Update, and the upload's total length.
+    // A client whose upload was interrupted continues it from there with /flash_firmware_resumable.
+    size_t resumable_offset = 0;
+    size_t resumable_length = 0;
 };
@@ -0,0 +1,145 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "flash_pipeline.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "task_scheduler.h"
+
+extern TaskScheduler task_scheduler;
+
+FlashPipeline::~FlashPipeline()
+{
+    abort();
+}
+
+bool FlashPipeline::begin(std::function<bool(const uint8_t *data, size_t len)> &&write)
+{
+    abort();
+
+    free_buffers = xQueueCreate(FLASH_PIPELINE_BUFFER_COUNT, sizeof(uint8_t));
+    if (free_buffers == nullptr)
+        return false;
+
+    for (uint8_t i = 0; i < FLASH_PIPELINE_BUFFER_COUNT; ++i) {
+        buffers[i] = (uint8_t *)malloc(FLASH_PIPELINE_BUFFER_SIZE);
+        if (buffers[i] == nullptr) {
+            stop();
+            return false;
+        }
+        xQueueSend(free_buffers, &i, 0);
+    }
+
+    this->write = std::move(write);
+    current = NO_BUFFER;
+    current_len = 0;
+    failed = false;
+    aborted = false;
+    bytes_written = 0;
+
+    return true;
+}
+
+bool FlashPipeline::push(const uint8_t *data, size_t len)
+{
+    while (len > 0 && !failed) {
+        if (current == NO_BUFFER) {
+            xQueueReceive(free_buffers, &current, portMAX_DELAY);
+            current_len = 0;
+        }
+
+        size_t to_copy = std::min(len, (size_t)FLASH_PIPELINE_BUFFER_SIZE - current_len);
+        memcpy(buffers[current] + current_len, data, to_copy);
+        current_len += to_copy;
+        data += to_copy;
+        len -= to_copy;
+
+        if (current_len == FLASH_PIPELINE_BUFFER_SIZE)
+            submit_current();
+    }
+
+    return !failed;
+}
+
+bool FlashPipeline::finish()
+{
+    if (!isRunning())
+        return false;
+
+    if (current != NO_BUFFER && current_len > 0)
+        submit_current();
+
+    stop();
+    return !failed;
+}
+
+void FlashPipeline::abort()
+{
+    if (!isRunning())
+        return;
+
+    aborted = true;
+    stop();
+}
+
+void FlashPipeline::submit_current()
+{
+    uint8_t buffer = current;
+    size_t len = current_len;
+    current = NO_BUFFER;
+
+    // Jobs on the same core run in submission order, so the buffers are written in order.
+    task_scheduler.submit("flash pipeline write", [this, buffer, len]() {
+        if (!failed && !aborted) {
+            if (write(buffers[buffer], len))
+                bytes_written += len;
+            else
+                failed = true;
+        }
+
+        xQueueSend(free_buffers, &buffer, portMAX_DELAY);
+    }, nullptr);
+}
+
+void FlashPipeline::stop()
+{
+    // Once the last submitted write is done, all buffers except the one push fills are back in the queue.
+    uint8_t to_collect = 0;
+    for (uint8_t i = 0; i < FLASH_PIPELINE_BUFFER_COUNT; ++i)
+        if (buffers[i] != nullptr && i != current)
+            ++to_collect;
+
+    uint8_t buffer;
+    for (uint8_t i = 0; i < to_collect; ++i)
+        xQueueReceive(free_buffers, &buffer, portMAX_DELAY);
+
+    for (uint8_t i = 0; i < FLASH_PIPELINE_BUFFER_COUNT; ++i) {
+        free(buffers[i]);
+        buffers[i] = nullptr;
+    }
+
+    vQueueDelete(free_buffers);
+    free_buffers = nullptr;
+    current = NO_BUFFER;
+    write = nullptr;
+}
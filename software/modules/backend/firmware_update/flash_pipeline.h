@@ -0,0 +1,86 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+// One flash sector: Update writes whole sectors, so each buffer is written with a single erase.
+#define FLASH_PIPELINE_BUFFER_SIZE 4096
+// One buffer is filled by the web server while the others are written.
+#define FLASH_PIPELINE_BUFFER_COUNT 3
+
+// Overlaps receiving an upload with writing it to flash.
+//
+// push copies the received data into a buffer. Full buffers are written by write on a
+// task_scheduler worker, in order, while the web server receives the next buffer.
+// push only blocks if all buffers wait to be written, i.e. if the flash is slower than the network.
+class FlashPipeline {
+public:
+    FlashPipeline() {}
+    ~FlashPipeline();
+
+    FlashPipeline(const FlashPipeline &) = delete;
+    FlashPipeline &operator=(const FlashPipeline &) = delete;
+
+    // Allocates the buffers. Returns false if there is not enough memory.
+    // write has to return false if writing failed. All later data is dropped in this case.
+    bool begin(std::function<bool(const uint8_t *data, size_t len)> &&write);
+
+    bool isRunning() { return free_buffers != nullptr; }
+
+    // Returns false if a previous write failed.
+    bool push(const uint8_t *data, size_t len);
+
+    // Writes the remaining data and waits until all writes are done. Frees the buffers.
+    // Returns false if a write failed.
+    bool finish();
+
+    // Waits for a running write, drops the remaining data and frees the buffers.
+    void abort();
+
+    size_t bytesWritten() { return bytes_written; }
+
+private:
+    static const uint8_t NO_BUFFER = 0xFF;
+
+    void submit_current();
+    void stop();
+
+    std::function<bool(const uint8_t *data, size_t len)> write;
+
+    uint8_t *buffers[FLASH_PIPELINE_BUFFER_COUNT] = {};
+    // Indices of the buffers that are not waiting to be written.
+    QueueHandle_t free_buffers = nullptr;
+
+    // Index of the buffer that push fills.
+    uint8_t current = NO_BUFFER;
+    size_t current_len = 0;
+
+    std::atomic<bool> failed{false};
+    std::atomic<bool> aborted{false};
+    size_t bytes_written = 0;
+};
@@ -0,0 +1,500 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "gzip_decoder.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "crc32.h"
+
+// A dynamic block header is at most 14 + 19 * 3 + 316 * (7 + 7) bits, about 563 bytes.
+// Every other unit is shorter.
+#define LOOKAHEAD 600
+
+#define FLAG_HCRC 0x02
+#define FLAG_EXTRA 0x04
+#define FLAG_NAME 0x08
+#define FLAG_COMMENT 0x10
+#define FLAGS_RESERVED 0xE0
+
+static_assert(GZIP_DECODER_IN_BUF_SIZE > 2 * LOOKAHEAD, "GzipDecoder: Input buffer too small");
+
+static const uint16_t length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t distance_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t distance_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const uint8_t code_length_order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+GzipDecoder::GzipDecoder(std::function<bool(const uint8_t *, size_t)> &&output) : output(std::move(output))
+{
+}
+
+bool GzipDecoder::write(const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+        if (state == State::Failed)
+            return false;
+
+        // Data after the end of the stream is ignored.
+        if (state == State::Done)
+            return true;
+
+        memmove(in_buf, in_buf + in_pos, in_len - in_pos);
+        in_len -= in_pos;
+        in_pos = 0;
+
+        // process leaves less than LOOKAHEAD bytes, so there is always space.
+        size_t to_copy = std::min(len, sizeof(in_buf) - in_len);
+        memcpy(in_buf + in_len, data, to_copy);
+        in_len += to_copy;
+        data += to_copy;
+        len -= to_copy;
+
+        if (!process(false))
+            return false;
+    }
+
+    return state != State::Failed;
+}
+
+bool GzipDecoder::finish()
+{
+    if (state == State::Failed)
+        return false;
+
+    if (!process(true))
+        return false;
+
+    if (state != State::Done)
+        return fail("Truncated stream");
+
+    return true;
+}
+
+bool GzipDecoder::fail(const char *message)
+{
+    if (state != State::Failed)
+        error_message = message;
+
+    state = State::Failed;
+    return false;
+}
+
+bool GzipDecoder::fill_bits(uint32_t count)
+{
+    while (bit_count < count && bit_count <= 24 && in_pos < in_len) {
+        bit_buf |= (uint32_t)in_buf[in_pos++] << bit_count;
+        bit_count += 8;
+    }
+
+    return bit_count >= count;
+}
+
+// count has to be at most 24.
+bool GzipDecoder::get_bits(uint32_t count, uint32_t *value)
+{
+    if (!fill_bits(count))
+        return fail("Truncated stream");
+
+    *value = bit_buf & ((1u << count) - 1);
+    bit_buf >>= count;
+    bit_count -= count;
+    return true;
+}
+
+bool GzipDecoder::build_huffman(Huffman *h, const uint8_t *code_lengths, size_t count)
+{
+    memset(h->count, 0, sizeof(h->count));
+    for (size_t i = 0; i < count; ++i)
+        ++h->count[code_lengths[i]];
+
+    // Reject over-subscribed codes. Incomplete codes are allowed, decode_symbol fails on their unused codes.
+    int left = 1;
+    for (size_t len = 1; len < 16; ++len) {
+        left <<= 1;
+        left -= h->count[len];
+        if (left < 0)
+            return false;
+    }
+
+    uint16_t offsets[16];
+    offsets[1] = 0;
+    for (size_t len = 1; len < 15; ++len)
+        offsets[len + 1] = offsets[len] + h->count[len];
+
+    for (size_t i = 0; i < count; ++i)
+        if (code_lengths[i] != 0)
+            h->symbol[offsets[code_lengths[i]]++] = i;
+
+    return true;
+}
+
+// Canonical Huffman codes of the same length are consecutive numbers, so the code is compared
+// against the range of each length. Codes are packed starting with their most significant bit.
+bool GzipDecoder::decode_symbol(const Huffman &h, int *symbol)
+{
+    fill_bits(15);
+
+    uint32_t bits = bit_buf;
+    int code = 0;
+    int first = 0;
+    int index = 0;
+
+    for (uint32_t len = 1; len < 16; ++len) {
+        if (len > bit_count)
+            return fail("Truncated stream");
+
+        code |= bits & 1;
+        bits >>= 1;
+
+        int count = h.count[len];
+        if (code - count < first) {
+            *symbol = h.symbol[index + (code - first)];
+            bit_buf >>= len;
+            bit_count -= len;
+            return true;
+        }
+
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+
+    return fail("Invalid Huffman code");
+}
+
+bool GzipDecoder::read_dynamic_tables()
+{
+    uint32_t literal_count, distance_count, code_length_count;
+    if (!get_bits(5, &literal_count) || !get_bits(5, &distance_count) || !get_bits(4, &code_length_count))
+        return false;
+
+    literal_count += 257;
+    distance_count += 1;
+    code_length_count += 4;
+
+    if (literal_count > 286 || distance_count > 30)
+        return fail("Invalid block header");
+
+    uint8_t code_lengths[286 + 30] = {0};
+
+    for (size_t i = 0; i < code_length_count; ++i) {
+        uint32_t len;
+        if (!get_bits(3, &len))
+            return false;
+        code_lengths[code_length_order[i]] = len;
+    }
+
+    // The code length code is only needed until the other codes are built.
+    if (!build_huffman(&lengths, code_lengths, 19))
+        return fail("Invalid code length code");
+
+    memset(code_lengths, 0, 19);
+
+    size_t index = 0;
+    while (index < literal_count + distance_count) {
+        int symbol;
+        if (!decode_symbol(lengths, &symbol))
+            return false;
+
+        if (symbol < 16) {
+            code_lengths[index++] = symbol;
+            continue;
+        }
+
+        uint8_t len = 0;
+        uint32_t repeat;
+        if (symbol == 16) {
+            if (index == 0)
+                return fail("Repeated code length without previous length");
+            len = code_lengths[index - 1];
+            if (!get_bits(2, &repeat))
+                return false;
+            repeat += 3;
+        } else if (symbol == 17) {
+            if (!get_bits(3, &repeat))
+                return false;
+            repeat += 3;
+        } else {
+            if (!get_bits(7, &repeat))
+                return false;
+            repeat += 11;
+        }
+
+        if (index + repeat > literal_count + distance_count)
+            return fail("Too many code lengths");
+
+        memset(code_lengths + index, len, repeat);
+        index += repeat;
+    }
+
+    if (code_lengths[256] == 0)
+        return fail("No end of block code");
+
+    if (!build_huffman(&lengths, code_lengths, literal_count) || !build_huffman(&distances, code_lengths + literal_count, distance_count))
+        return fail("Invalid literal/length or distance code");
+
+    return true;
+}
+
+void GzipDecoder::put(uint8_t b)
+{
+    window[out_pos & (WINDOW_SIZE - 1)] = b;
+    ++out_pos;
+}
+
+bool GzipDecoder::flush()
+{
+    while (flushed < out_pos) {
+        size_t start = flushed & (WINDOW_SIZE - 1);
+        size_t len = std::min(out_pos - flushed, WINDOW_SIZE - start);
+
+        crc32_ieee_802_3_recalculate(window + start, len, &crc);
+        if (!output(window + start, len))
+            return fail("Failed to write decompressed data");
+
+        flushed += len;
+    }
+
+    return true;
+}
+
+// Returns the state of the next optional header field that is present.
+GzipDecoder::State GzipDecoder::next_header_state(State current)
+{
+    if (current < State::HeaderExtraLength && (flags & FLAG_EXTRA) != 0)
+        return State::HeaderExtraLength;
+    if (current < State::HeaderName && (flags & FLAG_NAME) != 0)
+        return State::HeaderName;
+    if (current < State::HeaderComment && (flags & FLAG_COMMENT) != 0)
+        return State::HeaderComment;
+    if (current < State::HeaderCrc && (flags & FLAG_HCRC) != 0)
+        return State::HeaderCrc;
+
+    return State::BlockHeader;
+}
+
+void GzipDecoder::align_to_byte()
+{
+    bit_buf >>= bit_count % 8;
+    bit_count -= bit_count % 8;
+}
+
+bool GzipDecoder::process(bool final)
+{
+    uint32_t value;
+
+    for (;;) {
+        if (state == State::Done || state == State::Failed)
+            return state == State::Done;
+
+        if (!final && in_len - in_pos + bit_count / 8 < LOOKAHEAD)
+            return true;
+
+        switch (state) {
+            case State::Header:
+                if (!get_bits(8, &value))
+                    return false;
+
+                header[header_pos++] = value;
+                if (header_pos < sizeof(header))
+                    break;
+
+                if (header[0] != 0x1F || header[1] != 0x8B || header[2] != 8)
+                    return fail("Not a gzip stream");
+
+                flags = header[3];
+                if ((flags & FLAGS_RESERVED) != 0)
+                    return fail("Reserved header flags set");
+
+                state = next_header_state(State::Header);
+                break;
+
+            case State::HeaderExtraLength:
+                if (!get_bits(16, &field_remaining))
+                    return false;
+
+                state = State::HeaderExtra;
+                break;
+
+            case State::HeaderExtra:
+                if (field_remaining == 0) {
+                    state = next_header_state(State::HeaderExtra);
+                    break;
+                }
+
+                if (!get_bits(8, &value))
+                    return false;
+
+                --field_remaining;
+                break;
+
+            case State::HeaderName:
+            case State::HeaderComment:
+                // Null-terminated strings.
+                if (!get_bits(8, &value))
+                    return false;
+
+                if (value == 0)
+                    state = next_header_state(state);
+                break;
+
+            case State::HeaderCrc:
+                if (!get_bits(16, &value))
+                    return false;
+
+                state = State::BlockHeader;
+                break;
+
+            case State::BlockHeader:
+                if (!get_bits(1, &value))
+                    return false;
+
+                last_block = value == 1;
+
+                if (!get_bits(2, &value))
+                    return false;
+
+                if (value == 0) {
+                    align_to_byte();
+                    state = State::StoredLength;
+                } else if (value == 1) {
+                    uint8_t code_lengths[288];
+                    memset(code_lengths, 8, 144);
+                    memset(code_lengths + 144, 9, 112);
+                    memset(code_lengths + 256, 7, 24);
+                    memset(code_lengths + 280, 8, 8);
+                    build_huffman(&lengths, code_lengths, 288);
+
+                    memset(code_lengths, 5, 30);
+                    build_huffman(&distances, code_lengths, 30);
+
+                    state = State::Codes;
+                } else if (value == 2) {
+                    if (!read_dynamic_tables())
+                        return false;
+
+                    state = State::Codes;
+                } else {
+                    return fail("Invalid block type");
+                }
+                break;
+
+            case State::StoredLength:
+                if (!get_bits(16, &field_remaining) || !get_bits(16, &value))
+                    return false;
+
+                if (field_remaining != (~value & 0xFFFF))
+                    return fail("Invalid stored block length");
+
+                state = State::Stored;
+                break;
+
+            case State::Stored:
+                if (field_remaining == 0) {
+                    state = last_block ? State::Trailer : State::BlockHeader;
+                    break;
+                }
+
+                if (!get_bits(8, &value))
+                    return false;
+
+                put(value);
+                --field_remaining;
+                break;
+
+            case State::Codes: {
+                int symbol;
+                if (!decode_symbol(lengths, &symbol))
+                    return false;
+
+                if (symbol < 256) {
+                    put(symbol);
+                    break;
+                }
+
+                if (symbol == 256) {
+                    state = last_block ? State::Trailer : State::BlockHeader;
+                    break;
+                }
+
+                symbol -= 257;
+                if (symbol >= 29)
+                    return fail("Invalid length code");
+
+                if (!get_bits(length_extra[symbol], &value))
+                    return false;
+
+                uint32_t length = length_base[symbol] + value;
+
+                if (!decode_symbol(distances, &symbol))
+                    return false;
+
+                if (symbol >= 30)
+                    return fail("Invalid distance code");
+
+                if (!get_bits(distance_extra[symbol], &value))
+                    return false;
+
+                uint32_t distance = distance_base[symbol] + value;
+
+                if (distance > out_pos)
+                    return fail("Distance too far back");
+
+                if (distance > WINDOW_SIZE)
+                    return fail("Distance exceeds window size. The image has to be compressed with merge_firmware_hook.py");
+
+                for (uint32_t i = 0; i < length; ++i)
+                    put(window[(out_pos - distance) & (WINDOW_SIZE - 1)]);
+                break;
+            }
+
+            case State::Trailer: {
+                if (!flush())
+                    return false;
+
+                align_to_byte();
+
+                uint32_t crc_low, crc_high, size_low, size_high;
+                if (!get_bits(16, &crc_low) || !get_bits(16, &crc_high) || !get_bits(16, &size_low) || !get_bits(16, &size_high))
+                    return false;
+
+                if ((crc_low | (crc_high << 16)) != crc)
+                    return fail("CRC mismatch");
+
+                // The size is stored modulo 2^32.
+                if ((size_low | (size_high << 16)) != (uint32_t)out_pos)
+                    return fail("Size mismatch");
+
+                state = State::Done;
+                break;
+            }
+
+            default:
+                break;
+        }
+
+        // Unflushed data stays below WINDOW_SIZE / 2 + 258 bytes, so it is never overwritten.
+        if (out_pos - flushed >= WINDOW_SIZE / 2 && !flush())
+            return false;
+    }
+}
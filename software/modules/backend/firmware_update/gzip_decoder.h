@@ -0,0 +1,124 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+
+// Streaming gzip (RFC 1952) decoder for compressed firmware uploads.
+//
+// Only keeps a window of 2^GZIP_DECODER_WINDOW_BITS bytes instead of the 32 KiB deflate allows.
+// The images are compressed by merge_firmware_hook.py with the same window size; streams that
+// reference older data are rejected.
+//
+// Input can be split at any byte. A block header or symbol is only decoded if enough input
+// for the largest one is buffered (or finish was called), so decoding never has to stop in
+// the middle of one.
+
+// Has to match the window bits in merge_firmware_hook.py.
+#define GZIP_DECODER_WINDOW_BITS 12
+#define GZIP_DECODER_IN_BUF_SIZE 2048
+
+class GzipDecoder {
+public:
+    // output is called with the decompressed data. It returns false to stop decoding.
+    GzipDecoder(std::function<bool(const uint8_t *, size_t)> &&output);
+
+    GzipDecoder(const GzipDecoder &) = delete;
+    GzipDecoder &operator=(const GzipDecoder &) = delete;
+
+    // Returns false if the input is malformed or output returned false.
+    bool write(const uint8_t *data, size_t len);
+
+    // Decodes the remaining input. Returns false if the stream is incomplete or its CRC or size don't match.
+    bool finish();
+
+    // Describes why write or finish failed.
+    const char *error() { return error_message; }
+
+    size_t bytesWritten() { return flushed; }
+
+private:
+    static const size_t WINDOW_SIZE = 1 << GZIP_DECODER_WINDOW_BITS;
+
+    struct Huffman {
+        // Number of codes of each length and the symbols ordered by code.
+        uint16_t count[16];
+        uint16_t symbol[288];
+    };
+
+    enum class State {
+        Header,
+        HeaderExtraLength,
+        HeaderExtra,
+        HeaderName,
+        HeaderComment,
+        HeaderCrc,
+        BlockHeader,
+        StoredLength,
+        Stored,
+        Codes,
+        Trailer,
+        Done,
+        Failed,
+    };
+
+    bool process(bool final);
+    State next_header_state(State current);
+    void align_to_byte();
+    bool read_dynamic_tables();
+    bool decode_symbol(const Huffman &h, int *symbol);
+
+    bool fill_bits(uint32_t count);
+    bool get_bits(uint32_t count, uint32_t *value);
+
+    void put(uint8_t b);
+    bool flush();
+    bool fail(const char *message);
+
+    static bool build_huffman(Huffman *h, const uint8_t *lengths, size_t count);
+
+    std::function<bool(const uint8_t *, size_t)> output;
+    const char *error_message = nullptr;
+
+    State state = State::Header;
+    bool last_block = false;
+
+    uint8_t header[10];
+    size_t header_pos = 0;
+    uint8_t flags = 0;
+    uint32_t field_remaining = 0;
+
+    Huffman lengths;
+    Huffman distances;
+
+    uint8_t in_buf[GZIP_DECODER_IN_BUF_SIZE];
+    size_t in_pos = 0;
+    size_t in_len = 0;
+    uint32_t bit_buf = 0;
+    uint32_t bit_count = 0;
+
+    uint8_t window[WINDOW_SIZE];
+    size_t out_pos = 0;
+    size_t flushed = 0;
+    uint32_t crc = 0;
+};
@@ -19,6 +19,10 @@
 
 #include "http.h"
 
+#include <string.h>
+
+#include <algorithm>
+
 #include "api.h"
 #include "task_scheduler.h"
 #include "web_server.h"
@@ -27,8 +31,60 @@ extern API api;
 extern WebServer server;
 extern TaskScheduler task_scheduler;
 
-static char recv_buf[4096] = {0};
-static StaticJsonDocument<4096> json_buf;
+#define BODY_READ_CHUNK_SIZE 256
+
+// Smaller states fit into one TCP segment anyway. Larger ones are sent compressed if the client supports it.
+#define STATE_COMPRESSION_THRESHOLD 1024
+
+// Passes the request body to ArduinoJson in small pieces, so the body is never buffered completely.
+class RequestBodyReader {
+public:
+    RequestBodyReader(WebServerRequest &request) : request(request) {}
+
+    int read()
+    {
+        if (pos == len && !fill())
+            return -1;
+
+        return (uint8_t)buf[pos++];
+    }
+
+    size_t readBytes(char *dst, size_t n)
+    {
+        size_t done = 0;
+        while (done < n && (pos < len || fill())) {
+            size_t to_copy = std::min(n - done, len - pos);
+            memcpy(dst + done, buf + pos, to_copy);
+            pos += to_copy;
+            done += to_copy;
+        }
+        return done;
+    }
+
+    bool failed = false;
+
+private:
+    bool fill()
+    {
+        int received = request.readBody(buf, sizeof(buf));
+        if (received <= 0) {
+            failed = received < 0;
+            return false;
+        }
+
+        pos = 0;
+        len = received;
+        return true;
+    }
+
+    WebServerRequest &request;
+    char buf[BODY_READ_CHUNK_SIZE];
+    size_t pos = 0;
+    size_t len = 0;
+};
+
+// Part of the state ETags: Revisions restart at 0 after a reboot.
+static uint32_t etag_boot_id = 0;
 
 Http::Http()
 {
@@ -37,7 +93,7 @@ Http::Http()
 
 void Http::setup()
 {
-
+    etag_boot_id = esp_random();
 }
 
 void Http::register_urls()
@@ -59,25 +115,35 @@ void Http::addCommand(const CommandRegistration &reg)
             return;
         }
 
-        // TODO: Use streamed parsing
-        int bytes_written = request.receive(recv_buf, 4096);
-        if (bytes_written == -1) {
-            // buffer was not large enough
-            request.send(413);
+        // The document is sized for the largest payload the config accepts, not for the payload received,
+        // and is not shared with concurrent requests.
+        DynamicJsonDocument doc(reg.config->json_size());
+        if (doc.capacity() == 0) {
+            logger.printfln("Failed to allocate %u bytes to parse command payload for %s", reg.config->json_size(), reg.path.c_str());
+            request.send(500, "text/plain", "Out of memory");
             return;
-        } else if (bytes_written <= 0) {
-            logger.printfln("Failed to receive command payload: error code %d", bytes_written);
+        }
+
+        RequestBodyReader reader{request};
+        DeserializationError error = deserializeJson(doc, reader);
+        if (reader.failed) {
+            logger.printfln("Failed to receive command payload for %s", reg.path.c_str());
             request.send(400);
+            return;
+        }
+
+        if (error == DeserializationError::NoMemory) {
+            // The payload can't be valid for this config.
+            request.send(413);
+            return;
         }
 
-        //json_buf.clear(); // happens implicitly in deserializeJson
-        DeserializationError error = deserializeJson(json_buf, recv_buf, bytes_written);
         if (error) {
             logger.printfln("Failed to parse command payload: %s", error.c_str());
             request.send(400);
             return;
         }
-        JsonVariant json = json_buf.as<JsonVariant>();
+        JsonVariant json = doc.as<JsonVariant>();
         String message = reg.config->update_from_json(json);
 
         if (message == "") {
@@ -91,9 +157,34 @@ void Http::addCommand(const CommandRegistration &reg)
 
 void Http::addState(const StateRegistration &reg)
 {
-    server.on((String("/") + reg.path).c_str(), HTTP_GET, [reg](WebServerRequest request) {
-        String response = reg.config->to_string_except(reg.keys_to_censor);
-        request.send(200, "application/json; charset=utf-8", response.c_str());
+    // reg is stored in API::states, which never moves its elements.
+    const StateRegistration *state = &reg;
+
+    server.on((String("/") + reg.path).c_str(), HTTP_GET, [state](WebServerRequest request) {
+        // Large states are sent compressed: The response depends on Accept-Encoding and each coding needs its own ETag.
+        request.addVaryAcceptEncoding();
+        bool gzip = request.acceptsGzip();
+
+        // The revision only describes the current value if there is no update the API did not handle yet.
+        // Check this before reading the revision: Handling the update increments it.
+        char etag[28];
+        if (!state->config->was_updated()) {
+            snprintf(etag, sizeof(etag), "\"%08x-%x%s\"", etag_boot_id, state->revision, gzip ? "-gz" : "");
+
+            request.addResponseHeader("Cache-Control", "no-cache");
+            if (request.checkETag(etag))
+                return;
+        }
+
+        String response = state->config->to_string_except(state->keys_to_censor);
+        if (response.length() < STATE_COMPRESSION_THRESHOLD) {
+            request.send(200, "application/json; charset=utf-8", response.c_str());
+            return;
+        }
+
+        request.beginChunkedResponse(200, "application/json; charset=utf-8");
+        request.sendChunk(response.c_str(), response.length());
+        request.endChunkedResponse();
     });
 }
 
@@ -106,3 +197,8 @@ void Http::wifiAvailable()
 {
 
 }
+
+bool Http::needsJsonStateUpdates()
+{
+    return false;
+}
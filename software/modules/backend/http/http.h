@@ -33,6 +33,7 @@ public:
     void addState(const StateRegistration &reg);
     void pushStateUpdate(String payload, String path);
     void wifiAvailable();
+    bool needsJsonStateUpdates();
 
     bool initialized = false;
 };
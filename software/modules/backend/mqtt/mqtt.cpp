@@ -33,6 +33,8 @@ extern TaskScheduler task_scheduler;
 extern char uid[7];
 extern API api;
 
+static EventLogModule log_module{"mqtt"};
+
 #define MQTT_RECV_BUFFER_SIZE 4096
 #define MQTT_RECV_BUFFER_HEADROOM (MQTT_RECV_BUFFER_SIZE / 4)
 
@@ -74,11 +76,11 @@ void Mqtt::addCommand(const CommandRegistration &reg)
 {
     auto req_size = reg.config->json_size();
     if (req_size > MQTT_RECV_BUFFER_SIZE) {
-        logger.printfln("MQTT: Recv buf is %u bytes. %s requires %u. Bump MQTT_RECV_BUFFER_SIZE! Not subscribing!", MQTT_RECV_BUFFER_SIZE, reg.path.c_str(), req_size);
+        logger.printfln_at(EventLogLevel::ERROR, &log_module, "MQTT: Recv buf is %u bytes. %s requires %u. Bump MQTT_RECV_BUFFER_SIZE! Not subscribing!", MQTT_RECV_BUFFER_SIZE, reg.path.c_str(), req_size);
         return;
     }
     if (req_size > (MQTT_RECV_BUFFER_SIZE - MQTT_RECV_BUFFER_HEADROOM))
-        logger.printfln("MQTT: Recv buf is %u bytes. %s requires %u. Maybe bump MQTT_RECV_BUFFER_SIZE?", MQTT_RECV_BUFFER_SIZE, reg.path.c_str(), req_size);
+        logger.printfln_at(EventLogLevel::WARNING, &log_module, "MQTT: Recv buf is %u bytes. %s requires %u. Maybe bump MQTT_RECV_BUFFER_SIZE?", MQTT_RECV_BUFFER_SIZE, reg.path.c_str(), req_size);
 
     if (mqtt_state.get("connection_state")->asInt() != (int)MqttConnectionState::CONNECTED)
         return;
@@ -86,7 +88,7 @@ void Mqtt::addCommand(const CommandRegistration &reg)
     subscribe(reg.path, reg.config->json_size(), [reg](char *payload, size_t payload_len){
         String reason = api.getCommandBlockedReason(reg.path);
         if (reason != "") {
-            logger.printfln("MQTT: Command %s is blocked: %s", reg.path.c_str(), reason.c_str());
+            logger.printfln_at(EventLogLevel::WARNING, &log_module, "MQTT: Command %s is blocked: %s", reg.path.c_str(), reason.c_str());
             return;
         }
 
@@ -96,7 +98,7 @@ void Mqtt::addCommand(const CommandRegistration &reg)
             return;
         }
 
-        logger.printfln("MQTT: Failed to update %s from MQTT payload: %s", reg.path.c_str(), error.c_str());
+        logger.printfln_at(EventLogLevel::WARNING, &log_module, "MQTT: Failed to update %s from MQTT payload: %s", reg.path.c_str(), error.c_str());
     }, reg.is_action);
 }
 
@@ -114,6 +116,11 @@ void Mqtt::publish(String payload, String path)
 
 void Mqtt::pushStateUpdate(String payload, String path)
 {
+    // The API skips serializing states while no backend needs them. An empty retained message
+    // would delete the state on the broker. onMqttConnect publishes all states anyway.
+    if (payload.length() == 0)
+        return;
+
     this->publish(payload, path);
 }
 
@@ -125,9 +132,14 @@ void Mqtt::wifiAvailable()
     started = true;
 }
 
+bool Mqtt::needsJsonStateUpdates()
+{
+    return mqtt_state.get("connection_state")->asInt() == (int)MqttConnectionState::CONNECTED;
+}
+
 void Mqtt::onMqttConnect()
 {
-    logger.printfln("MQTT: Connected to broker.");
+    logger.printfln_at(EventLogLevel::INFO, &log_module, "MQTT: Connected to broker.");
     this->mqtt_state.get("connection_state")->updateInt((int)MqttConnectionState::CONNECTED);
 
     this->commands.clear();
@@ -142,7 +154,7 @@ void Mqtt::onMqttConnect()
 void Mqtt::onMqttDisconnect()
 {
     this->mqtt_state.get("connection_state")->updateInt((int)MqttConnectionState::NOT_CONNECTED);
-    logger.printfln("MQTT: Disconnected from broker.");
+    logger.printfln_at(EventLogLevel::INFO, &log_module, "MQTT: Disconnected from broker.");
 }
 
 void Mqtt::onMqttMessage(char *topic, size_t topic_len, char *data, size_t data_len, bool retain)
@@ -154,12 +166,12 @@ void Mqtt::onMqttMessage(char *topic, size_t topic_len, char *data, size_t data_
             continue;
 
         if (data_len > c.max_len) {
-            logger.printfln("MQTT: Ignoring message with payload length %u for topic %s. Maximum length allowed is %u.", data_len, c.topic.c_str(), c.max_len);
+            logger.printfln_at(EventLogLevel::WARNING, &log_module, "MQTT: Ignoring message with payload length %u for topic %s. Maximum length allowed is %u.", data_len, c.topic.c_str(), c.max_len);
             return;
         }
 
         if (retain && c.forbid_retained) {
-            logger.printfln("MQTT: Topic %s is an action. Ignoring retained message.", c.topic.c_str());
+            logger.printfln_at(EventLogLevel::INFO, &log_module, "MQTT: Topic %s is an action. Ignoring retained message.", c.topic.c_str());
             return;
         }
 
@@ -167,6 +179,36 @@ void Mqtt::onMqttMessage(char *topic, size_t topic_len, char *data, size_t data_
     }
 }
 
+void Mqtt::queueMqttMessage(const char *topic, size_t topic_len, const char *data, size_t data_len, bool retain)
+{
+    // The event's buffers are reused by the MQTT task as soon as the event handler returns.
+    char *buf = (char *)malloc(topic_len + data_len);
+    if (buf == nullptr) {
+        LOG_RATE_LIMITED(&log_module, EventLogLevel::ERROR, "MQTT: Failed to allocate %u bytes for message. Dropping it.", topic_len + data_len);
+        return;
+    }
+
+    memcpy(buf, topic, topic_len);
+    memcpy(buf + topic_len, data, data_len);
+
+    MqttMessage msg{buf, topic_len, buf + topic_len, data_len, retain};
+
+    // Don't drop command payloads if the main loop falls behind: Block the MQTT task until there is space.
+    // This throttles the broker via TCP flow control instead.
+    uint32_t wait_start = millis();
+    bool warned = false;
+    while (!message_queue.push(msg)) {
+        task_scheduler.wakeUp();
+        if (!warned && deadline_elapsed(wait_start + MQTT_MESSAGE_QUEUE_WARN_MS)) {
+            logger.printfln_at(EventLogLevel::WARNING, &log_module, "MQTT: Message queue full for %d ms. Main loop stalled?", MQTT_MESSAGE_QUEUE_WARN_MS);
+            warned = true;
+        }
+        vTaskDelay(1);
+    }
+
+    task_scheduler.wakeUp();
+}
+
 static char err_buf[64] = {0};
 
 static const char *get_mqtt_error(esp_mqtt_connect_return_code_t rc)
@@ -210,10 +252,11 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
             break;
         case MQTT_EVENT_DATA:
             if(event->total_data_len != event->data_len) {
-                logger.printfln("MQTT: fragmented payload (%u %u). Payload too long?", event->data_len, event->total_data_len);
+                logger.printfln_at(EventLogLevel::WARNING, &log_module, "MQTT: fragmented payload (%u %u). Payload too long?", event->data_len, event->total_data_len);
                 return;
             }
-            mqtt->onMqttMessage(event->topic, event->topic_len, event->data, event->data_len, event->retain);
+            // Handle the message in the main loop: The command callbacks update configs that are not thread safe.
+            mqtt->queueMqttMessage(event->topic, event->topic_len, event->data, event->data_len, event->retain);
             break;
         case MQTT_EVENT_ERROR: {
                 auto eh = event->error_handle;
@@ -221,25 +264,25 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
                 if (eh->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT) {
                     if (eh->esp_tls_last_esp_err != ESP_OK) {
                         const char *e = esp_err_to_name_r(eh->esp_tls_last_esp_err, err_buf, sizeof(err_buf) / sizeof(err_buf[0]));
-                        logger.printfln("MQTT: Transport error: %s (esp_tls_last_esp_err)", e);
+                        LOG_RATE_LIMITED(&log_module, EventLogLevel::ERROR, "MQTT: Transport error: %s (esp_tls_last_esp_err)", e);
                         mqtt->mqtt_state.get("last_error")->updateInt(eh->esp_tls_last_esp_err);
                     }
                     if (eh->esp_tls_stack_err != 0) {
                         const char *e = esp_err_to_name_r(eh->esp_tls_stack_err, err_buf, sizeof(err_buf) / sizeof(err_buf[0]));
-                        logger.printfln("MQTT: Transport error: %s (esp_tls_stack_err)", e);
+                        LOG_RATE_LIMITED(&log_module, EventLogLevel::ERROR, "MQTT: Transport error: %s (esp_tls_stack_err)", e);
                         mqtt->mqtt_state.get("last_error")->updateInt(eh->esp_tls_stack_err);
                     }
                     if (eh->esp_transport_sock_errno != 0) {
                         const char *e = strerror(eh->esp_transport_sock_errno);
-                        logger.printfln("MQTT: Transport error: %s", e);
+                        LOG_RATE_LIMITED(&log_module, EventLogLevel::ERROR, "MQTT: Transport error: %s", e);
                         mqtt->mqtt_state.get("last_error")->updateInt(eh->esp_transport_sock_errno);
                     }
                 } else if (eh->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED) {
-                    logger.printfln("MQTT: Connection refused: %s", get_mqtt_error(eh->connect_return_code));
+                    logger.printfln_at(EventLogLevel::ERROR, &log_module, "MQTT: Connection refused: %s", get_mqtt_error(eh->connect_return_code));
                     // Minus to indicate this is a connection error
                     mqtt->mqtt_state.get("last_error")->updateInt(-eh->connect_return_code);
                 } else {
-                    logger.printfln("MQTT: Unknown error");
+                    logger.printfln_at(EventLogLevel::ERROR, &log_module, "MQTT: Unknown error");
                     mqtt->mqtt_state.get("last_error")->updateInt(0xFFFFFFFF);
                 }
                 break;
@@ -295,5 +338,9 @@ void Mqtt::register_urls()
 
 void Mqtt::loop()
 {
-
+    MqttMessage msg;
+    while (message_queue.pop(&msg)) {
+        onMqttMessage(msg.topic, msg.topic_len, msg.data, msg.data_len, msg.retain);
+        free(msg.topic);
+    }
 }
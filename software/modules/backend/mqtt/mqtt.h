@@ -23,8 +23,12 @@
 
 #include "api.h"
 #include "config.h"
+#include "spsc_queue.h"
 
 #define MAX_CONNECT_ATTEMPT_INTERVAL_MS 5 * 60 * 1000
+#define MQTT_MESSAGE_QUEUE_SIZE 16
+// queueMqttMessage blocks while the queue is full. Warn if that takes longer than this.
+#define MQTT_MESSAGE_QUEUE_WARN_MS 1000
 
 enum class MqttConnectionState {
     NOT_CONFIGURED,
@@ -40,6 +44,16 @@ struct MqttCommand {
     bool forbid_retained;
 };
 
+// A received message, handed from the MQTT task to the main loop.
+// topic and data point into the same allocation, starting at topic.
+struct MqttMessage {
+    char *topic;
+    size_t topic_len;
+    char *data;
+    size_t data_len;
+    bool retain;
+};
+
 class Mqtt : public IAPIBackend {
 public:
     Mqtt();
@@ -56,6 +70,7 @@ public:
     void addState(const StateRegistration &reg);
     void pushStateUpdate(String payload, String path);
     void wifiAvailable();
+    bool needsJsonStateUpdates();
 
     bool initialized = false;
 
@@ -63,6 +78,9 @@ public:
     void onMqttMessage(char *topic, size_t topic_len, char *data, size_t data_len, bool retain);
     void onMqttDisconnect();
 
+    // Called in the MQTT task. Blocks while the message queue is full.
+    void queueMqttMessage(const char *topic, size_t topic_len, const char *data, size_t data_len, bool retain);
+
     Config mqtt_config;
     Config mqtt_state;
 
@@ -70,4 +88,7 @@ public:
 
     std::vector<MqttCommand> commands;
     esp_mqtt_client_handle_t client;
+
+    // Filled by the MQTT task, drained by loop().
+    TF_SPSCQueue<MqttMessage, MQTT_MESSAGE_QUEUE_SIZE> message_queue;
 };
@@ -35,6 +35,8 @@ extern TaskScheduler task_scheduler;
 
 extern API api;
 
+static EventLogModule log_module{"sdm72dm"};
+
 SDM72DM::SDM72DM() : DeviceModule("rs485", "RS485", "energy meter", std::bind(&SDM72DM::setupRS485, this))
 {
     state = Config::Object({
@@ -62,25 +64,25 @@ void read_input_registers_handler(struct TF_RS485 *device, uint8_t request_id, i
     SDM72DM::UserData *ud = (SDM72DM::UserData *) user_data;
 
     if (request_id != ud->expected_request_id || ud->expected_request_id == 0) {
-        logger.printfln("Unexpected request id %u, expected %u", request_id, ud->expected_request_id);
+        logger.printfln_at(EventLogLevel::WARNING, &log_module, "Unexpected request id %u, expected %u", request_id, ud->expected_request_id);
         ud->done = SDM72DM::UserDataDone::ERROR;
         return;
     }
 
     if (exception_code != 0) {
-        logger.printfln("Request %u: Exception code %d", request_id, exception_code);
+        logger.printfln_at(EventLogLevel::WARNING, &log_module, "Request %u: Exception code %d", request_id, exception_code);
         ud->done = SDM72DM::UserDataDone::ERROR;
         return;
     }
 
     if (input_registers_length != 2) {
-        logger.printfln("Request %u: Unexpected response length %I16u", request_id, input_registers_length);
+        logger.printfln_at(EventLogLevel::WARNING, &log_module, "Request %u: Unexpected response length %I16u", request_id, input_registers_length);
         ud->done = SDM72DM::UserDataDone::ERROR;
         return;
     }
 
     if (ud->value_to_write == nullptr) {
-        logger.printfln("value to write was nullptr");
+        logger.printfln_at(EventLogLevel::ERROR, &log_module, "value to write was nullptr");
         ud->done = SDM72DM::UserDataDone::ERROR;
         return;
     }
@@ -107,13 +109,13 @@ void write_multiple_registers_handler(struct TF_RS485 *device, uint8_t request_i
     SDM72DM::UserData *ud = (SDM72DM::UserData *)user_data;
 
     if (request_id != ud->expected_request_id || ud->expected_request_id == 0) {
-        logger.printfln("Unexpected request id %u, expected %u", request_id, ud->expected_request_id);
+        logger.printfln_at(EventLogLevel::WARNING, &log_module, "Unexpected request id %u, expected %u", request_id, ud->expected_request_id);
         ud->done = SDM72DM::UserDataDone::ERROR;
         return;
     }
 
     if (exception_code != 0) {
-        logger.printfln("Exception code %d", exception_code);
+        logger.printfln_at(EventLogLevel::WARNING, &log_module, "Exception code %d", exception_code);
         ud->done = SDM72DM::UserDataDone::ERROR;
         return;
     }
@@ -130,7 +132,7 @@ void SDM72DM::setupRS485()
     int result = tf_rs485_set_mode(&device, TF_RS485_MODE_MODBUS_MASTER_RTU);
     if (result != TF_E_OK) {
         if (!is_in_bootloader(result)) {
-            logger.printfln("RS485 set mode failed (rc %d). Disabling energy meter support.", result);
+            logger.printfln_at(EventLogLevel::ERROR, &log_module, "RS485 set mode failed (rc %d). Disabling energy meter support.", result);
         }
         return;
     }
@@ -138,7 +140,7 @@ void SDM72DM::setupRS485()
     result = tf_rs485_set_rs485_configuration(&device, 9600, TF_RS485_PARITY_NONE, TF_RS485_STOPBITS_1, TF_RS485_WORDLENGTH_8, TF_RS485_DUPLEX_HALF);
     if (result != TF_E_OK) {
         if (!is_in_bootloader(result)) {
-            logger.printfln("RS485 set config failed (rc %d). Disabling energy meter support.", result);
+            logger.printfln_at(EventLogLevel::ERROR, &log_module, "RS485 set config failed (rc %d). Disabling energy meter support.", result);
         }
         return;
     }
@@ -146,7 +148,7 @@ void SDM72DM::setupRS485()
     result = tf_rs485_set_modbus_configuration(&device, 1, 1000);
     if (result != TF_E_OK) {
         if (!is_in_bootloader(result)) {
-            logger.printfln("RS485 set modbus config failed (rc %d). Disabling energy meter support.", result);
+            logger.printfln_at(EventLogLevel::ERROR, &log_module, "RS485 set modbus config failed (rc %d). Disabling energy meter support.", result);
         }
         return;
     }
@@ -163,13 +165,13 @@ void SDM72DM::checkRS485State()
     int result = tf_rs485_get_mode(&device, &mode);
     if (result != TF_E_OK) {
         if (!is_in_bootloader(result)) {
-            logger.printfln("Failed to get RS485 mode, rc: %d", result);
+            logger.printfln_at(EventLogLevel::ERROR, &log_module, "Failed to get RS485 mode, rc: %d", result);
             error_counters.get("bricklet")->updateUint(error_counters.get("bricklet")->asUint() + 1);
         }
         return;
     }
     if (mode != TF_RS485_MODE_MODBUS_MASTER_RTU) {
-        logger.printfln("RS485 mode invalid (%u). Did the bricklet reset?", mode);
+        logger.printfln_at(EventLogLevel::WARNING, &log_module, "RS485 mode invalid (%u). Did the bricklet reset?", mode);
         error_counters.get("bricklet_reset")->updateUint(error_counters.get("bricklet_reset")->asUint() + 1);
         setupRS485();
     }
@@ -179,8 +181,8 @@ void SDM72DM::setup()
 {
     for (int i = 0; i < power_history.size(); ++i) {
         //float f = 5000.0 * sin(PI/120.0 * i) + 5000.0;
-        // Use negative values to mark that these are pre-filled.
-        power_history.push(-1);
+        // Use NAN to mark that these are pre-filled.
+        power_history.push(NAN);
     }
 
     setupRS485();
@@ -210,30 +212,17 @@ void SDM72DM::register_urls()
             return;
         }
 
-        const size_t buf_size = RING_BUF_SIZE * 6 + 100;
-        char buf[buf_size] = {0};
-        size_t buf_written = 0;
-
-        int16_t val;
-        power_history.peek(&val);
-        // Negative values are prefilled, because the ESP was booted less than 48 hours ago.
-        if (val < 0)
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%s", "[null");
-        else
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "[%d", (int)val);
-
-        for (int i = 1; i < power_history.used() && power_history.peek_offset(&val, i) && buf_written < buf_size; ++i) {
-            // Negative values are prefilled, because the ESP was booted less than 48 hours ago.
-            if (val < 0)
-                buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%s", ",null");
-            else
-                buf_written += snprintf(buf + buf_written, buf_size - buf_written, ",%d", (int)val);
-        }
-
-        if (buf_written < buf_size)
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%c", ']');
-
-        request.send(200, "application/json; charset=utf-8", buf, buf_written);
+        decltype(power_history)::Span spans[2];
+        power_history.peek_spans(0, power_history.used(), spans);
+
+        // NAN values are prefilled, because the ESP was booted less than 48 hours ago. They are sent as null.
+        bool first = true;
+        request.beginChunkedResponse(200, "application/json; charset=utf-8");
+        request.sendChunk("[", 1);
+        for (const auto &span : spans)
+            request.sendJsonIntegers(span.data, span.len, &first);
+        request.sendChunk("]", 1);
+        request.endChunkedResponse();
     });
 
     server.on("/meter/live", HTTP_GET, [this](WebServerRequest request) {
@@ -242,26 +231,30 @@ void SDM72DM::register_urls()
             return;
         }
 
-        const size_t buf_size = RING_BUF_SIZE * 6 + 100;
-        char buf[buf_size] = {0};
-        size_t buf_written = 0;
-
-        int16_t val;
-        interval_samples.peek(&val);
         float samples_per_second = 0;
         if (this->samples_per_interval > 0) {
             samples_per_second = ((float)this->samples_per_interval) / (60 * HISTORY_MINUTE_INTERVAL);
         } else {
             samples_per_second = (float)this->samples_last_interval / millis() * 1000;
         }
-        buf_written += snprintf(buf + buf_written, buf_size - buf_written, "{\"samples_per_second\":%f,\"samples\":[%d", samples_per_second, val);
 
-        for (int i = 1; (i < interval_samples.used() - 1) && interval_samples.peek_offset(&val, i) && buf_written < buf_size; ++i) {
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, ",%d", val);
+        char buf[64];
+        int buf_written = snprintf(buf, sizeof(buf), "{\"samples_per_second\":%f,\"samples\":[", isfinite(samples_per_second) ? samples_per_second : 0.0f);
+        if (buf_written < 0 || (size_t)buf_written >= sizeof(buf)) {
+            request.send(500, "text/plain", "failed to format samples");
+            return;
         }
-        if (buf_written < buf_size)
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%s", "]}");
-        request.send(200, "application/json; charset=utf-8", buf, buf_written);
+
+        decltype(interval_samples)::Span spans[2];
+        interval_samples.peek_spans(0, interval_samples.used() - 1, spans);
+
+        bool first = true;
+        request.beginChunkedResponse(200, "application/json; charset=utf-8");
+        request.sendChunk(buf, buf_written);
+        for (const auto &span : spans)
+            request.sendJsonIntegers(span.data, span.len, &first);
+        request.sendChunk("]}", 2);
+        request.endChunkedResponse();
     });
 
     this->DeviceModule::register_urls();
@@ -277,7 +270,7 @@ void SDM72DM::loop()
         return;
 
     if (user_data.done == UserDataDone::NOT_DONE) {
-        logger.printfln("rs485 deadline reached!");
+        LOG_RATE_LIMITED(&log_module, EventLogLevel::WARNING, "rs485 deadline reached!");
         this->checkRS485State();
     }
 
@@ -364,7 +357,7 @@ void SDM72DM::loop()
     user_data.expected_request_id = 0;
     is_in_bootloader(tf_rs485_modbus_master_read_input_registers(&device, 1, start_address, 2, &user_data.expected_request_id));
     if (user_data.expected_request_id == 0) {
-        logger.printfln("Failed to read energy meter registers starting at %u: request_id: %u", start_address, user_data.expected_request_id);
+        logger.printfln_at(EventLogLevel::WARNING, &log_module, "Failed to read energy meter registers starting at %u: request_id: %u", start_address, user_data.expected_request_id);
         this->checkRS485State();
     }
 
@@ -380,8 +373,7 @@ void SDM72DM::loop()
             if (deadline_elapsed(next_read_deadline_ms))
                 next_read_deadline_ms = millis() + 500;
 
-            int16_t val = (int16_t)min((float)INT16_MAX, state.get("power")->asFloat());
-            interval_samples.push(val);
+            interval_samples.push(state.get("power")->asFloat());
             ++samples_last_interval;
         } else if (last_user_data_done == UserDataDone::ERROR) {
             next_read_deadline_ms = millis() + 500;
@@ -393,13 +385,14 @@ void SDM72DM::loop()
 
         if (deadline_elapsed(interval_end_ms)) {
             float interval_sum = 0;
-            int16_t val;
-            for (int i = 0; i < samples_last_interval; ++i) {
-                interval_samples.peek_offset(&val, interval_samples.used() - 1 - i);
-                interval_sum += val;
-            }
-
-            power_history.push((int16_t)(interval_sum / samples_last_interval));
+            size_t samples = min((size_t)samples_last_interval, interval_samples.used());
+            decltype(interval_samples)::Span spans[2];
+            interval_samples.peek_spans(interval_samples.used() - samples, samples, spans);
+            for (const auto &span : spans)
+                for (size_t i = 0; i < span.len; ++i)
+                    interval_sum += span.data[i];
+
+            power_history.push(interval_sum / samples_last_interval);
             samples_per_interval = samples_last_interval;
             samples_last_interval = 0;
             interval_end_ms = millis() + 1000 * 60 * HISTORY_MINUTE_INTERVAL;
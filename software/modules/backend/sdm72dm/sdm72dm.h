@@ -82,12 +82,12 @@ private:
     int samples_last_interval = 0;
     int samples_per_interval = -1;
     uint32_t interval_end_ms = 1000 * 60 * HISTORY_MINUTE_INTERVAL;
-    TF_Ringbuffer<int16_t, 3 * 60 * HISTORY_MINUTE_INTERVAL, uint32_t, malloc_32bit_addressed, heap_caps_free> interval_samples;
+    TF_GenericRingbuffer<float, 3 * 60 * HISTORY_MINUTE_INTERVAL - 1, malloc_32bit_addressed, heap_caps_free> interval_samples;
 
     uint32_t next_modbus_read_deadline = 0;
     uint32_t next_power_history_entry = 0;
     UserData user_data;
-    TF_Ringbuffer<int16_t, HISTORY_HOURS * (60 / HISTORY_MINUTE_INTERVAL) + 1, uint32_t, malloc_32bit_addressed, heap_caps_free> power_history;
+    TF_GenericRingbuffer<float, HISTORY_HOURS * (60 / HISTORY_MINUTE_INTERVAL), malloc_32bit_addressed, heap_caps_free> power_history;
 
     bool energy_meter_reset_requested;
 
@@ -67,6 +67,10 @@ void Sse::addState(StateRegistration reg) {
 }
 
 void Sse::pushStateUpdate(String payload, String path) {
+    // Empty if no client was connected when the update was handled. New clients get all states in onConnect.
+    if (payload.length() == 0)
+        return;
+
     events.send(payload.c_str(), path.c_str(), millis());
 }
 
@@ -74,3 +78,8 @@ void Sse::wifiAvailable()
 {
 
 }
+
+bool Sse::needsJsonStateUpdates()
+{
+    return events.count() > 0;
+}
@@ -36,6 +36,7 @@ public:
     void addState(StateRegistration reg);
     void pushStateUpdate(String payload, String path);
     void wifiAvailable();
+    bool needsJsonStateUpdates();
 
     bool initialized = false;
 
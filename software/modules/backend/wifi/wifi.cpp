@@ -366,6 +366,12 @@ void Wifi::setup()
         WiFi.disconnect(false, true);
     }, ARDUINO_EVENT_WIFI_STA_LOST_IP);
 
+    // loop() reacts to WiFi and Ethernet state changes. Wake the main loop
+    // on every network event instead of waiting for its next poll.
+    WiFi.onEvent([](arduino_event_id_t event, arduino_event_info_t info) {
+            task_scheduler.wakeUp();
+        });
+
     bool enable_ap = wifi_ap_config_in_use.get("enable_ap")->asBool();
     bool enable_sta = wifi_sta_config_in_use.get("enable_sta")->asBool();
     bool ap_fallback_only = wifi_ap_config_in_use.get("ap_fallback_only")->asBool();
@@ -511,10 +517,13 @@ void Wifi::register_urls()
 
         if (network_count < 0) {
             request.send(200, "text/plain; charset=utf-8", result.c_str());
+            return;
         }
 
         logger.printfln("scan done");
-        request.send(200, "application/json; charset=utf-8", result.c_str());
+        request.beginChunkedResponse(200, "application/json; charset=utf-8");
+        request.sendChunk(result.c_str(), result.length());
+        request.endChunkedResponse();
     });
 
     api.addPersistentConfig("wifi/sta_config", &wifi_sta_config, {"passphrase"}, 1000);
@@ -21,10 +21,13 @@
 
 #include <esp_http_server.h>
 
+#include "cbor.h"
+#include "event_log.h"
 #include "keep_alive.h"
 #include "task_scheduler.h"
 #include "web_server.h"
 
+extern EventLog logger;
 extern TaskScheduler task_scheduler;
 extern WebServer server;
 extern API api;
@@ -39,9 +42,48 @@ void WS::setup()
 
 }
 
+static void write_text(CborWriter &writer, const String &text)
+{
+    writer.writeText(text.c_str(), text.length());
+}
+
+// Runs encode twice: Once to get the length, once to write into a payload of this length.
+// If the encoded data changed in between (for example a string of a state), its length differs
+// and encoding starts over once. Returns nullptr if the payload could not be allocated or the
+// length still differs.
+static char *encode_cbor(WebSockets &web_sockets, const std::function<void(CborWriter &)> &encode, size_t *len)
+{
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        CborWriter measure{nullptr, 0};
+        encode(measure);
+
+        char *payload = web_sockets.allocatePayload(measure.length());
+        if (payload == nullptr)
+            return nullptr;
+
+        CborWriter writer{(uint8_t *)payload, measure.length()};
+        encode(writer);
+
+        if (writer.length() == measure.length()) {
+            *len = writer.length();
+            return payload;
+        }
+
+        web_sockets.freePayload(payload);
+    }
+
+    logger.printfln("Dropped web socket message: Its length changed while it was encoded.");
+    return nullptr;
+}
+
 void WS::register_urls()
 {
     web_sockets.onConnect([this](WebSocketsClient client) {
+        if (client.protocol == WebSocketsProtocol::CBOR) {
+            sendCborDump(client);
+            return;
+        }
+
         String to_send = "";
         for (auto &reg : api.states) {
             to_send += String("{\"topic\":\"") + reg.path + String("\",\"payload\":") + reg.config->to_string_except(reg.keys_to_censor) + String("}\n");
@@ -49,12 +91,290 @@ void WS::register_urls()
         client.send(to_send.c_str(), to_send.length());
     });
 
+    web_sockets.onMessage([this](WebSocketsClient client, char *message, size_t len) {
+        handleCommand(client, message, len);
+    });
+
     web_sockets.start("/ws");
 
+    server.on("/ws/clients", HTTP_GET, [this](WebServerRequest request) {
+        String metrics = web_sockets.getClientMetrics();
+        request.send(200, "application/json; charset=utf-8", metrics.c_str());
+    });
+
     task_scheduler.scheduleWithFixedDelay("ws_keep_alive", [this](){
         const char *payload = "{\"topic\": \"keep-alive\", \"payload\": \"null\"}\n";
         web_sockets.sendToAll(payload, strlen(payload));
+
+        if (!web_sockets.haveActiveClient(WebSocketsProtocol::CBOR))
+            return;
+
+        size_t len;
+        char *to_send = encode_cbor(web_sockets, [](CborWriter &writer) {
+            writer.writeArray(2);
+            write_text(writer, "keep-alive");
+            writer.writeNull();
+        }, &len);
+
+        if (to_send != nullptr)
+            web_sockets.sendToAllOwned(to_send, len, WS_NO_TOPIC, WebSocketsProtocol::CBOR);
     }, 1000, 1000);
+
+    task_scheduler.scheduleWithFixedDelay("ws_event_log", [this](){
+        pushEventLog();
+    }, WS_EVENT_LOG_PUSH_INTERVAL_MS, WS_EVENT_LOG_PUSH_INTERVAL_MS);
+}
+
+static void append_json_escaped(String &s, const char *buf, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        char c = buf[i];
+        switch (c) {
+            case '"':
+                s += "\\\"";
+                break;
+            case '\\':
+                s += "\\\\";
+                break;
+            case '\n':
+                s += "\\n";
+                break;
+            default:
+                if ((uint8_t)c < 0x20) {
+                    char escaped[7];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    s += escaped;
+                } else {
+                    s += c;
+                }
+                break;
+        }
+    }
+}
+
+// Returns the length of the longest prefix of buf that ends with a complete line.
+// If buf has no newline, cuts before an incomplete trailing UTF-8 sequence instead.
+static size_t push_boundary(const char *buf, size_t len)
+{
+    for (size_t i = len; i > 0; --i)
+        if (buf[i - 1] == '\n')
+            return i;
+
+    // Find the start of the last sequence.
+    size_t start = len;
+    while (start > 0 && ((uint8_t)buf[start - 1] & 0xC0) == 0x80)
+        --start;
+
+    if (start == 0)
+        return len;
+
+    uint8_t lead = (uint8_t)buf[start - 1];
+    size_t seq_len = (lead & 0xE0) == 0xC0 ? 2 : (lead & 0xF0) == 0xE0 ? 3 : (lead & 0xF8) == 0xF0 ? 4 : 1;
+
+    return len - (start - 1) < seq_len ? start - 1 : len;
+}
+
+// Sends lines logged since the last push as
+// {"topic":"event_log/message","payload":{"since":<pos>,"next":<pos>,"text":"..."}}
+// since and next are positions as used by /event_log?since=. Clients can use them to detect gaps.
+void WS::pushEventLog()
+{
+    uint32_t oldest, end;
+    logger.get_bounds(&oldest, &end);
+
+    // Nobody would see the lines. Start with the next new line when a client connects.
+    if (!web_sockets.haveActiveClient()) {
+        event_log_cursor = end;
+        return;
+    }
+
+    // Lines that were dropped from the event buffer before they could be pushed are skipped.
+    // Clients see this as a gap between their position and since.
+    if ((int32_t)(oldest - event_log_cursor) > 0)
+        event_log_cursor = oldest;
+
+    if (event_log_cursor == end)
+        return;
+
+    bool capped = (int32_t)(end - event_log_cursor) > WS_EVENT_LOG_MAX_PUSH_LEN;
+    if (capped)
+        end = event_log_cursor + WS_EVENT_LOG_MAX_PUSH_LEN;
+
+    uint32_t since = event_log_cursor;
+
+    bool json = web_sockets.haveActiveClient(WebSocketsProtocol::JSON);
+    bool cbor = web_sockets.haveActiveClient(WebSocketsProtocol::CBOR);
+
+    String raw_text;
+    raw_text.reserve(WS_EVENT_LOG_MAX_PUSH_LEN);
+    logger.read_range(&event_log_cursor, end, EventLogLevel::DEBUG, [&raw_text](const char *buf, size_t len) {
+        for (size_t i = 0; i < len; ++i)
+            raw_text += buf[i];
+    });
+
+#if !EVENT_LOG_STRUCTURED
+    // Structured records are always read whole, but text can be cut anywhere, even inside a
+    // UTF-8 sequence. Browsers close the socket on invalid UTF-8 (taking every message batched
+    // with it), so only whole lines are pushed. The rest follows with the next push.
+    if (capped) {
+        size_t len = push_boundary(raw_text.c_str(), raw_text.length());
+        raw_text.remove(len);
+        event_log_cursor = since + len;
+    }
+#else
+    (void)capped;
+#endif
+
+    // Only JSON needs the text escaped.
+    if (json) {
+        String text;
+        text.reserve(raw_text.length() + 64);
+        append_json_escaped(text, raw_text.c_str(), raw_text.length());
+
+        String to_send = String("{\"topic\":\"event_log/message\",\"payload\":{\"since\":") + since
+                       + String(",\"next\":") + event_log_cursor
+                       + String(",\"text\":\"") + text + String("\"}}\n");
+
+        web_sockets.sendToAll(to_send.c_str(), to_send.length());
+    }
+
+    if (cbor) {
+        uint32_t next = event_log_cursor;
+        size_t len;
+        char *to_send = encode_cbor(web_sockets, [since, next, &raw_text](CborWriter &writer) {
+            writer.writeArray(2);
+            write_text(writer, "event_log/message");
+            writer.writeMap(3);
+            write_text(writer, "since");
+            writer.writeUint(since);
+            write_text(writer, "next");
+            writer.writeUint(next);
+            write_text(writer, "text");
+            write_text(writer, raw_text);
+        }, &len);
+
+        if (to_send != nullptr)
+            web_sockets.sendToAllOwned(to_send, len, WS_NO_TOPIC, WebSocketsProtocol::CBOR);
+    }
+}
+
+// Integers become int32_t if they fit, so that they are accepted by int and uint configs
+// and rejected by float configs, as with update_from_json.
+static Config::ConfUpdate to_conf_update(JsonVariant node)
+{
+    if (node.isNull())
+        return nullptr;
+
+    if (node.is<bool>())
+        return node.as<bool>();
+
+    if (node.is<int32_t>())
+        return node.as<int32_t>();
+
+    if (node.is<uint32_t>())
+        return node.as<uint32_t>();
+
+    if (node.is<float>())
+        return node.as<float>();
+
+    if (node.is<JsonArray>()) {
+        Config::ConfUpdateArray arr;
+        for (JsonVariant elem : node.as<JsonArray>())
+            arr.elements.push_back(to_conf_update(elem));
+        return arr;
+    }
+
+    if (node.is<JsonObject>()) {
+        Config::ConfUpdateObject obj;
+        for (JsonPair pair : node.as<JsonObject>())
+            obj.elements.push_back({String(pair.key().c_str()), to_conf_update(pair.value())});
+        return obj;
+    }
+
+    return node.as<String>();
+}
+
+// Runs on the httpd task, as the commands received by the HTTP backend.
+// Clients were authenticated by the web socket handshake. If that used a session token, web_sockets.cpp
+// checks it again before each command. Browsers could only connect from pages served by this device:
+// The handshake rejects other origins.
+void WS::handleCommand(WebSocketsClient client, char *message, size_t len)
+{
+    // The message is parsed in place, so only the nodes need memory.
+    // Each node except the root takes at least two chars.
+    DynamicJsonDocument doc(JSON_ARRAY_SIZE(len / 2 + 1));
+    if (doc.capacity() == 0) {
+        sendCommandResult(client, false, 0, "Out of memory");
+        return;
+    }
+
+    DeserializationError error = deserializeJson(doc, message, len);
+    if (error) {
+        sendCommandResult(client, false, 0, String("Failed to parse command: ") + error.c_str());
+        return;
+    }
+
+    JsonVariant id = doc["id"];
+    if (!id.is<uint32_t>()) {
+        sendCommandResult(client, false, 0, "Command has no request id");
+        return;
+    }
+
+    const char *topic = doc["topic"];
+    if (topic == nullptr) {
+        sendCommandResult(client, true, id.as<uint32_t>(), "Command has no topic");
+        return;
+    }
+
+    String reason = api.getCommandBlockedReason(topic);
+    if (reason != "") {
+        sendCommandResult(client, true, id.as<uint32_t>(), reason);
+        return;
+    }
+
+    sendCommandResult(client, true, id.as<uint32_t>(), api.callCommand(topic, to_conf_update(doc["payload"])));
+}
+
+void WS::sendCommandResult(WebSocketsClient client, bool have_id, uint32_t id, const String &error)
+{
+    if (client.protocol == WebSocketsProtocol::CBOR) {
+        size_t len;
+        char *to_send = encode_cbor(web_sockets, [have_id, id, &error](CborWriter &writer) {
+            writer.writeArray(2);
+            write_text(writer, "ws/command_result");
+            writer.writeMap(2);
+            write_text(writer, "id");
+            if (have_id)
+                writer.writeUint(id);
+            else
+                writer.writeNull();
+            write_text(writer, "error");
+            if (error == "")
+                writer.writeNull();
+            else
+                write_text(writer, error);
+        }, &len);
+
+        if (to_send != nullptr)
+            client.sendOwned(to_send, len);
+
+        return;
+    }
+
+    String to_send = String("{\"topic\":\"ws/command_result\",\"payload\":{\"id\":") + (have_id ? String(id) : String("null"))
+                   + String(",\"error\":");
+
+    if (error == "") {
+        to_send += "null";
+    } else {
+        to_send += "\"";
+        append_json_escaped(to_send, error.c_str(), error.length());
+        to_send += "\"";
+    }
+
+    to_send += "}}\n";
+
+    client.send(to_send.c_str(), to_send.length());
 }
 
 void WS::loop()
@@ -69,7 +389,8 @@ void WS::addCommand(const CommandRegistration &reg)
 
 void WS::addState(const StateRegistration &reg)
 {
-
+    state_topics.push_back(&reg);
+    web_sockets.registerTopic();
 }
 
 static const char *prefix = "{\"topic\":\"";
@@ -79,16 +400,41 @@ static size_t prefix_len = strlen(prefix);
 static size_t infix_len = strlen(infix);
 static size_t suffix_len = strlen(suffix);
 
+// The API pushes the states in registration order: Start looking after the last topic.
+int WS::findTopic(const String &path)
+{
+    for (size_t i = 0; i < state_topics.size(); ++i) {
+        size_t candidate = (last_topic + 1 + i) % state_topics.size();
+        if (state_topics[candidate]->path == path) {
+            last_topic = candidate;
+            return candidate;
+        }
+    }
+
+    return WS_NO_TOPIC;
+}
+
 void WS::pushStateUpdate(String payload, String path)
 {
     if (!web_sockets.haveActiveClient())
         return;
+
+    int topic = findTopic(path);
+
+    if (web_sockets.haveActiveClient(WebSocketsProtocol::CBOR))
+        pushCborStateUpdate(payload, path, topic);
+
+    // The payload is empty if the first JSON client connected after the API checked
+    // needsJsonStateUpdates. The client got the current state with the initial dump.
+    if (!web_sockets.haveActiveClient(WebSocketsProtocol::JSON) || payload.length() == 0)
+        return;
+
     //String to_send = String("{\"topic\":\"") + path + String("\",\"payload\":") + payload + String("}\n");
     size_t path_len = path.length();
     size_t payload_len = payload.length();
 
     size_t to_send_len = prefix_len + path_len + infix_len + payload_len + suffix_len;
-    char *to_send = (char *)malloc(to_send_len);
+    char *to_send = web_sockets.allocatePayload(to_send_len);
     if (to_send == nullptr)
         return;
 
@@ -108,10 +454,67 @@ void WS::pushStateUpdate(String payload, String path)
     memcpy(ptr, suffix, suffix_len);
     ptr += suffix_len;
 
-    web_sockets.sendToAllOwned(to_send, to_send_len);
+    web_sockets.sendToAllOwned(to_send, to_send_len, topic);
+}
+
+// States are encoded from their config instead of parsing payload.
+void WS::pushCborStateUpdate(const String &payload, const String &path, int topic)
+{
+    // Only states without topic are sent as their JSON payload.
+    if (topic == WS_NO_TOPIC && payload.length() == 0)
+        return;
+
+    size_t len;
+    char *to_send = encode_cbor(web_sockets, [this, &payload, &path, topic](CborWriter &writer) {
+        writer.writeArray(2);
+
+        if (topic != WS_NO_TOPIC) {
+            const StateRegistration *reg = state_topics[topic];
+            writer.writeUint(topic);
+            reg->config->write_cbor_except(writer, reg->keys_to_censor);
+        } else {
+            write_text(writer, path);
+            writer.writeTag(CBOR_TAG_EMBEDDED_JSON);
+            writer.writeBytes((const uint8_t *)payload.c_str(), payload.length());
+        }
+    }, &len);
+
+    if (to_send != nullptr)
+        web_sockets.sendToAllOwned(to_send, len, topic, WebSocketsProtocol::CBOR);
+}
+
+void WS::sendCborDump(WebSocketsClient client)
+{
+    size_t len;
+    char *to_send = encode_cbor(web_sockets, [this](CborWriter &writer) {
+        writer.writeArray(2);
+        write_text(writer, "ws/topics");
+        writer.writeArray(state_topics.size());
+        for (const StateRegistration *reg : state_topics)
+            write_text(writer, reg->path);
+
+        for (size_t i = 0; i < state_topics.size(); ++i) {
+            writer.writeArray(2);
+            writer.writeUint(i);
+            state_topics[i]->config->write_cbor_except(writer, state_topics[i]->keys_to_censor);
+        }
+    }, &len);
+
+    if (to_send != nullptr)
+        client.sendOwned(to_send, len);
 }
 
 void WS::wifiAvailable()
 {
 
 }
+
+// States of topics are encoded from their config for CBOR clients.
+bool WS::needsJsonStateUpdates()
+{
+    if (web_sockets.haveActiveClient(WebSocketsProtocol::JSON))
+        return true;
+
+    // States registered before this backend have no topic and are sent to CBOR clients as JSON.
+    return state_topics.size() < api.states.size() && web_sockets.haveActiveClient(WebSocketsProtocol::CBOR);
+}
@@ -22,6 +22,25 @@
 #include "api.h"
 #include "web_sockets.h"
 
+// Messages of the CBOR subprotocol (WS_CBOR_SUBPROTOCOL) are arrays [topic, payload].
+// The first message after connecting is the topic table ["ws/topics", [path, ...]].
+// States use their index into this table as topic and are encoded from their config.
+// Other messages use their path as topic. If their payload only exists as JSON text,
+// it is sent as byte string tagged with CBOR_TAG_EMBEDDED_JSON.
+
+// Clients of both protocols send commands as JSON text frames
+// {"id":<request id>,"topic":"<command path>","payload":<command payload>}.
+// The request id is an unsigned 32 bit integer. Each command is answered with the
+// message ws/command_result {"id":<request id>,"error":null or "<error message>"}.
+// Handshakes with an Origin header whose host differs from the Host header are rejected,
+// so other web sites can't send commands through a browser that is logged in.
+// Sockets opened with a session token are closed once the session expires or is revoked.
+
+// New event log lines are pushed to all clients at this interval.
+#define WS_EVENT_LOG_PUSH_INTERVAL_MS 250
+// Upper bound of event log chars per push. The rest follows in the next push.
+#define WS_EVENT_LOG_MAX_PUSH_LEN 2048
+
 class WS : public IAPIBackend {
 public:
     WS();
@@ -34,8 +53,24 @@ public:
     void addState(const StateRegistration &reg);
     void pushStateUpdate(String payload, String path);
     void wifiAvailable();
+    bool needsJsonStateUpdates();
 
     bool initialized = false;
 
     WebSockets web_sockets;
+
+private:
+    void pushEventLog();
+    int findTopic(const String &path);
+    void sendCborDump(WebSocketsClient client);
+    void handleCommand(WebSocketsClient client, char *message, size_t len);
+    void sendCommandResult(WebSocketsClient client, bool have_id, uint32_t id, const String &error);
+    void pushCborStateUpdate(const String &payload, const String &path, int topic);
+
+    // The web socket topic of each state is its index.
+    std::vector<const StateRegistration *> state_topics;
+    size_t last_topic = 0;
+
+    // Absolute event log position up to which new lines were already pushed.
+    uint32_t event_log_cursor = 0;
 };
@@ -26,7 +26,24 @@ declare function __(s: string): string;
 interface AuthenticationConfig {
     enable_auth: boolean,
     username: string,
-    password: string
+    password: string,
+    session_lifetime: number
+}
+
+let session_renew_interval: number = null;
+
+// Login sessions spare the device the digest authentication of every request.
+// Renew the session cookie before it expires.
+function renew_session_periodically(config: AuthenticationConfig) {
+    if (session_renew_interval != null) {
+        clearInterval(session_renew_interval);
+        session_renew_interval = null;
+    }
+
+    if (!config.enable_auth || config.session_lifetime == 0)
+        return;
+
+    session_renew_interval = window.setInterval(() => $.get("/login_state"), config.session_lifetime * 60 * 1000 / 2);
 }
 
 function update_authentication_config(config: AuthenticationConfig) {
@@ -42,6 +59,21 @@ function update_authentication_config(config: AuthenticationConfig) {
 
     $('#authentication_show_password').prop("disabled", !config.enable_auth);
     $('#authentication_show_password').prop("checked", false);
+
+    $('#authentication_session_lifetime').val(config.session_lifetime);
+
+    renew_session_periodically(config);
+}
+
+function revoke_sessions() {
+    $.ajax({
+        url: '/authentication/revoke_sessions',
+        method: 'PUT',
+        contentType: 'application/json',
+        data: JSON.stringify(null),
+        success: () => util.add_alert("authentication_revoke_sessions", "alert-success", __("authentication.script.revoke_sessions_success"), ""),
+        error: (xhr, status, error) => util.add_alert("authentication_revoke_sessions_failed", "alert-danger", __("authentication.script.revoke_sessions_failed"), error + ": " + xhr.responseText)
+    });
 }
 
 function save_authentication_config() {
@@ -49,6 +81,7 @@ function save_authentication_config() {
         enable_auth: $('#authentication_enable').is(':checked'),
         username: $('#authentication_username').val().toString(),
         password: util.passwordUpdate('#authentication_password'),
+        session_lifetime: parseInt($('#authentication_session_lifetime').val().toString(), 10),
     };
 
     $.ajax({
@@ -100,6 +133,8 @@ export function init() {
         save_authentication_config();
     }, false);
 
+    (<HTMLButtonElement>document.getElementById("authentication_revoke_sessions_button")).addEventListener("click", revoke_sessions);
+
     (<HTMLButtonElement>document.getElementById("authentication_reboot_button")).addEventListener("click", () => {
         $('#authentication_reboot').modal('hide');
         util.reboot();
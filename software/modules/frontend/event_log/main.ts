@@ -23,27 +23,63 @@ import * as util from "../util";
 
 declare function __(s: string): string;
 
+// Position of the end of the displayed log, as reported by the X-Event-Log-Next header
+// and event_log/message events. null until the log was loaded once.
+let event_log_next: number = null;
+let event_log_text = "";
+
+// Keep a long open page from growing without bound. The firmware's buffer is much smaller anyway.
+const EVENT_LOG_MAX_DISPLAY_LEN = 100000;
+
+function set_event_log(text: string) {
+    if (text.length > EVENT_LOG_MAX_DISPLAY_LEN)
+        text = text.substring(text.indexOf("\n", text.length - EVENT_LOG_MAX_DISPLAY_LEN) + 1);
+
+    event_log_text = text;
+    $('#event_log_content').val(event_log_text);
+}
+
 function load_event_log() {
-    $.get("/event_log")
-               .done((result) => {$('#event_log_content').html(result)})
-               .fail((xhr, status, error) => util.add_alert("event_log_load_failed", "alert-danger", __("event_log.script.load_event_report_error"), error + ": " + xhr.responseText))
+    let url = event_log_next == null ? "/event_log" : "/event_log?since=" + event_log_next;
+
+    $.get({url: url, dataType: "text"})
+        .done((result, status, xhr) => {
+            let since = parseInt(xhr.getResponseHeader("X-Event-Log-Since"));
+            // The firmware sends the whole log if the requested position is not available anymore.
+            if (event_log_next != null && since == event_log_next)
+                set_event_log(event_log_text + result);
+            else
+                set_event_log(result);
+
+            event_log_next = parseInt(xhr.getResponseHeader("X-Event-Log-Next"));
+        })
+        .fail((xhr, status, error) => util.add_alert("event_log_load_failed", "alert-danger", __("event_log.script.load_event_report_error"), error + ": " + xhr.responseText));
 }
 
-let update_event_log_interval: number = null;
+interface EventLogMessage {
+    since: number,
+    next: number,
+    text: string
+}
+
+function receive_event_log_message(msg: EventLogMessage) {
+    if (event_log_next == null || msg.next <= event_log_next)
+        return;
+
+    // Lines are missing between the displayed log and this message. Fetch them.
+    if (msg.since != event_log_next) {
+        load_event_log();
+        return;
+    }
+
+    set_event_log(event_log_text + msg.text);
+    event_log_next = msg.next;
+}
 
 export function init() {
     $('#sidebar-event_log').on('shown.bs.tab', function (e) {
+        // New lines are pushed via the web socket. Only fetch what could have been missed.
         load_event_log();
-        if (update_event_log_interval == null) {
-            update_event_log_interval = window.setInterval(load_event_log, 10000);
-        }
-    });
-
-    $('#sidebar-event_log').on('hidden.bs.tab', function (e) {
-        if (update_event_log_interval != null) {
-            clearInterval(update_event_log_interval);
-            update_event_log_interval = null;
-        }
     });
 
     $('#download_debug_report').on("click", () => {
@@ -68,15 +104,27 @@ export function init() {
                         })
                         .done((result) => {
                             debug_log += result + "\n";
-                            util.downloadToFile(debug_log, "debug-report-" + t + ".txt", "text/plain");
-                            window.clearTimeout(timeout);
-                            $('#debug_report_spinner').prop("hidden", true);
+
+                            // Not all partition tables have space for the persistent log. Leave it out if it is not available.
+                            $.get({url: "/event_log/previous_boot", dataType: "text"})
+                                .done((result) => {
+                                    debug_log += "\nEvent log of previous boot:\n\n" + result + "\n";
+                                })
+                                .always(() => {
+                                    util.downloadToFile(debug_log, "debug-report-" + t + ".txt", "text/plain");
+                                    window.clearTimeout(timeout);
+                                    $('#debug_report_spinner').prop("hidden", true);
+                                });
                         });
                 });
     });
 }
 
-export function addEventListeners(source: EventSource) {}
+export function addEventListeners(source: EventSource) {
+    source.addEventListener('event_log/message', function (e: util.SSE) {
+        receive_event_log_message(<EventLogMessage>(JSON.parse(e.data)));
+    }, false);
+}
 
 export function updateLockState(module_init: any) {
     $('#sidebar-event-log').prop('hidden', !module_init.event_log);
@@ -43,14 +43,64 @@ function update_version(version: Version) {
     $('#current_spiffs').val(version.spiffs);
 }
 
+// Compressed images have to be decompressed to find the info page. Browsers without
+// DecompressionStream skip the check: The firmware checks the info page again while flashing.
+function read_info_page(file: File, callback: (info_page: Blob) => void) {
+    let header_reader = new FileReader();
+    header_reader.onload = () => {
+        let header = new Uint8Array(<ArrayBuffer>header_reader.result);
+        if (header[0] != 0x1F || header[1] != 0x8B) {
+            callback(file.slice(0xd000 - 0x1000, 0xd000));
+            return;
+        }
+
+        let DecompressionStream = (<any>window).DecompressionStream;
+        if (DecompressionStream === undefined) {
+            callback(null);
+            return;
+        }
+
+        let reader = (<any>file).stream().pipeThrough(new DecompressionStream("gzip")).getReader();
+        let chunks: Uint8Array[] = [];
+        let length = 0;
+
+        let read = () => reader.read().then((result: any) => {
+            if (!result.done) {
+                chunks.push(result.value);
+                length += result.value.length;
+            }
+
+            if (!result.done && length < 0xd000) {
+                read();
+                return;
+            }
+
+            reader.cancel();
+            callback(new Blob(chunks).slice(0xd000 - 0x1000, 0xd000));
+        }, () => callback(null));
+
+        read();
+    };
+    header_reader.readAsArrayBuffer(file.slice(0, 2));
+}
+
 function check_upload(type: string) {
     let file_select = <HTMLInputElement>$(`#${type}_file_select`)[0];
 
+    read_info_page(file_select.files[0], (info_page) => {
+        if (info_page == null)
+            upload(type);
+        else
+            check_info_page(type, info_page);
+    });
+}
+
+function check_info_page(type: string, info_page: Blob) {
     $.ajax({
         timeout: 0,
         url: `/check_${type}`,
         type: 'POST',
-        data: file_select.files[0].slice(0xd000 - 0x1000, 0xd000),
+        data: info_page,
         contentType: false,
         processData: false,
         success: () => {
@@ -78,6 +128,137 @@ function check_upload(type: string) {
     });
 }
 
+let crc32_table: number[] = null;
+
+function crc32(data: Uint8Array) {
+    if (crc32_table == null) {
+        crc32_table = [];
+        for (let i = 0; i < 256; ++i) {
+            let c = i;
+            for (let k = 0; k < 8; ++k)
+                c = (c & 1) ? (0xEDB88320 ^ (c >>> 1)) : (c >>> 1);
+            crc32_table.push(c >>> 0);
+        }
+    }
+
+    let crc = 0xFFFFFFFF;
+    for (let i = 0; i < data.length; ++i)
+        crc = crc32_table[(crc ^ data[i]) & 0xFF] ^ (crc >>> 8);
+
+    return (crc ^ 0xFFFFFFFF) >>> 0;
+}
+
+const RESUMABLE_RETRIES = 10;
+const RESUMABLE_RETRY_DELAY_MS = 2000;
+
+// Continues a firmware upload that was interrupted by a lost connection in chunks.
+// After each further interruption it asks the firmware which offset it already wrote and continues from there.
+// complete is true if the whole file was already sent. The firmware then reboots into the new firmware,
+// so a lost response is not an error.
+function resume_upload(file: File,
+                       complete: boolean,
+                       on_progress: (per: number) => void,
+                       on_success: () => void,
+                       on_error: (xhr: JQuery.jqXHR, error: string) => void) {
+    let max_chunk_length = 16384;
+    let retries_left = RESUMABLE_RETRIES;
+
+    let resume = (state: any) => {
+        max_chunk_length = state.max_chunk_length;
+
+        if (state.length == file.size && state.offset < file.size) {
+            send_chunk(state.offset);
+            return;
+        }
+
+        // The firmware finished the upload. It is rebooting or already did.
+        if (complete) {
+            on_success();
+            return;
+        }
+
+        // The firmware forgot the upload: It restarted, another upload was started or the upload timed out.
+        send_chunk(0);
+    };
+
+    let request_state = () => window.setTimeout(() => $.ajax({
+        timeout: 5000,
+        url: '/flash_firmware_resumable',
+        type: 'GET',
+        success: resume,
+        error: (xhr: JQuery.jqXHR, status: string, error: string) => {
+            // There is no response while the firmware reboots into the new firmware.
+            if (complete && xhr.status == 0)
+                on_success();
+            else
+                retry(xhr, error);
+        }
+    }), RESUMABLE_RETRY_DELAY_MS);
+
+    let retry = (xhr: JQuery.jqXHR, error: string) => {
+        let state: any = null;
+        try {
+            state = JSON.parse(xhr.responseText);
+        } catch {}
+
+        // The firmware answers with its state if the chunk was corrupted or doesn't continue the upload.
+        let has_state = state != null && state.offset !== undefined;
+        // 503: The firmware had no memory for the chunk at the moment.
+        let transient = xhr.status == 0 || xhr.status == 503;
+
+        if ((!transient && !has_state) || retries_left == 0) {
+            on_error(xhr, error);
+            return;
+        }
+
+        --retries_left;
+
+        if (has_state)
+            resume(state);
+        else
+            request_state();
+    };
+
+    let send_chunk = (offset: number) => {
+        let chunk = file.slice(offset, offset + max_chunk_length);
+        let reader = new FileReader();
+        reader.onload = () => {
+            let data = new Uint8Array(<ArrayBuffer>reader.result);
+            let final = offset + data.length == file.size;
+            complete = complete || final;
+
+            $.ajax({
+                timeout: 30000,
+                url: '/flash_firmware_resumable',
+                type: 'PUT',
+                headers: {
+                    "X-Upload-Offset": offset.toString(),
+                    "X-Upload-Length": file.size.toString(),
+                    "X-Chunk-CRC32": crc32(data).toString(16)
+                },
+                data: chunk,
+                contentType: false,
+                processData: false,
+                success: (state: any) => {
+                    if (final) {
+                        on_success();
+                        return;
+                    }
+
+                    retries_left = RESUMABLE_RETRIES;
+                    max_chunk_length = state.max_chunk_length;
+                    on_progress(state.offset / file.size);
+                    send_chunk(state.offset);
+                },
+                error: (xhr: JQuery.jqXHR, status: string, error: string) => retry(xhr, error)
+            });
+        };
+        reader.readAsArrayBuffer(chunk);
+    };
+
+    request_state();
+}
+
 function upload(type: string) {
     util.pauseWebSockets();
 
@@ -89,39 +270,60 @@ function upload(type: string) {
     progress.prop("hidden", false);
     select.prop("hidden", true);
 
+    let on_progress = (per: number) => {
+        progress_bar.prop('style', "width: " + (per * 100) + "%");
+        progress_bar.prop('aria-valuenow', (per * 100));
+    };
+
+    let on_success = () => {
+        progress.prop("hidden", true);
+        select.prop("hidden", false);
+        util.postReboot(__("firmware_update.script.flash_success"), __("util.reboot_text"));
+    };
+
+    let on_error = (xhr: JQuery.jqXHR, error: string) => {
+        progress.prop("hidden", true);
+        select.prop("hidden", false);
+        if (xhr.status == 423)
+            util.add_alert("firmware_update_failed", "alert-danger", __("firmware_update.script.flash_fail"), __("firmware_update.script.vehicle_connected"));
+        else {
+            // There is no response if the connection was lost.
+            let response = xhr.responseText || "";
+            let txt = response.startsWith("firmware_update.") ? __/* hide this from the translation checker */(response) : error + ": " + response;
+            util.add_alert("firmware_update_failed","alert-danger", __("firmware_update.script.flash_fail"), txt);
+        }
+        util.resumeWebSockets();
+    };
+
+    let file = file_select.files[0];
+    // Set once the whole file was sent.
+    let complete = false;
+
     $.ajax({
         timeout: 0,
         url: `/flash_${type}`,
         type: 'POST',
-        data: file_select.files[0],
+        data: file,
         contentType: false,
         processData: false,
         xhr: function () {
             let xhr = new window.XMLHttpRequest();
             xhr.upload.addEventListener('progress', function (evt) {
                 if (evt.lengthComputable) {
-                    let per = evt.loaded / evt.total;
-                    progress_bar.prop('style', "width: " + (per * 100) + "%");
-                    progress_bar.prop('aria-valuenow', (per * 100));
+                    on_progress(evt.loaded / evt.total);
+                    complete = evt.loaded == evt.total;
                 }
             }, false);
             return xhr;
         },
-        success: () => {
-            progress.prop("hidden", true);
-            select.prop("hidden", false);
-            util.postReboot(__("firmware_update.script.flash_success"), __("util.reboot_text"));
-        },
+        success: on_success,
         error: (xhr, status, error) => {
-            progress.prop("hidden", true);
-            select.prop("hidden", false);
-            if (xhr.status == 423)
-                util.add_alert("firmware_update_failed", "alert-danger", __("firmware_update.script.flash_fail"), __("firmware_update.script.vehicle_connected"));
-            else {
-                let txt = xhr.responseText.startsWith("firmware_update.") ? __/* hide this from the translation checker */(xhr.responseText) : error + ": " + xhr.responseText;
-                util.add_alert("firmware_update_failed","alert-danger", __("firmware_update.script.flash_fail"), txt);
+            // The connection was lost. The firmware keeps the part of the image it received.
+            if (type == "firmware" && xhr.status == 0) {
+                resume_upload(file, complete, on_progress, on_success, on_error);
+                return;
             }
-            util.resumeWebSockets();
+            on_error(xhr, error);
         }
     });
 }
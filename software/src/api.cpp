@@ -45,8 +45,15 @@ void API::setup()
             }
 
             reg.config->set_update_handled();
+            ++reg.revision;
 
-            String payload = reg.config->to_string_except(reg.keys_to_censor);
+            // Web socket clients that use CBOR don't need the JSON payload.
+            bool json_needed = false;
+            for (auto *backend: this->backends) {
+                json_needed |= backend->needsJsonStateUpdates();
+            }
+
+            String payload = json_needed ? reg.config->to_string_except(reg.keys_to_censor) : String("");
 
             for (auto *backend: this->backends) {
                 backend->pushStateUpdate(payload, reg.path);
@@ -66,14 +73,14 @@ void API::addCommand(String path, Config *config, std::initializer_list<String>
 
 void API::addState(String path, Config *config, std::initializer_list<String> keys_to_censor, uint32_t interval_ms)
 {
-    states.push_back({path, config, keys_to_censor, interval_ms, millis()});
+    states.push_back({path, config, keys_to_censor, interval_ms, millis(), 0});
 
     for (auto *backend : this->backends) {
         backend->addState(states[states.size() - 1]);
     }
 }
 
-bool API::addPersistentConfig(String path, Config *config, std::initializer_list<String> keys_to_censor, uint32_t interval_ms)
+bool API::addPersistentConfig(String path, Config *config, std::initializer_list<String> keys_to_censor, uint32_t interval_ms, std::function<void(void)> callback)
 {
     if (path.length() > 29) {
         logger.printfln("The maximum allowed config path length is 29 bytes. Got %u bytes instead.", path.length());
@@ -86,26 +93,35 @@ bool API::addPersistentConfig(String path, Config *config, std::initializer_list
     }
 
     addState(path, config, keys_to_censor, interval_ms);
-    addCommand(path + String("_update"), config, keys_to_censor, [path, config]() {
-        String path_copy = path;
-        path_copy.replace('/', '_');
-        String cfg_path = String("/") + path_copy;
-        String tmp_path = String("/.") + path_copy; //max len is 31 - len("/.") = 29
-
-        if (LittleFS.exists(tmp_path)) {
-            LittleFS.remove(tmp_path);
-        }
+    addCommand(path + String("_update"), config, keys_to_censor, [path, config, callback]() {
+        if (callback)
+            callback();
+
+        // Serialize on the main loop, as the config may be modified concurrently.
+        // Only the flash write is offloaded to a worker.
+        String content = config->to_string();
+
+        task_scheduler.submit("persist config", [path, content]() {
+            String path_copy = path;
+            path_copy.replace('/', '_');
+            String cfg_path = String("/") + path_copy;
+            String tmp_path = String("/.") + path_copy; //max len is 31 - len("/.") = 29
+
+            if (LittleFS.exists(tmp_path)) {
+                LittleFS.remove(tmp_path);
+            }
 
-        File file = LittleFS.open(tmp_path, "w");
+            File file = LittleFS.open(tmp_path, "w");
 
-        config->save_to_file(file);
-        file.close();
+            file.print(content);
+            file.close();
 
-        if (LittleFS.exists(cfg_path)) {
-            LittleFS.remove(cfg_path);
-        }
+            if (LittleFS.exists(cfg_path)) {
+                LittleFS.remove(cfg_path);
+            }
 
-        LittleFS.rename(tmp_path, cfg_path);
+            LittleFS.rename(tmp_path, cfg_path);
+        }, nullptr);
     }, false);
 
     return true;
@@ -182,15 +198,22 @@ bool API::restorePersistentConfig(String path, Config *config)
     return error == "";
 }
 
+// The report contains all states and commands: Send it in parts instead of building it completely.
+#define DEBUG_REPORT_CHUNK_SIZE 2048
+
 void API::registerDebugUrl(WebServer *server)
 {
     server->on("/debug_report", HTTP_GET, [this](WebServerRequest request) {
+        request.beginChunkedResponse(200, "application/json; charset=utf-8");
+
         String result = "{\"uptime\": ";
         result += String(millis());
         result += ",\n \"free_heap_bytes\":";
         result += ESP.getFreeHeap();
         result += ",\n \"largest_free_heap_block\":";
         result += ESP.getMaxAllocHeap();
+        result += ",\n \"serial_chars_dropped\":";
+        result += logger.serial_chars_dropped.load();
         result += ",\n \"devices\": [";
 
         uint16_t i = 0;
@@ -230,6 +253,11 @@ void API::registerDebugUrl(WebServer *server)
             result += reg.path;
             result += "\": ";
             result += reg.config->to_string_except(reg.keys_to_censor);
+
+            if (result.length() >= DEBUG_REPORT_CHUNK_SIZE) {
+                request.sendChunk(result.c_str(), result.length());
+                result = "";
+            }
         }
 
         for (auto &reg : commands) {
@@ -237,11 +265,17 @@ void API::registerDebugUrl(WebServer *server)
             result += reg.path;
             result += "\": ";
             result += reg.config->to_string_except(reg.keys_to_censor_in_debug_report);
+
+            if (result.length() >= DEBUG_REPORT_CHUNK_SIZE) {
+                request.sendChunk(result.c_str(), result.length());
+                result = "";
+            }
         }
 
         result += "}";
 
-        request.send(200, "application/json; charset=utf-8", result.c_str());
+        request.sendChunk(result.c_str(), result.length());
+        request.endChunkedResponse();
     });
 }
 
@@ -21,6 +21,7 @@
 
 #include <Arduino.h>
 
+#include <deque>
 #include <functional>
 #include <initializer_list>
 #include <vector>
@@ -34,6 +35,8 @@ struct StateRegistration {
     std::vector<String> keys_to_censor;
     uint32_t interval;
     uint32_t last_update;
+    // Incremented whenever the API handles an update of config, i.e. when it pushes the state to the backends.
+    uint32_t revision;
 };
 
 struct CommandRegistration {
@@ -51,6 +54,10 @@ public:
     virtual void addState(const StateRegistration &reg) = 0;
     virtual void pushStateUpdate(String payload, String path) = 0;
     virtual void wifiAvailable() = 0;
+
+    // States are only serialized to JSON if a backend needs the payload at the moment.
+    // Otherwise pushStateUpdate gets an empty payload.
+    virtual bool needsJsonStateUpdates() { return true; }
 };
 
 class API {
@@ -66,7 +73,8 @@ public:
 
     void addCommand(String path, Config *config, std::initializer_list<String> keys_to_censor_in_debug_report, std::function<void(void)> callback, bool is_action);
     void addState(String path, Config *config, std::initializer_list<String> keys_to_censor, uint32_t interval_ms);
-    bool addPersistentConfig(String path, Config *config, std::initializer_list<String> keys_to_censor, uint32_t interval_ms);
+    // callback is called on the main loop after the config was updated via the API.
+    bool addPersistentConfig(String path, Config *config, std::initializer_list<String> keys_to_censor, uint32_t interval_ms, std::function<void(void)> callback = nullptr);
     //void addTemporaryConfig(String path, Config *config, std::initializer_list<String> keys_to_censor, uint32_t interval_ms, std::function<void(void)> callback);
 
     void blockCommand(String path, String reason);
@@ -81,7 +89,8 @@ public:
 
     void wifiAvailable();
 
-    std::vector<StateRegistration> states;
+    // A deque: Backends may keep references to registrations.
+    std::deque<StateRegistration> states;
     std::vector<CommandRegistration> commands;
 
     std::vector<IAPIBackend *> backends;
@@ -0,0 +1,142 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "cbor.h"
+
+#include <string.h>
+
+#define MAJOR_UINT 0
+#define MAJOR_NEGATIVE_INT 1
+#define MAJOR_BYTES 2
+#define MAJOR_TEXT 3
+#define MAJOR_ARRAY 4
+#define MAJOR_MAP 5
+#define MAJOR_TAG 6
+#define MAJOR_SIMPLE 7
+
+#define SIMPLE_FALSE 20
+#define SIMPLE_TRUE 21
+#define SIMPLE_NULL 22
+#define FLOAT32 26
+
+void CborWriter::put(uint8_t b)
+{
+    if (len < buf_len)
+        buf[len] = b;
+    ++len;
+}
+
+void CborWriter::put(const uint8_t *data, size_t count)
+{
+    if (len < buf_len)
+        memcpy(buf + len, data, count <= buf_len - len ? count : buf_len - len);
+    len += count;
+}
+
+// The value is encoded in the initial byte if it is smaller than 24,
+// else it follows in the smallest of 1, 2, 4 or 8 big endian bytes.
+void CborWriter::write_head(uint8_t major_type, uint64_t value)
+{
+    uint8_t initial = major_type << 5;
+
+    if (value < 24) {
+        put(initial | value);
+        return;
+    }
+
+    int bytes;
+    if (value <= 0xFF) {
+        put(initial | 24);
+        bytes = 1;
+    } else if (value <= 0xFFFF) {
+        put(initial | 25);
+        bytes = 2;
+    } else if (value <= 0xFFFFFFFF) {
+        put(initial | 26);
+        bytes = 4;
+    } else {
+        put(initial | 27);
+        bytes = 8;
+    }
+
+    for (int shift = (bytes - 1) * 8; shift >= 0; shift -= 8)
+        put(value >> shift);
+}
+
+void CborWriter::writeArray(size_t count)
+{
+    write_head(MAJOR_ARRAY, count);
+}
+
+void CborWriter::writeMap(size_t count)
+{
+    write_head(MAJOR_MAP, count);
+}
+
+void CborWriter::writeTag(uint64_t tag)
+{
+    write_head(MAJOR_TAG, tag);
+}
+
+void CborWriter::writeText(const char *text, size_t text_len)
+{
+    write_head(MAJOR_TEXT, text_len);
+    put((const uint8_t *)text, text_len);
+}
+
+void CborWriter::writeBytes(const uint8_t *data, size_t data_len)
+{
+    write_head(MAJOR_BYTES, data_len);
+    put(data, data_len);
+}
+
+void CborWriter::writeUint(uint64_t value)
+{
+    write_head(MAJOR_UINT, value);
+}
+
+void CborWriter::writeInt(int64_t value)
+{
+    // Negative integers are encoded as -1 - n.
+    if (value < 0)
+        write_head(MAJOR_NEGATIVE_INT, -1 - value);
+    else
+        write_head(MAJOR_UINT, value);
+}
+
+// Always single precision: Config stores floats, so this is exact.
+void CborWriter::writeFloat(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    put((MAJOR_SIMPLE << 5) | FLOAT32);
+    for (int shift = 24; shift >= 0; shift -= 8)
+        put(bits >> shift);
+}
+
+void CborWriter::writeBool(bool value)
+{
+    put((MAJOR_SIMPLE << 5) | (value ? SIMPLE_TRUE : SIMPLE_FALSE));
+}
+
+void CborWriter::writeNull()
+{
+    put((MAJOR_SIMPLE << 5) | SIMPLE_NULL);
+}
@@ -0,0 +1,65 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Writes CBOR (RFC 8949) items. Only definite lengths and the smallest encoding of each head.
+//
+// Like snprintf, output that does not fit into the buffer is only counted. To encode into an
+// exactly sized buffer, run the same writes twice: With a nullptr buffer to get the length and
+// then into a buffer of this length.
+//
+// This file does not depend on the ESP-IDF.
+
+// Tag of a byte string that contains JSON text (IANA CBOR tag registry).
+#define CBOR_TAG_EMBEDDED_JSON 262
+
+class CborWriter {
+public:
+    CborWriter(uint8_t *buf, size_t buf_len) : buf(buf), buf_len(buf_len) {}
+
+    // Followed by count items or count key value pairs.
+    void writeArray(size_t count);
+    void writeMap(size_t count);
+    // Followed by the tagged item.
+    void writeTag(uint64_t tag);
+
+    void writeText(const char *text, size_t len);
+    void writeBytes(const uint8_t *data, size_t len);
+    void writeUint(uint64_t value);
+    void writeInt(int64_t value);
+    void writeFloat(float value);
+    void writeBool(bool value);
+    void writeNull();
+
+    // Bytes written so far, including those that did not fit into the buffer.
+    size_t length() { return len; }
+
+private:
+    void write_head(uint8_t major_type, uint64_t value);
+    void put(uint8_t b);
+    void put(const uint8_t *data, size_t count);
+
+    uint8_t *buf;
+    size_t buf_len;
+    size_t len = 0;
+};
@@ -19,6 +19,10 @@
 
 #include "config.h"
 
+#include <algorithm>
+
+#include "cbor.h"
+
 struct printer {
   void operator()(const Config::ConfString &x) const { Serial.println("string"); }
   void operator()(const Config::ConfFloat &x) const { Serial.println("float"); }
@@ -137,6 +141,49 @@ struct to_json {
     const std::vector<String> &keys_to_censor;
 };
 
+struct to_cbor {
+    void operator()(Config::ConfString &x) {
+        writer.writeText(x.value.c_str(), x.value.length());
+    }
+    void operator()(Config::ConfFloat &x) {
+        writer.writeFloat(x.value);
+    }
+    void operator()(Config::ConfInt &x) {
+        writer.writeInt(x.value);
+    }
+    void operator()(Config::ConfUint &x) {
+        writer.writeUint(x.value);
+    }
+    void operator()(Config::ConfBool &x) {
+        writer.writeBool(x.value);
+    }
+    void operator()(std::nullptr_t x) {
+        writer.writeNull();
+    }
+    void operator()(Config::ConfArray &x) {
+        writer.writeArray(x.value.size());
+        for (size_t i = 0; i < x.value.size(); ++i)
+            strict_variant::apply_visitor(to_cbor{writer, keys_to_censor}, x.value[i].value);
+    }
+    void operator()(Config::ConfObject &x)
+    {
+        writer.writeMap(x.value.size());
+        for (size_t i = 0; i < x.value.size(); ++i) {
+            String &key = x.value[i].first;
+            writer.writeText(key.c_str(), key.length());
+
+            // Censored keys are null, as in to_json.
+            if (std::find(keys_to_censor.begin(), keys_to_censor.end(), key) != keys_to_censor.end())
+                writer.writeNull();
+            else
+                strict_variant::apply_visitor(to_cbor{writer, keys_to_censor}, x.value[i].second.value);
+        }
+    }
+
+    CborWriter &writer;
+    const std::vector<String> &keys_to_censor;
+};
+
 struct json_length_visitor {
     size_t operator()(Config::ConfString &x) {
         return x.maxChars + 1;
@@ -812,6 +859,11 @@ String Config::to_string_except(const std::vector<String> &keys_to_censor)
     return result;
 }
 
+void Config::write_cbor_except(CborWriter &writer, const std::vector<String> &keys_to_censor)
+{
+    strict_variant::apply_visitor(to_cbor{writer, keys_to_censor}, value);
+}
+
 void Config::write_to_stream_except(Print &output, std::initializer_list<String> keys_to_censor)
 {
     DynamicJsonDocument doc(json_size());
@@ -26,6 +26,8 @@
 
 #include "event_log.h"
 
+class CborWriter;
+
 #define STRICT_VARIANT_ASSUME_MOVE_NOTHROW true
 #include "strict_variant/variant.hpp"
 #include "strict_variant/mpl/find_with.hpp"
@@ -457,6 +459,9 @@ struct Config {
     String to_string();
     String to_string_except(std::initializer_list<String> keys_to_censor);
     String to_string_except(const std::vector<String> &keys_to_censor);
+
+    // Writes the same values as to_string_except as one CBOR item. Floats stay single precision.
+    void write_cbor_except(CborWriter &writer, const std::vector<String> &keys_to_censor);
 };
 
 /*void test() {
@@ -24,162 +24,338 @@
 */
 #include "digest_auth.h"
 
+#include <string.h>
+
+#include <algorithm>
+#include <mutex>
+
+#include "esp_system.h"
 #include "mbedtls/md5.h"
 #include "event_log.h"
-#include "build.h"
 
 extern EventLog logger;
 
-static bool getMD5(uint8_t * data, uint16_t len, char * output){//33 bytes or more
-    mbedtls_md5_context _ctx;
-  uint8_t i;
-  uint8_t * _buf = (uint8_t*)malloc(16);
-  if(_buf == NULL)
-    return false;
-  memset(_buf, 0x00, 16);
+// Realms whose HA1 is precomputed. Older firmwares used "asyncesp".
+static const char * const realms[] = {DIGEST_REALM, "asyncesp"};
+#define REALM_COUNT (sizeof(realms) / sizeof(realms[0]))
+
+// One nonce is used by a browser for all of its requests, so a few are enough even for several clients.
+#define NONCE_COUNT 16
+#define NONCE_LEN 32
+// Nonce counts may arrive out of order if a browser sends requests over several connections.
+// Accept any nonce count not seen yet that is at most NC_WINDOW below the highest one seen.
+#define NC_WINDOW 32
+
+#define HA2_CACHE_SIZE 8
+#define HA2_CACHE_KEY_LEN 48
+
+struct NonceEntry {
+  char nonce[NONCE_LEN];
+  bool valid;
+  uint32_t max_nc;
+  // Bit i is set if nonce count max_nc - i was used.
+  uint32_t seen_nc;
+  uint32_t last_used;
+};
+
+struct Ha2CacheEntry {
+  // method:uri
+  char key[HA2_CACHE_KEY_LEN];
+  size_t key_len;
+  char ha2[32];
+};
+
+static std::mutex mutex;
+
+static String digest_username;
+static char ha1[REALM_COUNT][32];
+static bool credentials_set = false;
 
-  mbedtls_md5_init(&_ctx);
-  mbedtls_md5_starts_ret(&_ctx);
-  mbedtls_md5_update_ret(&_ctx, data, len);
-  mbedtls_md5_finish_ret(&_ctx, _buf);
-  for(i = 0; i < 16; i++) {
-    sprintf(output + (i * 2), "%02x", _buf[i]);
+static NonceEntry nonces[NONCE_COUNT] = {};
+static uint32_t nonce_clock = 0;
+static char opaque[NONCE_LEN + 1] = {0};
+
+static Ha2CacheEntry ha2_cache[HA2_CACHE_SIZE] = {};
+static size_t ha2_cache_next = 0;
+
+struct Token {
+  const char * value;
+  size_t len;
+
+  bool equals(const char * s, size_t s_len) const {
+    return len == s_len && memcmp(value, s, len) == 0;
+  }
+};
+
+static void to_hex(const uint8_t * data, size_t len, char * out){
+  static const char digits[] = "0123456789abcdef";
+  for(size_t i = 0; i < len; ++i){
+    out[2 * i] = digits[data[i] >> 4];
+    out[2 * i + 1] = digits[data[i] & 0x0F];
   }
-  free(_buf);
-  return true;
 }
 
-static String genRandomString(){
-  uint8_t data[16] = {0};
-  uint32_t t = micros();
-  memcpy(data, &t, sizeof(t));
-  t = BUILD_TIMESTAMP;
-  memcpy(data + 4, &t, sizeof(t));
-  uint32_t r = rand();
-  memcpy(data + 8, &r, sizeof(r));
-  r = rand();
-  memcpy(data + 12, &r, sizeof(r));
-
-  char buf[33] = {0};
-  getMD5(data, 16, buf);
-
-  return String(buf);
+// Hashes the parts separated by colons.
+static void md5_hex(const Token * parts, size_t count, char * out){
+  mbedtls_md5_context ctx;
+  uint8_t digest[16];
+
+  mbedtls_md5_init(&ctx);
+  mbedtls_md5_starts_ret(&ctx);
+  for(size_t i = 0; i < count; ++i){
+    if(i != 0)
+      mbedtls_md5_update_ret(&ctx, (const uint8_t *)":", 1);
+    mbedtls_md5_update_ret(&ctx, (const uint8_t *)parts[i].value, parts[i].len);
+  }
+  mbedtls_md5_finish_ret(&ctx, digest);
+  mbedtls_md5_free(&ctx);
+
+  to_hex(digest, sizeof(digest), out);
 }
 
-static String stringMD5(const String& in){
-  char * out = (char*)malloc(33);
-  if(out == NULL || !getMD5((uint8_t*)(in.c_str()), in.length(), out))
-    return "";
-  String res = String(out);
-  free(out);
-  return res;
+static void random_hex(char * out, size_t len){
+  for(size_t i = 0; i < len; i += 8){
+    uint32_t r = esp_random();
+    char buf[8];
+    to_hex((const uint8_t *)&r, sizeof(r), buf);
+    memcpy(out + i, buf, std::min((size_t)8, len - i));
+  }
 }
 
-String requestDigestAuthentication(const char * realm){
-  String header = "realm=\"";
-  if(realm == NULL)
-    header.concat("esp32-lib");
-  else
-    header.concat(realm);
-  header.concat( "\", qop=\"auth\", nonce=\"");
-  header.concat(genRandomString());
+void setDigestCredentials(const char * username, const char * password){
+  std::lock_guard<std::mutex> lock{mutex};
+
+  digest_username = username;
+  for(size_t i = 0; i < REALM_COUNT; ++i){
+    Token parts[] = {{username, strlen(username)}, {realms[i], strlen(realms[i])}, {password, strlen(password)}};
+    md5_hex(parts, 3, ha1[i]);
+  }
+  credentials_set = true;
+
+  // Responses for the old credentials must not be accepted anymore.
+  memset(nonces, 0, sizeof(nonces));
+}
+
+String requestDigestAuthentication(bool stale){
+  char nonce[NONCE_LEN + 1] = {0};
+  random_hex(nonce, NONCE_LEN);
+
+  {
+    std::lock_guard<std::mutex> lock{mutex};
+
+    // Replace the least recently used nonce.
+    NonceEntry * entry = &nonces[0];
+    for(size_t i = 1; i < NONCE_COUNT && entry->valid; ++i)
+      if(!nonces[i].valid || (int32_t)(nonces[i].last_used - entry->last_used) < 0)
+        entry = &nonces[i];
+
+    memcpy(entry->nonce, nonce, NONCE_LEN);
+    entry->valid = true;
+    entry->max_nc = 0;
+    entry->seen_nc = 0;
+    entry->last_used = ++nonce_clock;
+
+    if(opaque[0] == '\0')
+      random_hex(opaque, NONCE_LEN);
+  }
+
+  String header = "realm=\"" DIGEST_REALM "\", qop=\"auth\", nonce=\"";
+  header.concat(nonce);
   header.concat("\", opaque=\"");
-  header.concat(genRandomString());
+  header.concat(opaque);
   header.concat("\"");
+  if(stale)
+    header.concat(", stale=TRUE");
   return header;
 }
 
-bool checkDigestAuthentication(const char * header, const char * method, const char * username, const char * password, const char * realm, bool passwordIsHash, const char * nonce, const char * opaque, const char * uri){
-  if(username == NULL || password == NULL || header == NULL || method == NULL){
-    logger.printfln("AUTH FAIL: missing requred fields");
+// Splits the next name=value pair off the header. Quotes around the value are removed.
+static bool next_param(const char ** p, const char * end, Token * name, Token * value){
+  const char * c = *p;
+  while(c < end && (*c == ' ' || *c == '\t' || *c == ','))
+    ++c;
+  if(c == end)
     return false;
+
+  name->value = c;
+  while(c < end && *c != '=' && *c != ',')
+    ++c;
+  name->len = c - name->value;
+  while(name->len > 0 && name->value[name->len - 1] == ' ')
+    --name->len;
+
+  if(c == end || *c != '='){
+    // A parameter without value: ignore it.
+    value->value = c;
+    value->len = 0;
+    *p = c;
+    return true;
   }
+  ++c;
+  while(c < end && *c == ' ')
+    ++c;
 
-  String myHeader = String(header);
-  int nextBreak = myHeader.indexOf(",");
-  if(nextBreak < 0){
-    logger.printfln("AUTH FAIL: no variables");
-    return false;
+  if(c < end && *c == '"'){
+    ++c;
+    value->value = c;
+    while(c < end && *c != '"')
+      ++c;
+    value->len = c - value->value;
+    if(c < end)
+      ++c;
+  } else {
+    value->value = c;
+    while(c < end && *c != ',')
+      ++c;
+    value->len = c - value->value;
+    while(value->len > 0 && value->value[value->len - 1] == ' ')
+      --value->len;
   }
 
-  String myUsername = String();
-  String myRealm = String();
-  String myNonce = String();
-  String myUri = String();
-  String myResponse = String();
-  String myQop = String();
-  String myNc = String();
-  String myCnonce = String();
-
-  myHeader += ", ";
-  do {
-    String avLine = myHeader.substring(0, nextBreak);
-    avLine.trim();
-    myHeader = myHeader.substring(nextBreak+1);
-    nextBreak = myHeader.indexOf(",");
-
-    int eqSign = avLine.indexOf("=");
-    if(eqSign < 0){
-      logger.printfln("AUTH FAIL: no = sign");
+  *p = c;
+  return true;
+}
+
+static bool parse_nc(const Token &nc, uint32_t * result){
+  if(nc.len != 8)
+    return false;
+
+  uint32_t v = 0;
+  for(size_t i = 0; i < nc.len; ++i){
+    char c = nc.value[i];
+    uint32_t digit;
+    if(c >= '0' && c <= '9')
+      digit = c - '0';
+    else if(c >= 'a' && c <= 'f')
+      digit = c - 'a' + 10;
+    else if(c >= 'A' && c <= 'F')
+      digit = c - 'A' + 10;
+    else
       return false;
+    v = (v << 4) | digit;
+  }
+  *result = v;
+  return true;
+}
+
+// Has to be called with the mutex locked.
+static const char * get_ha2(const char * method, const Token &uri){
+  size_t method_len = strlen(method);
+  size_t key_len = method_len + 1 + uri.len;
+
+  if(key_len <= HA2_CACHE_KEY_LEN){
+    for(size_t i = 0; i < HA2_CACHE_SIZE; ++i){
+      Ha2CacheEntry &e = ha2_cache[i];
+      if(e.key_len == key_len
+      && memcmp(e.key, method, method_len) == 0
+      && e.key[method_len] == ':'
+      && memcmp(e.key + method_len + 1, uri.value, uri.len) == 0)
+        return e.ha2;
     }
-    String varName = avLine.substring(0, eqSign);
-    avLine = avLine.substring(eqSign + 1);
-    if(avLine.startsWith("\"")){
-      avLine = avLine.substring(1, avLine.length() - 1);
-    }
+  }
 
-    if(varName.equals("username")){
-      if(!avLine.equals(username)){
-        logger.printfln("AUTH FAIL: username");
-        return false;
-      }
-      myUsername = avLine;
-    } else if(varName.equals("realm")){
-      if(realm != NULL && !avLine.equals(realm)){
-        logger.printfln("AUTH FAIL: realm");
-        return false;
-      } else if (realm == NULL && !avLine.equals("esp32-lib") && !avLine.equals("asyncesp")) {
-        logger.printfln("AUTH FAIL: realm");
-        return false;
-      }
-      myRealm = avLine;
-    } else if(varName.equals("nonce")){
-      if(nonce != NULL && !avLine.equals(nonce)){
-        logger.printfln("AUTH FAIL: nonce");
-        return false;
-      }
-      myNonce = avLine;
-    } else if(varName.equals("opaque")){
-      if(opaque != NULL && !avLine.equals(opaque)){
-        logger.printfln("AUTH FAIL: opaque");
-        return false;
-      }
-    } else if(varName.equals("uri")){
-      if(uri != NULL && !avLine.equals(uri)){
-        logger.printfln("AUTH FAIL: uri");
-        return false;
-      }
-      myUri = avLine;
-    } else if(varName.equals("response")){
-      myResponse = avLine;
-    } else if(varName.equals("qop")){
-      myQop = avLine;
-    } else if(varName.equals("nc")){
-      myNc = avLine;
-    } else if(varName.equals("cnonce")){
-      myCnonce = avLine;
+  Ha2CacheEntry &e = ha2_cache[ha2_cache_next];
+  Token parts[] = {{method, method_len}, uri};
+  md5_hex(parts, 2, e.ha2);
+
+  if(key_len <= HA2_CACHE_KEY_LEN){
+    memcpy(e.key, method, method_len);
+    e.key[method_len] = ':';
+    memcpy(e.key + method_len + 1, uri.value, uri.len);
+    e.key_len = key_len;
+  } else {
+    // Use the slot as scratch space without caching the result.
+    e.key_len = 0;
+  }
+  ha2_cache_next = (ha2_cache_next + 1) % HA2_CACHE_SIZE;
+  return e.ha2;
+}
+
+DigestAuthResult checkDigestAuthentication(const char * header, size_t header_len, const char * method){
+  if(header == NULL || method == NULL){
+    logger.printfln("AUTH FAIL: missing requred fields");
+    return DigestAuthResult::FAILED;
+  }
+
+  Token username = {}, realm = {}, nonce = {}, uri = {}, response = {}, qop = {}, nc = {}, cnonce = {};
+
+  const char * p = header;
+  const char * end = header + header_len;
+  Token name, value;
+  while(next_param(&p, end, &name, &value)){
+    if(name.equals("username", 8))
+      username = value;
+    else if(name.equals("realm", 5))
+      realm = value;
+    else if(name.equals("nonce", 5))
+      nonce = value;
+    else if(name.equals("uri", 3))
+      uri = value;
+    else if(name.equals("response", 8))
+      response = value;
+    else if(name.equals("qop", 3))
+      qop = value;
+    else if(name.equals("nc", 2))
+      nc = value;
+    else if(name.equals("cnonce", 6))
+      cnonce = value;
+  }
+
+  // Only qop=auth is offered in the challenge.
+  uint32_t nc_value;
+  if(!qop.equals("auth", 4) || !parse_nc(nc, &nc_value) || nc_value == 0 || response.len != 32 || nonce.len != NONCE_LEN || uri.value == NULL || cnonce.value == NULL){
+    logger.printfln("AUTH FAIL: malformed header");
+    return DigestAuthResult::FAILED;
+  }
+
+  std::lock_guard<std::mutex> lock{mutex};
+
+  if(!credentials_set || !username.equals(digest_username.c_str(), digest_username.length())){
+    logger.printfln("AUTH FAIL: username");
+    return DigestAuthResult::FAILED;
+  }
+
+  size_t realm_idx = 0;
+  while(realm_idx < REALM_COUNT && !realm.equals(realms[realm_idx], strlen(realms[realm_idx])))
+    ++realm_idx;
+  if(realm_idx == REALM_COUNT){
+    logger.printfln("AUTH FAIL: realm");
+    return DigestAuthResult::FAILED;
+  }
+
+  NonceEntry * entry = NULL;
+  for(size_t i = 0; i < NONCE_COUNT; ++i){
+    if(nonces[i].valid && memcmp(nonces[i].nonce, nonce.value, NONCE_LEN) == 0){
+      entry = &nonces[i];
+      break;
     }
-  } while(nextBreak > 0);
+  }
 
-  String ha1 = (passwordIsHash) ? String(password) : stringMD5(myUsername + ":" + myRealm + ":" + String(password));
-  String ha2 = String(method) + ":" + myUri;
-  String response = ha1 + ":" + myNonce + ":" + myNc + ":" + myCnonce + ":" + myQop + ":" + stringMD5(ha2);
+  if(entry == NULL)
+    return DigestAuthResult::STALE;
 
-  if(myResponse.equals(stringMD5(response))){
-    return true;
+  // Check the nonce count before hashing, but only record it after the response was verified.
+  uint32_t nc_offset = entry->max_nc - nc_value;
+  if(nc_value <= entry->max_nc && (nc_offset >= NC_WINDOW || (entry->seen_nc & (1u << nc_offset)) != 0))
+    return DigestAuthResult::STALE;
+
+  Token parts[] = {{ha1[realm_idx], 32}, nonce, nc, cnonce, qop, {get_ha2(method, uri), 32}};
+  char expected[32];
+  md5_hex(parts, 6, expected);
+
+  if(memcmp(expected, response.value, 32) != 0){
+    logger.printfln("AUTH FAIL: password");
+    return DigestAuthResult::FAILED;
+  }
+
+  if(nc_value > entry->max_nc){
+    uint32_t shift = nc_value - entry->max_nc;
+    entry->seen_nc = shift >= NC_WINDOW ? 0 : entry->seen_nc << shift;
+    entry->max_nc = nc_value;
+    nc_offset = 0;
   }
+  entry->seen_nc |= 1u << nc_offset;
+  entry->last_used = ++nonce_clock;
 
-  logger.printfln("AUTH FAIL: password");
-  return false;
+  return DigestAuthResult::OK;
 }
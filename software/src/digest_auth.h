@@ -27,8 +27,21 @@
 
 #include <Arduino.h>
 
-String requestDigestAuthentication(const char * realm);
-bool checkDigestAuthentication(const char * header, const char * method, const char * username, const char * password, const char * realm, bool passwordIsHash, const char * nonce, const char * opaque, const char * uri);
+#define DIGEST_REALM "esp32-lib"
 
-//for storing hashed versions on the device that can be authenticated against
-//String generateDigestHash(const char * username, const char * password, const char * realm);
+enum class DigestAuthResult {
+  OK,
+  // The response was for a nonce that is unknown, expired or whose nonce count was already used.
+  // Answer with a new challenge with stale=true: The client retries without asking the user.
+  STALE,
+  FAILED
+};
+
+// Precomputes HA1 for the credentials. Has to be called whenever they change.
+void setDigestCredentials(const char * username, const char * password);
+
+// Returns the parameters of a WWW-Authenticate: Digest header with a new nonce.
+String requestDigestAuthentication(bool stale);
+
+// header is the Authorization header without the "Digest " prefix and does not have to be null-terminated.
+DigestAuthResult checkDigestAuthentication(const char * header, size_t header_len, const char * method);
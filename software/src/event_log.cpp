@@ -19,68 +19,560 @@
 
 #include "event_log.h"
 
+#include <esp_partition.h>
+#include <esp_system.h>
+
+#include "api.h"
+#include "event_log_format.h"
+#include "task_scheduler.h"
+#include "tools.h"
 #include "web_server.h"
 
 extern WebServer server;
+extern EventLog logger;
+extern TaskScheduler task_scheduler;
+extern API api;
 
-void EventLog::write(const char *buf, size_t len)
+EventLogModule *EventLogModule::first = nullptr;
+
+EventLogModule::EventLogModule(const char *name, EventLogLevel default_level) :
+    name(name), default_level(default_level), level(default_level), next(first)
+{
+    first = this;
+}
+
+static Config event_log_config;
+static Config event_log_modules;
+
+class EspPartitionFlash : public PersistentLogFlash {
+public:
+    EspPartitionFlash(const esp_partition_t *partition) : partition(partition) {}
+
+    size_t size() override {
+        return partition->size;
+    }
+
+    bool read(size_t offset, void *buf, size_t len) override {
+        return esp_partition_read(partition, offset, buf, len) == ESP_OK;
+    }
+
+    bool write(size_t offset, const void *buf, size_t len) override {
+        return esp_partition_write(partition, offset, buf, len) == ESP_OK;
+    }
+
+    bool erase_segment(size_t offset) override {
+        return esp_partition_erase_range(partition, offset, PERSISTENT_LOG_SEGMENT_SIZE) == ESP_OK;
+    }
+
+private:
+    const esp_partition_t *partition;
+};
+
+static void flush_persistent_log_on_shutdown()
+{
+    logger.flush_persistent_log();
+}
+
+#define SERIAL_CHUNK_SIZE 128
+
+#if EVENT_LOG_STRUCTURED
+#define RECORD_FLAG_RAW 0x01
+#define RECORD_FLAG_NO_NEWLINE 0x02
+#define RECORD_FLAG_TRUNCATED 0x04
+
+struct EventLogRecordHeader {
+    // Length of the header and the payload
+    uint16_t length;
+    uint8_t level;
+    uint8_t flags;
+    uint32_t timestamp_ms;
+    const char *module;
+    // nullptr for raw records. Their payload is the text to log.
+    const char *fmt;
+};
+#endif
+
+void EventLog::setup()
+{
+    if (serial_task != nullptr)
+        return;
+
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, PERSISTENT_LOG_PARTITION_LABEL);
+    if (partition != nullptr) {
+        flash_batch = (char *)malloc(PERSISTENT_LOG_BATCH_SIZE);
+
+        if (flash_batch != nullptr && persistent_log.mount(new EspPartitionFlash(partition))) {
+            esp_register_shutdown_handler(flush_persistent_log_on_shutdown);
+        } else {
+            free(flash_batch);
+            flash_batch = nullptr;
+        }
+    }
+
+    xTaskCreate(serial_drain_task,
+                "log_serial",
+                4096,
+                this,
+                tskIDLE_PRIORITY + 1,
+                &serial_task);
+
+    if (persistent_log.is_mounted()) {
+        printfln("Persistent event log mounted. This is boot %u.", persistent_log.current_boot_id());
+    } else if (partition != nullptr) {
+        printfln("Failed to mount persistent event log.");
+    }
+}
+
+void EventLog::serial_drain_task(void *arg)
+{
+    EventLog *log = (EventLog *)arg;
+
+    for (;;) {
+        log->drain_to_serial();
+
+        bool flash_pending = log->drain_to_flash(deadline_elapsed(log->last_flash_flush + PERSISTENT_LOG_FLUSH_INTERVAL_MS));
+
+        // Wake up to write a partial batch, even if nothing is logged in the meantime.
+        ulTaskNotifyTake(pdTRUE, flash_pending ? pdMS_TO_TICKS(PERSISTENT_LOG_FLUSH_INTERVAL_MS) : portMAX_DELAY);
+    }
+}
+
+bool EventLog::drain_to_flash(bool force)
+{
+    if (!persistent_log.is_mounted())
+        return false;
+
+    std::lock_guard<std::mutex> lock{flash_mutex};
+
+    auto append_batch = [this]() {
+        if (flash_batch_used == 0)
+            return;
+
+        // Unwritten flash reads as 0xFF. The persistent log uses it to find the end of the text.
+        for (size_t i = 0; i < flash_batch_used; ++i)
+            if (flash_batch[i] == (char)0xFF)
+                flash_batch[i] = '?';
+
+        if (!persistent_log.append(flash_batch, flash_batch_used)) {
+            Serial.println("Failed to write to persistent event log.");
+        }
+
+        flash_batch_used = 0;
+        last_flash_flush = millis();
+    };
+
+    auto add_to_batch = [this, &append_batch](const char *buf, size_t len) {
+        while (len > 0) {
+            size_t to_copy = MIN(len, PERSISTENT_LOG_BATCH_SIZE - flash_batch_used);
+            memcpy(flash_batch + flash_batch_used, buf, to_copy);
+            flash_batch_used += to_copy;
+            buf += to_copy;
+            len -= to_copy;
+
+            if (flash_batch_used == PERSISTENT_LOG_BATCH_SIZE)
+                append_batch();
+        }
+    };
+
+    uint32_t end;
+    get_bounds(nullptr, &end);
+
+    for (;;) {
+        uint32_t dropped = 0;
+        bool have_entry = read_entry(&flash_written, end, &dropped, EventLogLevel::DEBUG, add_to_batch);
+
+        if (dropped > 0) {
+            char buf[64];
+            int written = snprintf(buf, sizeof(buf), "[%u chars of log output dropped: flash too slow]\n", dropped);
+            add_to_batch(buf, MIN((size_t)written, sizeof(buf) - 1));
+        }
+
+        if (!have_entry)
+            break;
+    }
+
+    if (force)
+        append_batch();
+    else if (flash_batch_used == 0)
+        last_flash_flush = millis();
+
+    return flash_batch_used > 0;
+}
+
+void EventLog::flush_persistent_log()
+{
+    drain_to_flash(true);
+}
+
+void EventLog::drain_to_serial()
+{
+    uint32_t end;
+    get_bounds(nullptr, &end);
+
+    for (;;) {
+        uint32_t dropped = 0;
+
+        // Serial.write blocks until the UART accepted the data. Only the drain task waits here.
+        bool have_entry = read_entry(&serial_written, end, &dropped, EventLogLevel::DEBUG, [](const char *buf, size_t len) {
+            Serial.write((const uint8_t *)buf, len);
+        });
+
+        if (dropped > 0) {
+            serial_chars_dropped += dropped;
+            Serial.printf("[%u chars of log output dropped: serial console too slow]\n", dropped);
+        }
+
+        if (!have_entry)
+            return;
+    }
+}
+
+void EventLog::get_bounds(uint32_t *oldest, uint32_t *end)
 {
     std::lock_guard<std::mutex> lock{event_buf_mutex};
-    String t = String(millis());
-    size_t to_write = 12 + len + 1; // 12 for the longest timestamp (-2^31) and a space; 1 for the \n
 
-    Serial.print(t);
-    for (int i = 0; i < 12 - t.length(); ++i)
-        Serial.print(' ');
-    Serial.print(buf);
+    if (oldest != nullptr)
+        *oldest = total_written - event_buf.used();
+
+    if (end != nullptr)
+        *end = total_written;
+}
+
+uint32_t EventLog::read_range(uint32_t *pos, uint32_t end, EventLogLevel min_level, const std::function<void(const char *, size_t)> &out)
+{
+    uint32_t dropped = 0;
+
+    while (read_entry(pos, end, &dropped, min_level, out)) {
+    }
+
+    return dropped;
+}
+
+bool EventLog::read_entry(uint32_t *pos, uint32_t end, uint32_t *dropped, EventLogLevel min_level, const std::function<void(const char *, size_t)> &out)
+{
+#if EVENT_LOG_STRUCTURED
+    EventLogRecordHeader header;
+    uint8_t payload[EVENT_LOG_MAX_ARGS_LEN];
+    size_t payload_len;
+
+    {
+        std::lock_guard<std::mutex> lock{event_buf_mutex};
+        uint32_t oldest = total_written - event_buf.used();
+
+        // The event buffer has overwritten entries that were not read yet.
+        if ((int32_t)(oldest - *pos) > 0) {
+            *dropped += oldest - *pos;
+            *pos = oldest;
+        }
+
+        for (;;) {
+            if ((int32_t)(end - *pos) <= 0)
+                return false;
+
+            size_t offset = *pos - oldest;
+            if (event_buf.peek_n((char *)&header, offset, sizeof(header)) != sizeof(header))
+                return false;
+
+            *pos += header.length;
+
+            if (header.level >= (uint8_t)min_level)
+                break;
+        }
+
+        payload_len = header.length - sizeof(header);
+        event_buf.peek_n((char *)payload, *pos - header.length - oldest + sizeof(header), payload_len);
+    }
+
+    char timestamp[13];
+    snprintf(timestamp, sizeof(timestamp), "%-12lu", (unsigned long)header.timestamp_ms);
+    out(timestamp, 12);
+
+    if (header.fmt == nullptr) {
+        out((const char *)payload, payload_len);
+    } else {
+        format_log_args(header.fmt, payload, payload_len, out);
+    }
+
+    if ((header.flags & RECORD_FLAG_NO_NEWLINE) == 0)
+        out("\n", 1);
+
+    return true;
+#else
+    (void)min_level;
+
+    char chunk[SERIAL_CHUNK_SIZE];
+    size_t len;
+
+    {
+        std::lock_guard<std::mutex> lock{event_buf_mutex};
+        uint32_t oldest = total_written - event_buf.used();
+
+        // The event buffer has overwritten chars that were not read yet.
+        if ((int32_t)(oldest - *pos) > 0) {
+            *dropped += oldest - *pos;
+            *pos = oldest;
+        }
+
+        if ((int32_t)(end - *pos) <= 0)
+            return false;
+
+        len = event_buf.peek_n(chunk, *pos - oldest, MIN(sizeof(chunk), end - *pos));
+        *pos += len;
+    }
+
+    if (len == 0)
+        return false;
+
+    out(chunk, len);
+    return true;
+#endif
+}
+
+#if EVENT_LOG_STRUCTURED
+void EventLog::write_record(EventLogLevel level, const char *module, const char *fmt, const uint8_t *payload, size_t payload_len, uint8_t flags)
+{
+    EventLogRecordHeader header;
+    header.length = sizeof(header) + payload_len;
+    header.level = (uint8_t)level;
+    header.flags = flags;
+    header.timestamp_ms = millis();
+    header.module = module;
+    header.fmt = fmt;
+
+    {
+        std::lock_guard<std::mutex> lock{event_buf_mutex};
+
+        if (event_buf.free() < header.length) {
+            drop(header.length - event_buf.free());
+        }
 
-    if (buf[len - 1] != '\n') {
-        Serial.println("");
+        event_buf.push_n((const char *)&header, sizeof(header));
+        event_buf.push_n((const char *)payload, payload_len);
+
+        total_written += header.length;
     }
 
-    if (event_buf.free() < to_write) {
-        drop(to_write - event_buf.free());
+    if (serial_task != nullptr) {
+        xTaskNotifyGive(serial_task);
     }
+}
+#endif
 
-    for (int i = 0; i < t.length(); ++i) {
-        event_buf.push(t[i]);
+void EventLog::write(const char *buf, size_t len)
+{
+    if (len == 0)
+        return;
+
+#if EVENT_LOG_STRUCTURED
+    // Store the text as raw records. Split it, so that every record fits into the read buffer.
+    while (len > 0) {
+        size_t chunk_len = MIN(len, EVENT_LOG_MAX_ARGS_LEN);
+        len -= chunk_len;
+
+        uint8_t flags = RECORD_FLAG_RAW;
+        if (len > 0) {
+            flags |= RECORD_FLAG_NO_NEWLINE;
+        } else if (buf[chunk_len - 1] == '\n') {
+            // Don't print the newline twice
+            --chunk_len;
+        }
+
+        write_record(EventLogLevel::INFO, nullptr, nullptr, (const uint8_t *)buf, chunk_len, flags);
+        buf += chunk_len;
     }
-    for (int i = 0; i < 12 - t.length(); ++i)
-        event_buf.push(' ');
+#else
+    // 12 for the longest timestamp (-2^31) and a space
+    char timestamp[13];
+    snprintf(timestamp, sizeof(timestamp), "%-12lu", (unsigned long)millis());
+
+    bool add_newline = buf[len - 1] != '\n';
+    size_t to_write = 12 + len + (add_newline ? 1 : 0);
+
+    {
+        std::lock_guard<std::mutex> lock{event_buf_mutex};
 
-    for (int i = 0; i < len; ++i) {
-        event_buf.push(buf[i]);
+        if (event_buf.free() < to_write) {
+            drop(to_write - event_buf.free());
+        }
+
+        event_buf.push_n(timestamp, 12);
+        event_buf.push_n(buf, len);
+        if (add_newline) {
+            event_buf.push('\n');
+        }
+
+        total_written += to_write;
     }
-    if (buf[len - 1] != '\n') {
-        event_buf.push('\n');
+
+    if (serial_task != nullptr) {
+        xTaskNotifyGive(serial_task);
     }
+#endif
 }
 
 void EventLog::printfln(const char *fmt, ...)
 {
-    char buf[128];
-    memset(buf, 0, sizeof(buf) / sizeof(buf[0]));
+    va_list args;
+    va_start(args, fmt);
+    vprintfln_at(EventLogLevel::INFO, nullptr, fmt, args);
+    va_end(args);
+}
 
+void EventLog::printfln_at(EventLogLevel level, EventLogModule *module, const char *fmt, ...)
+{
     va_list args;
     va_start(args, fmt);
-    auto written = vsnprintf(buf, sizeof(buf) / sizeof(buf[0]), fmt, args);
+    vprintfln_at(level, module, fmt, args);
     va_end(args);
+}
+
+void EventLog::printfln_limited(EventLogRateLimit *limit, EventLogLevel level, EventLogModule *module, const char *fmt, ...)
+{
+    if (module != nullptr && level < module->level)
+        return;
+
+    uint32_t suppressed = 0;
+
+    {
+        std::lock_guard<std::mutex> lock{rate_limit_mutex};
+        uint32_t now = millis();
+
+        if (limit->tokens < limit->burst) {
+            uint32_t refills = (now - limit->last_refill_ms) / limit->refill_interval_ms;
+            if (refills > 0) {
+                limit->tokens = MIN((uint32_t)limit->burst, limit->tokens + refills);
+                limit->last_refill_ms += refills * limit->refill_interval_ms;
+            }
+        } else {
+            limit->last_refill_ms = now;
+        }
+
+        if (limit->tokens == 0) {
+            ++limit->suppressed;
+            limit->last_suppressed_ms = now;
+
+            if (!limit->linked) {
+                limit->fmt = fmt;
+                limit->module = module;
+                limit->level = level;
+                limit->linked = true;
+                limit->next = first_rate_limit;
+                first_rate_limit = limit;
+            }
+            return;
+        }
+
+        --limit->tokens;
+        suppressed = limit->suppressed;
+        limit->suppressed = 0;
+    }
+
+    if (suppressed > 0)
+        log_suppressed(limit, suppressed);
+
+    va_list args;
+    va_start(args, fmt);
+    vprintfln_at(level, module, fmt, args);
+    va_end(args);
+}
+
+void EventLog::log_suppressed(EventLogRateLimit *limit, uint32_t suppressed)
+{
+    // Identify the message by the constant part of its format string.
+    int prefix_len = MIN(strcspn(limit->fmt, "%"), 48);
+    if (prefix_len == 0)
+        prefix_len = MIN(strlen(limit->fmt), 48);
+
+    printfln_at(limit->level, limit->module, "%.*s... repeated %u times", prefix_len, limit->fmt, suppressed);
+}
+
+void EventLog::flush_rate_limits()
+{
+    EventLogRateLimit *first;
+    {
+        std::lock_guard<std::mutex> lock{rate_limit_mutex};
+        first = first_rate_limit;
+    }
+
+    // Rate limits are only ever prepended, so the rest of the list is stable.
+    for (EventLogRateLimit *limit = first; limit != nullptr; limit = limit->next) {
+        uint32_t suppressed = 0;
+
+        {
+            std::lock_guard<std::mutex> lock{rate_limit_mutex};
+            if (limit->suppressed == 0 || !deadline_elapsed(limit->last_suppressed_ms + limit->refill_interval_ms))
+                continue;
+
+            suppressed = limit->suppressed;
+            limit->suppressed = 0;
+        }
+
+        log_suppressed(limit, suppressed);
+    }
+}
+
+void EventLog::apply_levels()
+{
+    for (EventLogModule *module = EventLogModule::first; module != nullptr; module = module->next) {
+        module->level = module->default_level;
+
+        for (Config &entry : event_log_config.get("levels")->asArray()) {
+            if (entry.get("module")->asString() == module->name) {
+                module->level = (EventLogLevel)entry.get("level")->asUint();
+                break;
+            }
+        }
+    }
+}
+
+void EventLog::vprintfln_at(EventLogLevel level, EventLogModule *module, const char *fmt, va_list args)
+{
+    if (module != nullptr && level < module->level)
+        return;
+
+#if EVENT_LOG_STRUCTURED
+    uint8_t payload[EVENT_LOG_MAX_ARGS_LEN];
+    bool truncated = false;
+
+    size_t payload_len = pack_log_args(payload, sizeof(payload), fmt, args, &truncated);
+    write_record(level, module == nullptr ? nullptr : module->name, fmt, payload, payload_len, truncated ? RECORD_FLAG_TRUNCATED : 0);
+#else
+
+    char buf[128];
+    memset(buf, 0, sizeof(buf) / sizeof(buf[0]));
+
+    auto written = vsnprintf(buf, sizeof(buf) / sizeof(buf[0]), fmt, args);
+
+    if (written < 0)
+        return;
 
     if (written >= sizeof(buf) / sizeof(buf[0])) {
         write("Next log message was truncated. Bump EventLog::printfln buffer size!", 69);
+        written = sizeof(buf) / sizeof(buf[0]) - 1;
     }
 
     write(buf, written);
+#endif
 }
 
 void EventLog::drop(size_t count)
 {
+#if EVENT_LOG_STRUCTURED
+    // Only drop whole records.
+    size_t dropped = 0;
+    while (dropped < count && event_buf.used() > 0) {
+        uint16_t record_len;
+        event_buf.peek_n((char *)&record_len, 0, sizeof(record_len));
+        dropped += event_buf.discard(record_len);
+    }
+#else
     char c = '\n';
     for (int i = 0; i < count; ++i)
         event_buf.pop(&c);
 
     while (event_buf.used() > 0 && c != '\n')
         event_buf.pop(&c);
+#endif
 }
 
 #define CHUNK_SIZE 1024
@@ -88,21 +580,112 @@ char chunk_buf[CHUNK_SIZE] = {0};
 
 void EventLog::register_urls()
 {
+    event_log_config = Config::Object({
+        {"levels", Config::Array(
+            {},
+            new Config{Config::Object({
+                {"module", Config::Str("", 32)},
+                {"level", Config::Uint((uint32_t)EventLogLevel::DEBUG, (uint32_t)EventLogLevel::DEBUG, (uint32_t)EventLogLevel::ERROR)}
+            })},
+            0, 32, Config::type_id<Config::ConfObject>()
+        )}
+    });
+
+    api.restorePersistentConfig("event_log/config", &event_log_config);
+    apply_levels();
+
+    // Levels take effect immediately, not only after a reboot.
+    api.addPersistentConfig("event_log/config", &event_log_config, {}, 1000, [this]() {
+        apply_levels();
+    });
+
+    event_log_modules = Config::Array({}, new Config{Config::Str("", 32)}, 0, 64, Config::type_id<Config::ConfString>());
+
+    size_t module_count = 0;
+    for (EventLogModule *module = EventLogModule::first; module != nullptr; module = module->next) {
+        event_log_modules.add();
+        event_log_modules.get(module_count++)->updateString(module->name);
+    }
+
+    api.addState("event_log/modules", &event_log_modules, {}, 10000);
+
+    task_scheduler.scheduleWithFixedDelay("event_log_rate_limits", [this]() {
+        flush_rate_limits();
+    }, 1000, 1000);
+
     server.on("/event_log", HTTP_GET, [this](WebServerRequest request) {
-        std::lock_guard<std::mutex> lock{event_buf_mutex};
-        auto used = event_buf.used();
+        EventLogLevel min_level = EventLogLevel::DEBUG;
+        String level = request.getQueryParam("level");
+        if (level != "") {
+#if EVENT_LOG_STRUCTURED
+            min_level = (EventLogLevel)constrain(level.toInt(), 0L, (long)EventLogLevel::ERROR);
+#else
+            // Text entries don't carry a level.
+            request.send(400, "text/plain", "level requires a firmware built with EVENT_LOG_STRUCTURED");
+            return;
+#endif
+        }
+
+        uint32_t oldest;
+        uint32_t end;
+        get_bounds(&oldest, &end);
+
+        // since is the X-Event-Log-Next value of a previous response.
+        // If it is not in the event buffer anymore (or is from before a reboot), the whole log is sent.
+        // Clients can detect this by comparing X-Event-Log-Since with the requested position.
+        uint32_t pos = oldest;
+        String since = request.getQueryParam("since");
+        if (since != "") {
+            uint32_t since_pos = strtoul(since.c_str(), nullptr, 10);
+            if ((int32_t)(since_pos - oldest) >= 0 && (int32_t)(end - since_pos) >= 0)
+                pos = since_pos;
+        }
+
+        char since_str[11];
+        char next_str[11];
+        snprintf(since_str, sizeof(since_str), "%u", pos);
+        snprintf(next_str, sizeof(next_str), "%u", end);
+        request.addResponseHeader("X-Event-Log-Since", since_str);
+        request.addResponseHeader("X-Event-Log-Next", next_str);
 
         request.beginChunkedResponse(200, "text/plain");
 
-        for (int index = 0; index < used; index += CHUNK_SIZE) {
-            size_t to_write = MIN(CHUNK_SIZE, used - index);
+        // Only hold event_buf_mutex while copying a single entry, never while sending.
+        size_t chunk_used = 0;
+        read_range(&pos, end, min_level, [&request, &chunk_used](const char *buf, size_t len) {
+            while (len > 0) {
+                size_t to_copy = MIN(len, CHUNK_SIZE - chunk_used);
+                memcpy(chunk_buf + chunk_used, buf, to_copy);
+                chunk_used += to_copy;
+                buf += to_copy;
+                len -= to_copy;
 
-            for (int i = 0; i < to_write; ++i) {
-                event_buf.peek_offset((char *)(chunk_buf + i), index + i);
+                if (chunk_used == CHUNK_SIZE) {
+                    request.sendChunk(chunk_buf, chunk_used);
+                    chunk_used = 0;
+                }
             }
-            request.sendChunk(chunk_buf, to_write);
+        });
+
+        if (chunk_used > 0) {
+            request.sendChunk(chunk_buf, chunk_used);
         }
 
         request.endChunkedResponse();
     });
+
+    server.on("/event_log/previous_boot", HTTP_GET, [this](WebServerRequest request) {
+        if (!persistent_log.is_mounted()) {
+            request.send(404, "text/plain", "Persistent event log not available");
+            return;
+        }
+
+        request.beginChunkedResponse(200, "text/plain");
+
+        persistent_log.read_boot(persistent_log.previous_boot_id(), [&request](const char *buf, size_t len) {
+            request.sendChunk(buf, len);
+        });
+
+        request.endChunkedResponse();
+    });
 }
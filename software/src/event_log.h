@@ -20,27 +20,184 @@
 #pragma once
 
 #include <stdarg.h>
+#include <atomic>
+#include <functional>
 #include <mutex>
 
 #include <Arduino.h>
 
 #include "ringbuffer.h"
 #include "malloc_tools.h"
+#include "persistent_log.h"
 
 #include "bindings/macros.h"
 
+// Build with -DEVENT_LOG_STRUCTURED=1 to store binary records (timestamp, level, module, format string and packed arguments)
+// instead of text. Records are only formatted when the log is read, which is cheaper for the logging task
+// and fits several times more messages into event_buf. The esp32 and esp32_ethernet environments enable it.
+#ifndef EVENT_LOG_STRUCTURED
+#define EVENT_LOG_STRUCTURED 0
+#endif
+
+// Maximum size of the packed arguments of a structured record.
+// Longer string arguments are truncated.
+#define EVENT_LOG_MAX_ARGS_LEN 160
+
+// The log is mirrored to this flash partition if the partition table has it.
+// OTA updates keep the old partition table, so devices only get the partition by flashing
+// the merged firmware image. Without it, the persistent log is disabled.
+#define PERSISTENT_LOG_PARTITION_LABEL "eventlog"
+// Text is collected and written to flash in batches of this size,
+// or after PERSISTENT_LOG_FLUSH_INTERVAL_MS if less was logged.
+#define PERSISTENT_LOG_BATCH_SIZE 512
+#define PERSISTENT_LOG_FLUSH_INTERVAL_MS 1000
+
+enum class EventLogLevel : uint8_t {
+    DEBUG,
+    INFO,
+    WARNING,
+    ERROR
+};
+
+// A module whose log level can be set via the event_log/config API.
+// Define one per module with static storage duration, for example
+// static EventLogModule log_module{"charge_manager"};
+// The level only applies to messages logged with printfln_at or LOG_RATE_LIMITED and the module.
+// printfln ignores it, so a module should log all of its messages with printfln_at.
+// event_log/modules lists the modules that define one.
+class EventLogModule {
+public:
+    EventLogModule(const char *name, EventLogLevel default_level = EventLogLevel::DEBUG);
+
+    // Has to be a string literal, as only the pointer is stored in the structured mode.
+    const char *name;
+    EventLogLevel default_level;
+    // Messages below this level are dropped before they are formatted.
+    EventLogLevel level;
+
+    // All modules, linked when they are constructed.
+    static EventLogModule *first;
+    EventLogModule *next;
+};
+
+#define EVENT_LOG_RATE_LIMIT_BURST 3
+#define EVENT_LOG_RATE_LIMIT_INTERVAL_MS 10000
+
+// Token bucket of a call site that can log at a high rate.
+// Up to burst messages are logged at once. Afterwards one message per refill_interval_ms is let through.
+// The number of suppressed messages is logged when the next message is let through
+// or at the latest refill_interval_ms after the last suppressed message.
+struct EventLogRateLimit {
+    EventLogRateLimit(uint8_t burst = EVENT_LOG_RATE_LIMIT_BURST, uint32_t refill_interval_ms = EVENT_LOG_RATE_LIMIT_INTERVAL_MS) :
+        burst(burst), refill_interval_ms(refill_interval_ms), tokens(burst) {}
+
+    uint8_t burst;
+    uint32_t refill_interval_ms;
+
+    uint8_t tokens;
+    uint32_t last_refill_ms = 0;
+    uint32_t last_suppressed_ms = 0;
+    uint32_t suppressed = 0;
+
+    // Used for the summary of suppressed messages.
+    const char *fmt = nullptr;
+    EventLogModule *module = nullptr;
+    EventLogLevel level = EventLogLevel::DEBUG;
+
+    // Rate limits that suppressed a message, linked when that happens the first time.
+    bool linked = false;
+    EventLogRateLimit *next = nullptr;
+};
+
+// Logs from this call site with the default token bucket. Messages over the limit are not formatted.
+// Requires extern EventLog logger; like all other logging.
+#define LOG_RATE_LIMITED(module, level, fmt, ...) \
+    do { \
+        static EventLogRateLimit _event_log_rate_limit; \
+        logger.printfln_limited(&_event_log_rate_limit, (level), (module), fmt, ##__VA_ARGS__); \
+    } while (0)
+
 class EventLog {
 public:
     std::mutex event_buf_mutex;
     TF_Ringbuffer<char, 10000, uint32_t, malloc_32bit_addressed, heap_caps_free> event_buf;
 
+    // Mounts the persistent log and starts the task that drains the event buffer
+    // to the serial console and the persistent log.
+    void setup();
+
     void write(const char *buf, size_t len);
 
     void printfln(const char *fmt, ...) __attribute__((__format__(__printf__, 2, 3)));
 
+    // Drops the message if level is below the module's level. module may be nullptr.
+    void printfln_at(EventLogLevel level, EventLogModule *module, const char *fmt, ...) __attribute__((__format__(__printf__, 4, 5)));
+
+    void vprintfln_at(EventLogLevel level, EventLogModule *module, const char *fmt, va_list args);
+
+    // Like printfln_at, but drops the message if limit has no token left. See LOG_RATE_LIMITED.
+    void printfln_limited(EventLogRateLimit *limit, EventLogLevel level, EventLogModule *module, const char *fmt, ...) __attribute__((__format__(__printf__, 5, 6)));
+
     void drop(size_t count);
 
+    // Returns the absolute positions of the oldest entry in event_buf and of the end of the log.
+    // Either pointer may be nullptr.
+    void get_bounds(uint32_t *oldest, uint32_t *end);
+
+    // Passes all entries from *pos up to end formatted to out and advances *pos.
+    // event_buf_mutex is only held while copying a single entry, not while calling out.
+    // Returns the number of chars that were dropped from event_buf before they could be read.
+    uint32_t read_range(uint32_t *pos, uint32_t end, EventLogLevel min_level, const std::function<void(const char *, size_t)> &out);
+
+    // Writes everything that is not in the persistent log yet to flash.
+    // Called before a restart, so that the log survives it.
+    void flush_persistent_log();
+
     void register_urls();
 
     bool sending_response = false;
+
+    // Absolute number of chars ever written into event_buf.
+    // The oldest char in event_buf is at total_written - event_buf.used().
+    uint32_t total_written = 0;
+
+    // Chars that were overwritten in event_buf before they could be printed on the serial console.
+    // Written by the serial drain task, reported in /debug_report.
+    std::atomic<uint32_t> serial_chars_dropped{0};
+
+    PersistentLog persistent_log;
+
+private:
+    static void serial_drain_task(void *arg);
+    void drain_to_serial();
+
+    void log_suppressed(EventLogRateLimit *limit, uint32_t suppressed);
+    void flush_rate_limits();
+    void apply_levels();
+
+    std::mutex rate_limit_mutex;
+    EventLogRateLimit *first_rate_limit = nullptr;
+
+    // Copies new entries into flash_batch and writes full batches to the persistent log.
+    // A partial batch is only written if force is set. Returns true if a partial batch is pending.
+    bool drain_to_flash(bool force);
+
+    // Passes the entry at the absolute position *pos formatted to out and advances *pos to the next entry.
+    // In text mode, an entry is a chunk of text. Structured entries below min_level are skipped.
+    // If *pos was already dropped from event_buf, it is moved to the oldest entry and *dropped is increased.
+    // Returns false if there is no entry between *pos and end.
+    bool read_entry(uint32_t *pos, uint32_t end, uint32_t *dropped, EventLogLevel min_level, const std::function<void(const char *, size_t)> &out);
+
+#if EVENT_LOG_STRUCTURED
+    void write_record(EventLogLevel level, const char *module, const char *fmt, const uint8_t *payload, size_t payload_len, uint8_t flags);
+#endif
+
+    TaskHandle_t serial_task = nullptr;
+    uint32_t serial_written = 0;
+
+    std::mutex flash_mutex;
+    char *flash_batch = nullptr;
+    size_t flash_batch_used = 0;
+    uint32_t flash_written = 0;
+    uint32_t last_flash_flush = 0;
 };
@@ -0,0 +1,409 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#include "event_log_format.h"
+
+#include <stdio.h>
+#include <string.h>
+
+enum class ArgType {
+    NONE,
+    INT32,
+    INT64,
+    UINT32,
+    UINT64,
+    DOUBLE,
+    POINTER,
+    STRING
+};
+
+struct FormatSpec {
+    // Points to the '%'
+    const char *start;
+    size_t len;
+    int stars;
+    ArgType type;
+    // The spec without length modifiers, f.e. "%-5" for "%-5lld". The conversion is added when formatting.
+    size_t prefix_len;
+    // Number of 'h' length modifiers. Those narrow the value when formatting, so they are kept.
+    int shorts;
+    char conversion;
+};
+
+// Parses the conversion specification starting at fmt (which points to a '%').
+// Returns false for unsupported or malformed specifications.
+static bool parse_spec(const char *fmt, FormatSpec *spec)
+{
+    const char *p = fmt + 1;
+
+    spec->start = fmt;
+    spec->stars = 0;
+
+    while (*p != '\0' && strchr("-+ #0", *p) != nullptr)
+        ++p;
+
+    if (*p == '*') {
+        ++spec->stars;
+        ++p;
+    } else {
+        while (*p >= '0' && *p <= '9')
+            ++p;
+    }
+
+    if (*p == '.') {
+        ++p;
+        if (*p == '*') {
+            ++spec->stars;
+            ++p;
+        } else {
+            while (*p >= '0' && *p <= '9')
+                ++p;
+        }
+    }
+
+    spec->prefix_len = p - fmt;
+
+    int longs = 0;
+    spec->shorts = 0;
+    bool size_t_like = false;
+    bool long_double = false;
+
+    while (*p != '\0' && strchr("hlzjtL", *p) != nullptr) {
+        if (*p == 'l')
+            ++longs;
+        else if (*p == 'h')
+            ++spec->shorts;
+        else if (*p == 'z' || *p == 'j' || *p == 't')
+            size_t_like = true;
+        else if (*p == 'L')
+            long_double = true;
+        ++p;
+    }
+
+    spec->conversion = *p;
+
+    switch (*p) {
+        case 'd':
+        case 'i':
+            spec->type = (longs > 0 || size_t_like) ? ArgType::INT64 : ArgType::INT32;
+            break;
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+            spec->type = (longs > 0 || size_t_like) ? ArgType::UINT64 : ArgType::UINT32;
+            break;
+        case 'c':
+            spec->type = ArgType::INT32;
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            // long double arguments are not supported.
+            if (long_double)
+                return false;
+            spec->type = ArgType::DOUBLE;
+            break;
+        case 'p':
+            spec->type = ArgType::POINTER;
+            break;
+        case 's':
+            spec->type = ArgType::STRING;
+            break;
+        case '%':
+            spec->type = ArgType::NONE;
+            break;
+        default:
+            return false;
+    }
+
+    spec->len = p + 1 - fmt;
+    return true;
+}
+
+// Returns the number of chars before the next conversion specification.
+static size_t literal_len(const char *fmt)
+{
+    const char *p = strchr(fmt, '%');
+    return p == nullptr ? strlen(fmt) : p - fmt;
+}
+
+template<typename T>
+static bool pack_value(uint8_t *buf, size_t buf_len, size_t *used, T val)
+{
+    if (buf_len - *used < sizeof(T))
+        return false;
+
+    memcpy(buf + *used, &val, sizeof(T));
+    *used += sizeof(T);
+    return true;
+}
+
+size_t pack_log_args(uint8_t *buf, size_t buf_len, const char *fmt, va_list args, bool *truncated)
+{
+    size_t used = 0;
+    *truncated = false;
+
+    const char *p = fmt;
+    while (*p != '\0') {
+        p += literal_len(p);
+        if (*p == '\0')
+            break;
+
+        FormatSpec spec;
+        if (!parse_spec(p, &spec))
+            break;
+
+        p += spec.len;
+
+        bool ok = true;
+        for (int i = 0; i < spec.stars; ++i)
+            ok &= pack_value<int32_t>(buf, buf_len, &used, va_arg(args, int));
+
+        // Length modifiers were already folded into spec.type. Read the argument with the type
+        // the caller passed it with, but store it with a fixed width.
+        bool is_long_long = false;
+        bool is_size_t = false;
+        for (const char *c = spec.start + spec.prefix_len; c < spec.start + spec.len - 1; ++c) {
+            if (*c == 'l' && c[1] == 'l')
+                is_long_long = true;
+            if (*c == 'z' || *c == 'j' || *c == 't')
+                is_size_t = true;
+        }
+
+        switch (spec.type) {
+            case ArgType::NONE:
+                break;
+            case ArgType::INT32:
+                ok &= pack_value<int32_t>(buf, buf_len, &used, va_arg(args, int));
+                break;
+            case ArgType::UINT32:
+                ok &= pack_value<uint32_t>(buf, buf_len, &used, va_arg(args, unsigned int));
+                break;
+            case ArgType::INT64:
+                if (is_long_long)
+                    ok &= pack_value<int64_t>(buf, buf_len, &used, va_arg(args, long long));
+                else if (is_size_t)
+                    ok &= pack_value<int64_t>(buf, buf_len, &used, (int64_t)va_arg(args, ptrdiff_t));
+                else
+                    ok &= pack_value<int64_t>(buf, buf_len, &used, va_arg(args, long));
+                break;
+            case ArgType::UINT64:
+                if (is_long_long)
+                    ok &= pack_value<uint64_t>(buf, buf_len, &used, va_arg(args, unsigned long long));
+                else if (is_size_t)
+                    ok &= pack_value<uint64_t>(buf, buf_len, &used, (uint64_t)va_arg(args, size_t));
+                else
+                    ok &= pack_value<uint64_t>(buf, buf_len, &used, va_arg(args, unsigned long));
+                break;
+            case ArgType::DOUBLE:
+                ok &= pack_value<double>(buf, buf_len, &used, va_arg(args, double));
+                break;
+            case ArgType::POINTER:
+                ok &= pack_value<uintptr_t>(buf, buf_len, &used, (uintptr_t)va_arg(args, void *));
+                break;
+            case ArgType::STRING: {
+                const char *s = va_arg(args, const char *);
+                if (s == nullptr)
+                    s = "(null)";
+
+                size_t s_len = strlen(s);
+                if (buf_len - used < sizeof(uint16_t)) {
+                    ok = false;
+                    break;
+                }
+
+                size_t space = buf_len - used - sizeof(uint16_t);
+                if (s_len > space) {
+                    s_len = space;
+                    *truncated = true;
+                }
+
+                pack_value<uint16_t>(buf, buf_len, &used, (uint16_t)s_len);
+                memcpy(buf + used, s, s_len);
+                used += s_len;
+                break;
+            }
+        }
+
+        if (!ok) {
+            *truncated = true;
+            break;
+        }
+    }
+
+    return used;
+}
+
+template<typename T>
+static bool unpack_value(const uint8_t *args, size_t args_len, size_t *offset, T *val)
+{
+    if (args_len - *offset < sizeof(T))
+        return false;
+
+    memcpy(val, args + *offset, sizeof(T));
+    *offset += sizeof(T);
+    return true;
+}
+
+template<typename T>
+static int format_value(char *buf, size_t buf_len, const char *fmt, int stars, const int32_t *star_vals, T val)
+{
+    switch (stars) {
+        case 0:
+            return snprintf(buf, buf_len, fmt, val);
+        case 1:
+            return snprintf(buf, buf_len, fmt, star_vals[0], val);
+        default:
+            return snprintf(buf, buf_len, fmt, star_vals[0], star_vals[1], val);
+    }
+}
+
+void format_log_args(const char *fmt, const uint8_t *args, size_t args_len, const std::function<void(const char *, size_t)> &out)
+{
+    // Large enough for any number, as long as the field width is sane.
+    char piece[64];
+    // The spec without length modifiers, plus "ll", the conversion and the NUL terminator.
+    char spec_fmt[32];
+    size_t offset = 0;
+
+    const char *p = fmt;
+    while (*p != '\0') {
+        size_t lit = literal_len(p);
+        if (lit > 0)
+            out(p, lit);
+        p += lit;
+
+        if (*p == '\0')
+            break;
+
+        FormatSpec spec;
+        if (!parse_spec(p, &spec) || spec.prefix_len + 4 > sizeof(spec_fmt)) {
+            // Print the rest of the format string verbatim: we don't know which arguments it references.
+            out(p, strlen(p));
+            return;
+        }
+
+        p += spec.len;
+
+        if (spec.type == ArgType::NONE) {
+            out("%", 1);
+            continue;
+        }
+
+        int32_t star_vals[2] = {0, 0};
+        bool ok = true;
+        for (int i = 0; i < spec.stars; ++i)
+            ok &= unpack_value(args, args_len, &offset, &star_vals[i]);
+
+        memcpy(spec_fmt, spec.start, spec.prefix_len);
+        size_t spec_fmt_len = spec.prefix_len;
+        if (spec.type == ArgType::INT64 || spec.type == ArgType::UINT64) {
+            spec_fmt[spec_fmt_len++] = 'l';
+            spec_fmt[spec_fmt_len++] = 'l';
+        } else if (spec.type == ArgType::INT32 || spec.type == ArgType::UINT32) {
+            for (int i = 0; i < spec.shorts && i < 2; ++i)
+                spec_fmt[spec_fmt_len++] = 'h';
+        }
+        spec_fmt[spec_fmt_len++] = spec.conversion;
+        spec_fmt[spec_fmt_len] = '\0';
+
+        int written = -1;
+
+        switch (spec.type) {
+            case ArgType::NONE:
+                break;
+            case ArgType::INT32: {
+                int32_t v;
+                if ((ok &= unpack_value(args, args_len, &offset, &v)))
+                    written = format_value(piece, sizeof(piece), spec_fmt, spec.stars, star_vals, (int)v);
+                break;
+            }
+            case ArgType::UINT32: {
+                uint32_t v;
+                if ((ok &= unpack_value(args, args_len, &offset, &v)))
+                    written = format_value(piece, sizeof(piece), spec_fmt, spec.stars, star_vals, (unsigned int)v);
+                break;
+            }
+            case ArgType::INT64: {
+                int64_t v;
+                if ((ok &= unpack_value(args, args_len, &offset, &v)))
+                    written = format_value(piece, sizeof(piece), spec_fmt, spec.stars, star_vals, (long long)v);
+                break;
+            }
+            case ArgType::UINT64: {
+                uint64_t v;
+                if ((ok &= unpack_value(args, args_len, &offset, &v)))
+                    written = format_value(piece, sizeof(piece), spec_fmt, spec.stars, star_vals, (unsigned long long)v);
+                break;
+            }
+            case ArgType::DOUBLE: {
+                double v;
+                if ((ok &= unpack_value(args, args_len, &offset, &v)))
+                    written = format_value(piece, sizeof(piece), spec_fmt, spec.stars, star_vals, v);
+                break;
+            }
+            case ArgType::POINTER: {
+                uintptr_t v;
+                if ((ok &= unpack_value(args, args_len, &offset, &v)))
+                    written = format_value(piece, sizeof(piece), spec_fmt, spec.stars, star_vals, (void *)v);
+                break;
+            }
+            case ArgType::STRING: {
+                uint16_t s_len;
+                if (!(ok &= unpack_value(args, args_len, &offset, &s_len)) || args_len - offset < s_len) {
+                    ok = false;
+                    break;
+                }
+
+                const char *s = (const char *)(args + offset);
+                offset += s_len;
+
+                // Plain %s is the common case. Don't copy the string for it.
+                if (spec.prefix_len == 1) {
+                    out(s, s_len);
+                    break;
+                }
+
+                // Width and precision only make sense for short strings. Format them piecewise otherwise.
+                char str_buf[sizeof(piece)];
+                size_t to_copy = s_len < sizeof(str_buf) - 1 ? s_len : sizeof(str_buf) - 1;
+                memcpy(str_buf, s, to_copy);
+                str_buf[to_copy] = '\0';
+                written = format_value(piece, sizeof(piece), spec_fmt, spec.stars, star_vals, (const char *)str_buf);
+                break;
+            }
+        }
+
+        if (!ok) {
+            // The arguments were truncated when logging.
+            out("[...]", 5);
+            return;
+        }
+
+        if (written > 0)
+            out(piece, (size_t)written < sizeof(piece) ? written : sizeof(piece) - 1);
+    }
+}
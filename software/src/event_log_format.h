@@ -0,0 +1,44 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#pragma once
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+
+// Deferred formatting for the structured event log:
+// Instead of formatting a message when it is logged, only the arguments
+// referenced by the format string are packed into a compact binary form.
+// The message is formatted when the log is read.
+// The format string itself is not copied, so it must be a string literal.
+
+// Packs the arguments referenced by fmt into buf.
+// Strings are copied, all other arguments are stored by value.
+// Returns the number of bytes used. If buf is too small, strings are truncated
+// and arguments that don't fit are dropped; *truncated is set in this case.
+size_t pack_log_args(uint8_t *buf, size_t buf_len, const char *fmt, va_list args, bool *truncated);
+
+// Formats fmt with the arguments that were packed by pack_log_args.
+// out is called for every piece of the formatted message, so that
+// the message length is not limited by an intermediate buffer.
+void format_log_args(const char *fmt, const uint8_t *args, size_t args_len, const std::function<void(const char *, size_t)> &out);
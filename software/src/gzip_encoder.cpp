@@ -0,0 +1,277 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "gzip_encoder.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define NIL 0xFFFF
+
+static_assert(2 * (1 << GZIP_ENCODER_WINDOW_BITS) < NIL, "GzipEncoder: Window positions must fit into uint16_t");
+static_assert((1 << GZIP_ENCODER_WINDOW_BITS) >= 2 * MAX_MATCH, "GzipEncoder: Window too small");
+
+// CRC-32 (IEEE 802.3) with a nibble table: 64 bytes instead of the 1 KiB of a byte table.
+static const uint32_t crc_table[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+};
+
+static uint32_t update_crc(uint32_t crc, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        crc = (crc >> 4) ^ crc_table[(crc ^ data[i]) & 0x0F];
+        crc = (crc >> 4) ^ crc_table[(crc ^ (data[i] >> 4)) & 0x0F];
+    }
+    return crc;
+}
+
+static const uint8_t reversed_nibbles[16] = {0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE, 0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF};
+
+// Huffman codes are packed starting with their most significant bit, all other values with their least significant bit.
+static uint32_t reverse_bits(uint32_t value, uint32_t bit_count)
+{
+    uint32_t reversed = (reversed_nibbles[value & 0x0F] << 8) | (reversed_nibbles[(value >> 4) & 0x0F] << 4) | reversed_nibbles[(value >> 8) & 0x0F];
+    return reversed >> (12 - bit_count);
+}
+
+static uint32_t highest_bit(uint32_t value)
+{
+    return 31 - __builtin_clz(value);
+}
+
+static uint32_t hash3(const uint8_t *p)
+{
+    uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+    return (v * 2654435761u) >> (32 - GZIP_ENCODER_HASH_BITS);
+}
+
+GzipEncoder::GzipEncoder(std::function<void(const uint8_t *, size_t)> &&output) : output(std::move(output))
+{
+    memset(head, 0xFF, sizeof(head));
+
+    // ID1, ID2, CM = deflate, FLG, MTIME (4 bytes), XFL, OS = unknown
+    static const uint8_t header[] = {0x1F, 0x8B, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF};
+    for (uint8_t b : header)
+        put_byte(b);
+
+    // BFINAL = 0, BTYPE = 01 (fixed Huffman codes). All data goes into this block.
+    put_bits(0b010, 3);
+}
+
+void GzipEncoder::write(const uint8_t *data, size_t len)
+{
+    crc = update_crc(crc, data, len);
+    input_size += len;
+
+    while (len > 0) {
+        if (window_end == 2 * WINDOW_SIZE)
+            slide();
+
+        size_t to_copy = std::min(len, 2 * WINDOW_SIZE - window_end);
+        memcpy(window + window_end, data, to_copy);
+        window_end += to_copy;
+        data += to_copy;
+        len -= to_copy;
+
+        compress(false);
+    }
+}
+
+void GzipEncoder::finish()
+{
+    compress(true);
+
+    // End of block, then an empty final block.
+    put_bits(0, 7);
+    put_bits(0b011, 3);
+    put_bits(0, 7);
+
+    if (bit_count > 0)
+        put_bits(0, 8 - bit_count);
+
+    uint32_t trailer[2] = {crc ^ 0xFFFFFFFF, input_size};
+    for (uint32_t value : trailer)
+        for (size_t i = 0; i < 4; ++i)
+            put_byte(value >> (8 * i));
+
+    flush_output();
+}
+
+void GzipEncoder::compress(bool flush)
+{
+    // Keep a full match of lookahead unless this is the end of the input, so that matches are not cut short.
+    while (window_end - pos > (flush ? 0 : MAX_MATCH)) {
+        size_t distance = 0;
+        size_t length = longest_match(pos, &distance);
+
+        if (length >= MIN_MATCH) {
+            put_match(length, distance);
+            for (size_t i = 0; i < length; ++i)
+                insert(pos + i);
+            pos += length;
+        } else {
+            put_literal(window[pos]);
+            insert(pos);
+            ++pos;
+        }
+    }
+}
+
+void GzipEncoder::slide()
+{
+    // compress left at most MAX_MATCH bytes of lookahead, so pos is in the upper half.
+    memmove(window, window + WINDOW_SIZE, WINDOW_SIZE);
+    pos -= WINDOW_SIZE;
+    window_end -= WINDOW_SIZE;
+
+    for (uint16_t &p : head)
+        p = (p != NIL && p >= WINDOW_SIZE) ? p - WINDOW_SIZE : NIL;
+
+    for (uint16_t &p : prev)
+        p = (p != NIL && p >= WINDOW_SIZE) ? p - WINDOW_SIZE : NIL;
+}
+
+void GzipEncoder::insert(size_t p)
+{
+    if (window_end - p < MIN_MATCH)
+        return;
+
+    uint32_t h = hash3(window + p);
+    prev[p & (WINDOW_SIZE - 1)] = head[h];
+    head[h] = p;
+}
+
+size_t GzipEncoder::longest_match(size_t p, size_t *distance)
+{
+    size_t max_length = std::min((size_t)MAX_MATCH, window_end - p);
+    if (max_length < MIN_MATCH)
+        return 0;
+
+    const uint8_t *current = window + p;
+    size_t best_length = MIN_MATCH - 1;
+    size_t candidate = head[hash3(current)];
+
+    for (size_t chain = 0; chain < GZIP_ENCODER_MAX_CHAIN; ++chain) {
+        // Also stops at NIL. prev entries older than the window have been overwritten by newer positions.
+        if (candidate >= p || p - candidate >= WINDOW_SIZE)
+            break;
+
+        const uint8_t *match = window + candidate;
+        if (match[best_length] == current[best_length] && match[0] == current[0] && match[1] == current[1]) {
+            size_t length = 2;
+            while (length < max_length && match[length] == current[length])
+                ++length;
+
+            if (length > best_length) {
+                best_length = length;
+                *distance = p - candidate;
+                if (length == max_length)
+                    break;
+            }
+        }
+
+        size_t next = prev[candidate & (WINDOW_SIZE - 1)];
+        if (next >= candidate)
+            break;
+        candidate = next;
+    }
+
+    return best_length >= MIN_MATCH ? best_length : 0;
+}
+
+void GzipEncoder::put_bits(uint32_t value, uint32_t count)
+{
+    bit_buf |= value << bit_count;
+    bit_count += count;
+
+    while (bit_count >= 8) {
+        put_byte(bit_buf & 0xFF);
+        bit_buf >>= 8;
+        bit_count -= 8;
+    }
+}
+
+void GzipEncoder::put_literal(uint8_t literal)
+{
+    if (literal < 144)
+        put_bits(reverse_bits(0x30 + literal, 8), 8);
+    else
+        put_bits(reverse_bits(0x190 + literal - 144, 9), 9);
+}
+
+void GzipEncoder::put_match(size_t length, size_t distance)
+{
+    // Length codes 257 to 285: 3 to 10 have their own code, then four codes per power of two.
+    uint32_t l = length - MIN_MATCH;
+    uint32_t code, extra_bits = 0;
+    if (length == MAX_MATCH) {
+        code = 28;
+    } else if (l < 8) {
+        code = l;
+    } else {
+        uint32_t n = highest_bit(l);
+        code = 4 * (n - 1) + ((l >> (n - 2)) & 3);
+        extra_bits = n - 2;
+    }
+
+    uint32_t symbol = 257 + code;
+    if (symbol < 280)
+        put_bits(reverse_bits(symbol - 256, 7), 7);
+    else
+        put_bits(reverse_bits(0xC0 + symbol - 280, 8), 8);
+
+    if (extra_bits > 0)
+        put_bits(l & ((1 << extra_bits) - 1), extra_bits);
+
+    // Distance codes 0 to 29: 1 to 4 have their own code, then two codes per power of two.
+    uint32_t d = distance - 1;
+    extra_bits = 0;
+    if (d < 4) {
+        code = d;
+    } else {
+        uint32_t n = highest_bit(d);
+        code = 2 * n + ((d >> (n - 1)) & 1);
+        extra_bits = n - 1;
+    }
+
+    put_bits(reverse_bits(code, 5), 5);
+
+    if (extra_bits > 0)
+        put_bits(d & ((1 << extra_bits) - 1), extra_bits);
+}
+
+void GzipEncoder::put_byte(uint8_t b)
+{
+    out_buf[out_used++] = b;
+    if (out_used == sizeof(out_buf))
+        flush_output();
+}
+
+void GzipEncoder::flush_output()
+{
+    if (out_used == 0)
+        return;
+
+    output(out_buf, out_used);
+    out_used = 0;
+}
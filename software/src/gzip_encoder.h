@@ -0,0 +1,90 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+
+// Streaming gzip (RFC 1952) encoder for dynamic HTTP responses.
+//
+// Uses LZ77 with a small window and the fixed Huffman codes of deflate (RFC 1951, block type 1).
+// The fixed codes don't need a second pass over the data or per-block code tables, so the
+// whole state fits into about 11 KiB. Dynamic responses are JSON or log text with many
+// repeated keys and phrases: Most of the gain comes from the matches anyway.
+//
+// This file does not depend on the ESP-IDF.
+
+// The window has to hold at least two maximum length matches.
+#define GZIP_ENCODER_WINDOW_BITS 11
+#define GZIP_ENCODER_HASH_BITS 10
+// Maximum number of candidates checked per position. Trades speed for compression ratio.
+#define GZIP_ENCODER_MAX_CHAIN 8
+#define GZIP_ENCODER_OUT_BUF_SIZE 1024
+
+class GzipEncoder {
+public:
+    // output is called with up to GZIP_ENCODER_OUT_BUF_SIZE bytes of compressed data at a time.
+    GzipEncoder(std::function<void(const uint8_t *, size_t)> &&output);
+
+    GzipEncoder(const GzipEncoder &) = delete;
+    GzipEncoder &operator=(const GzipEncoder &) = delete;
+
+    void write(const uint8_t *data, size_t len);
+
+    // Compresses the remaining input and writes the gzip trailer. write must not be called afterwards.
+    void finish();
+
+private:
+    static const size_t WINDOW_SIZE = 1 << GZIP_ENCODER_WINDOW_BITS;
+    static const size_t HASH_SIZE = 1 << GZIP_ENCODER_HASH_BITS;
+
+    void compress(bool flush);
+    void slide();
+    void insert(size_t pos);
+    size_t longest_match(size_t pos, size_t *distance);
+
+    void put_bits(uint32_t value, uint32_t count);
+    void put_literal(uint8_t literal);
+    void put_match(size_t length, size_t distance);
+    void put_byte(uint8_t b);
+    void flush_output();
+
+    std::function<void(const uint8_t *, size_t)> output;
+
+    uint8_t window[2 * WINDOW_SIZE];
+    // Position of the next byte to compress and end of the input in window.
+    size_t pos = 0;
+    size_t window_end = 0;
+
+    // Most recent position of each hash and the previous position with the same hash.
+    uint16_t head[HASH_SIZE];
+    uint16_t prev[WINDOW_SIZE];
+
+    uint32_t bit_buf = 0;
+    uint32_t bit_count = 0;
+
+    uint8_t out_buf[GZIP_ENCODER_OUT_BUF_SIZE];
+    size_t out_used = 0;
+
+    uint32_t crc = 0xFFFFFFFF;
+    uint32_t input_size = 0;
+};
@@ -0,0 +1,181 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "persistent_log.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#define SEGMENT_MAGIC 0x474F4C54 // "TLOG"
+#define READ_CHUNK_SIZE 256
+
+bool PersistentLog::read_header(size_t segment, SegmentHeader *header)
+{
+    return flash->read(segment * PERSISTENT_LOG_SEGMENT_SIZE, header, sizeof(*header)) && header->magic == SEGMENT_MAGIC;
+}
+
+bool PersistentLog::start_segment(size_t new_segment)
+{
+    size_t offset = new_segment * PERSISTENT_LOG_SEGMENT_SIZE;
+
+    if (!flash->erase_segment(offset))
+        return false;
+
+    SegmentHeader header;
+    header.magic = SEGMENT_MAGIC;
+    header.seq = seq + 1;
+    header.boot_id = boot_id;
+
+    // Write the magic number last: A segment whose header write was interrupted is ignored.
+    if (!flash->write(offset + sizeof(header.magic), &header.seq, sizeof(header) - sizeof(header.magic)))
+        return false;
+    if (!flash->write(offset, &header.magic, sizeof(header.magic)))
+        return false;
+
+    seq = header.seq;
+    segment = new_segment;
+    write_offset = sizeof(header);
+    return true;
+}
+
+bool PersistentLog::mount(PersistentLogFlash *new_flash)
+{
+    std::lock_guard<std::mutex> lock{mutex};
+
+    flash = new_flash;
+    segment_count = flash->size() / PERSISTENT_LOG_SEGMENT_SIZE;
+
+    if (segment_count < 2) {
+        flash = nullptr;
+        return false;
+    }
+
+    bool found = false;
+    size_t newest = 0;
+    SegmentHeader newest_header;
+
+    for (size_t i = 0; i < segment_count; ++i) {
+        SegmentHeader header;
+        if (!read_header(i, &header))
+            continue;
+
+        if (!found || (int32_t)(header.seq - newest_header.seq) > 0) {
+            found = true;
+            newest = i;
+            newest_header = header;
+        }
+    }
+
+    if (found) {
+        seq = newest_header.seq;
+        boot_id = newest_header.boot_id + 1;
+    } else {
+        seq = 0;
+        boot_id = 1;
+    }
+
+    if (!start_segment(found ? (newest + 1) % segment_count : 0)) {
+        flash = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+bool PersistentLog::append(const char *buf, size_t len)
+{
+    std::lock_guard<std::mutex> lock{mutex};
+
+    if (flash == nullptr)
+        return false;
+
+    while (len > 0) {
+        if (write_offset == PERSISTENT_LOG_SEGMENT_SIZE && !start_segment((segment + 1) % segment_count))
+            return false;
+
+        size_t to_write = std::min(len, (size_t)PERSISTENT_LOG_SEGMENT_SIZE - write_offset);
+        if (!flash->write(segment * PERSISTENT_LOG_SEGMENT_SIZE + write_offset, buf, to_write))
+            return false;
+
+        write_offset += to_write;
+        buf += to_write;
+        len -= to_write;
+    }
+
+    return true;
+}
+
+void PersistentLog::read_boot(uint32_t read_boot_id, const std::function<void(const char *, size_t)> &out)
+{
+    std::vector<std::pair<uint32_t, size_t>> segments;
+
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+
+        if (flash == nullptr)
+            return;
+
+        for (size_t i = 0; i < segment_count; ++i) {
+            SegmentHeader header;
+            if (read_header(i, &header) && header.boot_id == read_boot_id)
+                segments.emplace_back(header.seq, i);
+        }
+    }
+
+    std::sort(segments.begin(), segments.end(), [](const std::pair<uint32_t, size_t> &a, const std::pair<uint32_t, size_t> &b) {
+        return (int32_t)(a.first - b.first) < 0;
+    });
+
+    char chunk[READ_CHUNK_SIZE];
+
+    for (const auto &s : segments) {
+        size_t offset = sizeof(SegmentHeader);
+
+        while (offset < PERSISTENT_LOG_SEGMENT_SIZE) {
+            size_t len = std::min((size_t)READ_CHUNK_SIZE, (size_t)PERSISTENT_LOG_SEGMENT_SIZE - offset);
+
+            {
+                std::lock_guard<std::mutex> lock{mutex};
+
+                // The segment could have been reused by the current boot since the scan.
+                SegmentHeader header;
+                if (!read_header(s.second, &header) || header.seq != s.first)
+                    break;
+
+                if (!flash->read(s.second * PERSISTENT_LOG_SEGMENT_SIZE + offset, chunk, len))
+                    break;
+            }
+
+            // Unwritten flash marks the end of the segment's data.
+            const char *end = (const char *)memchr(chunk, 0xFF, len);
+            if (end != nullptr)
+                len = end - chunk;
+
+            if (len > 0)
+                out(chunk, len);
+
+            if (end != nullptr)
+                break;
+
+            offset += len;
+        }
+    }
+}
@@ -0,0 +1,99 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <mutex>
+
+// Append-only log store on a dedicated flash partition.
+//
+// The partition is split into segments of one flash sector. Each segment starts with a header
+// containing a sequence number and the boot it belongs to, followed by the appended text.
+// Unwritten flash reads as 0xFF, which never occurs in UTF-8 text, so the end of a segment's data
+// does not have to be stored. Segments are used round-robin: every sector is erased once per
+// lap through the partition, which spreads the wear evenly.
+//
+// Every boot starts with a fresh segment, so the log of the previous boot can be read back
+// as long as the current boot has not overwritten it.
+//
+// This file does not depend on the ESP-IDF. Flash access goes through PersistentLogFlash.
+
+#define PERSISTENT_LOG_SEGMENT_SIZE 4096
+
+// Flash access. Offsets are relative to the start of the log partition.
+class PersistentLogFlash {
+public:
+    virtual ~PersistentLogFlash() {}
+
+    virtual size_t size() = 0;
+    virtual bool read(size_t offset, void *buf, size_t len) = 0;
+    virtual bool write(size_t offset, const void *buf, size_t len) = 0;
+    // Erases the PERSISTENT_LOG_SEGMENT_SIZE bytes starting at offset.
+    virtual bool erase_segment(size_t offset) = 0;
+};
+
+class PersistentLog {
+public:
+    // Scans the segment headers and starts a new segment for this boot.
+    // Returns false if the flash is not usable; append and read_boot do nothing in this case.
+    bool mount(PersistentLogFlash *flash);
+
+    bool is_mounted() {
+        return flash != nullptr;
+    }
+
+    // Appends the text to the current segment, continuing in the next one if necessary.
+    // Returns false if a flash operation failed.
+    bool append(const char *buf, size_t len);
+
+    // Passes the text logged during the given boot to out, oldest first.
+    void read_boot(uint32_t boot_id, const std::function<void(const char *, size_t)> &out);
+
+    uint32_t current_boot_id() {
+        return boot_id;
+    }
+
+    // 0 if there was no previous boot.
+    uint32_t previous_boot_id() {
+        return boot_id - 1;
+    }
+
+private:
+    struct SegmentHeader {
+        uint32_t magic;
+        uint32_t seq;
+        uint32_t boot_id;
+    };
+
+    bool read_header(size_t segment, SegmentHeader *header);
+    bool start_segment(size_t segment);
+
+    std::mutex mutex;
+    PersistentLogFlash *flash = nullptr;
+    size_t segment_count = 0;
+
+    uint32_t boot_id = 0;
+    uint32_t seq = 0;
+    size_t segment = 0;
+    size_t write_offset = 0;
+};
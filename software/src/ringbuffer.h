@@ -22,6 +22,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 #include <type_traits>
 
 template <typename T, size_t SIZE, typename AlignedT, void*(*malloc_fn)(size_t), void(*free_fn)(void*)>
@@ -80,7 +81,87 @@ public:
         AlignedT write_mask = bits << (buffer_offset * 8 * sizeof(T));
         AlignedT keep_mask = ~write_mask;
 
-        buffer[buffer_idx] = (buffer[buffer_idx] & keep_mask) | (((AlignedT)val) << (buffer_offset * 8 * sizeof(T)));
+        // Mask the value: Casting a negative T to AlignedT sign-extends it, which would overwrite the neighbouring items.
+        buffer[buffer_idx] = (buffer[buffer_idx] & keep_mask) | ((((AlignedT)val) & bits) << (buffer_offset * 8 * sizeof(T)));
+    }
+
+    // Writes count items to the consecutive indices [idx, idx + count).
+    // The buffer is only accessed in AlignedT-sized words, so that it can live in memory that only allows 32 bit accesses.
+    void write_aligned_n(size_t idx, const T *vals, size_t count)
+    {
+        if (sizeof(T) == sizeof(AlignedT)) {
+            for (size_t i = 0; i < count; ++i)
+                buffer[idx + i] = vals[i];
+            return;
+        }
+
+        size_t items_per_slot = sizeof(AlignedT) / sizeof(T);
+        AlignedT bits = (AlignedT(1) << (sizeof(T) * 8)) - 1;
+
+        // Leading items until idx is slot-aligned
+        while (count > 0 && idx % items_per_slot != 0) {
+            write_aligned(idx, *vals);
+            ++idx;
+            ++vals;
+            --count;
+        }
+
+        // Whole slots
+        while (count >= items_per_slot) {
+            AlignedT slot = 0;
+            for (size_t i = 0; i < items_per_slot; ++i)
+                slot |= (((AlignedT)vals[i]) & bits) << (i * 8 * sizeof(T));
+
+            buffer[idx / items_per_slot] = slot;
+            idx += items_per_slot;
+            vals += items_per_slot;
+            count -= items_per_slot;
+        }
+
+        // Trailing items
+        while (count > 0) {
+            write_aligned(idx, *vals);
+            ++idx;
+            ++vals;
+            --count;
+        }
+    }
+
+    // Reads count items from the consecutive indices [idx, idx + count).
+    void read_aligned_n(size_t idx, T *vals, size_t count)
+    {
+        if (sizeof(T) == sizeof(AlignedT)) {
+            for (size_t i = 0; i < count; ++i)
+                vals[i] = buffer[idx + i];
+            return;
+        }
+
+        size_t items_per_slot = sizeof(AlignedT) / sizeof(T);
+        AlignedT bits = (AlignedT(1) << (sizeof(T) * 8)) - 1;
+
+        while (count > 0 && idx % items_per_slot != 0) {
+            *vals = read_aligned(idx);
+            ++idx;
+            ++vals;
+            --count;
+        }
+
+        while (count >= items_per_slot) {
+            AlignedT slot = buffer[idx / items_per_slot];
+            for (size_t i = 0; i < items_per_slot; ++i)
+                vals[i] = (T)((slot >> (i * 8 * sizeof(T))) & bits);
+
+            idx += items_per_slot;
+            vals += items_per_slot;
+            count -= items_per_slot;
+        }
+
+        while (count > 0) {
+            *vals = read_aligned(idx);
+            ++idx;
+            ++vals;
+            --count;
+        }
     }
 
     T read_aligned(size_t idx)
@@ -114,6 +195,34 @@ public:
             }
         }
     }
+    // Pushes count items. If there is not enough space, the oldest items are overwritten.
+    void push_n(const T *vals, size_t count)
+    {
+        // Only the newest size() items can be stored.
+        if (count > size()) {
+            vals += count - size();
+            count = size();
+        }
+
+        size_t to_overwrite = count > free() ? count - free() : 0;
+
+        while (count > 0) {
+            size_t chunk = SIZE - end < count ? SIZE - end : count;
+            write_aligned_n(end, vals, chunk);
+            vals += chunk;
+            count -= chunk;
+            end += chunk;
+            if (end >= SIZE) {
+                end = 0;
+            }
+        }
+
+        start += to_overwrite;
+        if (start >= SIZE) {
+            start -= SIZE;
+        }
+    }
+
     bool pop(T *val)
     {
         // Silence Wmaybe-uninitialized in the _read_[type] functions.
@@ -132,6 +241,21 @@ public:
         return true;
     }
 
+    // Removes up to count of the oldest items. Returns the number of items removed.
+    size_t discard(size_t count)
+    {
+        if (count > used()) {
+            count = used();
+        }
+
+        start += count;
+        if (start >= SIZE) {
+            start -= SIZE;
+        }
+
+        return count;
+    }
+
     bool peek(T *val)
     {
         // Silence Wmaybe-uninitialized in the _read_[type] functions.
@@ -160,9 +284,213 @@ public:
         return true;
     }
 
+    // Copies up to count items, starting offset items after the oldest one.
+    // Returns the number of items copied.
+    size_t peek_n(T *vals, size_t offset, size_t count)
+    {
+        size_t available = used();
+        if (offset >= available) {
+            return 0;
+        }
+
+        if (count > available - offset) {
+            count = available - offset;
+        }
+
+        size_t idx = start + offset >= SIZE ? start + offset - SIZE : start + offset;
+        size_t copied = 0;
+
+        while (copied < count) {
+            size_t chunk = SIZE - idx < count - copied ? SIZE - idx : count - copied;
+            read_aligned_n(idx, vals + copied, chunk);
+            copied += chunk;
+            idx += chunk;
+            if (idx >= SIZE) {
+                idx = 0;
+            }
+        }
+
+        return copied;
+    }
+
     // index of first valid elemnt
     size_t start;
     // index of first invalid element
     size_t end;
     AlignedT *buffer;
 };
+
+// Ring buffer of CAPACITY items of any trivially copyable type, for example floats or structs.
+// All CAPACITY slots are usable. If CAPACITY is a power of two, indices are wrapped by masking.
+// Items whose size is a multiple of four bytes are copied word by word,
+// so the buffer can live in memory that only allows 32 bit accesses (see malloc_32bit_addressed).
+template <typename T, size_t CAPACITY, void*(*malloc_fn)(size_t), void(*free_fn)(void*)>
+class TF_GenericRingbuffer {
+    static_assert(std::is_trivially_copyable<T>::value, "TF_GenericRingbuffer: Item type must be trivially copyable");
+    static_assert(CAPACITY > 0, "TF_GenericRingbuffer: Capacity must not be zero");
+
+    static constexpr bool CAPACITY_IS_POW2 = (CAPACITY & (CAPACITY - 1)) == 0;
+    static constexpr bool COPY_WORDS = sizeof(T) % sizeof(uint32_t) == 0;
+
+public:
+    // A contiguous part of the buffer. See peek_spans.
+    struct Span {
+        const T *data;
+        size_t len;
+    };
+
+    TF_GenericRingbuffer() : start(0), count(0)
+    {
+        buffer = (T *)malloc_fn(sizeof(T) * CAPACITY);
+    }
+
+    void clear()
+    {
+        start = 0;
+        count = 0;
+    }
+
+    size_t size() {
+        return CAPACITY;
+    }
+
+    size_t used() {
+        return count;
+    }
+
+    size_t free() {
+        return CAPACITY - count;
+    }
+
+    // Appends val. If the buffer is full, the oldest item is overwritten.
+    void push(const T &val)
+    {
+        copy_items(buffer + wrap(start + count), &val, 1);
+
+        if (count == CAPACITY) {
+            start = wrap(start + 1);
+        } else {
+            ++count;
+        }
+    }
+
+    // Appends n items. If there is not enough space, the oldest items are overwritten.
+    void push_n(const T *vals, size_t n)
+    {
+        // Only the newest CAPACITY items can be stored.
+        if (n > CAPACITY) {
+            vals += n - CAPACITY;
+            n = CAPACITY;
+        }
+
+        size_t end = wrap(start + count);
+        size_t first = CAPACITY - end < n ? CAPACITY - end : n;
+        copy_items(buffer + end, vals, first);
+        copy_items(buffer, vals + first, n - first);
+
+        size_t to_overwrite = n > free() ? n - free() : 0;
+        start = wrap(start + to_overwrite);
+        count += n - to_overwrite;
+    }
+
+    bool pop(T *val)
+    {
+        if (count == 0)
+            return false;
+
+        copy_items(val, buffer + start, 1);
+        start = wrap(start + 1);
+        --count;
+        return true;
+    }
+
+    // Removes up to n of the oldest items. Returns the number of items removed.
+    size_t discard(size_t n)
+    {
+        if (n > count)
+            n = count;
+
+        start = wrap(start + n);
+        count -= n;
+        return n;
+    }
+
+    bool peek(T *val)
+    {
+        return peek_offset(val, 0);
+    }
+
+    // Copies the item offset items after the oldest one.
+    bool peek_offset(T *val, size_t offset)
+    {
+        if (offset >= count)
+            return false;
+
+        copy_items(val, buffer + wrap(start + offset), 1);
+        return true;
+    }
+
+    // Copies up to n items, starting offset items after the oldest one.
+    // Returns the number of items copied.
+    size_t peek_n(T *vals, size_t offset, size_t n)
+    {
+        Span spans[2];
+        n = peek_spans(offset, n, spans);
+
+        copy_items(vals, spans[0].data, spans[0].len);
+        copy_items(vals + spans[0].len, spans[1].data, spans[1].len);
+        return n;
+    }
+
+    // Returns up to n items, starting offset items after the oldest one, without copying them:
+    // spans[0] holds the older items, spans[1] the items after the wrap-around (if any).
+    // The spans are only valid until the buffer is modified. Returns the number of items in both spans.
+    size_t peek_spans(size_t offset, size_t n, Span spans[2])
+    {
+        if (offset >= count) {
+            n = 0;
+        } else if (n > count - offset) {
+            n = count - offset;
+        }
+
+        size_t idx = wrap(start + (offset < count ? offset : 0));
+        size_t first = CAPACITY - idx < n ? CAPACITY - idx : n;
+
+        spans[0] = {buffer + idx, first};
+        spans[1] = {buffer, n - first};
+        return n;
+    }
+
+private:
+    // idx must be less than 2 * CAPACITY.
+    static size_t wrap(size_t idx)
+    {
+        if (CAPACITY_IS_POW2)
+            return idx & (CAPACITY - 1);
+
+        return idx >= CAPACITY ? idx - CAPACITY : idx;
+    }
+
+    static void copy_items(T *dst, const T *src, size_t n)
+    {
+        if (n == 0)
+            return;
+
+        if (!COPY_WORDS) {
+            memcpy(dst, src, n * sizeof(T));
+            return;
+        }
+
+        typedef uint32_t __attribute__((__may_alias__)) word_t;
+        word_t *d = (word_t *)dst;
+        const word_t *s = (const word_t *)src;
+        for (size_t i = 0; i < n * sizeof(T) / sizeof(word_t); ++i)
+            d[i] = s[i];
+    }
+
+    // index of the oldest item
+    size_t start;
+    // number of items
+    size_t count;
+    T *buffer;
+};
@@ -0,0 +1,272 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "session_auth.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <mutex>
+
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "mbedtls/sha256.h"
+
+#define KEY_LEN 32
+#define MAC_LEN 16
+#define MESSAGE_LEN (8 + 1 + 8)
+
+struct RevokedSession {
+    uint32_t id;
+    uint32_t expiry;
+};
+
+static std::mutex mutex;
+
+static uint32_t lifetime = 0;
+static uint32_t next_id = 0;
+
+// SHA256 states after hashing the key XOR ipad or opad: Computing a MAC only has to hash the message.
+static mbedtls_sha256_context inner_base;
+static mbedtls_sha256_context outer_base;
+static bool key_set = false;
+
+static RevokedSession revoked[SESSION_REVOKED_COUNT] = {};
+
+static uint32_t now_s()
+{
+    return (uint32_t)(esp_timer_get_time() / 1000000);
+}
+
+static void init_base(mbedtls_sha256_context *base, const uint8_t block[64])
+{
+    mbedtls_sha256_context tmp;
+    mbedtls_sha256_init(&tmp);
+    mbedtls_sha256_starts_ret(&tmp, 0);
+    mbedtls_sha256_update_ret(&tmp, block, 64);
+
+    // On the ESP32, a context that uses the SHA peripheral keeps it locked until it is freed.
+    // The clone is a software context, so the base states don't block the peripheral for TLS.
+    mbedtls_sha256_init(base);
+    mbedtls_sha256_clone(base, &tmp);
+    mbedtls_sha256_free(&tmp);
+}
+
+// Has to be called with the mutex locked.
+static void generate_key()
+{
+    uint8_t key[KEY_LEN];
+    for (size_t i = 0; i < KEY_LEN; i += 4) {
+        uint32_t r = esp_random();
+        memcpy(key + i, &r, sizeof(r));
+    }
+
+    uint8_t block[64];
+
+    if (key_set) {
+        mbedtls_sha256_free(&inner_base);
+        mbedtls_sha256_free(&outer_base);
+    }
+
+    memset(block, 0x36, sizeof(block));
+    for (size_t i = 0; i < KEY_LEN; ++i)
+        block[i] ^= key[i];
+    init_base(&inner_base, block);
+
+    memset(block, 0x5c, sizeof(block));
+    for (size_t i = 0; i < KEY_LEN; ++i)
+        block[i] ^= key[i];
+    init_base(&outer_base, block);
+
+    memset(key, 0, sizeof(key));
+    memset(block, 0, sizeof(block));
+    memset(revoked, 0, sizeof(revoked));
+    key_set = true;
+}
+
+// Has to be called with the mutex locked.
+static void compute_mac(const char *message, uint8_t mac[MAC_LEN])
+{
+    uint8_t hash[32];
+    mbedtls_sha256_context ctx;
+
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_clone(&ctx, &inner_base);
+    mbedtls_sha256_update_ret(&ctx, (const uint8_t *)message, MESSAGE_LEN);
+    mbedtls_sha256_finish_ret(&ctx, hash);
+    mbedtls_sha256_free(&ctx);
+
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_clone(&ctx, &outer_base);
+    mbedtls_sha256_update_ret(&ctx, hash, sizeof(hash));
+    mbedtls_sha256_finish_ret(&ctx, hash);
+    mbedtls_sha256_free(&ctx);
+
+    memcpy(mac, hash, MAC_LEN);
+}
+
+static bool parse_hex(const char *s, size_t len, uint8_t *out)
+{
+    for (size_t i = 0; i < len; ++i) {
+        char c = s[i];
+        uint8_t digit;
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else
+            return false;
+
+        if (i % 2 == 0)
+            out[i / 2] = digit << 4;
+        else
+            out[i / 2] |= digit;
+    }
+    return true;
+}
+
+static bool parse_u32(const char *s, uint32_t *out)
+{
+    uint8_t bytes[4];
+    if (!parse_hex(s, 8, bytes))
+        return false;
+
+    *out = ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+    return true;
+}
+
+// Splits token into its message part and fields. Does not check the MAC.
+static bool parse_token(const char *token, size_t token_len, uint32_t *expiry, uint32_t *id, uint8_t mac[MAC_LEN])
+{
+    return token_len == SESSION_TOKEN_LEN
+        && token[8] == '.'
+        && token[MESSAGE_LEN] == '.'
+        && parse_u32(token, expiry)
+        && parse_u32(token + 9, id)
+        && parse_hex(token + MESSAGE_LEN + 1, MAC_LEN * 2, mac);
+}
+
+void setSessionLifetime(uint32_t lifetime_s)
+{
+    std::lock_guard<std::mutex> lock{mutex};
+
+    lifetime = lifetime_s;
+    if (lifetime != 0 && !key_set) {
+        generate_key();
+        next_id = esp_random();
+    }
+}
+
+uint32_t getSessionLifetime()
+{
+    std::lock_guard<std::mutex> lock{mutex};
+    return lifetime;
+}
+
+bool createSessionToken(char buf[SESSION_TOKEN_LEN + 1])
+{
+    std::lock_guard<std::mutex> lock{mutex};
+
+    if (lifetime == 0)
+        return false;
+
+    snprintf(buf, SESSION_TOKEN_LEN + 1, "%08x.%08x.", (unsigned)(now_s() + lifetime), (unsigned)next_id++);
+
+    uint8_t mac[MAC_LEN];
+    compute_mac(buf, mac);
+    for (size_t i = 0; i < MAC_LEN; ++i)
+        snprintf(buf + MESSAGE_LEN + 1 + 2 * i, 3, "%02x", mac[i]);
+
+    return true;
+}
+
+bool checkSessionToken(const char *token, size_t token_len)
+{
+    uint32_t expiry, id;
+    uint8_t mac[MAC_LEN];
+    if (!parse_token(token, token_len, &expiry, &id, mac))
+        return false;
+
+    std::lock_guard<std::mutex> lock{mutex};
+
+    if (lifetime == 0)
+        return false;
+
+    // Also reject tokens that claim to live longer than the lifetime allows.
+    uint32_t now = now_s();
+    if ((int32_t)(expiry - now) <= 0 || expiry - now > lifetime)
+        return false;
+
+    uint8_t expected[MAC_LEN];
+    compute_mac(token, expected);
+
+    // Constant time comparison: Don't tell an attacker how many bytes of a forged MAC are correct.
+    uint8_t diff = 0;
+    for (size_t i = 0; i < MAC_LEN; ++i)
+        diff |= expected[i] ^ mac[i];
+    if (diff != 0)
+        return false;
+
+    for (size_t i = 0; i < SESSION_REVOKED_COUNT; ++i)
+        if (revoked[i].id == id && (int32_t)(revoked[i].expiry - now) > 0)
+            return false;
+
+    return true;
+}
+
+void revokeSessionToken(const char *token, size_t token_len)
+{
+    if (!checkSessionToken(token, token_len))
+        return;
+
+    uint32_t expiry, id;
+    uint8_t mac[MAC_LEN];
+    parse_token(token, token_len, &expiry, &id, mac);
+
+    std::lock_guard<std::mutex> lock{mutex};
+
+    // Reuse the entry of a session that has expired anyway or the one that expires next.
+    uint32_t now = now_s();
+    RevokedSession *entry = &revoked[0];
+    for (size_t i = 0; i < SESSION_REVOKED_COUNT; ++i) {
+        if ((int32_t)(revoked[i].expiry - now) <= 0) {
+            entry = &revoked[i];
+            break;
+        }
+        if ((int32_t)(revoked[i].expiry - entry->expiry) < 0)
+            entry = &revoked[i];
+    }
+
+    if ((int32_t)(entry->expiry - now) > 0) {
+        // All entries are in use. Dropping one would make its session valid again.
+        generate_key();
+        return;
+    }
+
+    entry->id = id;
+    entry->expiry = expiry;
+}
+
+void revokeAllSessionTokens()
+{
+    std::lock_guard<std::mutex> lock{mutex};
+
+    if (key_set)
+        generate_key();
+}
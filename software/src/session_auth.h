@@ -0,0 +1,54 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Session tokens issued after a successful digest authentication.
+//
+// A token is "<expiry>.<id>.<mac>": expiry in seconds since boot and a session id as 8 hex digits each,
+// mac is the first 128 bits of HMAC-SHA256(key, "<expiry>.<id>") as hex. Checking a token does
+// not need any state besides the key and a short list of revoked ids.
+// The key is random and only kept in RAM, so all sessions end with a reboot.
+
+#define SESSION_COOKIE_NAME "session"
+#define SESSION_TOKEN_LEN (8 + 1 + 8 + 1 + 32)
+
+// Each logout blocks the token's id until the token expires. If more sessions are logged out within
+// one session lifetime, the key is replaced, which ends all sessions. Sized for a few users that log out
+// from several browsers each. The authentication page mentions this limit.
+#define SESSION_REVOKED_COUNT 32
+
+// Enables session tokens with the given lifetime. 0 disables them: no tokens are issued or accepted.
+void setSessionLifetime(uint32_t lifetime_s);
+uint32_t getSessionLifetime();
+
+// Writes a new token with SESSION_TOKEN_LEN characters and a null terminator to buf.
+// Returns false if session tokens are disabled.
+bool createSessionToken(char buf[SESSION_TOKEN_LEN + 1]);
+
+// token does not have to be null-terminated.
+bool checkSessionToken(const char *token, size_t token_len);
+
+void revokeSessionToken(const char *token, size_t token_len);
+
+// Invalidates all issued tokens by replacing the key.
+void revokeAllSessionTokens();
@@ -0,0 +1,97 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <type_traits>
+
+// Wait-free queue to hand items from exactly one producer task to exactly one consumer task.
+// push may only be called by the producer, pop and peek only by the consumer.
+// If there are several producers, they have to serialize their push calls, for example with a mutex.
+// The consumer side stays wait-free in this case.
+//
+// head and tail run freely and are masked on access, so CAPACITY has to be a power of two.
+// The producer publishes an item with a release store of tail after writing it;
+// the consumer's acquire load of tail guarantees that it sees the written item,
+// also if producer and consumer run on different cores.
+template <typename T, size_t CAPACITY>
+class TF_SPSCQueue {
+    static_assert(std::is_trivially_copyable<T>::value, "TF_SPSCQueue: Item type must be trivially copyable");
+    static_assert(CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0, "TF_SPSCQueue: Capacity must be a power of two");
+
+public:
+    TF_SPSCQueue() : head(0), tail(0) {}
+
+    // Producer only. Returns false if the queue is full.
+    bool push(const T &val)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == CAPACITY)
+            return false;
+
+        items[t & (CAPACITY - 1)] = val;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Returns false if the queue is empty.
+    bool pop(T *val)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (tail.load(std::memory_order_acquire) == h)
+            return false;
+
+        *val = items[h & (CAPACITY - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Returns a pointer to the oldest item or nullptr if the queue is empty.
+    // The item stays valid until it is popped.
+    T *peek()
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (tail.load(std::memory_order_acquire) == h)
+            return nullptr;
+
+        return &items[h & (CAPACITY - 1)];
+    }
+
+    // Exact on the consumer side. The producer only sees an upper bound.
+    size_t used()
+    {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    size_t size()
+    {
+        return CAPACITY;
+    }
+
+private:
+    // Next item to pop. Only written by the consumer.
+    std::atomic<size_t> head;
+    // Next slot to push to. Only written by the producer.
+    std::atomic<size_t> tail;
+    T items[CAPACITY];
+};
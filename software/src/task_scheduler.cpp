@@ -36,8 +36,21 @@ bool compare(const Task &a, const Task &b) {
     return a.next_deadline_ms >= b.next_deadline_ms;
 }
 
+bool compare_jobs(const Job &a, const Job &b) {
+    if (a.priority != b.priority)
+        return a.priority < b.priority;
+
+    return (int32_t)(a.seq - b.seq) > 0;
+}
+
 void TaskScheduler::setup()
 {
+    // setup() and loop() run on the same (Arduino loop) task.
+#ifdef ESP_PLATFORM
+    main_task = xTaskGetCurrentTaskHandle();
+#else
+    main_thread = std::this_thread::get_id();
+#endif
     initialized = true;
 }
 
@@ -53,6 +66,12 @@ void TaskScheduler::register_urls()
     server.on("/scheduler/task", HTTP_GET, [](WebServerRequest request) {
         request.send(200, "text/html", String(current_scheduler_task).c_str());
     });
+
+    server.on("/scheduler/wake_ups", HTTP_GET, [this](WebServerRequest request) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "{\"wake_ups\":%u,\"max_wake_latency_us\":%u}", wake_ups, max_wake_latency_us);
+        request.send(200, "application/json; charset=utf-8", buf);
+    });
 }
 
 void TaskScheduler::loop()
@@ -105,12 +124,237 @@ void TaskScheduler::loop()
 
 void TaskScheduler::scheduleOnce(const char *taskName, std::function<void(void)> &&fn, uint32_t delay)
 {
-    std::lock_guard<std::mutex> l{this->task_mutex};
-    tasks.emplace(taskName, fn, delay, 0, true);
+    {
+        std::lock_guard<std::mutex> l{this->task_mutex};
+        tasks.emplace(taskName, fn, delay, 0, true);
+    }
+    wakeUp();
 }
 
 void TaskScheduler::scheduleWithFixedDelay(const char *taskName, std::function<void(void)> &&fn, uint32_t first_delay, uint32_t delay)
 {
+    {
+        std::lock_guard<std::mutex> l{this->task_mutex};
+        tasks.emplace(taskName, fn, first_delay, delay, false);
+    }
+    wakeUp();
+}
+
+bool TaskScheduler::pollDue()
+{
+    return !poll_scheduled || deadline_elapsed(next_poll_ms);
+}
+
+void TaskScheduler::setNextPoll(uint32_t delay_ms)
+{
+    next_poll_ms = millis() + delay_ms;
+    poll_scheduled = true;
+}
+
+uint32_t TaskScheduler::msUntilNextDeadline(uint32_t max_ms)
+{
+    if (pollDue())
+        return 0;
+
+    max_ms = MIN(next_poll_ms - millis(), max_ms);
+
     std::lock_guard<std::mutex> l{this->task_mutex};
-    tasks.emplace(taskName, fn, first_delay, delay, false);
+    if (tasks.empty())
+        return max_ms;
+
+    uint32_t deadline = tasks.top().next_deadline_ms;
+    if (deadline_elapsed(deadline))
+        return 0;
+
+    return MIN(deadline - millis(), max_ms);
+}
+
+void TaskScheduler::waitForWork(uint32_t max_wait_ms)
+{
+    uint32_t to_wait = msUntilNextDeadline(max_wait_ms);
+    if (to_wait == 0)
+        return;
+
+    // Returns early if wakeUp() was called since the last wait.
+#ifdef ESP_PLATFORM
+    if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(to_wait)) == 0)
+        return;
+#else
+    {
+        std::unique_lock<std::mutex> l{this->wake_up_mutex};
+        if (!wake_up_cv.wait_for(l, std::chrono::milliseconds(to_wait), [this]() { return wake_up_pending; }))
+            return;
+        wake_up_pending = false;
+    }
+#endif
+
+    uint32_t requested_us = wake_up_requested_us;
+    wake_up_requested_us = 0;
+    ++wake_ups;
+
+    if (requested_us != 0) {
+        uint32_t latency_us = micros() - requested_us;
+        if (latency_us > max_wake_latency_us)
+            max_wake_latency_us = latency_us;
+    }
+}
+
+void TaskScheduler::wakeUp()
+{
+#ifdef ESP_PLATFORM
+    if (main_task == nullptr || xTaskGetCurrentTaskHandle() == main_task)
+        return;
+#else
+    if (main_thread == std::thread::id() || std::this_thread::get_id() == main_thread)
+        return;
+#endif
+
+    if (wake_up_requested_us == 0)
+        wake_up_requested_us = micros();
+
+#ifdef ESP_PLATFORM
+    xTaskNotifyGive(main_task);
+#else
+    {
+        std::lock_guard<std::mutex> l{this->wake_up_mutex};
+        wake_up_pending = true;
+    }
+    wake_up_cv.notify_one();
+#endif
+}
+
+void TaskScheduler::worker_fn(void *arg)
+{
+    Worker *worker = (Worker *)arg;
+    TaskScheduler *scheduler = worker->scheduler;
+
+    for (;;) {
+#ifdef ESP_PLATFORM
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#else
+        {
+            std::unique_lock<std::mutex> l{scheduler->job_mutex};
+            worker->job_available.wait(l, [worker]() { return worker->stop || !worker->jobs.empty(); });
+            if (worker->stop)
+                return;
+        }
+#endif
+
+        for (;;) {
+            Job job;
+            {
+                std::lock_guard<std::mutex> l{scheduler->job_mutex};
+                if (worker->jobs.empty()) {
+                    worker->busy = false;
+                    scheduler->workers_idle.notify_all();
+                    break;
+                }
+
+                job = worker->jobs.top();
+                worker->jobs.pop();
+                worker->busy = true;
+            }
+
+            job.fn();
+
+            if (job.on_done)
+                scheduler->scheduleOnce(job.job_name, std::move(job.on_done), 0);
+        }
+    }
+}
+
+void TaskScheduler::submit(const char *job_name, std::function<void(void)> &&fn, std::function<void(void)> &&on_done, int core_affinity, uint8_t priority)
+{
+    std::lock_guard<std::mutex> l{this->job_mutex};
+
+    if (core_affinity < 0 || core_affinity >= portNUM_PROCESSORS) {
+        // No affinity requested: use the least loaded worker.
+        core_affinity = 0;
+        for (int i = 1; i < portNUM_PROCESSORS; ++i) {
+            size_t load = workers[i].jobs.size() + (workers[i].busy ? 1 : 0);
+            size_t best = workers[core_affinity].jobs.size() + (workers[core_affinity].busy ? 1 : 0);
+            if (load < best)
+                core_affinity = i;
+        }
+    }
+
+    Worker &worker = workers[core_affinity];
+
+    if (!start_worker(worker, core_affinity)) {
+        logger.printfln("Failed to start worker task on core %d. Running job %s on the main loop.", core_affinity, job_name);
+        scheduleOnce(job_name, [fn, on_done]() {
+            fn();
+            if (on_done)
+                on_done();
+        }, 0);
+        return;
+    }
+
+    worker.jobs.push(Job{job_name, std::move(fn), std::move(on_done), priority, next_job_seq++});
+    notify_worker(worker);
+}
+
+bool TaskScheduler::waitForJobs(uint32_t timeout_ms)
+{
+    std::unique_lock<std::mutex> l{this->job_mutex};
+    return workers_idle.wait_for(l, std::chrono::milliseconds(timeout_ms), [this]() {
+        for (int i = 0; i < portNUM_PROCESSORS; ++i)
+            if (workers[i].busy || !workers[i].jobs.empty())
+                return false;
+        return true;
+    });
+}
+
+// Called with job_mutex held.
+bool TaskScheduler::start_worker(Worker &worker, int core)
+{
+#ifdef ESP_PLATFORM
+    if (worker.task != nullptr)
+        return true;
+
+    worker.scheduler = this;
+    worker.core = core;
+
+    char task_name[configMAX_TASK_NAME_LEN];
+    snprintf(task_name, sizeof(task_name), "worker%d", core);
+
+    if (xTaskCreatePinnedToCore(worker_fn, task_name, WORKER_STACK_SIZE, &worker, tskIDLE_PRIORITY + 1, &worker.task, core) != pdPASS) {
+        worker.task = nullptr;
+        return false;
+    }
+#else
+    if (worker.thread.joinable())
+        return true;
+
+    worker.scheduler = this;
+    worker.core = core;
+    worker.thread = std::thread(worker_fn, &worker);
+#endif
+    return true;
+}
+
+// Called with job_mutex held.
+void TaskScheduler::notify_worker(Worker &worker)
+{
+#ifdef ESP_PLATFORM
+    xTaskNotifyGive(worker.task);
+#else
+    worker.job_available.notify_one();
+#endif
+}
+
+#ifndef ESP_PLATFORM
+TaskScheduler::~TaskScheduler()
+{
+    for (Worker &worker : workers) {
+        {
+            std::lock_guard<std::mutex> l{this->job_mutex};
+            worker.stop = true;
+        }
+        worker.job_available.notify_one();
+
+        if (worker.thread.joinable())
+            worker.thread.join();
+    }
 }
+#endif
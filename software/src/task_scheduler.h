@@ -25,6 +25,12 @@
 #include <queue>
 #include <functional>
 #include <mutex>
+#include <condition_variable>
+
+#ifndef ESP_PLATFORM
+// Host builds (see test/) run the workers and the main loop's wake-ups on std::threads.
+#include <thread>
+#endif
 
 #include <time.h>
 #include <iostream>
@@ -45,9 +51,35 @@ struct Task {
 
 bool compare(const Task &a, const Task &b);
 
+struct Job {
+    const char *job_name;
+    std::function<void(void)> fn;
+    std::function<void(void)> on_done;
+    uint8_t priority;
+    uint32_t seq;
+};
+
+bool compare_jobs(const Job &a, const Job &b);
+
+// The Arduino loop task runs on core 1, so jobs are offloaded to core 0 by default.
+#define WORKER_DEFAULT_CORE 0
+#define WORKER_STACK_SIZE 8192
+
+#ifndef ESP_PLATFORM
+#define portNUM_PROCESSORS 2
+#endif
+
+// Restarts wait this long for pending jobs (for example persistent config writes) to finish.
+#ifndef WORKER_DRAIN_TIMEOUT_MS
+#define WORKER_DRAIN_TIMEOUT_MS 5000
+#endif
+
 class TaskScheduler {
 public:
     TaskScheduler() : tasks(&compare) {}
+#ifndef ESP_PLATFORM
+    ~TaskScheduler();
+#endif
     void setup();
     void register_urls();
     void loop();
@@ -57,7 +89,80 @@ public:
     void scheduleOnce(const char *task_name, std::function<void(void)> &&fn, uint32_t delay);
     void scheduleWithFixedDelay(const char *task_name, std::function<void(void)> &&fn, uint32_t first_delay, uint32_t delay);
 
+    // Bricklets have no interrupt line, so the main loop polls them.
+    // pollDue() returns true until setNextPoll is called and then again once delay_ms elapsed.
+    bool pollDue();
+    void setNextPoll(uint32_t delay_ms);
+
+    // Returns the number of milliseconds until the next task or poll is due.
+    // Returns max_ms if nothing is scheduled or the next deadline is further away.
+    uint32_t msUntilNextDeadline(uint32_t max_ms);
+
+    // Blocks the main loop until the next task or poll is due, wakeUp() is called or max_wait_ms elapsed.
+    void waitForWork(uint32_t max_wait_ms);
+
+    // Wakes the main loop if it is blocked in waitForWork. Can be called from any task.
+    void wakeUp();
+
+    uint32_t wake_ups = 0;
+    uint32_t max_wake_latency_us = 0;
+
+    // Runs fn on a worker task pinned to core_affinity (or any core if tskNO_AFFINITY is passed).
+    // Jobs with a higher priority are run first; jobs with the same priority on the same core are run in submission order.
+    // on_done (if set) is then scheduled to run on the main loop.
+    void submit(const char *job_name, std::function<void(void)> &&fn, std::function<void(void)> &&on_done, int core_affinity = WORKER_DEFAULT_CORE, uint8_t priority = 0);
+
+    // Blocks until all workers are idle or timeout_ms elapsed. Returns false on timeout.
+    // Call this before restarting: Jobs still running would be cut off mid-write.
+    // Must not be called from a job.
+    bool waitForJobs(uint32_t timeout_ms);
+
 private:
+    struct Worker {
+        TaskScheduler *scheduler;
+        int core;
+#ifdef ESP_PLATFORM
+        TaskHandle_t task;
+#else
+        std::thread thread;
+        std::condition_variable job_available;
+        bool stop = false;
+#endif
+        std::priority_queue<Job, std::vector<Job>, decltype(&compare_jobs)> jobs;
+        bool busy;
+
+#ifdef ESP_PLATFORM
+        Worker() : scheduler(nullptr), core(0), task(nullptr), jobs(&compare_jobs), busy(false) {}
+#else
+        Worker() : scheduler(nullptr), core(0), jobs(&compare_jobs), busy(false) {}
+#endif
+    };
+
+    static void worker_fn(void *arg);
+
+    bool start_worker(Worker &worker, int core);
+    void notify_worker(Worker &worker);
+
+    std::mutex job_mutex;
+    // Notified whenever a worker runs out of jobs.
+    std::condition_variable workers_idle;
+    Worker workers[portNUM_PROCESSORS];
+    uint32_t next_job_seq = 0;
+
+#ifdef ESP_PLATFORM
+    TaskHandle_t main_task = nullptr;
+#else
+    std::thread::id main_thread;
+    std::mutex wake_up_mutex;
+    std::condition_variable wake_up_cv;
+    bool wake_up_pending = false;
+#endif
+    volatile uint32_t wake_up_requested_us = 0;
+
+    // Only used by the main loop.
+    uint32_t next_poll_ms = 0;
+    bool poll_scheduled = false;
+
     std::mutex task_mutex;
     std::priority_queue<Task, std::vector<Task>, decltype(&compare)> tasks;
 };
@@ -0,0 +1,259 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "uri_router.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+// FNV-1a
+static uint32_t hash_segment(const char *segment, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (uint8_t)segment[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static const char *segment_end(const char *p, const char *end)
+{
+    const char *slash = (const char *)memchr(p, '/', end - p);
+    return slash == nullptr ? end : slash;
+}
+
+const UriRouterParam *UriRouterParams::get(const char *name) const
+{
+    size_t name_len = strlen(name);
+    for (size_t i = 0; i < count; ++i)
+        if (params[i].name_len == name_len && memcmp(params[i].name, name, name_len) == 0)
+            return &params[i];
+
+    return nullptr;
+}
+
+UriRouter::UriRouter() : root(new Node())
+{
+}
+
+UriRouter::~UriRouter()
+{
+    free_node(root);
+}
+
+void UriRouter::free_node(Node *node)
+{
+    for (Node *child : node->children)
+        free_node(child);
+
+    if (node->param_child != nullptr)
+        free_node(node->param_child);
+
+    for (Route *routes : {node->routes, node->wildcard_routes}) {
+        while (routes != nullptr) {
+            Route *next = routes->next;
+            delete routes;
+            routes = next;
+        }
+    }
+
+    delete node;
+}
+
+UriRouter::Node *UriRouter::find_child(Node *node, const char *segment, size_t segment_len, uint32_t hash)
+{
+    auto it = std::lower_bound(node->children.begin(), node->children.end(), hash, [](const Node *child, uint32_t h) {
+        return child->hash < h;
+    });
+
+    for (; it != node->children.end() && (*it)->hash == hash; ++it)
+        if ((*it)->segment_len == segment_len && memcmp((*it)->segment, segment, segment_len) == 0)
+            return *it;
+
+    return nullptr;
+}
+
+bool UriRouter::add_route(Route **routes, int method, WebServerHandler *handler)
+{
+    for (Route *r = *routes; r != nullptr; r = r->next)
+        if (r->method == method)
+            return false;
+
+    *routes = new Route{method, handler, *routes};
+    return true;
+}
+
+bool UriRouter::add(const char *pattern, int method, WebServerHandler *handler)
+{
+    size_t len = strlen(pattern);
+    if (len == 0 || pattern[0] != '/')
+        return false;
+
+    const char *end = pattern + len;
+
+    // Validate before modifying the trie.
+    size_t param_count = 0;
+    for (const char *p = pattern + 1; p <= end; ) {
+        const char *seg_end = segment_end(p, end);
+        size_t seg_len = seg_end - p;
+
+        if (seg_len == 1 && *p == '*') {
+            if (seg_end != end)
+                return false;
+            ++param_count;
+        } else if (seg_len > 1 && *p == ':') {
+            ++param_count;
+        }
+
+        p = seg_end + 1;
+    }
+
+    if (param_count > URI_ROUTER_MAX_PARAMS)
+        return false;
+
+    Node *node = root;
+    bool wildcard = false;
+
+    // "/" is the root node itself.
+    for (const char *p = pattern + 1; len > 1 && p <= end; ) {
+        const char *seg_end = segment_end(p, end);
+        size_t seg_len = seg_end - p;
+
+        if (seg_len == 1 && *p == '*') {
+            wildcard = true;
+            break;
+        }
+
+        if (seg_len > 1 && *p == ':') {
+            if (node->param_child == nullptr) {
+                node->param_child = new Node();
+                node->param_child->segment = p;
+                node->param_child->segment_len = seg_len;
+            } else if (node->param_child->segment_len != seg_len || memcmp(node->param_child->segment, p, seg_len) != 0) {
+                // Parameters at the same position have to use the same name.
+                return false;
+            }
+
+            node = node->param_child;
+        } else {
+            uint32_t hash = hash_segment(p, seg_len);
+            Node *child = find_child(node, p, seg_len, hash);
+
+            if (child == nullptr) {
+                child = new Node();
+                child->segment = p;
+                child->segment_len = seg_len;
+                child->hash = hash;
+
+                auto it = std::upper_bound(node->children.begin(), node->children.end(), hash, [](uint32_t h, const Node *c) {
+                    return h < c->hash;
+                });
+                node->children.insert(it, child);
+            }
+
+            node = child;
+        }
+
+        p = seg_end + 1;
+    }
+
+    return add_route(wildcard ? &node->wildcard_routes : &node->routes, method, handler);
+}
+
+const UriRouter::Route *UriRouter::match(const char *path, size_t path_len, UriRouterParams *params)
+{
+    if (params != nullptr)
+        params->count = 0;
+
+    if (path_len == 0 || path[0] != '/')
+        return nullptr;
+
+    const char *end = path + path_len;
+    Node *node = root;
+
+    const Route *wildcard = nullptr;
+    size_t wildcard_param_count = 0;
+    const char *wildcard_value = nullptr;
+
+    // "/*" also matches "/", as "/a/*" matches "/a/".
+    if (path_len == 1 && root->wildcard_routes != nullptr) {
+        wildcard = root->wildcard_routes;
+        wildcard_value = end;
+    }
+
+    for (const char *p = path + 1; path_len > 1 && p <= end; ) {
+        if (node->wildcard_routes != nullptr) {
+            wildcard = node->wildcard_routes;
+            wildcard_param_count = params != nullptr ? params->count : 0;
+            wildcard_value = p;
+        }
+
+        const char *seg_end = segment_end(p, end);
+        size_t seg_len = seg_end - p;
+
+        Node *next = find_child(node, p, seg_len, hash_segment(p, seg_len));
+
+        if (next == nullptr && seg_len > 0 && node->param_child != nullptr) {
+            next = node->param_child;
+
+            // add guarantees that no pattern has more than URI_ROUTER_MAX_PARAMS parameters.
+            if (params != nullptr)
+                params->params[params->count++] = UriRouterParam{next->segment + 1, next->segment_len - 1, p, seg_len};
+        }
+
+        node = next;
+        if (node == nullptr)
+            break;
+
+        p = seg_end + 1;
+    }
+
+    if (node != nullptr && node->routes != nullptr)
+        return node->routes;
+
+    if (wildcard != nullptr) {
+        if (params != nullptr) {
+            params->count = wildcard_param_count;
+            params->params[params->count++] = UriRouterParam{"*", 1, wildcard_value, (size_t)(end - wildcard_value)};
+        }
+        return wildcard;
+    }
+
+    return nullptr;
+}
+
+WebServerHandler *UriRouter::find(const char *path, size_t path_len, int method, UriRouterParams *params, bool *path_found)
+{
+    const Route *routes = match(path, path_len, params);
+
+    *path_found = routes != nullptr;
+
+    for (; routes != nullptr; routes = routes->next)
+        if (routes->method == method)
+            return routes->handler;
+
+    return nullptr;
+}
+
+bool UriRouter::contains(const char *path, size_t path_len)
+{
+    return match(path, path_len, nullptr) != nullptr;
+}
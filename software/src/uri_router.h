@@ -0,0 +1,107 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// Maps request paths to handlers with a trie of path segments.
+//
+// A pattern is a path like "/evse/state". Segments starting with ':' match any single segment
+// and capture it as a path parameter, for example "/meter/:id/values". A trailing "*" segment
+// matches the rest of the path, including further slashes, and captures it as the parameter "*".
+//
+// The children of a node are sorted by the hash of their segment, so matching a path takes
+// one hash computation and one binary search per segment, independent of the number of routes.
+// Static segments take precedence over parameters. Matching does not backtrack, except to the
+// deepest "*" route seen on the way down.
+//
+// This file does not depend on the ESP-IDF. Handlers are only passed through.
+
+struct WebServerHandler;
+
+#define URI_ROUTER_MAX_PARAMS 4
+
+struct UriRouterParam {
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+};
+
+struct UriRouterParams {
+    size_t count = 0;
+    UriRouterParam params[URI_ROUTER_MAX_PARAMS];
+
+    // Returns nullptr if there is no parameter with this name.
+    const UriRouterParam *get(const char *name) const;
+};
+
+class UriRouter {
+public:
+    UriRouter();
+    ~UriRouter();
+
+    UriRouter(const UriRouter &) = delete;
+    UriRouter &operator=(const UriRouter &) = delete;
+
+    // pattern has to stay valid as long as the router exists.
+    // Returns false if the pattern is invalid or a handler for pattern and method already exists.
+    bool add(const char *pattern, int method, WebServerHandler *handler);
+
+    // path does not have to be null-terminated. params may be nullptr.
+    // Returns the handler for method or nullptr. path_found is set if the path has handlers
+    // for other methods, i.e. the request should be answered with 405 instead of 404.
+    WebServerHandler *find(const char *path, size_t path_len, int method, UriRouterParams *params, bool *path_found);
+
+    // Returns whether any handler is registered for path.
+    bool contains(const char *path, size_t path_len);
+
+private:
+    struct Route {
+        int method;
+        WebServerHandler *handler;
+        Route *next;
+    };
+
+    struct Node {
+        const char *segment = nullptr;
+        size_t segment_len = 0;
+        uint32_t hash = 0;
+
+        // Sorted by hash.
+        std::vector<Node *> children;
+        // The segment of param_child is the parameter name including the ':'.
+        Node *param_child = nullptr;
+
+        Route *routes = nullptr;
+        Route *wildcard_routes = nullptr;
+    };
+
+    static void free_node(Node *node);
+    static Node *find_child(Node *node, const char *segment, size_t segment_len, uint32_t hash);
+    static bool add_route(Route **routes, int method, WebServerHandler *handler);
+
+    const Route *match(const char *path, size_t path_len, UriRouterParams *params);
+
+    Node *root;
+};
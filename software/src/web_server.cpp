@@ -24,12 +24,52 @@
 
 #include "task_scheduler.h"
 #include "digest_auth.h"
+#include "session_auth.h"
 
+#include <algorithm>
+#include <iterator>
 #include <memory>
+#include <new>
+
+#include <math.h>
+#include <unistd.h>
 
 extern TaskScheduler task_scheduler;
 
-#define MAX_URI_HANDLERS 128
+// esp_http_server handlers: the router's catch-all handlers and the web socket handler.
+// Handlers registered with WebServer::on don't count against this limit.
+#define MAX_URI_HANDLERS 8
+
+// Never a valid request path, as it does not start with '/'.
+#define ROUTER_CATCH_ALL_URI "*"
+
+static const httpd_method_t router_methods[] = {HTTP_GET, HTTP_PUT, HTTP_POST, HTTP_DELETE};
+
+static WebServer *router_server = nullptr;
+
+static bool uri_match(const char *reference_uri, const char *uri_to_match, size_t match_upto)
+{
+    // The catch-all handlers only match paths known to the router. Other requests fall through to
+    // handlers registered directly with esp_http_server (i.e. the web socket handler) or get a 404.
+    if (strcmp(reference_uri, ROUTER_CATCH_ALL_URI) == 0) {
+        std::lock_guard<std::mutex> lock{router_server->router_mutex};
+        return router_server->router.contains(uri_to_match, match_upto);
+    }
+
+    return strlen(reference_uri) == match_upto && strncmp(reference_uri, uri_to_match, match_upto) == 0;
+}
+
+static esp_err_t router_handler(httpd_req_t *req);
+
+static void close_session(httpd_handle_t hd, int sockfd)
+{
+    WebServer *server = (WebServer *)httpd_get_global_user_ctx(hd);
+    if (server->on_disconnect)
+        server->on_disconnect(sockfd);
+
+    // A close_fn has to close the socket itself.
+    close(sockfd);
+}
 
 void WebServer::start()
 {
@@ -42,9 +82,13 @@ void WebServer::start()
     config.stack_size = 8192;
     config.max_uri_handlers = MAX_URI_HANDLERS;
     config.global_user_ctx = this;
+    config.uri_match_fn = uri_match;
+    config.close_fn = close_session;
     /*config.task_priority = tskIDLE_PRIORITY+7;
     config.core_id = 1;*/
 
+    router_server = this;
+
     // Start the httpd server
     auto result = httpd_start(&this->httpd, &config);
     if (result != ESP_OK) {
@@ -52,80 +96,100 @@ void WebServer::start()
         logger.printfln("Failed to start web server! %s (%d)", esp_err_to_name(result), result);
         return;
     }
+
+    for (httpd_method_t method : router_methods) {
+        httpd_uri_t ll_handler = {};
+        ll_handler.uri       = ROUTER_CATCH_ALL_URI;
+        ll_handler.method    = method;
+        ll_handler.handler   = router_handler;
+        ll_handler.user_ctx  = this;
+
+        httpd_register_uri_handler(httpd, &ll_handler);
+    }
 }
 
-struct UserCtx {
-    WebServer *server;
-    WebServerHandler *handler;
-};
+// Digest headers of current browsers are about 300 bytes long.
+#define AUTHORIZATION_HEADER_BUF_SIZE 512
 
-bool authenticate(WebServerRequest req, const char *username, const char *password)
+int getSessionToken(WebServerRequest &req, char *buf, size_t buf_len, const char **token)
 {
-    String auth = req.header("Authorization");
-    if (auth == "") {
-        return false;
+    int len = req.header("Authorization", buf, buf_len);
+    if (len > 7 && strncmp(buf, "Bearer ", 7) == 0) {
+        *token = buf + 7;
+        return len - 7;
     }
 
-    if (!auth.startsWith("Digest ")) {
-        return false;
-    }
+    len = req.header("Cookie", buf, buf_len);
+    if (len <= 0)
+        return -1;
 
-    auth = auth.substring(7);
-    return checkDigestAuthentication(auth.c_str(), req.methodString(), username, password, nullptr, false, nullptr, nullptr, nullptr);
-}
+    // Cookies are separated by "; ".
+    const size_t name_len = strlen(SESSION_COOKIE_NAME "=");
+    const char *end = buf + len;
+    for (const char *p = buf; p < end; ) {
+        while (p < end && *p == ' ')
+            ++p;
 
-static esp_err_t low_level_handler(httpd_req_t *req)
-{
-    auto ctx = (UserCtx *)req->user_ctx;
-    auto request = WebServerRequest{req};
-    if (ctx->server->username != "" && ctx->server->password != "" && !authenticate(request, ctx->server->username.c_str(), ctx->server->password.c_str())) {
-        if (ctx->server->on_not_authorized) {
-            ctx->server->on_not_authorized(request);
-            return ESP_OK;
+        const char *cookie_end = (const char *)memchr(p, ';', end - p);
+        if (cookie_end == nullptr)
+            cookie_end = end;
+
+        if ((size_t)(cookie_end - p) > name_len && memcmp(p, SESSION_COOKIE_NAME "=", name_len) == 0) {
+            *token = p + name_len;
+            return cookie_end - *token;
         }
-        request.requestAuthentication();
-        return ESP_OK;
+
+        p = cookie_end + 1;
     }
 
-    ctx->handler->callback(request);
-    return ESP_OK;
+    return -1;
 }
 
-WebServerHandler *WebServer::on(const char *uri, httpd_method_t method, wshCallback callback)
+bool authenticate(WebServerRequest &req)
 {
-    if (handler_count >= MAX_URI_HANDLERS) {
-        logger.printfln("Can't add WebServer handler for %s: %d handlers already registered. Please increase MAX_URI_HANDLERS.", uri, handler_count);
-        return nullptr;
+    char auth[AUTHORIZATION_HEADER_BUF_SIZE];
+
+    // A valid session token is checked with one HMAC and no nonce bookkeeping.
+    if (getSessionLifetime() != 0) {
+        const char *token;
+        int token_len = getSessionToken(req, auth, sizeof(auth), &token);
+        if (token_len > 0 && checkSessionToken(token, token_len))
+            return true;
     }
 
-    handlers.emplace_front(uri, method, callback, wshUploadCallback());
-    ++handler_count;
-    WebServerHandler *result = &handlers.front();
+    int auth_len = req.header("Authorization", auth, sizeof(auth));
+    if (auth_len < 7 || strncmp(auth, "Digest ", 7) != 0) {
+        return false;
+    }
 
-    UserCtx *user_ctx = (UserCtx *)malloc(sizeof(UserCtx));
-    user_ctx->server = this;
-    user_ctx->handler = result;
+    DigestAuthResult result = checkDigestAuthentication(auth + 7, auth_len - 7, req.methodString());
+    req.stale_nonce = result == DigestAuthResult::STALE;
+    return result == DigestAuthResult::OK;
+}
 
-    httpd_uri_t ll_handler = {};
-    ll_handler.uri       = uri;
-    ll_handler.method    = method;
-    ll_handler.handler   = low_level_handler;
-    ll_handler.user_ctx  = (void*)user_ctx;
+static esp_err_t low_level_handler(WebServer *server, WebServerHandler *handler, WebServerRequest request)
+{
+    if (server->username != "" && server->password != "" && !authenticate(request)) {
+        if (server->on_not_authorized) {
+            server->on_not_authorized(request);
+            return ESP_OK;
+        }
+        request.requestAuthentication();
+        return ESP_OK;
+    }
 
-    httpd_register_uri_handler(httpd, &ll_handler);
-    return result;
+    handler->callback(request);
+    return ESP_OK;
 }
 
 static const size_t SCRATCH_BUFSIZE = 4096;
 static uint8_t scratch_buf[SCRATCH_BUFSIZE] = {0};
 
-static esp_err_t low_level_upload_handler(httpd_req_t *req)
+static esp_err_t low_level_upload_handler(WebServer *server, WebServerHandler *handler, WebServerRequest request, httpd_req_t *req)
 {
-    auto ctx = (UserCtx *)req->user_ctx;
-    auto request = WebServerRequest{req};
-    if (ctx->server->username != "" && ctx->server->password != "" && !authenticate(request, ctx->server->username.c_str(), ctx->server->password.c_str())) {
-        if (ctx->server->on_not_authorized) {
-            ctx->server->on_not_authorized(request);
+    if (server->username != "" && server->password != "" && !authenticate(request)) {
+        if (server->on_not_authorized) {
+            server->on_not_authorized(request);
             return ESP_OK;
         }
         request.requestAuthentication();
@@ -150,47 +214,94 @@ static esp_err_t low_level_upload_handler(httpd_req_t *req)
         }
 
         remaining -= received;
-        if (!ctx->handler->uploadCallback(request, "not implemented", index, scratch_buf, received, remaining == 0)) {
+        if (!handler->uploadCallback(request, "not implemented", index, scratch_buf, received, remaining == 0)) {
             return ESP_FAIL;
         }
 
         index += received;
     }
 
-    ctx->handler->callback(request);
+    handler->callback(request);
     return ESP_OK;
 }
 
+static esp_err_t router_handler(httpd_req_t *req)
+{
+    auto server = (WebServer *)req->user_ctx;
+
+    // The path parameters point into req->uri and the handler's uri, both outlive the request.
+    UriRouterParams params;
+    WebServerHandler *handler;
+    bool path_found;
+    {
+        std::lock_guard<std::mutex> lock{server->router_mutex};
+        handler = server->router.find(req->uri, strcspn(req->uri, "?"), req->method, &params, &path_found);
+    }
+
+    auto request = WebServerRequest{req, false, &params};
+
+    if (handler == nullptr) {
+        // uri_match only lets requests for known paths through, but the path could have been
+        // registered for another method than the catch-all handler that was selected.
+        request.send(path_found ? 405 : 404);
+        return ESP_OK;
+    }
+
+    if (handler->uploadCallback)
+        return low_level_upload_handler(server, handler, request, req);
+
+    return low_level_handler(server, handler, request);
+}
+
+WebServerHandler *WebServer::on(const char *uri, httpd_method_t method, wshCallback callback)
+{
+    return on(uri, method, callback, wshUploadCallback());
+}
+
 WebServerHandler *WebServer::on(const char *uri, httpd_method_t method, wshCallback callback, wshUploadCallback uploadCallback)
 {
-    if (handler_count >= MAX_URI_HANDLERS) {
-        logger.printfln("Can't add WebServer handler for %s: %d handlers already registered. Please increase MAX_URI_HANDLERS.", uri, handler_count);
+    if (std::find(std::begin(router_methods), std::end(router_methods), method) == std::end(router_methods)) {
+        logger.printfln("Can't add WebServer handler for %s: Method %d is not supported.", uri, (int)method);
         return nullptr;
     }
 
     handlers.emplace_front(uri, method, callback, uploadCallback);
-    ++handler_count;
     WebServerHandler *result = &handlers.front();
 
-    UserCtx *user_ctx = (UserCtx *)malloc(sizeof(UserCtx));
-    user_ctx->server = this;
-    user_ctx->handler = result;
+    bool added;
+    {
+        std::lock_guard<std::mutex> lock{router_mutex};
+        // Use the handler's copy of uri: The router keeps pointers to it.
+        added = router.add(result->uri.c_str(), method, result);
+    }
 
-    httpd_uri_t ll_handler = {};
-    ll_handler.uri       = uri;
-    ll_handler.method    = method;
-    ll_handler.handler   = low_level_upload_handler;
-    ll_handler.user_ctx  = (void*)user_ctx;
+    if (!added) {
+        logger.printfln("Can't add WebServer handler for %s: Invalid URI or handler already registered.", uri);
+        handlers.pop_front();
+        return nullptr;
+    }
 
-    httpd_register_uri_handler(httpd, &ll_handler);
     return result;
 }
 
+void WebServer::setAuthentication(String username, String password)
+{
+    this->username = username;
+    this->password = password;
+
+    setDigestCredentials(username.c_str(), password.c_str());
+}
+
 void WebServer::onNotAuthorized(wshCallback callback)
 {
     this->on_not_authorized = callback;
 }
 
+void WebServer::onDisconnect(std::function<void(int fd)> callback)
+{
+    this->on_disconnect = callback;
+}
+
 // From: https://www.iana.org/assignments/http-status-codes/http-status-codes.xhtml
 const char *httpStatusCodeToString(int code)
 {
@@ -333,7 +444,32 @@ void WebServerRequest::send(uint16_t code, const char *content_type, const char
     }
 }
 
-void WebServerRequest::beginChunkedResponse(uint16_t code, const char *content_type)
+// Returns whether the Accept-Encoding header value lists gzip without q=0.
+static bool accepts_gzip(const char *accept_encoding)
+{
+    for (const char *p = accept_encoding; *p != '\0'; ) {
+        while (*p == ' ' || *p == ',')
+            ++p;
+
+        const char *coding = p;
+        while (*p != '\0' && *p != ',' && *p != ';' && *p != ' ')
+            ++p;
+        size_t coding_len = p - coding;
+
+        // Parameters of this coding, e.g. ";q=0.5".
+        float q = 1;
+        for (; *p != '\0' && *p != ','; ++p)
+            if ((*p == 'q' || *p == 'Q') && p[1] == '=')
+                q = strtof(p + 2, nullptr);
+
+        if (coding_len == 4 && strncasecmp(coding, "gzip", 4) == 0)
+            return q > 0;
+    }
+
+    return false;
+}
+
+void WebServerRequest::beginChunkedResponse(uint16_t code, const char *content_type, bool allow_compression)
 {
     auto result = httpd_resp_set_type(req, content_type);
     if (result != ESP_OK) {
@@ -346,10 +482,36 @@ void WebServerRequest::beginChunkedResponse(uint16_t code, const char *content_t
         printf("Failed to set response status: %d\n", result);
         return;
     }
+
+    if (!allow_compression)
+        return;
+
+    addVaryAcceptEncoding();
+
+    if (!acceptsGzip())
+        return;
+
+    // Send the response uncompressed if the heap is too fragmented.
+    httpd_req_t *r = req;
+    GzipEncoder *encoder = new (std::nothrow) GzipEncoder([r](const uint8_t *data, size_t len) {
+        auto send_result = httpd_resp_send_chunk(r, (const char *)data, len);
+        if (send_result != ESP_OK)
+            printf("Failed to send response chunk: %d\n", send_result);
+    });
+    if (encoder == nullptr)
+        return;
+
+    gzip.reset(encoder);
+    addResponseHeader("Content-Encoding", "gzip");
 }
 
 void WebServerRequest::sendChunk(const char *chunk, size_t chunk_len)
 {
+    if (gzip) {
+        gzip->write((const uint8_t *)chunk, chunk_len);
+        return;
+    }
+
     auto result = httpd_resp_send_chunk(req, chunk, chunk_len);
     if (result != ESP_OK) {
         printf("Failed to send response chunk: %d\n", result);
@@ -357,8 +519,49 @@ void WebServerRequest::sendChunk(const char *chunk, size_t chunk_len)
     }
 }
 
+#define JSON_INTEGERS_CHUNK_SIZE 256
+
+void WebServerRequest::sendJsonIntegers(const float *values, size_t count, bool *first)
+{
+    char buf[JSON_INTEGERS_CHUNK_SIZE];
+    size_t used = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        float value = values[i];
+        const char *separator = *first ? "" : ",";
+        *first = false;
+
+        // The longest entry is ",-2147483648".
+        char entry[16];
+        int written;
+        if (isfinite(value) && value > (float)INT32_MIN && value < (float)INT32_MAX)
+            written = snprintf(entry, sizeof(entry), "%s%d", separator, (int)value);
+        else
+            written = snprintf(entry, sizeof(entry), "%snull", separator);
+
+        if (written < 0 || (size_t)written >= sizeof(entry))
+            continue;
+
+        if (used + written > sizeof(buf)) {
+            sendChunk(buf, used);
+            used = 0;
+        }
+
+        memcpy(buf + used, entry, written);
+        used += written;
+    }
+
+    if (used > 0)
+        sendChunk(buf, used);
+}
+
 void WebServerRequest::endChunkedResponse()
 {
+    if (gzip) {
+        gzip->finish();
+        gzip.reset();
+    }
+
     auto result = httpd_resp_send_chunk(req, nullptr, 0);
     if (result != ESP_OK) {
         printf("Failed to end chunked response: %d\n", result);
@@ -375,14 +578,77 @@ void WebServerRequest::addResponseHeader(const char *field, const char *value)
     }
 }
 
+bool WebServerRequest::acceptsGzip()
+{
+    char accept_encoding[128];
+    return header("Accept-Encoding", accept_encoding, sizeof(accept_encoding)) > 0 && accepts_gzip(accept_encoding);
+}
+
+void WebServerRequest::addVaryAcceptEncoding()
+{
+    if (vary_sent)
+        return;
+
+    addResponseHeader("Vary", "Accept-Encoding");
+    vary_sent = true;
+}
+
 void WebServerRequest::requestAuthentication()
 {
     String payload = "Digest ";
-    payload.concat(requestDigestAuthentication("esp32-lib"));
+    payload.concat(requestDigestAuthentication(stale_nonce));
     addResponseHeader("WWW-Authenticate", payload.c_str());
     send(401);
 }
 
+// If-None-Match uses the weak comparison: "W/" prefixes are ignored.
+static bool etag_list_matches(const char *list, const char *etag)
+{
+    size_t etag_len = strlen(etag);
+    const char *p = list;
+
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            ++p;
+
+        if (*p == '\0')
+            break;
+
+        if (*p == '*')
+            return true;
+
+        if (p[0] == 'W' && p[1] == '/')
+            p += 2;
+
+        const char *start = p;
+        if (*p == '"') {
+            const char *closing = strchr(p + 1, '"');
+            p = closing != nullptr ? closing + 1 : p + strlen(p);
+        } else {
+            // Be lenient: Older firmwares sent unquoted ETags, which clients send back as is.
+            while (*p != '\0' && *p != ',' && *p != ' ')
+                ++p;
+        }
+
+        if ((size_t)(p - start) == etag_len && memcmp(start, etag, etag_len) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+bool WebServerRequest::checkETag(const char *etag)
+{
+    addResponseHeader("ETag", etag);
+
+    String if_none_match = header("If-None-Match");
+    if (if_none_match == "" || !etag_list_matches(if_none_match.c_str(), etag))
+        return false;
+
+    send(304);
+    return true;
+}
+
 class CustomString : public String {
 public:
     void setLength(int len) {
@@ -407,6 +673,55 @@ String WebServerRequest::header(const char *header_name)
     return result;
 }
 
+int WebServerRequest::header(const char *header_name, char *buf, size_t buf_len)
+{
+    size_t len = httpd_req_get_hdr_value_len(req, header_name);
+    if (len == 0 || len >= buf_len)
+        return -1;
+
+    if (httpd_req_get_hdr_value_str(req, header_name, buf, buf_len) != ESP_OK)
+        return -1;
+
+    return len;
+}
+
+String WebServerRequest::getQueryParam(const char *key)
+{
+    auto query_len = httpd_req_get_url_query_len(req) + 1;
+    if (query_len == 1)
+        return String("");
+
+    char *query = (char *)malloc(query_len);
+    if (query == nullptr)
+        return String("");
+
+    char value[32];
+    String result;
+    if (httpd_req_get_url_query_str(req, query, query_len) == ESP_OK
+     && httpd_query_key_value(query, key, value, sizeof(value)) == ESP_OK) {
+        result = value;
+    }
+
+    free(query);
+    return result;
+}
+
+String WebServerRequest::getPathParam(const char *name)
+{
+    if (path_params == nullptr)
+        return String("");
+
+    const UriRouterParam *param = path_params->get(name);
+    if (param == nullptr)
+        return String("");
+
+    String result;
+    result.reserve(param->value_len);
+    for (size_t i = 0; i < param->value_len; ++i)
+        result += param->value[i];
+    return result;
+}
+
 size_t WebServerRequest::contentLength() {
     return req->content_len;
 }
@@ -425,7 +740,19 @@ int WebServerRequest::receive(char *buf, size_t buf_len)
     return httpd_req_recv(req, buf, contentLength());
 }
 
-WebServerRequest::WebServerRequest(httpd_req_t *req, bool keep_alive) : req(req)
+int WebServerRequest::readBody(char *buf, size_t buf_len)
+{
+    // Give a slow client a few chances before giving up.
+    for (int i = 0; i < 5; ++i) {
+        int received = httpd_req_recv(req, buf, buf_len);
+        if (received != HTTPD_SOCK_ERR_TIMEOUT)
+            return received;
+    }
+
+    return HTTPD_SOCK_ERR_TIMEOUT;
+}
+
+WebServerRequest::WebServerRequest(httpd_req_t *req, bool keep_alive, const UriRouterParams *path_params) : req(req), path_params(path_params)
 {
     if (!keep_alive)
         this->addResponseHeader("Connection", "close");
@@ -23,33 +23,72 @@
 
 #include <forward_list>
 #include <functional>
+#include <memory>
+#include <mutex>
 
 #include <Arduino.h>
 
+#include "gzip_encoder.h"
+#include "uri_router.h"
+
 class WebServerRequest {
 public:
-    WebServerRequest(httpd_req_t *req, bool keep_alive = false);
+    WebServerRequest(httpd_req_t *req, bool keep_alive = false, const UriRouterParams *path_params = nullptr);
 
     void send(uint16_t code, const char *content_type = "text/plain", const char *content = "", size_t content_len = HTTPD_RESP_USE_STRLEN);
 
-    void beginChunkedResponse(uint16_t code, const char *content_type);
+    // If allow_compression is set and the client accepts gzip, the chunks are compressed on the fly.
+    // allow_compression also adds "Vary: Accept-Encoding", see addVaryAcceptEncoding.
+    void beginChunkedResponse(uint16_t code, const char *content_type, bool allow_compression = true);
 
     void sendChunk(const char *chunk, size_t chunk_len);
 
+    // Sends the values truncated to integers as comma separated JSON numbers, in chunks of a small stack buffer.
+    // Values that are not finite (for example NAN marking missing history entries) or out of range are sent as null.
+    // A comma is sent before the first value unless *first is set. *first is cleared once a value was sent.
+    void sendJsonIntegers(const float *values, size_t count, bool *first);
+
     void endChunkedResponse();
 
     void addResponseHeader(const char *field, const char *value);
 
+    // Returns whether the Accept-Encoding header lists gzip.
+    bool acceptsGzip();
+
+    // Adds "Vary: Accept-Encoding" once. Needed for every response to a URL that may be sent compressed,
+    // including uncompressed and 304 responses, so that caches don't serve one coding to all clients.
+    void addVaryAcceptEncoding();
+
     void requestAuthentication();
 
+    // Adds etag (including the quotes) as ETag header. If the request's If-None-Match header
+    // matches etag, sends 304 Not Modified and returns true. etag has to stay valid until
+    // the response is sent.
+    bool checkETag(const char *etag);
+
     String header(const char *header_name);
 
+    // Copies the header's value into buf. Returns the value's length or -1 if the header
+    // is not set or does not fit into buf.
+    int header(const char *header_name, char *buf, size_t buf_len);
+
+    // Returns the value of the query string parameter key or an empty string if it is not set.
+    String getQueryParam(const char *key);
+
+    // Returns the value of the path parameter name (":name" or "*" in the handler's URI)
+    // or an empty string if the handler's URI has no such parameter.
+    String getPathParam(const char *name);
+
     size_t contentLength();
 
     char *receive();
 
     int receive(char *buf, size_t buf_len);
 
+    // Reads up to buf_len bytes of the body. Can be called repeatedly to stream the body.
+    // Returns the number of bytes read, 0 at the end of the body or a negative value on error.
+    int readBody(char *buf, size_t buf_len);
+
     int method() {
         return req->method;
     }
@@ -72,12 +111,26 @@ public:
 
 private:
     httpd_req_t *req;
+    const UriRouterParams *path_params;
+    // Set by beginChunkedResponse if the response is compressed.
+    std::shared_ptr<GzipEncoder> gzip;
+    // Set by authenticate, makes requestAuthentication send stale=TRUE.
+    bool stale_nonce = false;
+    bool vary_sent = false;
+
+    friend bool authenticate(WebServerRequest &req);
 };
 
 using wshCallback = std::function<void(WebServerRequest)>;
 using wshUploadCallback = std::function<bool(WebServerRequest request, String filename, size_t index, uint8_t *data, size_t len, bool final)>;
 
-bool authenticate(WebServerRequest req, const char *username, const char *password);
+// Accepts a valid session token (see session_auth.h) or checks the request's digest authentication
+// against the credentials set with WebServer::setAuthentication.
+bool authenticate(WebServerRequest &req);
+
+// Finds the session token in the "Authorization: Bearer" header or the session cookie.
+// buf receives the header, token points into buf. Returns the token's length or -1.
+int getSessionToken(WebServerRequest &req, char *buf, size_t buf_len, const char **token);
 
 struct WebServerHandler {
     WebServerHandler(String uri, httpd_method_t method, wshCallback callback, wshUploadCallback uploadCallback) : uri(uri), method(method), callback(callback), uploadCallback(uploadCallback) {}
@@ -93,22 +146,24 @@ public:
     WebServer() : httpd(nullptr), handlers() {}
     void start();
 
+    // uri can contain path parameters, see uri_router.h.
     WebServerHandler *on(const char *uri, httpd_method_t method, wshCallback callback);
     WebServerHandler *on(const char *uri, httpd_method_t method, wshCallback callback, wshUploadCallback uploadCallback);
     void onNotAuthorized(wshCallback callback);
+    // Called by the httpd task when a session (HTTP or web socket) is closed.
+    void onDisconnect(std::function<void(int fd)> callback);
 
-    void setAuthentication(String username, String password)
-    {
-        this->username = username;
-        this->password = password;
-    }
+    void setAuthentication(String username, String password);
 
     bool initialized = false;
 
     httpd_handle_t httpd;
     std::forward_list<WebServerHandler> handlers;
-    int handler_count = 0;
+    // All handlers registered with on() are dispatched by one esp_http_server handler per method.
+    UriRouter router;
+    std::mutex router_mutex;
     wshCallback on_not_authorized;
+    std::function<void(int fd)> on_disconnect;
 
     String username;
     String password;
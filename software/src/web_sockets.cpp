@@ -25,9 +25,18 @@
 #include "web_server.h"
 
 #include "esp_httpd_priv.h"
+#include "session_auth.h"
+#include "spsc_queue.h"
 
+#include <lwip/sockets.h>
+
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+#include <algorithm>
+#include <atomic>
 #include <mutex>
-#include <deque>
 
 extern TaskScheduler task_scheduler;
 extern WebServer server;
@@ -35,38 +44,328 @@ extern EventLog logger;
 
 static const size_t max_clients = 7;
 
+// Frames queued per client. If a client can't keep up, frames to it are dropped
+// instead of delaying the other clients or growing without bound.
+#define WS_CLIENT_QUEUE_SIZE 32
+
+// Room for the longest web socket frame header (server frames are not masked).
+#define WS_MAX_HEADER_LEN 10
+
+// A text or binary frame, shared by all clients it is sent to. The header is built once, directly
+// in front of the payload. Clients get the same bytes with one send call each.
+// Header and payload are a single allocation.
+struct ws_payload {
+    int refs;
+    size_t len;
+    uint8_t header_len;
+    uint8_t header_buf[WS_MAX_HEADER_LEN];
+    char data[];
+};
+
+#define WS_OPCODE_TEXT 0x1
+#define WS_OPCODE_BINARY 0x2
+
+static const uint8_t ping_frame[2] = {0x89, 0x00};
+
+static ws_payload *payload_alloc(size_t len)
+{
+    ws_payload *p = (ws_payload *)malloc(sizeof(ws_payload) + len);
+    if (p == nullptr)
+        return nullptr;
+
+    p->refs = 1;
+    p->len = len;
+    p->header_len = 0;
+    return p;
+}
+
+static ws_payload *payload_from_data(char *data)
+{
+    return (ws_payload *)(data - offsetof(ws_payload, data));
+}
+
+// Writes the header of a final data frame with a payload of len bytes. Returns the header's length.
+static uint8_t build_header(uint8_t *header, size_t len, WebSocketsProtocol protocol)
+{
+    uint8_t header_len = 0;
+
+    header[header_len++] = 0x80 | (protocol == WebSocketsProtocol::CBOR ? WS_OPCODE_BINARY : WS_OPCODE_TEXT);
+
+    if (len < 126) {
+        header[header_len++] = len;
+    } else if (len <= 0xFFFF) {
+        header[header_len++] = 126;
+        header[header_len++] = len >> 8;
+        header[header_len++] = len;
+    } else {
+        header[header_len++] = 127;
+        for (int shift = 56; shift >= 0; shift -= 8)
+            header[header_len++] = (uint64_t)len >> shift;
+    }
+
+    return header_len;
+}
+
+// Writes the header directly in front of the payload.
+static void payload_build_header(ws_payload *p, WebSocketsProtocol protocol)
+{
+    uint8_t header[WS_MAX_HEADER_LEN];
+    p->header_len = build_header(header, p->len, protocol);
+    memcpy(p->header_buf + WS_MAX_HEADER_LEN - p->header_len, header, p->header_len);
+}
+
+static void payload_ref(ws_payload *p)
+{
+    __atomic_add_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+}
+
+// Payloads are released by the httpd task after sending and by the producers.
+static void payload_release(ws_payload *p)
+{
+    if (p == nullptr || __atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    free(p);
+}
+
 struct ws_work_item {
-    httpd_handle_t hd;
-    int fd;
-    char *payload;
-    size_t payload_len;
-    int *payload_ref_counter;
-
-    ws_work_item(httpd_handle_t hd,
-                 int fd,
-                 char *payload,
-                 size_t payload_len,
-                 int *payload_ref_counter) :
-                    hd(hd), fd(fd), payload(payload), payload_len(payload_len), payload_ref_counter(payload_ref_counter)
-    {}
-
-    void clear()
-    {
-        if (this->payload_ref_counter == nullptr)
-            return;
+    // nullptr for pings and topic items.
+    ws_payload *payload;
+    // WS_NO_TOPIC or the topic whose newest payload is sent.
+    int topic;
+};
+
+// Messages that are sent as one frame. JSON messages end with a newline, so clients split
+// the frame like the initial dump. CBOR items are self-delimiting.
+// A frame without payloads and with header is a ping.
+struct ws_frame {
+    ws_payload *payloads[WS_BATCH_MAX_MESSAGES];
+    size_t count = 0;
+    size_t len = 0;
+
+    // Only used for frames of several payloads and pings. A single payload is sent
+    // with the header its producer built in front of it.
+    uint8_t header[WS_MAX_HEADER_LEN];
+    uint8_t header_len = 0;
+
+    // Header and payload bytes and how many of them were sent. 0 while the frame is assembled.
+    size_t total = 0;
+    size_t sent = 0;
+};
 
-        if (*this->payload_ref_counter > 0) {
-            --(*this->payload_ref_counter);
+// Latest value wins: A client has at most one item per topic queued. The item references
+// the topic, the payload is stored in latest. A newer payload of the topic replaces the
+// queued one instead of being queued as well, so a client that falls behind skips
+// superseded states instead of working through all of them. Only frames without topic
+// are dropped if the queue is full: States are sent once there is space again.
+//
+// Producers (the main loop, the keep alive task, ...) serialize on clients_mutex.
+// The httpd task pops without locking, so it only waits for a producer when it
+// assigns or releases a client. Only the httpd task does this: Clients are assigned
+// after the handshake and released when httpd closes the session. Producers walk
+// the clients without asking httpd for its sessions.
+struct ws_client {
+    int fd = -1;
+    WebSocketsProtocol protocol = WebSocketsProtocol::JSON;
+    TF_SPSCQueue<ws_work_item, WS_CLIENT_QUEUE_SIZE> queue;
+
+    // Newest not yet sent payload per topic. Exchanged atomically by producers and the httpd task.
+    ws_payload **latest = nullptr;
+    int topic_count = 0;
+    // Set if the queue was full when a topic's item had to be queued.
+    std::atomic<bool> topics_without_item{false};
+
+    // httpd task only. Sockets are written without blocking: If the socket buffer is full,
+    // the rest of the frame is sent in a later call of work. Nothing else is sent to the client before.
+    ws_frame frame;
+    // A ping was popped while a data frame was assembled. It is sent after that frame.
+    bool ping_pending = false;
+    // Popped payload that did not fit into the last frame.
+    ws_payload *overflow = nullptr;
+    // Set by the httpd task if sending failed. httpd closes the session and then releases the client.
+    std::atomic<bool> closing{false};
+
+    // Set if the handshake was authenticated with a session token. The token is checked again for each
+    // command and keep alive check, so that the socket does not outlive its session's expiry or logout.
+    bool has_session = false;
+    char session_token[SESSION_TOKEN_LEN];
+
+    // Metrics. sent counts frames, messages the messages coalesced into them.
+    uint32_t sent = 0;
+    uint32_t messages = 0;
+    uint32_t dropped = 0;
+    uint32_t superseded = 0;
+    uint32_t max_queued = 0;
+};
+
+static std::mutex clients_mutex;
+static ws_client clients[max_clients];
+// Indexed by protocol.
+static std::atomic<int> client_count[WS_PROTOCOL_COUNT];
+// Set while a call of work is queued, to not flood the httpd control socket.
+static std::atomic<bool> work_queued{false};
+// Set by producers. The flush task queues a call of work every WS_BATCH_INTERVAL_MS if set,
+// so that all messages queued in between are coalesced.
+static std::atomic<bool> work_pending{false};
+
+static void work(void *arg);
+
+static void frame_release(ws_frame &frame)
+{
+    for (size_t i = 0; i < frame.count; ++i)
+        payload_release(frame.payloads[i]);
+
+    frame.count = 0;
+    frame.len = 0;
+    frame.header_len = 0;
+    frame.total = 0;
+    frame.sent = 0;
+}
+
+// Has to be called with clients_mutex locked. Takes a reference of payload if it was queued.
+static bool enqueue_work(ws_client &client, ws_payload *payload, int topic)
+{
+    if (client.closing)
+        return false;
+
+    if (topic != WS_NO_TOPIC && topic < client.topic_count) {
+        payload_ref(payload);
+        ws_payload *old = __atomic_exchange_n(&client.latest[topic], payload, __ATOMIC_ACQ_REL);
+        if (old != nullptr) {
+            // The queued item of this topic sends the new payload.
+            payload_release(old);
+            ++client.superseded;
+            return true;
+        }
+
+        if (client.queue.push(ws_work_item{nullptr, topic})) {
+            client.max_queued = std::max(client.max_queued, (uint32_t)client.queue.used());
+            return true;
         }
-        if (*this->payload_ref_counter == 0) {
-            free(this->payload);
-            free(this->payload_ref_counter);
+
+        // The newest state must not get lost: The httpd task sends it once the queue is empty.
+        client.topics_without_item = true;
+        return true;
+    } else {
+        if (payload != nullptr)
+            payload_ref(payload);
+
+        if (client.queue.push(ws_work_item{payload, WS_NO_TOPIC})) {
+            client.max_queued = std::max(client.max_queued, (uint32_t)client.queue.used());
+            return true;
         }
+
+        payload_release(payload);
     }
-};
 
-std::mutex work_queue_mutex;
-std::deque<ws_work_item> work_queue;
+    ++client.dropped;
+    // Log the first drop and then every 100th.
+    if (client.dropped % 100 == 1)
+        logger.printfln("Web socket client %d can't keep up. Dropped %u frames so far.", client.fd, client.dropped);
+
+    return false;
+}
+
+static void schedule_work(httpd_handle_t hd)
+{
+    if (work_queued.exchange(true))
+        return;
+
+    if (httpd_queue_work(hd, work, nullptr) != ESP_OK) {
+        work_queued = false;
+        logger.printfln("httpd_queue_work failed!");
+    }
+}
+
+// httpd task only.
+static void release_client(ws_client &client)
+{
+    if (client.fd < 0)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock{clients_mutex};
+        client.fd = -1;
+    }
+
+    --client_count[(size_t)client.protocol];
+
+    // No producer touches the client anymore.
+    ws_work_item wi;
+    while (client.queue.pop(&wi))
+        payload_release(wi.payload);
+
+    for (int i = 0; i < client.topic_count; ++i)
+        payload_release(client.latest[i]);
+
+    free(client.latest);
+    client.latest = nullptr;
+    client.topic_count = 0;
+    client.topics_without_item = false;
+
+    frame_release(client.frame);
+    client.ping_pending = false;
+    payload_release(client.overflow);
+    client.overflow = nullptr;
+    client.closing = false;
+    client.has_session = false;
+}
+
+// httpd task only.
+// session_token is nullptr if the client did not authenticate with a session token.
+static bool assign_client(int fd, int topic_count, WebSocketsProtocol protocol, const char *session_token)
+{
+    ws_client *free_client = nullptr;
+
+    for (auto &client : clients) {
+        if (client.fd < 0 && free_client == nullptr)
+            free_client = &client;
+    }
+
+    if (free_client == nullptr)
+        return false;
+
+    ws_payload **latest = nullptr;
+    if (topic_count > 0) {
+        latest = (ws_payload **)calloc(topic_count, sizeof(ws_payload *));
+        if (latest == nullptr)
+            return false;
+    }
+
+    std::lock_guard<std::mutex> lock{clients_mutex};
+    free_client->latest = latest;
+    free_client->topic_count = topic_count;
+    free_client->sent = 0;
+    free_client->messages = 0;
+    free_client->dropped = 0;
+    free_client->superseded = 0;
+    free_client->max_queued = 0;
+    free_client->protocol = protocol;
+    free_client->has_session = session_token != nullptr;
+    if (session_token != nullptr)
+        memcpy(free_client->session_token, session_token, SESSION_TOKEN_LEN);
+    free_client->fd = fd;
+    ++client_count[(size_t)protocol];
+    return true;
+}
+
+// httpd task only.
+static ws_client *find_client(int fd)
+{
+    for (auto &client : clients)
+        if (client.fd == fd)
+            return &client;
+
+    return nullptr;
+}
+
+// httpd task only.
+static void release_client_fd(int fd)
+{
+    for (auto &client : clients)
+        if (client.fd == fd)
+            release_client(client);
+}
 
 static void removeFd(wss_keep_alive_t h, int fd){
     wss_keep_alive_remove_client(h, fd);
@@ -84,11 +383,74 @@ void wss_close_fd(wss_keep_alive_t hd, int sockfd)
     removeFd(hd, sockfd);
 }
 
+// Returns true if the comma separated list of the Sec-WebSocket-Protocol header contains protocol.
+static bool subprotocol_offered(httpd_req_t *req, const char *protocol)
+{
+    char buf[64];
+    esp_err_t ret = httpd_req_get_hdr_value_str(req, "Sec-WebSocket-Protocol", buf, sizeof(buf));
+    if (ret != ESP_OK && ret != ESP_ERR_HTTPD_RESULT_TRUNC)
+        return false;
+
+    size_t protocol_len = strlen(protocol);
+    char *save_ptr;
+    for (char *token = strtok_r(buf, ",", &save_ptr); token != nullptr; token = strtok_r(nullptr, ",", &save_ptr)) {
+        while (*token == ' ')
+            ++token;
+
+        size_t token_len = strlen(token);
+        while (token_len > 0 && token[token_len - 1] == ' ')
+            --token_len;
+
+        if (token_len == protocol_len && memcmp(token, protocol, protocol_len) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+// Browsers send the origin of the page that opens a web socket. Other sites must not open web
+// sockets with the credentials of a browser that is logged in to this device and send commands
+// through them, so the origin's host and port have to match the Host header. Clients that are
+// not browsers usually send no Origin header and are accepted.
+static bool origin_allowed(httpd_req_t *req)
+{
+    if (httpd_req_get_hdr_value_len(req, "Origin") == 0)
+        return true;
+
+    auto request = WebServerRequest{req};
+    char origin[96];
+    char host[64];
+    if (request.header("Origin", origin, sizeof(origin)) < 0 || request.header("Host", host, sizeof(host)) < 0)
+        return false;
+
+    // scheme "://" host [":" port]. Opaque origins are serialized as "null".
+    const char *origin_host = strstr(origin, "://");
+    if (origin_host == nullptr)
+        return false;
+
+    return strcasecmp(origin_host + 3, host) == 0;
+}
+
+// Returns the valid session token of the handshake request or nullptr. buf receives the header the token points into.
+static const char *handshake_session_token(WebServerRequest &request, char *buf, size_t buf_len)
+{
+    if (server.username == "" || server.password == "" || getSessionLifetime() == 0)
+        return nullptr;
+
+    // authenticate prefers a valid session token over digest authentication.
+    const char *token;
+    int token_len = getSessionToken(request, buf, buf_len, &token);
+    if (token_len != SESSION_TOKEN_LEN || !checkSessionToken(token, token_len))
+        return nullptr;
+
+    return token;
+}
+
 static esp_err_t ws_handler(httpd_req_t *req)
 {
     if (req->method == HTTP_GET) {
         auto request = WebServerRequest{req};
-        if (server.username != "" && server.password != "" && !authenticate(request, server.username.c_str(), server.password.c_str())) {
+        if (server.username != "" && server.password != "" && !authenticate(request)) {
             if (server.on_not_authorized) {
                 server.on_not_authorized(request);
                 return ESP_OK;
@@ -99,9 +461,19 @@ static esp_err_t ws_handler(httpd_req_t *req)
 
         struct httpd_req_aux *aux = (struct httpd_req_aux *)req->aux;
         if (aux->ws_handshake_detect) {
+            if (!origin_allowed(req)) {
+                logger.printfln("Web socket client %d rejected: Origin does not match Host", httpd_req_to_sockfd(req));
+                request.send(403, "text/plain", "Origin does not match Host");
+                return ESP_OK;
+            }
+
             //logger.printfln("Responding WS handshake to sock %d", aux->sd->fd);
+            WebSocketsProtocol protocol = WebSocketsProtocol::JSON;
+            if (subprotocol_offered(req, WS_CBOR_SUBPROTOCOL))
+                protocol = WebSocketsProtocol::CBOR;
+
             struct httpd_data *hd = (struct httpd_data *)server.httpd;
-            esp_err_t ret = httpd_ws_respond_server_handshake(&hd->hd_req, nullptr);
+            esp_err_t ret = httpd_ws_respond_server_handshake(&hd->hd_req, protocol == WebSocketsProtocol::CBOR ? WS_CBOR_SUBPROTOCOL : nullptr);
             if (ret != ESP_OK) {
                 return ret;
             }
@@ -115,10 +487,18 @@ static esp_err_t ws_handler(httpd_req_t *req)
 
             int sock = httpd_req_to_sockfd(req);
             WebSockets *ws = (WebSockets *)req->user_ctx;
+            char token_buf[512];
+            const char *session_token = handshake_session_token(request, token_buf, sizeof(token_buf));
+            if (!assign_client(sock, ws->topic_count, protocol, session_token)) {
+                logger.printfln("Web socket client %d rejected: No free client slot", sock);
+                httpd_sess_trigger_close(req->handle, sock);
+                return ESP_OK;
+            }
+
             wss_open_fd(ws->keep_alive, sock);
 
             if (ws->on_client_connect_fn) {
-                ws->on_client_connect_fn(WebSocketsClient{sock, ws});
+                ws->on_client_connect_fn(WebSocketsClient{sock, ws, protocol});
             }
         }
         return ESP_OK;
@@ -135,6 +515,12 @@ static esp_err_t ws_handler(httpd_req_t *req)
         return ret;
     }
     //logger.printfln("frame len is %d", ws_pkt.len);
+    if (ws_pkt.len > WS_MAX_RECEIVE_LEN) {
+        // The rest of the frame can't be skipped: Make httpd close the connection.
+        logger.printfln("Web socket client %d sent a frame of %u bytes. Closing connection.", httpd_req_to_sockfd(req), ws_pkt.len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
     if (ws_pkt.len) {
         /* ws_pkt.len + 1 is for NULL termination as we are expecting a string */
         buf = (uint8_t *)calloc(1, ws_pkt.len + 1);
@@ -159,21 +545,24 @@ static esp_err_t ws_handler(httpd_req_t *req)
         WebSockets *ws = (WebSockets *)req->user_ctx;
         return wss_keep_alive_client_is_active(ws->keep_alive, httpd_req_to_sockfd(req));
     } else if (ws_pkt.type == HTTPD_WS_TYPE_TEXT) {
-        // If it was a TEXT message, print it
-        logger.printfln("Received packet with message: %s", ws_pkt.payload);
-        /*ret = httpd_ws_send_frame(req, &ws_pkt);
-        if (ret != ESP_OK) {
-            logger.printfln("httpd_ws_send_frame failed with %d", ret);
+        WebSockets *ws = (WebSockets *)req->user_ctx;
+        int sock = httpd_req_to_sockfd(req);
+        ws_client *client = find_client(sock);
+        if (client != nullptr && client->has_session && !checkSessionToken(client->session_token, SESSION_TOKEN_LEN)) {
+            // Make httpd close the connection.
+            logger.printfln("Web socket client %d sent a command after its session expired or was revoked. Closing connection.", sock);
+            free(buf);
+            return ESP_FAIL;
         }
-        logger.printfln("ws_handler: httpd_handle_t=%p, sockfd=%d, client_info:%d", req->handle,
-                 httpd_req_to_sockfd(req), httpd_ws_get_fd_info(req->handle, httpd_req_to_sockfd(req)));
-        free(buf);
-        return ret;*/
+        if (client != nullptr && ws->on_message_fn && buf != nullptr)
+            ws->on_message_fn(WebSocketsClient{sock, ws, client->protocol}, (char *)buf, ws_pkt.len);
     } else if (ws_pkt.type == HTTPD_WS_TYPE_CLOSE) {
         // If it was a CLOSE, remove it from the keep-alive list
         free(buf);
         WebSockets *ws = (WebSockets *)req->user_ctx;
-        wss_close_fd(ws->keep_alive, httpd_req_to_sockfd(req));
+        int sock = httpd_req_to_sockfd(req);
+        wss_close_fd(ws->keep_alive, sock);
+        release_client_fd(sock);
         return ESP_OK;
     }
     free(buf);
@@ -188,233 +577,394 @@ bool client_not_alive_cb(wss_keep_alive_t h, int fd)
     return true;
 }
 
-static void work(void *arg)
+enum class SendResult {
+    Done,
+    // The socket buffer is full.
+    WouldBlock,
+    Failed,
+};
+
+// Returns the next unsent part of the frame that is contiguous in memory.
+static void frame_unsent_part(const ws_frame &frame, const uint8_t **buf, size_t *len)
 {
-    while (!work_queue.empty()) {
-        ws_work_item wi = work_queue.front();
-        {
-            std::lock_guard<std::mutex> lock{work_queue_mutex};
-            work_queue.pop_front();
-        }
-        if (httpd_ws_get_fd_info(wi.hd, wi.fd) != HTTPD_WS_CLIENT_WEBSOCKET) {
-            wi.clear();
-            continue;
-        }
+    size_t offset = frame.sent;
+
+    if (frame.header_len == 0) {
+        const ws_payload *p = frame.payloads[0];
+        *buf = (const uint8_t *)p->data - p->header_len + offset;
+        *len = frame.total - offset;
+        return;
+    }
 
-        httpd_ws_frame_t ws_pkt;
-        memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
+    if (offset < frame.header_len) {
+        *buf = frame.header + offset;
+        *len = frame.header_len - offset;
+        return;
+    }
+
+    offset -= frame.header_len;
+    size_t i = 0;
+    while (offset >= frame.payloads[i]->len) {
+        offset -= frame.payloads[i]->len;
+        ++i;
+    }
 
-        ws_pkt.payload = (uint8_t *)wi.payload;
-        ws_pkt.len = wi.payload_len;
-        ws_pkt.type = wi.payload_len == 0 ? HTTPD_WS_TYPE_PING : HTTPD_WS_TYPE_TEXT;
+    *buf = (const uint8_t *)frame.payloads[i]->data + offset;
+    *len = frame.payloads[i]->len - offset;
+}
+
+// Stops serving the client. Its frames can't be sent anymore and the client
+// would otherwise get the following frames without the lost one.
+static void close_client(httpd_handle_t hd, ws_client &client)
+{
+    logger.printfln("Failed to send to web socket client %d. Closing connection.", client.fd);
+    client.closing = true;
+    frame_release(client.frame);
+    httpd_sess_trigger_close(hd, client.fd);
+}
 
-        auto result = httpd_ws_send_frame_async(wi.hd, wi.fd, &ws_pkt);
-        if (result != ESP_OK) {
-            printf("failed to send frame: %d\n", result);
+// Sends the rest of the client's frame without blocking. Releases the frame's payloads once it is sent.
+static SendResult send_frame(httpd_handle_t hd, ws_client &client)
+{
+    ws_frame &frame = client.frame;
+
+    while (frame.sent < frame.total) {
+        const uint8_t *buf;
+        size_t len;
+        frame_unsent_part(frame, &buf, &len);
+
+        int sent = httpd_socket_send(hd, client.fd, (const char *)buf, len, MSG_DONTWAIT);
+        if (sent == HTTPD_SOCK_ERR_TIMEOUT)
+            return SendResult::WouldBlock;
+
+        if (sent < 0) {
+            close_client(hd, client);
+            return SendResult::Failed;
         }
 
-        wi.clear();
+        frame.sent += sent;
     }
+
+    ++client.sent;
+    client.messages += frame.count;
+    frame_release(frame);
+    return SendResult::Done;
 }
 
-bool check_client_alive_cb(wss_keep_alive_t h, int fd)
+// Finishes assembling the client's frame and starts sending it.
+static SendResult start_frame(httpd_handle_t hd, ws_client &client)
 {
-    httpd_handle_t hd = (httpd_handle_t)wss_keep_alive_get_user_ctx(h);
-
-    {
-        std::lock_guard<std::mutex> lock{work_queue_mutex};
-        work_queue.emplace_back(hd, fd, nullptr, 0, nullptr);
+    ws_frame &frame = client.frame;
+
+    if (frame.count == 0)
+        return SendResult::Done;
+
+    if (frame.count == 1) {
+        // Use the header built by the producer.
+        frame.header_len = 0;
+        frame.total = frame.payloads[0]->header_len + frame.len;
+    } else {
+        frame.header_len = build_header(frame.header, frame.len, client.protocol);
+        frame.total = frame.header_len + frame.len;
     }
-    return httpd_queue_work(hd, work, nullptr) == ESP_OK;
+
+    return send_frame(hd, client);
 }
 
-void WebSocketsClient::send(const char* payload, size_t payload_len)
+static SendResult start_ping(httpd_handle_t hd, ws_client &client)
 {
-    ws->sendToClient(payload, payload_len, fd);
+    ws_frame &frame = client.frame;
+
+    client.ping_pending = false;
+    memcpy(frame.header, ping_frame, sizeof(ping_frame));
+    frame.header_len = sizeof(ping_frame);
+    frame.total = sizeof(ping_frame);
+
+    return send_frame(hd, client);
 }
 
-void WebSockets::sendToClient(const char *payload, size_t payload_len, int sock)
+// A payload that doesn't fit into the frame anymore is stored in client.overflow. It starts the next frame.
+static void add_to_frame(ws_client &client, ws_payload *p)
 {
-    httpd_handle_t httpd = server.httpd;
-    int *payload_ref_counter = (int *)malloc(sizeof(int));
-    if (payload_ref_counter == nullptr)
-        return;
-    char *payload_copy = (char *)malloc(payload_len * sizeof(char));
-    if (payload_copy == nullptr) {
-        free(payload_ref_counter);
+    ws_frame &frame = client.frame;
+
+    if (frame.count == WS_BATCH_MAX_MESSAGES || (frame.count > 0 && frame.len + p->len > WS_BATCH_MAX_LEN)) {
+        client.overflow = p;
         return;
     }
 
-    memcpy(payload_copy, payload, payload_len);
+    frame.payloads[frame.count++] = p;
+    frame.len += p->len;
+}
+
+static void add_topic_to_frame(ws_client &client, int topic)
+{
+    // The payload was already sent if the topic was superseded while it did not have an item.
+    ws_payload *payload = __atomic_exchange_n(&client.latest[topic], nullptr, __ATOMIC_ACQ_REL);
+    if (payload != nullptr)
+        add_to_frame(client, payload);
+}
 
-    *payload_ref_counter = 1;
+// Sends at most one frame to the client. Returns false if there was nothing to send
+// or the socket buffer is still full.
+static bool serve_client(httpd_handle_t hd, ws_client &client)
+{
+    ws_frame &frame = client.frame;
 
-    {
-        // TODO: locking here means, that we assume, the sock fd is valid up to now.
-        // This holds true if sendToClient is only called from the onClientConnect callback,
-        // i.e. from the same thread.
-        std::lock_guard<std::mutex> lock{work_queue_mutex};
-        work_queue.emplace_back(httpd, sock, payload_copy, payload_len, payload_ref_counter);
+    if (client.closing)
+        return false;
+
+    // Complete the frame that did not fit into the socket buffer last time.
+    if (frame.total > 0) {
+        size_t sent_before = frame.sent;
+        SendResult result = send_frame(hd, client);
+        return result == SendResult::Done || (result == SendResult::WouldBlock && frame.sent != sent_before);
     }
 
-    if (httpd_queue_work(httpd, work, nullptr) != ESP_OK) {
-        logger.printfln("httpd_queue_work failed!");
+    if (client.ping_pending) {
+        start_ping(hd, client);
+        return true;
     }
-}
 
-bool WebSockets::haveActiveClient()
-{
-    httpd_handle_t httpd = server.httpd;
-    size_t clients = 7;
-    int client_fds[7];
+    bool popped = false;
 
-    auto result = httpd_get_client_list(httpd, &clients, client_fds);
-    if (result != ESP_OK) {
-        logger.printfln("httpd_get_client_list failed! %d", result);
-        return false;
+    if (client.overflow != nullptr) {
+        ws_payload *p = client.overflow;
+        client.overflow = nullptr;
+        add_to_frame(client, p);
+        popped = true;
     }
 
-    int active_clients = 0;
-    int http_clients = 0;
-    int invalid_clients = 0;
-    int unknown_clients = 0;
-    //printf("payload (len: %d) after copy: %s\n", payload_len, payload_copy);
-
-    for (size_t i = 0; i < clients; ++i)
-        if (httpd_ws_get_fd_info(httpd, client_fds[i]) == HTTPD_WS_CLIENT_WEBSOCKET)
-            ++active_clients;
-        else if (httpd_ws_get_fd_info(httpd, client_fds[i]) == HTTPD_WS_CLIENT_HTTP)
-            ++http_clients;
-        else if (httpd_ws_get_fd_info(httpd, client_fds[i]) == HTTPD_WS_CLIENT_INVALID)
-            ++invalid_clients;
+    ws_work_item wi;
+    while (client.overflow == nullptr && frame.count < WS_BATCH_MAX_MESSAGES && frame.len < WS_BATCH_MAX_LEN && client.queue.pop(&wi)) {
+        popped = true;
+
+        if (wi.topic != WS_NO_TOPIC)
+            add_topic_to_frame(client, wi.topic);
+        else if (wi.payload == nullptr)
+            // Control frames can't be part of a data frame. The ping is sent after this frame.
+            client.ping_pending = true;
         else
-            ++unknown_clients;
+            add_to_frame(client, wi.payload);
+    }
+
+    // The queue is empty: Send the states that did not fit into it.
+    if (frame.count == 0 && client.overflow == nullptr && client.topics_without_item.exchange(false)) {
+        popped = true;
+        for (int topic = 0; topic < client.topic_count && client.overflow == nullptr; ++topic)
+            add_topic_to_frame(client, topic);
+
+        // The remaining topics follow in a later frame.
+        if (client.overflow != nullptr)
+            client.topics_without_item = true;
+    }
 
-    return active_clients != 0;
+    start_frame(hd, client);
+    return popped;
 }
 
-void WebSockets::sendToAllOwned(char *payload, size_t payload_len)
+static void work(void *arg)
 {
-    httpd_handle_t httpd = server.httpd;
-    size_t clients = 7;
-    int client_fds[7];
+    // Producers that push from now on schedule another call.
+    work_queued = false;
 
-    auto result = httpd_get_client_list(httpd, &clients, client_fds);
-    if (result != ESP_OK) {
-        logger.printfln("httpd_get_client_list failed! %d", result);
-        return;
+    httpd_handle_t hd = server.httpd;
+
+    // Round robin: One frame per client and turn, so a client with a long queue does not delay the others' frames.
+    // A client whose socket buffer is full is skipped until the next call.
+    bool any_sent;
+    do {
+        any_sent = false;
+
+        for (auto &client : clients) {
+            if (client.fd < 0)
+                continue;
+
+            any_sent |= serve_client(hd, client);
+        }
+    } while (any_sent);
+
+    // Retry the frames that did not fit into the socket buffers with the next batch.
+    for (auto &client : clients) {
+        if (client.fd >= 0 && client.frame.total > 0) {
+            work_pending = true;
+            break;
+        }
     }
+}
 
-    int active_clients = 0;
-    int http_clients = 0;
-    int invalid_clients = 0;
-    int unknown_clients = 0;
-    //printf("payload (len: %d) after copy: %s\n", payload_len, payload_copy);
-
-    for (size_t i = 0; i < clients; ++i)
-        if (httpd_ws_get_fd_info(httpd, client_fds[i]) == HTTPD_WS_CLIENT_WEBSOCKET)
-            ++active_clients;
-        else if (httpd_ws_get_fd_info(httpd, client_fds[i]) == HTTPD_WS_CLIENT_HTTP)
-            ++http_clients;
-        else if (httpd_ws_get_fd_info(httpd, client_fds[i]) == HTTPD_WS_CLIENT_INVALID)
-            ++invalid_clients;
-        else
-            ++unknown_clients;
+bool check_client_alive_cb(wss_keep_alive_t h, int fd)
+{
+    bool has_session = false;
+    char session_token[SESSION_TOKEN_LEN];
 
-    /*printf("active_clients %d, http_clients %d, invalid_clients %d, unknown_clients %d\n",
-            active_clients,
-            http_clients,
-            invalid_clients,
-            unknown_clients);*/
+    {
+        std::lock_guard<std::mutex> lock{clients_mutex};
+        ws_client *client = nullptr;
+        for (auto &c : clients)
+            if (c.fd == fd)
+                client = &c;
 
-    if (active_clients == 0)
-        return;
+        if (client == nullptr)
+            return false;
 
-    int *payload_ref_counter = (int *)malloc(sizeof(int));
-    if (payload_ref_counter == nullptr)
-        return;
+        has_session = client->has_session;
+        memcpy(session_token, client->session_token, SESSION_TOKEN_LEN);
+    }
+
+    // Also close sockets that only receive state updates once their session ended.
+    if (has_session && !checkSessionToken(session_token, SESSION_TOKEN_LEN)) {
+        logger.printfln("Session of web socket client %d expired or was revoked. Closing connection.", fd);
+        httpd_sess_trigger_close(wss_keep_alive_get_user_ctx(h), fd);
+        wss_close_fd(h, fd);
+        return false;
+    }
 
-    *payload_ref_counter = active_clients;
+    {
+        std::lock_guard<std::mutex> lock{clients_mutex};
+        ws_client *client = nullptr;
+        for (auto &c : clients)
+            if (c.fd == fd)
+                client = &c;
+
+        if (client == nullptr || !enqueue_work(*client, nullptr, WS_NO_TOPIC))
+            return false;
+    }
 
-    std::lock_guard<std::mutex> lock{work_queue_mutex};
-    for (size_t i = 0; i < clients; ++i) {
-        int sock = client_fds[i];
-        if (httpd_ws_get_fd_info(httpd, sock) != HTTPD_WS_CLIENT_WEBSOCKET) {
-            continue;
-        }
+    work_pending = true;
+    return true;
+}
 
-        work_queue.emplace_back(httpd, sock, payload, payload_len, payload_ref_counter);
+void WebSocketsClient::send(const char* payload, size_t payload_len)
+{
+    ws->sendToClient(payload, payload_len, fd);
+}
+
+void WebSocketsClient::sendOwned(char *payload, size_t payload_len)
+{
+    ws->sendToClientOwned(payload, payload_len, fd);
+}
 
-        if (httpd_queue_work(httpd, work, nullptr) != ESP_OK) {
-            logger.printfln("httpd_queue_work failed!");
+void WebSockets::sendToClient(const char *payload, size_t payload_len, int sock)
+{
+    char *payload_copy = allocatePayload(payload_len);
+    if (payload_copy == nullptr)
+        return;
+
+    memcpy(payload_copy, payload, payload_len);
+    sendToClientOwned(payload_copy, payload_len, sock);
+}
+
+void WebSockets::sendToClientOwned(char *payload, size_t payload_len, int sock)
+{
+    ws_payload *p = payload_from_data(payload);
+    p->len = payload_len;
+
+    bool queued = false;
+    {
+        std::lock_guard<std::mutex> lock{clients_mutex};
+        for (auto &client : clients) {
+            if (client.fd == sock) {
+                payload_build_header(p, client.protocol);
+                queued = enqueue_work(client, p, WS_NO_TOPIC);
+            }
         }
     }
+
+    payload_release(p);
+
+    if (queued)
+        work_pending = true;
 }
 
-void WebSockets::sendToAll(const char *payload, size_t payload_len)
+bool WebSockets::haveActiveClient()
 {
-    httpd_handle_t httpd = server.httpd;
-    size_t clients = 7;
-    int client_fds[7];
+    for (size_t i = 0; i < WS_PROTOCOL_COUNT; ++i)
+        if (client_count[i] > 0)
+            return true;
 
-    auto result = httpd_get_client_list(httpd, &clients, client_fds);
-    if (result != ESP_OK) {
-        logger.printfln("httpd_get_client_list failed! %d", result);
-        return;
+    return false;
+}
+
+bool WebSockets::haveActiveClient(WebSocketsProtocol protocol)
+{
+    return client_count[(size_t)protocol] > 0;
+}
+
+char *WebSockets::allocatePayload(size_t payload_len)
+{
+    ws_payload *p = payload_alloc(payload_len);
+    return p == nullptr ? nullptr : p->data;
+}
+
+void WebSockets::freePayload(char *payload)
+{
+    payload_release(payload_from_data(payload));
+}
+
+void WebSockets::sendToAllOwned(char *payload, size_t payload_len, int topic, WebSocketsProtocol protocol)
+{
+    ws_payload *p = payload_from_data(payload);
+    p->len = payload_len;
+    payload_build_header(p, protocol);
+
+    bool queued = false;
+    {
+        std::lock_guard<std::mutex> lock{clients_mutex};
+        for (auto &client : clients)
+            if (client.fd >= 0 && client.protocol == protocol)
+                queued |= enqueue_work(client, p, topic);
     }
 
-    int active_clients = 0;
-    int http_clients = 0;
-    int invalid_clients = 0;
-    int unknown_clients = 0;
-    //printf("payload (len: %d) after copy: %s\n", payload_len, payload_copy);
-
-    for (size_t i = 0; i < clients; ++i)
-        if (httpd_ws_get_fd_info(httpd, client_fds[i]) == HTTPD_WS_CLIENT_WEBSOCKET)
-            ++active_clients;
-        else if (httpd_ws_get_fd_info(httpd, client_fds[i]) == HTTPD_WS_CLIENT_HTTP)
-            ++http_clients;
-        else if (httpd_ws_get_fd_info(httpd, client_fds[i]) == HTTPD_WS_CLIENT_INVALID)
-            ++invalid_clients;
-        else
-            ++unknown_clients;
+    payload_release(p);
 
-    /*printf("active_clients %d, http_clients %d, invalid_clients %d, unknown_clients %d\n",
-            active_clients,
-            http_clients,
-            invalid_clients,
-            unknown_clients);*/
+    if (queued)
+        work_pending = true;
+}
 
-    if (active_clients == 0)
+void WebSockets::sendToAll(const char *payload, size_t payload_len, WebSocketsProtocol protocol)
+{
+    if (!haveActiveClient(protocol))
         return;
 
-    int *payload_ref_counter = (int *)malloc(sizeof(int));
-    if (payload_ref_counter == nullptr)
+    char *payload_copy = allocatePayload(payload_len);
+    if (payload_copy == nullptr)
         return;
 
-    *payload_ref_counter = active_clients;
+    memcpy(payload_copy, payload, payload_len);
+    sendToAllOwned(payload_copy, payload_len, WS_NO_TOPIC, protocol);
+}
 
-    char *payload_copy = (char *)malloc(payload_len * sizeof(char));
-    if (payload_copy == nullptr) {
-        free(payload_ref_counter);
-        return;
-    }
+int WebSockets::registerTopic()
+{
+    return topic_count++;
+}
 
-    memcpy(payload_copy, payload, payload_len);
+String WebSockets::getClientMetrics()
+{
+    String result = "[";
 
-    std::lock_guard<std::mutex> lock{work_queue_mutex};
-    for (size_t i = 0; i < clients; ++i) {
-        int sock = client_fds[i];
-        if (httpd_ws_get_fd_info(httpd, sock) != HTTPD_WS_CLIENT_WEBSOCKET) {
+    std::lock_guard<std::mutex> lock{clients_mutex};
+    for (auto &client : clients) {
+        if (client.fd < 0)
             continue;
-        }
-
-        work_queue.emplace_back(httpd, sock, payload_copy, payload_len, payload_ref_counter);
 
-        if (httpd_queue_work(httpd, work, nullptr) != ESP_OK) {
-            logger.printfln("httpd_queue_work failed!");
-        }
+        char buf[192];
+        snprintf(buf, sizeof(buf), "%s{\"fd\":%d,\"protocol\":\"%s\",\"queued\":%u,\"max_queued\":%u,\"sent\":%u,\"messages\":%u,\"dropped\":%u,\"superseded\":%u}",
+                 result.length() > 1 ? "," : "",
+                 client.fd,
+                 client.protocol == WebSocketsProtocol::CBOR ? "cbor" : "json",
+                 client.queue.used(),
+                 client.max_queued,
+                 client.sent,
+                 client.messages,
+                 client.dropped,
+                 client.superseded);
+        result += buf;
     }
+
+    result += "]";
+    return result;
 }
 
 void WebSockets::start(const char *uri)
@@ -445,11 +995,27 @@ void WebSockets::start(const char *uri)
     httpd_register_uri_handler(httpd, &ws);
     wss_keep_alive_set_user_ctx(keep_alive, httpd);
 
-    //server.onConnect([this](int fd) {removeFd(this->keep_alive, fd);});
-    //server.onDisconnect([this](int fd) {removeFd(this->keep_alive, fd);});
+    task_scheduler.scheduleWithFixedDelay("ws_flush", [](){
+        if (work_pending.exchange(false))
+            schedule_work(server.httpd);
+    }, WS_BATCH_INTERVAL_MS, WS_BATCH_INTERVAL_MS);
+
+    server.onDisconnect([this](int fd) {
+        for (auto &client : clients) {
+            if (client.fd == fd) {
+                wss_close_fd(keep_alive, fd);
+                release_client(client);
+            }
+        }
+    });
 }
 
 void WebSockets::onConnect(std::function<void(WebSocketsClient)> fn)
 {
     on_client_connect_fn = fn;
 }
+
+void WebSockets::onMessage(std::function<void(WebSocketsClient, char *, size_t)> fn)
+{
+    on_message_fn = fn;
+}
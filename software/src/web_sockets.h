@@ -25,13 +25,48 @@
 
 #include "keep_alive.h"
 
+// Frames that don't belong to a topic. See WebSockets::registerTopic.
+#define WS_NO_TOPIC -1
+
+// Messages queued within this interval are coalesced into one frame per client.
+#ifndef WS_BATCH_INTERVAL_MS
+#define WS_BATCH_INTERVAL_MS 100
+#endif
+
+// Upper bounds of a coalesced frame. A message longer than WS_BATCH_MAX_LEN is sent as its own frame.
+#ifndef WS_BATCH_MAX_MESSAGES
+#define WS_BATCH_MAX_MESSAGES 16
+#endif
+
+#ifndef WS_BATCH_MAX_LEN
+#define WS_BATCH_MAX_LEN 4096
+#endif
+
+// Clients choose the protocol with the Sec-WebSocket-Protocol header. Without it, they get JSON text frames.
+enum class WebSocketsProtocol : uint8_t {
+    JSON,
+    // Binary frames that contain a sequence of CBOR items.
+    CBOR,
+};
+
+#define WS_PROTOCOL_COUNT 2
+#define WS_CBOR_SUBPROTOCOL "cbor"
+
+// Longest message a client may send. Longer frames close the connection.
+#ifndef WS_MAX_RECEIVE_LEN
+#define WS_MAX_RECEIVE_LEN 2048
+#endif
+
 class WebSockets;
 
 struct WebSocketsClient {
     int fd;
     WebSockets *ws;
+    WebSocketsProtocol protocol;
 
     void send(const char *payload, size_t payload_len);
+    // See WebSockets::sendToClientOwned.
+    void sendOwned(char *payload, size_t payload_len);
 };
 
 class WebSockets {
@@ -40,14 +75,37 @@ public:
     void start(const char *uri);
     void stop() {}
 
+    // The payload has to be in the protocol of the client.
     void sendToClient(const char *payload, size_t payload_len, int sock);
-    void sendToAll(const char *payload, size_t payload_len);
-    void sendToAllOwned(char *payload, size_t payload_len);
+    void sendToClientOwned(char *payload, size_t payload_len, int sock);
+    // Sends to the clients that use protocol.
+    void sendToAll(const char *payload, size_t payload_len, WebSocketsProtocol protocol = WebSocketsProtocol::JSON);
+    // Returns a buffer for a payload of up to payload_len bytes for the send*Owned functions or nullptr.
+    char *allocatePayload(size_t payload_len);
+    // Frees a payload that was not passed to a send*Owned function.
+    void freePayload(char *payload);
+
+    // Takes ownership of payload, which has to be allocated with allocatePayload.
+    // The payload is not copied. A client that falls behind only gets the newest
+    // not yet sent payload of a topic.
+    void sendToAllOwned(char *payload, size_t payload_len, int topic = WS_NO_TOPIC, WebSocketsProtocol protocol = WebSocketsProtocol::JSON);
+
+    // Returns a topic for sendToAllOwned. Topics have to be registered before clients connect.
+    int registerTopic();
+
+    // Queue depth, sent, dropped and superseded frames of each client as JSON array.
+    String getClientMetrics();
 
     bool haveActiveClient();
+    bool haveActiveClient(WebSocketsProtocol protocol);
 
     void onConnect(std::function<void(WebSocketsClient)> fn);
+    // Called on the httpd task for each text frame a client sends. The payload is
+    // null-terminated and only valid during the call. fn may modify it.
+    void onMessage(std::function<void(WebSocketsClient, char *, size_t)> fn);
 
     std::function<void(WebSocketsClient)> on_client_connect_fn;
+    std::function<void(WebSocketsClient, char *, size_t)> on_message_fn;
     wss_keep_alive_t keep_alive;
+    int topic_count = 0;
 };
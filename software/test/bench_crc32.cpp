@@ -0,0 +1,65 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+// Compares the slicing-by-4 CRC32 with the previous bitwise implementation
+// on a firmware sized buffer. Run with "make bench".
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <vector>
+
+#include "crc32.h"
+#include "crc32_bitwise.h"
+
+#define BUF_SIZE (1024 * 1024)
+// Chunk size of the firmware upload handler.
+#define CHUNK_SIZE 4096
+#define ROUNDS 20
+
+// Keeps the compiler from optimizing the calculation away.
+static volatile uint32_t sink;
+
+template <typename Fn>
+static void bench(const char *name, const std::vector<uint8_t> &buf, Fn fn)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < ROUNDS; ++i) {
+        uint32_t crc = 0;
+        for (size_t offset = 0; offset < BUF_SIZE; offset += CHUNK_SIZE)
+            fn(buf.data() + offset, CHUNK_SIZE, &crc);
+        sink = crc;
+    }
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("%-44s %9.1f MB/s\n", name, (double)BUF_SIZE * ROUNDS / s / 1e6);
+}
+
+int main()
+{
+    std::vector<uint8_t> buf(BUF_SIZE);
+    for (auto &b : buf)
+        b = rand();
+
+    bench("crc32, bitwise", buf, bitwise_crc32_recalculate);
+    bench("crc32, slicing-by-4", buf, crc32_ieee_802_3_recalculate);
+
+    return 0;
+}
@@ -0,0 +1,140 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+// Compares the cost of checking a digest authentication response. The full computation hashes
+// HA1 (username:realm:password), HA2 (method:uri) and the response for every request. The firmware
+// precomputes HA1 when the credentials are set and caches HA2, so a polling client only costs
+// the response hash and parsing the header. The full computation does not parse a header, so it
+// underestimates the cost of the old implementation. Run with "make bench".
+
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "digest_auth.h"
+#include "mbedtls/md5.h"
+
+#define USERNAME "admin"
+#define PASSWORD "correct horse battery staple"
+#define CNONCE "0a4f113b"
+#define REQUESTS 20000
+
+// Keeps the compiler from optimizing the hashes away.
+static volatile uint32_t sink;
+
+static void md5_hex(const std::string &s, char out[33])
+{
+    static const char digits[] = "0123456789abcdef";
+    mbedtls_md5_context ctx;
+    uint8_t digest[16];
+
+    mbedtls_md5_init(&ctx);
+    mbedtls_md5_starts_ret(&ctx);
+    mbedtls_md5_update_ret(&ctx, (const uint8_t *)s.data(), s.length());
+    mbedtls_md5_finish_ret(&ctx, digest);
+    mbedtls_md5_free(&ctx);
+
+    for (size_t i = 0; i < sizeof(digest); ++i) {
+        out[2 * i] = digits[digest[i] >> 4];
+        out[2 * i + 1] = digits[digest[i] & 0x0F];
+    }
+    out[32] = '\0';
+}
+
+static std::string response_for(const std::string &nonce, const char *nc, const std::string &uri)
+{
+    char ha1[33], ha2[33], response[33];
+    md5_hex(USERNAME ":" DIGEST_REALM ":" PASSWORD, ha1);
+    md5_hex("GET:" + uri, ha2);
+    md5_hex(std::string(ha1) + ":" + nonce + ":" + nc + ":" CNONCE ":auth:" + ha2, response);
+    return response;
+}
+
+static std::string new_nonce()
+{
+    std::string challenge = requestDigestAuthentication(false).c_str();
+    size_t start = challenge.find("nonce=\"") + 7;
+    return challenge.substr(start, challenge.find('"', start) - start);
+}
+
+// Builds REQUESTS valid Authorization headers for one nonce, cycling through uri_count URIs.
+static std::vector<std::string> build_headers(size_t uri_count)
+{
+    std::string nonce = new_nonce();
+    std::vector<std::string> headers;
+
+    for (uint32_t i = 0; i < REQUESTS; ++i) {
+        char nc[9];
+        snprintf(nc, sizeof(nc), "%08x", (unsigned)(i + 1));
+        std::string uri = "/meter/values/" + std::to_string(i % uri_count);
+
+        headers.push_back("username=\"" USERNAME "\", realm=\"" DIGEST_REALM "\", nonce=\"" + nonce + "\", uri=\"" + uri
+                          + "\", algorithm=MD5, response=\"" + response_for(nonce, nc, uri)
+                          + "\", opaque=\"0\", qop=auth, nc=" + nc + ", cnonce=\"" CNONCE "\"");
+    }
+
+    return headers;
+}
+
+template <typename Fn>
+static void bench(const char *name, Fn fn)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < REQUESTS; ++i)
+        fn(i);
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("%-50s %7.2f us/request %9.0f requests/s\n", name, s * 1e6 / REQUESTS, REQUESTS / s);
+}
+
+static void bench_check(const char *name, const std::vector<std::string> &headers)
+{
+    uint32_t failed = 0;
+    bench(name, [&headers, &failed](uint32_t i) {
+        if (checkDigestAuthentication(headers[i].c_str(), headers[i].length(), "GET") != DigestAuthResult::OK)
+            ++failed;
+    });
+
+    if (failed != 0) {
+        printf("%u of %u requests were rejected\n", failed, REQUESTS);
+        exit(1);
+    }
+}
+
+int main()
+{
+    setDigestCredentials(USERNAME, PASSWORD);
+
+    std::string nonce = new_nonce();
+    bench("full HA1 + HA2 + response", [&nonce](uint32_t i) {
+        sink = response_for(nonce, "00000001", "/meter/values/0")[0];
+    });
+
+    // The HA2 cache has 8 entries and is replaced round robin: 16 URIs always miss it.
+    std::vector<std::string> polling = build_headers(1);
+    std::vector<std::string> many_uris = build_headers(16);
+
+    bench_check("precomputed HA1, cached HA2", polling);
+    bench_check("precomputed HA1, HA2 cache miss", many_uris);
+
+    return 0;
+}
@@ -0,0 +1,104 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+// Compression ratio and speed of GzipEncoder on synthetic versions of the responses it compresses,
+// with zlib at level 1 and 6 as reference. zlib uses a 32 KiB window and dynamic Huffman codes,
+// which don't fit into the heap budget of a response. Chunks are written like the handlers send them.
+// Run with "make bench".
+
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "gzip_encoder.h"
+#include "gzip_payloads.h"
+
+#define CHUNK_SIZE 512
+#define MIN_SECONDS 0.2
+
+// Keeps the compiler from optimizing the output away.
+static volatile size_t sink;
+
+static size_t encode(const std::string &data)
+{
+    size_t out_len = 0;
+    GzipEncoder *encoder = new GzipEncoder([&out_len](const uint8_t *out, size_t len) {
+        out_len += len;
+    });
+
+    for (size_t offset = 0; offset < data.size(); offset += CHUNK_SIZE)
+        encoder->write((const uint8_t *)data.data() + offset, std::min((size_t)CHUNK_SIZE, data.size() - offset));
+    encoder->finish();
+    delete encoder;
+
+    return out_len;
+}
+
+static size_t zlib_encode(const std::string &data, int level)
+{
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    deflateInit2(&strm, level, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+
+    std::vector<uint8_t> out(deflateBound(&strm, data.size()));
+    strm.next_in = (uint8_t *)data.data();
+    strm.avail_in = data.size();
+    strm.next_out = out.data();
+    strm.avail_out = out.size();
+    deflate(&strm, Z_FINISH);
+    size_t out_len = strm.total_out;
+    deflateEnd(&strm);
+
+    return out_len;
+}
+
+template <typename Fn>
+static void bench(const char *name, const std::string &data, Fn fn)
+{
+    size_t out_len = 0;
+    size_t rounds = 0;
+    double s = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    do {
+        out_len = fn(data);
+        ++rounds;
+        s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (s < MIN_SECONDS);
+
+    sink = out_len;
+    printf("  %-14s %7zu -> %6zu bytes %5.1f%% %8.1f MB/s\n", name, data.size(), out_len, 100.0 * out_len / data.size(), data.size() * (double)rounds / s / 1e6);
+}
+
+int main()
+{
+    for (const GzipPayload &payload : gzip_payloads(1)) {
+        printf("%s\n", payload.name);
+        bench("GzipEncoder", payload.data, encode);
+        bench("zlib -1", payload.data, [](const std::string &data) { return zlib_encode(data, 1); });
+        bench("zlib -6", payload.data, [](const std::string &data) { return zlib_encode(data, 6); });
+    }
+
+    return 0;
+}
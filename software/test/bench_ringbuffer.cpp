@@ -0,0 +1,154 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+// Compares TF_GenericRingbuffer with TF_Ringbuffer for the access patterns of the firmware:
+// the meter history (one sample pushed, all samples read for /meter/history) and the event log
+// (lines pushed and read in bulk). The event log is also pushed one char at a time, as it was before
+// push_n, to show the gain in lines/s. Run with "make bench".
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+
+#include "ringbuffer.h"
+
+#define HISTORY_SIZE 720
+#define EVENT_BUF_SIZE 10000
+#define ROUNDS 2000
+#define LINES_PER_ROUND 50
+
+// Keeps the compiler from optimizing the reads away.
+static volatile uint32_t sink;
+
+// Pass lines_per_round = 0 for benchmarks that don't push log lines.
+template <typename Fn>
+static void bench(const char *name, size_t bytes_per_round, size_t lines_per_round, Fn fn)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < ROUNDS; ++i)
+        fn(i);
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("%-48s %9.1f us/round %9.1f MB/s", name, s * 1e6 / ROUNDS, bytes_per_round * (double)ROUNDS / s / 1e6);
+    if (lines_per_round != 0)
+        printf(" %12.0f lines/s", lines_per_round * (double)ROUNDS / s);
+    printf("\n");
+}
+
+int main()
+{
+    // Old meter history: int16_t samples packed into uint32_t, read one by one.
+    TF_Ringbuffer<int16_t, HISTORY_SIZE + 1, uint32_t, malloc, free> old_history;
+    for (int i = 0; i < HISTORY_SIZE; ++i)
+        old_history.push(i);
+
+    bench("history read, TF_Ringbuffer peek_offset", HISTORY_SIZE * sizeof(int16_t), 0, [&old_history](int round) {
+        uint32_t sum = 0;
+        int16_t val;
+        for (size_t i = 0; i < old_history.used(); ++i) {
+            old_history.peek_offset(&val, i);
+            sum += val;
+        }
+        int16_t dropped;
+        old_history.pop(&dropped);
+        old_history.push(round);
+        sink = sum;
+    });
+
+    TF_GenericRingbuffer<float, HISTORY_SIZE, malloc, free> new_history;
+    for (int i = 0; i < HISTORY_SIZE; ++i)
+        new_history.push(i);
+
+    bench("history read, TF_GenericRingbuffer spans", HISTORY_SIZE * sizeof(float), 0, [&new_history](int round) {
+        float sum = 0;
+        decltype(new_history)::Span spans[2];
+        new_history.peek_spans(0, new_history.used(), spans);
+        for (const auto &span : spans)
+            for (size_t i = 0; i < span.len; ++i)
+                sum += span.data[i];
+        new_history.push(round);
+        sink = (uint32_t)sum;
+    });
+
+    static char line[100];
+    for (size_t i = 0; i < sizeof(line); ++i)
+        line[i] = 'a' + i % 26;
+    static char out[EVENT_BUF_SIZE];
+
+    TF_Ringbuffer<char, EVENT_BUF_SIZE, uint32_t, malloc, free> old_log_per_char;
+    bench("event log, TF_Ringbuffer per-char push", LINES_PER_ROUND * sizeof(line) * 2, LINES_PER_ROUND, [&old_log_per_char](int round) {
+        for (int i = 0; i < LINES_PER_ROUND; ++i) {
+            if (old_log_per_char.free() < sizeof(line)) {
+                char c;
+                for (size_t j = 0; j < sizeof(line); ++j)
+                    old_log_per_char.pop(&c);
+            }
+            for (size_t j = 0; j < sizeof(line); ++j)
+                old_log_per_char.push(line[j]);
+        }
+        sink = old_log_per_char.peek_n(out, 0, LINES_PER_ROUND * sizeof(line));
+    });
+
+    TF_Ringbuffer<char, EVENT_BUF_SIZE, uint32_t, malloc, free> old_log;
+    bench("event log, TF_Ringbuffer push_n/peek_n", LINES_PER_ROUND * sizeof(line) * 2, LINES_PER_ROUND, [&old_log](int round) {
+        for (int i = 0; i < LINES_PER_ROUND; ++i) {
+            if (old_log.free() < sizeof(line)) {
+                char c;
+                for (size_t j = 0; j < sizeof(line); ++j)
+                    old_log.pop(&c);
+            }
+            old_log.push_n(line, sizeof(line));
+        }
+        sink = old_log.peek_n(out, 0, LINES_PER_ROUND * sizeof(line));
+    });
+
+    TF_GenericRingbuffer<char, EVENT_BUF_SIZE, malloc, free> new_log_per_char;
+    bench("event log, TF_GenericRingbuffer per-char push", LINES_PER_ROUND * sizeof(line) * 2, LINES_PER_ROUND, [&new_log_per_char](int round) {
+        for (int i = 0; i < LINES_PER_ROUND; ++i) {
+            if (new_log_per_char.free() < sizeof(line))
+                new_log_per_char.discard(sizeof(line));
+            for (size_t j = 0; j < sizeof(line); ++j)
+                new_log_per_char.push(line[j]);
+        }
+        sink = new_log_per_char.peek_n(out, 0, LINES_PER_ROUND * sizeof(line));
+    });
+
+    TF_GenericRingbuffer<char, EVENT_BUF_SIZE, malloc, free> new_log;
+    bench("event log, TF_GenericRingbuffer push_n/peek_n", LINES_PER_ROUND * sizeof(line) * 2, LINES_PER_ROUND, [&new_log](int round) {
+        for (int i = 0; i < LINES_PER_ROUND; ++i) {
+            if (new_log.free() < sizeof(line))
+                new_log.discard(sizeof(line));
+            new_log.push_n(line, sizeof(line));
+        }
+        sink = new_log.peek_n(out, 0, LINES_PER_ROUND * sizeof(line));
+    });
+
+    TF_GenericRingbuffer<char, 8192, malloc, free> pow2_log;
+    bench("event log, TF_GenericRingbuffer 8192 (masked)", LINES_PER_ROUND * sizeof(line) * 2, LINES_PER_ROUND, [&pow2_log](int round) {
+        for (int i = 0; i < LINES_PER_ROUND; ++i) {
+            if (pow2_log.free() < sizeof(line))
+                pow2_log.discard(sizeof(line));
+            pow2_log.push_n(line, sizeof(line));
+        }
+        sink = pow2_log.peek_n(out, 0, LINES_PER_ROUND * sizeof(line));
+    });
+
+    return 0;
+}
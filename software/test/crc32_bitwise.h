@@ -0,0 +1,89 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+// The bitwise CRC32 implementation that crc32.cpp used before the slicing-by-4 tables,
+// kept as reference for test_crc32 and bench_crc32 (without its per-call logging).
+// Like the original it reads the whole words containing the data, so buffers passed
+// to it must be readable up to the next word boundary.
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef unsigned int word_t;
+
+#define BITWISE_CRC32_POLYNOMIAL 0xEDB88320UL
+#define BITWISE_WORD_SIZE (sizeof(word_t))
+#define BITWISE_WORD_ALIGNMENT_MASK ~((uintptr_t)BITWISE_WORD_SIZE - 1)
+
+static inline uint32_t bitwise_crc32_bytes(word_t data, uint32_t crc, uint_fast8_t bytes)
+{
+    crc ^= data;
+
+    for (uint_fast8_t bit = 8 * bytes; bit > 0; bit--) {
+        if (crc & 1)
+            crc = (crc >> 1) ^ BITWISE_CRC32_POLYNOMIAL;
+        else
+            crc >>= 1;
+    }
+
+    return crc;
+}
+
+static inline void bitwise_crc32_recalculate(const void *data, size_t length, uint32_t *crc)
+{
+    const word_t *word_ptr = (const word_t *)((uintptr_t)data & BITWISE_WORD_ALIGNMENT_MASK);
+    size_t temp_length;
+    uint32_t temp_crc = *crc ^ 0xffffffffUL;
+    word_t word;
+
+    if (length < BITWISE_WORD_SIZE)
+        temp_length = length;
+    else
+        temp_length = ~BITWISE_WORD_ALIGNMENT_MASK & (BITWISE_WORD_SIZE - (uintptr_t)data);
+
+    if (temp_length) {
+        length -= temp_length;
+
+        word = *(word_ptr++);
+        word >>= 8 * (BITWISE_WORD_SIZE - temp_length);
+        temp_crc = bitwise_crc32_bytes(word, temp_crc, temp_length);
+    }
+
+    temp_length = length & BITWISE_WORD_ALIGNMENT_MASK;
+
+    if (temp_length) {
+        length -= temp_length;
+        temp_length /= BITWISE_WORD_SIZE;
+
+        while (temp_length--) {
+            word = *(word_ptr++);
+            temp_crc = bitwise_crc32_bytes(word, temp_crc, BITWISE_WORD_SIZE);
+        }
+    }
+
+    if (length) {
+        word = *word_ptr;
+        word &= 0xffffffffUL >> (8 * (BITWISE_WORD_SIZE - length));
+        temp_crc = bitwise_crc32_bytes(word, temp_crc, length);
+    }
+
+    *crc = temp_crc ^ 0xffffffffUL;
+}
@@ -0,0 +1,132 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+// Synthetic versions of the large dynamic responses that are sent compressed,
+// shared by test_gzip_encoder and bench_gzip_encoder. Deterministic for a given seed.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+
+struct GzipPayload {
+    const char *name;
+    std::string data;
+};
+
+// /event_log: timestamped log lines from a small set of modules and messages.
+static std::string payload_event_log(size_t size)
+{
+    static const char *const messages[] = {
+        "Wifi connected to Tiefgarage-Nord",
+        "Wifi got IP address: 192.168.178.47. Connected to BSSID 3C:A6:2F:11:8E:02",
+        "Wifi disconnected from Tiefgarage-Nord: Beacon timeout (200)",
+        "MQTT: Connected to broker.",
+        "MQTT: Transport error: ESP_ERR_ESP_TLS_CONNECTION_TIMEOUT (esp_tls_last_esp_err)",
+        "EVSE: Charging started, allowed current 16000 mA",
+        "EVSE: Charging stopped by user",
+        "Meter: Energy counter 1234.56 kWh",
+        "NFC: Tag 04:A2:3B:1C:55:80 seen",
+        "charge_manager: Charger 192.168.178.51 not reachable",
+    };
+
+    std::string out;
+    uint32_t uptime_ms = 1000;
+    while (out.size() < size) {
+        uptime_ms += rand() % 5000;
+        char line[160];
+        snprintf(line, sizeof(line), "%10u,%03u  %s\n", (unsigned)(uptime_ms / 1000), (unsigned)(uptime_ms % 1000), messages[rand() % 10]);
+        out += line;
+    }
+    out.resize(size);
+    return out;
+}
+
+// /meter/history: 720 power samples as a JSON array. The load changes slowly with some noise.
+static std::string payload_meter_history()
+{
+    std::string out = "[";
+    int power = 0;
+    for (int i = 0; i < 720; ++i) {
+        if (rand() % 60 == 0)
+            power = rand() % 3 == 0 ? 0 : 3500 + rand() % 7500;
+        int sample = power == 0 ? 0 : power + rand() % 50 - 25;
+        if (i != 0)
+            out += ",";
+        out += std::to_string(sample);
+    }
+    out += "]";
+    return out;
+}
+
+// /wifi/scan_results
+static std::string payload_wifi_scan()
+{
+    std::string out = "[";
+    for (int i = 0; i < 25; ++i) {
+        char entry[200];
+        snprintf(entry, sizeof(entry), "%s{\"ssid\": \"%s-%d\", \"bssid\": \"%02X:%02X:%02X:%02X:%02X:%02X\", \"rssi\": %d, \"channel\": %d, \"encryption\": %d}",
+                 i == 0 ? "" : ",", i % 3 == 0 ? "FRITZ!Box 7590" : "Tiefgarage", i,
+                 rand() % 256, rand() % 256, rand() % 256, rand() % 256, rand() % 256, rand() % 256,
+                 -40 - rand() % 50, 1 + rand() % 13, rand() % 5);
+        out += entry;
+    }
+    out += "]";
+    return out;
+}
+
+// /debug_report and full state dumps: many small JSON objects with recurring keys and numbers.
+static std::string payload_state_dump(size_t size)
+{
+    static const char *const objects[] = {
+        "\"evse/state\": {\"iec61851_state\":%d,\"charger_state\":%d,\"contactor_state\":%d,\"contactor_error\":0,\"allowed_charging_current\":%d,\"error_state\":0,\"lock_state\":0}",
+        "\"evse/hardware_configuration\": {\"jumper_configuration\":%d,\"has_lock_switch\":false,\"evse_version\":%d}",
+        "\"evse/low_level_state\": {\"led_state\":%d,\"cp_pwm_duty_cycle\":%d,\"adc_values\":[%d,%d],\"voltages\":[%d,%d,%d],\"resistances\":[%d,%d],\"gpio\":[false,true,false,false,true],\"charging_time\":%d}",
+        "\"meter/values\": {\"power\":%d.%d,\"energy_rel\":%d.%d,\"energy_abs\":%d.%d}",
+        "\"wifi/state\": {\"connection_state\":%d,\"ap_state\":%d,\"ap_bssid\":\"A8:03:2A:12:34:56\",\"sta_ip\":[192,168,178,%d],\"sta_rssi\":%d,\"sta_bssid\":\"3C:A6:2F:11:8E:02\"}",
+        "\"mqtt/config\": {\"enable_mqtt\":true,\"broker_host\":\"192.168.178.2\",\"broker_port\":1883,\"broker_username\":\"\",\"broker_password\":null,\"global_topic_prefix\":\"warp/%d\",\"client_name\":\"warp-%d\",\"interval\":%d}",
+    };
+
+    std::string out = "{\"uptime\": 123456";
+    while (out.size() < size) {
+        char entry[400];
+        snprintf(entry, sizeof(entry), objects[rand() % 6],
+                 rand() % 5, rand() % 4, rand() % 4, rand() % 32000, rand() % 1000, rand() % 4000,
+                 rand() % 4000, rand() % 30000, rand() % 30000, rand() % 30000, rand() % 100000, rand() % 100000, rand() % 1000000);
+        out += ",\n \"";
+        out += entry + 1;
+    }
+    out.resize(size - 1);
+    out += "}";
+    return out;
+}
+
+static std::vector<GzipPayload> gzip_payloads(unsigned seed)
+{
+    srand(seed);
+    return {
+        {"event log", payload_event_log(64 * 1024)},
+        {"meter history", payload_meter_history()},
+        {"wifi scan results", payload_wifi_scan()},
+        {"state dump", payload_state_dump(48 * 1024)},
+    };
+}
@@ -0,0 +1,62 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+// Host replacement for the parts of the Arduino core used by the tested sources.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+// millis() and micros() follow the host's monotonic clock
+// until a test calls fake_clock_set_ms. From then on they only move with the fake clock.
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+
+void fake_clock_set_ms(uint32_t ms);
+void fake_clock_advance_ms(uint32_t ms);
+
+class String {
+public:
+    String() {}
+    String(const char *s) : s(s) {}
+    String(const std::string &s) : s(s) {}
+    explicit String(uint32_t value) : s(std::to_string(value)) {}
+
+    const char *c_str() const { return s.c_str(); }
+    size_t length() const { return s.length(); }
+    void concat(const char *other) { s += other; }
+    bool operator==(const String &other) const { return s == other.s; }
+
+private:
+    std::string s;
+};
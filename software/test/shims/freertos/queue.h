@@ -0,0 +1,94 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+// FreeRTOS queues on top of a mutex and a condition variable.
+
+#include <string.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "freertos/FreeRTOS.h"
+
+struct HostQueue {
+    HostQueue(UBaseType_t length, UBaseType_t item_size) : length(length), item_size(item_size) {}
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::vector<uint8_t>> items;
+    size_t length;
+    size_t item_size;
+};
+
+typedef HostQueue *QueueHandle_t;
+
+static inline QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    return new HostQueue(length, item_size);
+}
+
+static inline void vQueueDelete(QueueHandle_t queue)
+{
+    delete queue;
+}
+
+template <typename Predicate>
+static inline bool host_queue_wait(QueueHandle_t queue, std::unique_lock<std::mutex> &lock, TickType_t ticks, Predicate pred)
+{
+    if (ticks == portMAX_DELAY) {
+        queue->changed.wait(lock, pred);
+        return true;
+    }
+    return queue->changed.wait_for(lock, std::chrono::milliseconds(ticks), pred);
+}
+
+static inline BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+    std::unique_lock<std::mutex> lock{queue->mutex};
+    if (!host_queue_wait(queue, lock, ticks, [queue]() { return queue->items.size() < queue->length; }))
+        return pdFAIL;
+
+    const uint8_t *bytes = (const uint8_t *)item;
+    queue->items.emplace_back(bytes, bytes + queue->item_size);
+    queue->changed.notify_all();
+    return pdPASS;
+}
+
+static inline BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks)
+{
+    std::unique_lock<std::mutex> lock{queue->mutex};
+    if (!host_queue_wait(queue, lock, ticks, [queue]() { return !queue->items.empty(); }))
+        return pdFALSE;
+
+    memcpy(item, queue->items.front().data(), queue->item_size);
+    queue->items.pop_front();
+    queue->changed.notify_all();
+    return pdTRUE;
+}
+
+static inline UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    std::lock_guard<std::mutex> lock{queue->mutex};
+    return queue->items.size();
+}
@@ -0,0 +1,115 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <Arduino.h>
+
+#include <stdarg.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <thread>
+
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "event_log.h"
+#include "tools.h"
+#include "web_server.h"
+
+static std::atomic<bool> fake_clock_enabled{false};
+static std::atomic<uint32_t> fake_clock_ms{0};
+
+static uint64_t host_us()
+{
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+uint32_t millis()
+{
+    if (fake_clock_enabled)
+        return fake_clock_ms;
+    return (uint32_t)(host_us() / 1000);
+}
+
+uint32_t micros()
+{
+    if (fake_clock_enabled)
+        return fake_clock_ms * 1000;
+    return (uint32_t)host_us();
+}
+
+void delay(uint32_t ms)
+{
+    if (fake_clock_enabled) {
+        fake_clock_ms += ms;
+        return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+int64_t esp_timer_get_time()
+{
+    if (fake_clock_enabled)
+        return (int64_t)fake_clock_ms * 1000;
+    return (int64_t)host_us();
+}
+
+void fake_clock_set_ms(uint32_t ms)
+{
+    fake_clock_ms = ms;
+    fake_clock_enabled = true;
+}
+
+void fake_clock_advance_ms(uint32_t ms)
+{
+    fake_clock_ms += ms;
+}
+
+uint32_t esp_random()
+{
+    static std::mutex mutex;
+    static std::mt19937 rng{std::random_device{}()};
+
+    std::lock_guard<std::mutex> lock{mutex};
+    return rng();
+}
+
+bool deadline_elapsed(uint32_t deadline_ms)
+{
+    uint32_t now = millis();
+
+    return ((uint32_t)(now - deadline_ms)) < (UINT32_MAX / 2);
+}
+
+EventLog logger;
+WebServer server;
+
+void EventLog::printfln(const char *fmt, ...)
+{
+    char buf[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    last_line = buf;
+    fprintf(stderr, "%s\n", buf);
+}
@@ -0,0 +1,58 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+// Host replacement for the mbedtls MD5 functions used by the firmware, implemented with OpenSSL.
+// Link with -lcrypto.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <openssl/evp.h>
+
+struct mbedtls_md5_context {
+    EVP_MD_CTX *ctx;
+};
+
+static inline void mbedtls_md5_init(mbedtls_md5_context *ctx)
+{
+    ctx->ctx = EVP_MD_CTX_new();
+}
+
+static inline void mbedtls_md5_free(mbedtls_md5_context *ctx)
+{
+    EVP_MD_CTX_free(ctx->ctx);
+    ctx->ctx = nullptr;
+}
+
+static inline int mbedtls_md5_starts_ret(mbedtls_md5_context *ctx)
+{
+    return EVP_DigestInit_ex(ctx->ctx, EVP_md5(), nullptr) == 1 ? 0 : -1;
+}
+
+static inline int mbedtls_md5_update_ret(mbedtls_md5_context *ctx, const unsigned char *input, size_t ilen)
+{
+    return EVP_DigestUpdate(ctx->ctx, input, ilen) == 1 ? 0 : -1;
+}
+
+static inline int mbedtls_md5_finish_ret(mbedtls_md5_context *ctx, unsigned char output[16])
+{
+    return EVP_DigestFinal_ex(ctx->ctx, output, nullptr) == 1 ? 0 : -1;
+}
@@ -0,0 +1,64 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+// Host replacement for the mbedtls SHA256 functions used by the firmware, implemented with OpenSSL.
+// Link with -lcrypto.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <openssl/evp.h>
+
+struct mbedtls_sha256_context {
+    EVP_MD_CTX *ctx;
+};
+
+static inline void mbedtls_sha256_init(mbedtls_sha256_context *ctx)
+{
+    ctx->ctx = EVP_MD_CTX_new();
+}
+
+static inline void mbedtls_sha256_free(mbedtls_sha256_context *ctx)
+{
+    EVP_MD_CTX_free(ctx->ctx);
+    ctx->ctx = nullptr;
+}
+
+static inline void mbedtls_sha256_clone(mbedtls_sha256_context *dst, const mbedtls_sha256_context *src)
+{
+    EVP_MD_CTX_copy_ex(dst->ctx, src->ctx);
+}
+
+// SHA224 (is224 != 0) is not used by the firmware.
+static inline int mbedtls_sha256_starts_ret(mbedtls_sha256_context *ctx, int is224)
+{
+    return EVP_DigestInit_ex(ctx->ctx, is224 ? EVP_sha224() : EVP_sha256(), nullptr) == 1 ? 0 : -1;
+}
+
+static inline int mbedtls_sha256_update_ret(mbedtls_sha256_context *ctx, const unsigned char *input, size_t ilen)
+{
+    return EVP_DigestUpdate(ctx->ctx, input, ilen) == 1 ? 0 : -1;
+}
+
+static inline int mbedtls_sha256_finish_ret(mbedtls_sha256_context *ctx, unsigned char output[32])
+{
+    return EVP_DigestFinal_ex(ctx->ctx, output, nullptr) == 1 ? 0 : -1;
+}
@@ -0,0 +1,53 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+// Handlers can be registered but are never called.
+
+#include <functional>
+
+#include <Arduino.h>
+
+enum httpd_method_t {
+    HTTP_DELETE = 0,
+    HTTP_GET = 1,
+    HTTP_HEAD = 2,
+    HTTP_POST = 3,
+    HTTP_PUT = 4,
+};
+
+#define HTTPD_RESP_USE_STRLEN -1
+
+class WebServerRequest {
+public:
+    void send(uint16_t code, const char *content_type = "text/plain", const char *content = "", ssize_t content_len = HTTPD_RESP_USE_STRLEN) {}
+    void beginChunkedResponse(uint16_t code, const char *content_type, bool allow_compression = true) {}
+    void sendChunk(const char *chunk, size_t chunk_len) {}
+    void endChunkedResponse() {}
+};
+
+using wshCallback = std::function<void(WebServerRequest)>;
+
+struct WebServerHandler {};
+
+class WebServer {
+public:
+    WebServerHandler *on(const char *uri, httpd_method_t method, wshCallback callback) { return nullptr; }
+};
@@ -0,0 +1,50 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+// Minimal assertion helpers for the host tests. A failed check prints its location
+// and makes the test binary exit with 1 after the current test case.
+
+#include <stdio.h>
+
+static int test_failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            ++test_failures; \
+        } \
+    } while (0)
+
+#define CHECK_EQ(a, b) do { \
+        long long _a = (long long)(a), _b = (long long)(b); \
+        if (_a != _b) { \
+            fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", __FILE__, __LINE__, #a, #b, _a, _b); \
+            ++test_failures; \
+        } \
+    } while (0)
+
+#define RUN_TEST(fn) do { \
+        int _before = test_failures; \
+        fn(); \
+        printf("%s %s\n", test_failures == _before ? "ok  " : "FAIL", #fn); \
+    } while (0)
+
+#define TEST_EXIT_CODE (test_failures == 0 ? 0 : 1)
@@ -0,0 +1,474 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+// Round trip of the CBOR web socket protocol: A state tree is encoded like Config::write_cbor_except
+// does, decoded again and rendered as JSON. The result has to match the JSON rendering of the
+// tree as Config::to_string_except produces it (censored keys become null).
+// Config itself needs ArduinoJson and strict_variant, so the tree is a stand-in with the same value types.
+
+#include "test.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "cbor.h"
+
+struct Node {
+    enum class Type { Null, String, Float, Int, Uint, Bool, Array, Object } type = Type::Null;
+
+    std::string string;
+    float f = 0;
+    int32_t i = 0;
+    uint32_t u = 0;
+    bool b = false;
+    std::vector<Node> elements;
+    std::vector<std::pair<std::string, Node>> members;
+
+    static Node str(const std::string &s) { Node n; n.type = Type::String; n.string = s; return n; }
+    static Node flt(float f) { Node n; n.type = Type::Float; n.f = f; return n; }
+    static Node sint(int32_t i) { Node n; n.type = Type::Int; n.i = i; return n; }
+    static Node uint(uint32_t u) { Node n; n.type = Type::Uint; n.u = u; return n; }
+    static Node boolean(bool b) { Node n; n.type = Type::Bool; n.b = b; return n; }
+    static Node array() { Node n; n.type = Type::Array; return n; }
+    static Node object() { Node n; n.type = Type::Object; return n; }
+};
+
+typedef std::vector<std::string> Censored;
+
+static bool censored(const Censored &keys, const std::string &key)
+{
+    return std::find(keys.begin(), keys.end(), key) != keys.end();
+}
+
+// Same writes as to_cbor in config.cpp.
+static void write_cbor(CborWriter &writer, const Node &node, const Censored &keys_to_censor)
+{
+    switch (node.type) {
+        case Node::Type::Null:
+            writer.writeNull();
+            break;
+        case Node::Type::String:
+            writer.writeText(node.string.c_str(), node.string.length());
+            break;
+        case Node::Type::Float:
+            writer.writeFloat(node.f);
+            break;
+        case Node::Type::Int:
+            writer.writeInt(node.i);
+            break;
+        case Node::Type::Uint:
+            writer.writeUint(node.u);
+            break;
+        case Node::Type::Bool:
+            writer.writeBool(node.b);
+            break;
+        case Node::Type::Array:
+            writer.writeArray(node.elements.size());
+            for (const Node &element : node.elements)
+                write_cbor(writer, element, keys_to_censor);
+            break;
+        case Node::Type::Object:
+            writer.writeMap(node.members.size());
+            for (const auto &member : node.members) {
+                writer.writeText(member.first.c_str(), member.first.length());
+                if (censored(keys_to_censor, member.first))
+                    writer.writeNull();
+                else
+                    write_cbor(writer, member.second, keys_to_censor);
+            }
+            break;
+    }
+}
+
+static void append_json_string(std::string &out, const std::string &s)
+{
+    out += '"';
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((uint8_t)c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+// Enough digits to tell all float32 values apart.
+static void append_json_float(std::string &out, float f)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.9g", f);
+    out += buf;
+}
+
+// Like to_json in config.cpp followed by serializeJson, except for the float formatting.
+static void write_json(std::string &out, const Node &node, const Censored &keys_to_censor)
+{
+    switch (node.type) {
+        case Node::Type::Null:
+            out += "null";
+            break;
+        case Node::Type::String:
+            append_json_string(out, node.string);
+            break;
+        case Node::Type::Float:
+            append_json_float(out, node.f);
+            break;
+        case Node::Type::Int:
+            out += std::to_string(node.i);
+            break;
+        case Node::Type::Uint:
+            out += std::to_string(node.u);
+            break;
+        case Node::Type::Bool:
+            out += node.b ? "true" : "false";
+            break;
+        case Node::Type::Array:
+            out += '[';
+            for (size_t i = 0; i < node.elements.size(); ++i) {
+                if (i > 0)
+                    out += ',';
+                write_json(out, node.elements[i], keys_to_censor);
+            }
+            out += ']';
+            break;
+        case Node::Type::Object:
+            out += '{';
+            for (size_t i = 0; i < node.members.size(); ++i) {
+                if (i > 0)
+                    out += ',';
+                append_json_string(out, node.members[i].first);
+                out += ':';
+                if (censored(keys_to_censor, node.members[i].first))
+                    out += "null";
+                else
+                    write_json(out, node.members[i].second, keys_to_censor);
+            }
+            out += '}';
+            break;
+    }
+}
+
+// Decodes the subset of CBOR that CborWriter produces and renders it as JSON.
+class CborToJson {
+public:
+    CborToJson(const std::vector<uint8_t> &data) : data(data) {}
+
+    // Returns false if the data is malformed or has trailing bytes.
+    bool convert(std::string &out)
+    {
+        return item(out) && pos == data.size();
+    }
+
+private:
+    bool byte(uint8_t *b)
+    {
+        if (pos >= data.size())
+            return false;
+        *b = data[pos++];
+        return true;
+    }
+
+    bool head(uint8_t *major, uint64_t *value)
+    {
+        uint8_t initial;
+        if (!byte(&initial))
+            return false;
+
+        *major = initial >> 5;
+        uint8_t info = initial & 0x1F;
+
+        if (info < 24) {
+            *value = info;
+            return true;
+        }
+
+        if (info > 27)
+            return false;
+
+        *value = 0;
+        for (int i = 0; i < (1 << (info - 24)); ++i) {
+            uint8_t b;
+            if (!byte(&b))
+                return false;
+            *value = (*value << 8) | b;
+        }
+
+        return true;
+    }
+
+    bool item(std::string &out)
+    {
+        size_t start = pos;
+        uint8_t major;
+        uint64_t value;
+        if (!head(&major, &value))
+            return false;
+
+        switch (major) {
+            case 0:
+                out += std::to_string(value);
+                return true;
+            case 1:
+                out += std::to_string(-1 - (int64_t)value);
+                return true;
+            case 3: {
+                if (data.size() - pos < value)
+                    return false;
+                append_json_string(out, std::string(data.begin() + pos, data.begin() + pos + value));
+                pos += value;
+                return true;
+            }
+            case 4:
+                out += '[';
+                for (uint64_t i = 0; i < value; ++i) {
+                    if (i > 0)
+                        out += ',';
+                    if (!item(out))
+                        return false;
+                }
+                out += ']';
+                return true;
+            case 5:
+                out += '{';
+                for (uint64_t i = 0; i < value; ++i) {
+                    if (i > 0)
+                        out += ',';
+                    // Config keys are strings.
+                    if (pos >= data.size() || data[pos] >> 5 != 3 || !item(out))
+                        return false;
+                    out += ':';
+                    if (!item(out))
+                        return false;
+                }
+                out += '}';
+                return true;
+            case 7:
+                if (value == 20 || value == 21) {
+                    out += value == 21 ? "true" : "false";
+                    return true;
+                }
+                if (value == 22) {
+                    out += "null";
+                    return true;
+                }
+                if ((data[start] & 0x1F) == 26) {
+                    uint32_t bits = value;
+                    float f;
+                    memcpy(&f, &bits, sizeof(f));
+                    append_json_float(out, f);
+                    return true;
+                }
+                return false;
+            default:
+                return false;
+        }
+    }
+
+    const std::vector<uint8_t> &data;
+    size_t pos = 0;
+};
+
+// Encodes twice, as encode_cbor in ws.cpp does.
+static std::vector<uint8_t> encode(const Node &node, const Censored &keys_to_censor = {})
+{
+    CborWriter measure{nullptr, 0};
+    write_cbor(measure, node, keys_to_censor);
+
+    std::vector<uint8_t> buf(measure.length());
+    CborWriter writer{buf.data(), buf.size()};
+    write_cbor(writer, node, keys_to_censor);
+    CHECK_EQ(writer.length(), measure.length());
+
+    return buf;
+}
+
+static std::string hex(const std::vector<uint8_t> &data)
+{
+    std::string out;
+    char buf[3];
+    for (uint8_t b : data) {
+        snprintf(buf, sizeof(buf), "%02x", b);
+        out += buf;
+    }
+    return out;
+}
+
+#define CHECK_HEX(node, expected) do { \
+        std::string _hex = hex(encode(node)); \
+        if (_hex != (expected)) { \
+            fprintf(stderr, "%s:%d: encoded %s, expected %s\n", __FILE__, __LINE__, _hex.c_str(), (expected)); \
+            ++test_failures; \
+        } \
+    } while (0)
+
+// Examples from RFC 8949, appendix A.
+static void test_rfc_examples()
+{
+    CHECK_HEX(Node::uint(0), "00");
+    CHECK_HEX(Node::uint(23), "17");
+    CHECK_HEX(Node::uint(24), "1818");
+    CHECK_HEX(Node::uint(100), "1864");
+    CHECK_HEX(Node::uint(1000), "1903e8");
+    CHECK_HEX(Node::uint(1000000), "1a000f4240");
+    CHECK_HEX(Node::uint(UINT32_MAX), "1affffffff");
+    CHECK_HEX(Node::sint(-1), "20");
+    CHECK_HEX(Node::sint(-1000), "3903e7");
+    CHECK_HEX(Node::sint(INT32_MIN), "3a7fffffff");
+    CHECK_HEX(Node::flt(1.5f), "fa3fc00000");
+    CHECK_HEX(Node::flt(100000.0f), "fa47c35000");
+    CHECK_HEX(Node::boolean(false), "f4");
+    CHECK_HEX(Node::boolean(true), "f5");
+    CHECK_HEX(Node(), "f6");
+    CHECK_HEX(Node::str(""), "60");
+    CHECK_HEX(Node::str("IETF"), "6449455446");
+    CHECK_HEX(Node::str("\xc3\xbc"), "62c3bc");
+
+    Node nested = Node::array();
+    nested.elements.push_back(Node::uint(1));
+    Node inner = Node::array();
+    inner.elements.push_back(Node::uint(2));
+    inner.elements.push_back(Node::uint(3));
+    nested.elements.push_back(inner);
+    CHECK_HEX(nested, "8201820203");
+
+    Node map = Node::object();
+    map.members.push_back({"a", Node::uint(1)});
+    map.members.push_back({"b", inner});
+    CHECK_HEX(map, "a26161016162820203");
+}
+
+// A state like meter/detailed_values and one with every value type.
+static Node make_states()
+{
+    Node states = Node::object();
+
+    Node detailed_values = Node::array();
+    for (int i = 0; i < 85; ++i)
+        detailed_values.elements.push_back(Node::flt(230.1f + i * 0.37f - (i % 7) * 1000.0f));
+    detailed_values.elements.push_back(Node::flt(0.0f));
+    detailed_values.elements.push_back(Node::flt(-0.0f));
+    detailed_values.elements.push_back(Node::flt(1e-38f));
+    detailed_values.elements.push_back(Node::flt(3.4e38f));
+    states.members.push_back({"meter/detailed_values", detailed_values});
+
+    Node config = Node::object();
+    config.members.push_back({"ssid", Node::str("Caf\xc3\xa9 \"guest\"\\\n")});
+    config.members.push_back({"passphrase", Node::str("secret")});
+    config.members.push_back({"enable", Node::boolean(true)});
+    config.members.push_back({"offset", Node::sint(INT32_MIN)});
+    config.members.push_back({"limit", Node::sint(INT32_MAX)});
+    config.members.push_back({"uptime", Node::uint(UINT32_MAX)});
+    config.members.push_back({"small", Node::uint(23)});
+    config.members.push_back({"nothing", Node()});
+
+    Node ip = Node::array();
+    for (uint32_t b : {192, 168, 0, 1})
+        ip.elements.push_back(Node::uint(b));
+    config.members.push_back({"ip", ip});
+
+    Node chargers = Node::array();
+    for (int i = 0; i < 3; ++i) {
+        Node charger = Node::object();
+        charger.members.push_back({"name", Node::str("charger " + std::to_string(i))});
+        charger.members.push_back({"allocated_current", Node::uint(i * 6000)});
+        charger.members.push_back({"passphrase", Node::str("nested secret")});
+        chargers.elements.push_back(charger);
+    }
+    config.members.push_back({"chargers", chargers});
+    config.members.push_back({"empty_array", Node::array()});
+    config.members.push_back({"empty_object", Node::object()});
+
+    states.members.push_back({"wifi/sta_config", config});
+    return states;
+}
+
+static void test_round_trip_matches_json()
+{
+    Node states = make_states();
+
+    for (const Censored &keys : {Censored{}, Censored{"passphrase"}}) {
+        std::string expected;
+        write_json(expected, states, keys);
+
+        std::vector<uint8_t> cbor = encode(states, keys);
+        std::string decoded;
+        CHECK(CborToJson(cbor).convert(decoded));
+        CHECK(decoded == expected);
+        if (decoded != expected)
+            fprintf(stderr, "decoded:  %s\nexpected: %s\n", decoded.c_str(), expected.c_str());
+    }
+
+    std::string json;
+    write_json(json, states, {"passphrase"});
+    CHECK(json.find("secret") == std::string::npos);
+}
+
+static void test_smaller_than_json()
+{
+    Node states = make_states();
+    std::string json;
+    write_json(json, states.members[0].second, {});
+
+    std::vector<uint8_t> cbor = encode(states.members[0].second);
+    printf("     meter/detailed_values: %u bytes JSON, %u bytes CBOR\n", (unsigned)json.size(), (unsigned)cbor.size());
+    // 5 bytes per float plus two bytes array head.
+    CHECK_EQ(cbor.size(), 2 + 5 * states.members[0].second.elements.size());
+    CHECK(cbor.size() < json.size());
+}
+
+// encode_cbor in ws.cpp relies on this to detect states that changed between its two passes.
+static void test_longer_output_is_counted_but_not_written()
+{
+    Node state = Node::object();
+    state.members.push_back({"ssid", Node::str("short")});
+
+    CborWriter measure{nullptr, 0};
+    write_cbor(measure, state, {});
+
+    state.members[0].second.string = "a much longer name";
+
+    std::vector<uint8_t> buf(measure.length() + 1, 0xAA);
+    CborWriter writer{buf.data(), measure.length()};
+    write_cbor(writer, state, {});
+
+    CHECK(writer.length() > measure.length());
+    // The guard byte after the buffer is untouched.
+    CHECK_EQ(buf.back(), 0xAA);
+}
+
+int main()
+{
+    RUN_TEST(test_rfc_examples);
+    RUN_TEST(test_round_trip_matches_json);
+    RUN_TEST(test_smaller_than_json);
+    RUN_TEST(test_longer_output_is_counted_but_not_written);
+
+    return TEST_EXIT_CODE;
+}
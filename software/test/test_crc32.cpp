@@ -0,0 +1,120 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "crc32.h"
+#include "crc32_bitwise.h"
+
+#define BUF_SIZE 4096
+// Both implementations read whole words; keep the reads inside the allocation.
+#define BUF_PADDING 8
+
+// Plain byte at a time CRC32 as independent reference for all lengths and alignments.
+static uint32_t reference_crc32(const uint8_t *data, size_t length, uint32_t crc)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < length; ++i) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; ++bit)
+            crc = (crc >> 1) ^ (0xEDB88320UL & (0 - (crc & 1)));
+    }
+    return ~crc;
+}
+
+static std::vector<uint8_t> random_buf()
+{
+    std::vector<uint8_t> buf(BUF_SIZE + BUF_PADDING);
+    for (auto &b : buf)
+        b = rand();
+    return buf;
+}
+
+static void test_check_value()
+{
+    CHECK_EQ(crc32_ieee_802_3("123456789", 9), 0xCBF43926);
+    CHECK_EQ(crc32_ieee_802_3("", 0), 0);
+}
+
+static void test_matches_reference_for_all_alignments()
+{
+    std::vector<uint8_t> buf = random_buf();
+
+    for (size_t offset = 0; offset < 8; ++offset) {
+        for (size_t length = 0; length <= 64; ++length) {
+            uint32_t crc = 0x12345678;
+            crc32_ieee_802_3_recalculate(buf.data() + offset, length, &crc);
+            CHECK_EQ(crc, reference_crc32(buf.data() + offset, length, 0x12345678));
+        }
+    }
+}
+
+// The bitwise implementation was wrong for blocks shorter than a word that don't end
+// on a word boundary, so it is only compared for blocks of at least one word.
+static void test_matches_bitwise_implementation()
+{
+    std::vector<uint8_t> buf = random_buf();
+
+    for (int i = 0; i < 20000; ++i) {
+        size_t offset = rand() % (BUF_SIZE - 4);
+        size_t length = 4 + rand() % (BUF_SIZE - offset - 3);
+        uint32_t start = ((uint32_t)rand() << 16) ^ rand();
+
+        uint32_t crc = start;
+        uint32_t expected = start;
+        crc32_ieee_802_3_recalculate(buf.data() + offset, length, &crc);
+        bitwise_crc32_recalculate(buf.data() + offset, length, &expected);
+        CHECK_EQ(crc, expected);
+    }
+}
+
+static void test_chunked_equals_one_shot()
+{
+    std::vector<uint8_t> buf = random_buf();
+    uint32_t one_shot = crc32_ieee_802_3(buf.data(), BUF_SIZE);
+
+    for (int i = 0; i < 100; ++i) {
+        uint32_t crc = 0;
+        size_t offset = 0;
+        while (offset < BUF_SIZE) {
+            size_t length = std::min((size_t)(rand() % 300), BUF_SIZE - offset);
+            crc32_ieee_802_3_recalculate(buf.data() + offset, length, &crc);
+            offset += length;
+        }
+        CHECK_EQ(crc, one_shot);
+    }
+}
+
+int main()
+{
+    srand(1);
+
+    RUN_TEST(test_check_value);
+    RUN_TEST(test_matches_reference_for_all_alignments);
+    RUN_TEST(test_matches_bitwise_implementation);
+    RUN_TEST(test_chunked_equals_one_shot);
+
+    return TEST_EXIT_CODE;
+}
@@ -0,0 +1,116 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "test.h"
+
+#include <stdarg.h>
+#include <string.h>
+
+#include <string>
+
+#include "event_log_format.h"
+
+#define EVENT_LOG_MAX_ARGS_LEN 160
+
+// Packs and formats like the structured event log does and compares the result with vsnprintf.
+static std::string deferred(size_t buf_len, bool *truncated, const char *fmt, ...)
+{
+    uint8_t buf[EVENT_LOG_MAX_ARGS_LEN];
+    va_list args;
+    va_start(args, fmt);
+    size_t len = pack_log_args(buf, buf_len, fmt, args, truncated);
+    va_end(args);
+
+    std::string result;
+    format_log_args(fmt, buf, len, [&result](const char *s, size_t s_len) {
+        result.append(s, s_len);
+    });
+    return result;
+}
+
+static std::string immediate(const char *fmt, ...)
+{
+    char buf[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    return buf;
+}
+
+#define CHECK_SAME(fmt, ...) do { \
+        bool truncated = false; \
+        std::string a = deferred(EVENT_LOG_MAX_ARGS_LEN, &truncated, fmt, __VA_ARGS__); \
+        std::string b = immediate(fmt, __VA_ARGS__); \
+        if (a != b) { \
+            fprintf(stderr, "%s:%d: \"%s\" != \"%s\"\n", __FILE__, __LINE__, a.c_str(), b.c_str()); \
+            ++test_failures; \
+        } \
+        CHECK(!truncated); \
+    } while (0)
+
+static void test_matches_printf()
+{
+    CHECK_SAME("plain text%s", "");
+    CHECK_SAME("%d %i %u", -5, 17, 4000000000u);
+    CHECK_SAME("%x %X %o %c", 0xbeef, 0xBEEFu, 8, 'z');
+    CHECK_SAME("%5d|%-5d|%05d", 42, 42, 42);
+    CHECK_SAME("%ld %lu %lld %llu", -1L, 2UL, -3LL, 18446744073709551615ULL);
+    CHECK_SAME("%f %.2f %e %g", 1.5, 3.14159, 12345.678, 0.0001);
+    CHECK_SAME("%s and %.3s", "string", "truncated");
+    CHECK_SAME("%p", (void *)0x1234);
+    CHECK_SAME("100%% %s", "done");
+    CHECK_SAME("%*d|%-*d", 6, 1, 4, 2);
+}
+
+static void test_null_string()
+{
+    bool truncated = false;
+    std::string a = deferred(EVENT_LOG_MAX_ARGS_LEN, &truncated, "[%s]", (const char *)nullptr);
+    CHECK(a == "[(null)]");
+}
+
+static void test_long_string_is_truncated()
+{
+    std::string long_string(300, 'a');
+    bool truncated = false;
+    std::string a = deferred(EVENT_LOG_MAX_ARGS_LEN, &truncated, "%s|%d", long_string.c_str(), 7);
+
+    CHECK(truncated);
+    CHECK(a.size() < long_string.size());
+    CHECK_EQ(a.compare(0, 10, std::string(10, 'a')), 0);
+}
+
+static void test_small_buffer_drops_arguments()
+{
+    bool truncated = false;
+    std::string a = deferred(4, &truncated, "%d %d %d", 1, 2, 3);
+    CHECK(truncated);
+    CHECK_EQ(a.compare(0, 1, "1"), 0);
+}
+
+int main()
+{
+    RUN_TEST(test_matches_printf);
+    RUN_TEST(test_null_string);
+    RUN_TEST(test_long_string_is_truncated);
+    RUN_TEST(test_small_buffer_drops_arguments);
+
+    return TEST_EXIT_CODE;
+}
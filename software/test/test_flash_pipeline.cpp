@@ -0,0 +1,202 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "test.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "task_scheduler.h"
+#include "flash_pipeline.h"
+
+TaskScheduler task_scheduler;
+
+// Typical TCP segment payload.
+#define RECEIVE_CHUNK_SIZE 1436
+#define IMAGE_SIZE (256 * 1024)
+
+// Simulated slow flash: erasing and writing a sector takes WRITE_DELAY_US.
+#define WRITE_DELAY_US 4000
+// Simulated network: receiving a chunk takes RECEIVE_DELAY_US.
+#define RECEIVE_DELAY_US 1200
+
+struct SlowFlash {
+    std::mutex mutex;
+    std::vector<uint8_t> data;
+    size_t writes = 0;
+    // Number of writes that still succeed; -1 for no limit.
+    int fail_after = -1;
+
+    std::function<bool(const uint8_t *, size_t)> writer() {
+        return [this](const uint8_t *buf, size_t len) {
+            std::this_thread::sleep_for(std::chrono::microseconds(WRITE_DELAY_US));
+
+            std::lock_guard<std::mutex> l{mutex};
+            if (fail_after == 0)
+                return false;
+            if (fail_after > 0)
+                --fail_after;
+
+            data.insert(data.end(), buf, buf + len);
+            ++writes;
+            return true;
+        };
+    }
+};
+
+static std::vector<uint8_t> make_image()
+{
+    std::vector<uint8_t> image(IMAGE_SIZE);
+    uint32_t x = 12345;
+    for (auto &b : image) {
+        x = x * 1103515245 + 12345;
+        b = x >> 16;
+    }
+    return image;
+}
+
+// Returns the duration in ms.
+static double upload(FlashPipeline &pipeline, const std::vector<uint8_t> &image, bool *ok)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    *ok = true;
+    for (size_t offset = 0; offset < image.size() && *ok; offset += RECEIVE_CHUNK_SIZE) {
+        std::this_thread::sleep_for(std::chrono::microseconds(RECEIVE_DELAY_US));
+        *ok = pipeline.push(image.data() + offset, std::min((size_t)RECEIVE_CHUNK_SIZE, image.size() - offset));
+    }
+
+    if (*ok)
+        *ok = pipeline.finish();
+    else
+        pipeline.abort();
+
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void test_writes_in_order_and_overlaps_receiving()
+{
+    std::vector<uint8_t> image = make_image();
+    SlowFlash flash;
+    FlashPipeline pipeline;
+
+    CHECK(pipeline.begin(flash.writer()));
+    bool ok;
+    double ms = upload(pipeline, image, &ok);
+
+    CHECK(ok);
+    CHECK(!pipeline.isRunning());
+    CHECK_EQ(pipeline.bytesWritten(), image.size());
+    CHECK(flash.data == image);
+    CHECK_EQ(flash.writes, (image.size() + FLASH_PIPELINE_BUFFER_SIZE - 1) / FLASH_PIPELINE_BUFFER_SIZE);
+
+    // Receiving and writing one after the other would take the sum of both.
+    double receive_ms = (double)((image.size() + RECEIVE_CHUNK_SIZE - 1) / RECEIVE_CHUNK_SIZE) * RECEIVE_DELAY_US / 1000;
+    double write_ms = (double)flash.writes * WRITE_DELAY_US / 1000;
+    printf("     %u KiB in %.0f ms (%.0f KiB/s); sequential would take at least %.0f ms\n",
+           (unsigned)(image.size() / 1024), ms, image.size() / 1024 / (ms / 1000), receive_ms + write_ms);
+    CHECK(ms < 0.85 * (receive_ms + write_ms));
+}
+
+static void test_partial_last_buffer()
+{
+    std::vector<uint8_t> image = make_image();
+    image.resize(3 * FLASH_PIPELINE_BUFFER_SIZE + 17);
+    SlowFlash flash;
+    FlashPipeline pipeline;
+
+    CHECK(pipeline.begin(flash.writer()));
+    bool ok;
+    upload(pipeline, image, &ok);
+
+    CHECK(ok);
+    CHECK(flash.data == image);
+    CHECK_EQ(flash.writes, 4);
+}
+
+static void test_write_failure_stops_upload()
+{
+    std::vector<uint8_t> image = make_image();
+    SlowFlash flash;
+    flash.fail_after = 5;
+    FlashPipeline pipeline;
+
+    CHECK(pipeline.begin(flash.writer()));
+    bool ok;
+    upload(pipeline, image, &ok);
+
+    CHECK(!ok);
+    CHECK(!pipeline.isRunning());
+    CHECK_EQ(flash.writes, 5);
+    CHECK_EQ(pipeline.bytesWritten(), 5 * FLASH_PIPELINE_BUFFER_SIZE);
+}
+
+static void test_abort_waits_for_running_write()
+{
+    std::vector<uint8_t> image = make_image();
+    SlowFlash flash;
+    FlashPipeline pipeline;
+
+    CHECK(pipeline.begin(flash.writer()));
+    CHECK(pipeline.push(image.data(), 2 * FLASH_PIPELINE_BUFFER_SIZE + 100));
+    pipeline.abort();
+
+    CHECK(!pipeline.isRunning());
+    // No write may touch the freed buffers after abort returned.
+    size_t writes = flash.writes;
+    std::this_thread::sleep_for(std::chrono::microseconds(3 * WRITE_DELAY_US));
+    CHECK_EQ(flash.writes, writes);
+    CHECK(writes <= 2);
+    CHECK(task_scheduler.waitForJobs(1000));
+}
+
+static void test_restart_after_abort()
+{
+    std::vector<uint8_t> image = make_image();
+    SlowFlash first_flash;
+    SlowFlash flash;
+    FlashPipeline pipeline;
+
+    CHECK(pipeline.begin(first_flash.writer()));
+    CHECK(pipeline.push(image.data(), FLASH_PIPELINE_BUFFER_SIZE + 1));
+
+    // begin aborts the running upload.
+    CHECK(pipeline.begin(flash.writer()));
+    bool ok;
+    upload(pipeline, image, &ok);
+
+    CHECK(ok);
+    CHECK(flash.data == image);
+}
+
+int main()
+{
+    task_scheduler.setup();
+
+    RUN_TEST(test_writes_in_order_and_overlaps_receiving);
+    RUN_TEST(test_partial_last_buffer);
+    RUN_TEST(test_write_failure_stops_upload);
+    RUN_TEST(test_abort_waits_for_running_write);
+    RUN_TEST(test_restart_after_abort);
+
+    return TEST_EXIT_CODE;
+}
@@ -0,0 +1,262 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "gzip_decoder.h"
+
+// Stands in for the Arduino Update class that receives the decompressed image.
+class MockUpdate {
+public:
+    // Writes beyond the partition size fail like on the ESP.
+    explicit MockUpdate(size_t partition_size) : partition_size(partition_size) {}
+
+    size_t write(const uint8_t *data, size_t len)
+    {
+        ++writes;
+        if (error)
+            ++writes_after_error;
+        if (image.size() + len > partition_size) {
+            error = true;
+            return 0;
+        }
+        image.insert(image.end(), data, data + len);
+        return len;
+    }
+
+    std::vector<uint8_t> image;
+    size_t partition_size;
+    size_t writes = 0;
+    size_t writes_after_error = 0;
+    bool error = false;
+};
+
+// Compresses like merge_firmware_hook.py: level 9, memLevel 9, 2^window_bits bytes window.
+static std::vector<uint8_t> gzip(const std::vector<uint8_t> &data, int window_bits = GZIP_DECODER_WINDOW_BITS,
+                                 int level = 9, int strategy = Z_DEFAULT_STRATEGY, gz_header *header = nullptr)
+{
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    deflateInit2(&strm, level, Z_DEFLATED, 16 + window_bits, 9, strategy);
+    if (header != nullptr)
+        deflateSetHeader(&strm, header);
+
+    std::vector<uint8_t> out(deflateBound(&strm, data.size()) + 1024);
+    strm.next_in = const_cast<uint8_t *>(data.data());
+    strm.avail_in = data.size();
+    strm.next_out = out.data();
+    strm.avail_out = out.size();
+    deflate(&strm, Z_FINISH);
+    out.resize(strm.total_out);
+    deflateEnd(&strm);
+    return out;
+}
+
+// Firmware-like data: repeated fragments at varying distances mixed with noise.
+static std::vector<uint8_t> make_image(size_t size)
+{
+    std::vector<uint8_t> image;
+    while (image.size() < size) {
+        if (image.size() > 64 && rand() % 3 != 0) {
+            size_t distance = 1 + rand() % std::min(image.size(), (size_t)30000);
+            size_t length = 3 + rand() % 100;
+            for (size_t i = 0; i < length; ++i)
+                image.push_back(image[image.size() - distance]);
+        } else {
+            size_t length = 1 + rand() % 20;
+            for (size_t i = 0; i < length; ++i)
+                image.push_back(rand() % 64);
+        }
+    }
+    image.resize(size);
+    return image;
+}
+
+// Feeds the stream in chunks of 1 to max_chunk bytes, like the web server hands over upload chunks.
+static bool decode(const std::vector<uint8_t> &stream, MockUpdate *update, size_t max_chunk, const char **error = nullptr)
+{
+    GzipDecoder *decoder = new GzipDecoder([update](const uint8_t *data, size_t len) {
+        return update->write(data, len) == len;
+    });
+
+    bool ok = true;
+    size_t offset = 0;
+    while (ok && offset < stream.size()) {
+        size_t len = std::min(1 + rand() % max_chunk, stream.size() - offset);
+        ok = decoder->write(stream.data() + offset, len);
+        offset += len;
+    }
+    if (ok)
+        ok = decoder->finish();
+
+    if (ok)
+        CHECK_EQ(decoder->bytesWritten(), update->image.size());
+    if (error != nullptr)
+        *error = decoder->error();
+
+    delete decoder;
+    return ok;
+}
+
+static void test_firmware_image_in_upload_chunks()
+{
+    std::vector<uint8_t> image = make_image(1024 * 1024);
+    std::vector<uint8_t> stream = gzip(image);
+    MockUpdate update(2 * 1024 * 1024);
+
+    CHECK(decode(stream, &update, 5744));
+    CHECK(update.image == image);
+    printf("     %u KiB compressed to %u KiB, %u writes\n", (unsigned)(image.size() / 1024), (unsigned)(stream.size() / 1024), (unsigned)update.writes);
+}
+
+static void test_single_byte_chunks()
+{
+    std::vector<uint8_t> image = make_image(64 * 1024);
+    MockUpdate update(image.size());
+
+    CHECK(decode(gzip(image), &update, 1));
+    CHECK(update.image == image);
+}
+
+static void test_stored_and_fixed_blocks()
+{
+    std::vector<uint8_t> image = make_image(100 * 1024);
+
+    MockUpdate stored(image.size());
+    CHECK(decode(gzip(image, GZIP_DECODER_WINDOW_BITS, 0), &stored, 3000));
+    CHECK(stored.image == image);
+
+    MockUpdate fixed(image.size());
+    CHECK(decode(gzip(image, GZIP_DECODER_WINDOW_BITS, 9, Z_FIXED), &fixed, 3000));
+    CHECK(fixed.image == image);
+}
+
+static void test_optional_header_fields()
+{
+    std::vector<uint8_t> image = make_image(10 * 1024);
+    uint8_t extra[] = {'T', 'F', 3, 0, 1, 2, 3};
+    char name[] = "firmware_merged.bin";
+    char comment[] = "test";
+
+    gz_header header;
+    memset(&header, 0, sizeof(header));
+    header.extra = extra;
+    header.extra_len = sizeof(extra);
+    header.name = (Bytef *)name;
+    header.comment = (Bytef *)comment;
+    header.hcrc = 1;
+
+    MockUpdate update(image.size());
+    CHECK(decode(gzip(image, GZIP_DECODER_WINDOW_BITS, 9, Z_DEFAULT_STRATEGY, &header), &update, 7));
+    CHECK(update.image == image);
+}
+
+static void test_empty_image()
+{
+    MockUpdate update(0);
+    CHECK(decode(gzip(std::vector<uint8_t>()), &update, 100));
+    CHECK_EQ(update.image.size(), 0);
+}
+
+static void test_rejects_larger_window()
+{
+    std::vector<uint8_t> image = make_image(256 * 1024);
+    MockUpdate update(image.size());
+    const char *error;
+
+    CHECK(!decode(gzip(image, 15), &update, 4096, &error));
+    CHECK(strstr(error, "window") != nullptr);
+}
+
+static void test_rejects_corrupted_streams()
+{
+    std::vector<uint8_t> image = make_image(50 * 1024);
+    std::vector<uint8_t> stream = gzip(image);
+    const char *error;
+
+    std::vector<uint8_t> bad_crc = stream;
+    bad_crc[bad_crc.size() - 8] ^= 1;
+    MockUpdate crc_update(image.size());
+    CHECK(!decode(bad_crc, &crc_update, 4096, &error));
+    CHECK(strcmp(error, "CRC mismatch") == 0);
+
+    std::vector<uint8_t> bad_size = stream;
+    bad_size[bad_size.size() - 4] ^= 1;
+    MockUpdate size_update(image.size());
+    CHECK(!decode(bad_size, &size_update, 4096, &error));
+    CHECK(strcmp(error, "Size mismatch") == 0);
+
+    std::vector<uint8_t> truncated(stream.begin(), stream.end() - 100);
+    MockUpdate truncated_update(image.size());
+    CHECK(!decode(truncated, &truncated_update, 4096, &error));
+    CHECK(strcmp(error, "Truncated stream") == 0);
+
+    std::vector<uint8_t> not_gzip = stream;
+    not_gzip[0] = 0xE9;
+    MockUpdate magic_update(image.size());
+    CHECK(!decode(not_gzip, &magic_update, 4096, &error));
+    CHECK(strcmp(error, "Not a gzip stream") == 0);
+    CHECK_EQ(magic_update.writes, 0);
+
+    // Random corruption in the compressed data has to fail cleanly, never crash.
+    for (int i = 0; i < 200; ++i) {
+        std::vector<uint8_t> corrupted = stream;
+        corrupted[10 + rand() % (corrupted.size() - 18)] ^= 1 << (rand() % 8);
+        MockUpdate update(image.size());
+        CHECK(!decode(corrupted, &update, 4096));
+    }
+}
+
+static void test_update_write_failure_stops_decoding()
+{
+    std::vector<uint8_t> image = make_image(200 * 1024);
+    MockUpdate update(64 * 1024);
+    const char *error;
+
+    CHECK(!decode(gzip(image), &update, 4096, &error));
+    CHECK(update.error);
+    CHECK(strcmp(error, "Failed to write decompressed data") == 0);
+
+    // Nothing is written after the failed write.
+    CHECK_EQ(update.writes_after_error, 0);
+    CHECK(update.image.size() <= 64 * 1024);
+}
+
+int main()
+{
+    srand(1);
+
+    RUN_TEST(test_firmware_image_in_upload_chunks);
+    RUN_TEST(test_single_byte_chunks);
+    RUN_TEST(test_stored_and_fixed_blocks);
+    RUN_TEST(test_optional_header_fields);
+    RUN_TEST(test_empty_image);
+    RUN_TEST(test_rejects_larger_window);
+    RUN_TEST(test_rejects_corrupted_streams);
+    RUN_TEST(test_update_write_failure_stops_decoding);
+
+    return TEST_EXIT_CODE;
+}
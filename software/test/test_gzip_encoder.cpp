@@ -0,0 +1,173 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "gzip_encoder.h"
+#include "gzip_payloads.h"
+
+struct Compressed {
+    std::vector<uint8_t> data;
+    size_t outputs = 0;
+    size_t largest_output = 0;
+};
+
+// Feeds data in chunks of 1 to max_chunk bytes, like a handler that sends a response with several sendChunk calls.
+static Compressed compress(const std::string &data, size_t max_chunk)
+{
+    Compressed result;
+    GzipEncoder *encoder = new GzipEncoder([&result](const uint8_t *out, size_t len) {
+        result.data.insert(result.data.end(), out, out + len);
+        ++result.outputs;
+        result.largest_output = std::max(result.largest_output, len);
+    });
+
+    size_t offset = 0;
+    while (offset < data.size()) {
+        size_t len = std::min(1 + rand() % max_chunk, data.size() - offset);
+        encoder->write((const uint8_t *)data.data() + offset, len);
+        offset += len;
+    }
+    encoder->finish();
+    delete encoder;
+
+    return result;
+}
+
+// Decompresses with zlib, which also checks the gzip header and the CRC32 and size in the trailer.
+static bool gunzip(const std::vector<uint8_t> &stream, std::string *out)
+{
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK)
+        return false;
+
+    strm.next_in = const_cast<uint8_t *>(stream.data());
+    strm.avail_in = stream.size();
+
+    int result;
+    do {
+        uint8_t buf[4096];
+        strm.next_out = buf;
+        strm.avail_out = sizeof(buf);
+        result = inflate(&strm, Z_NO_FLUSH);
+        out->append((const char *)buf, sizeof(buf) - strm.avail_out);
+    } while (result == Z_OK);
+
+    bool ok = result == Z_STREAM_END && strm.avail_in == 0;
+    inflateEnd(&strm);
+    return ok;
+}
+
+static bool round_trip(const std::string &data, size_t max_chunk)
+{
+    Compressed compressed = compress(data, max_chunk);
+    CHECK(compressed.largest_output <= GZIP_ENCODER_OUT_BUF_SIZE);
+
+    std::string decompressed;
+    bool ok = gunzip(compressed.data, &decompressed) && decompressed == data;
+    CHECK(ok);
+    return ok;
+}
+
+static void test_empty_input()
+{
+    round_trip("", 1);
+}
+
+static void test_payloads_in_one_write()
+{
+    for (const GzipPayload &payload : gzip_payloads(1)) {
+        if (!round_trip(payload.data, payload.data.size()))
+            fprintf(stderr, "    payload: %s\n", payload.name);
+    }
+}
+
+static void test_payloads_in_random_split_writes()
+{
+    for (unsigned seed = 1; seed <= 20; ++seed) {
+        for (const GzipPayload &payload : gzip_payloads(seed)) {
+            // Mostly small writes like sendJsonIntegers, sometimes larger than the window.
+            size_t max_chunk = seed % 2 == 0 ? 16 : 3 * 2048;
+            if (!round_trip(payload.data, max_chunk))
+                fprintf(stderr, "    payload: %s, seed %u\n", payload.name, seed);
+        }
+    }
+}
+
+static void test_single_byte_writes()
+{
+    std::string data = gzip_payloads(2)[1].data;
+    round_trip(data, 1);
+}
+
+// Long runs produce maximum length matches at distance 1.
+static void test_long_runs()
+{
+    std::string data(100000, 'a');
+    data += std::string(5000, 'b') + "end";
+    round_trip(data, 4096);
+
+    Compressed compressed = compress(data, 4096);
+    CHECK(compressed.data.size() < data.size() / 100);
+}
+
+// Random data can't be compressed: The fixed Huffman literals cost at most 9 bits per byte.
+static void test_incompressible_data()
+{
+    std::string data;
+    for (int i = 0; i < 50000; ++i)
+        data += (char)(rand() % 256);
+
+    round_trip(data, 1000);
+
+    Compressed compressed = compress(data, 1000);
+    CHECK(compressed.data.size() < data.size() * 9 / 8 + 64);
+}
+
+static void test_compresses_payloads()
+{
+    for (const GzipPayload &payload : gzip_payloads(3)) {
+        Compressed compressed = compress(payload.data, 512);
+        if (compressed.data.size() * 2 > payload.data.size())
+            fprintf(stderr, "    payload %s: %zu -> %zu bytes\n", payload.name, payload.data.size(), compressed.data.size());
+        CHECK(compressed.data.size() * 2 <= payload.data.size());
+    }
+}
+
+int main()
+{
+    RUN_TEST(test_empty_input);
+    RUN_TEST(test_payloads_in_one_write);
+    RUN_TEST(test_payloads_in_random_split_writes);
+    RUN_TEST(test_single_byte_writes);
+    RUN_TEST(test_long_runs);
+    RUN_TEST(test_incompressible_data);
+    RUN_TEST(test_compresses_payloads);
+
+    return TEST_EXIT_CODE;
+}
@@ -0,0 +1,170 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "test.h"
+
+#include <chrono>
+#include <thread>
+
+#include "task_scheduler.h"
+
+#define MAIN_LOOP_MAX_SLEEP_MS 1000
+
+struct LoopDriver {
+    TaskScheduler scheduler;
+    uint32_t poll_interval_ms;
+    uint32_t polls = 0;
+    uint32_t iterations = 0;
+    uint32_t longest_sleep_ms = 0;
+
+    LoopDriver(uint32_t poll_interval_ms) : poll_interval_ms(poll_interval_ms) {
+        scheduler.setup();
+    }
+
+    // Mirrors loop() in main.cpp.template. Instead of blocking in waitForWork,
+    // the fake clock jumps to the end of the sleep.
+    uint32_t iterate() {
+        if (scheduler.pollDue()) {
+            ++polls;
+            scheduler.setNextPoll(poll_interval_ms);
+        }
+
+        scheduler.loop();
+        ++iterations;
+
+        uint32_t sleep_ms = scheduler.msUntilNextDeadline(MAIN_LOOP_MAX_SLEEP_MS);
+        if (sleep_ms > longest_sleep_ms)
+            longest_sleep_ms = sleep_ms;
+        fake_clock_advance_ms(sleep_ms);
+        return sleep_ms;
+    }
+
+    void run_for(uint32_t ms) {
+        uint32_t end = millis() + ms;
+        while (!deadline_elapsed(end))
+            iterate();
+    }
+};
+
+static void test_poll_interval_caps_sleep()
+{
+    fake_clock_set_ms(1000);
+    LoopDriver driver(10);
+
+    driver.run_for(1000);
+
+    CHECK_EQ(driver.polls, 100);
+    CHECK_EQ(driver.longest_sleep_ms, 10);
+    // One iteration per poll: the loop never spins while idle.
+    CHECK_EQ(driver.iterations, driver.polls);
+}
+
+static void test_task_deadline_caps_sleep()
+{
+    fake_clock_set_ms(1000);
+    LoopDriver driver(10);
+
+    int runs = 0;
+    driver.scheduler.scheduleOnce("task", [&runs]() { ++runs; }, 3);
+
+    driver.iterate();
+    CHECK_EQ(millis(), 1003);
+    CHECK_EQ(runs, 0);
+
+    driver.iterate();
+    CHECK_EQ(runs, 1);
+    CHECK_EQ(millis(), 1010);
+}
+
+static void test_idle_without_bricklets()
+{
+    fake_clock_set_ms(1000);
+    LoopDriver driver(MAIN_LOOP_MAX_SLEEP_MS);
+
+    int runs = 0;
+    driver.scheduler.scheduleWithFixedDelay("task", [&runs]() { ++runs; }, 250, 500);
+
+    driver.run_for(10000);
+
+    CHECK_EQ(runs, 20);
+    CHECK_EQ(driver.polls, 10);
+    CHECK_EQ(driver.longest_sleep_ms, 500);
+    CHECK_EQ(driver.iterations, 30);
+}
+
+static void test_due_task_does_not_sleep()
+{
+    fake_clock_set_ms(1000);
+    LoopDriver driver(10);
+    driver.iterate();
+
+    driver.scheduler.scheduleOnce("now", []() {}, 0);
+    CHECK_EQ(driver.scheduler.msUntilNextDeadline(MAIN_LOOP_MAX_SLEEP_MS), 0);
+}
+
+static void test_clock_wrap_around()
+{
+    fake_clock_set_ms(UINT32_MAX - 25);
+    LoopDriver driver(10);
+
+    int runs = 0;
+    driver.scheduler.scheduleWithFixedDelay("task", [&runs]() { ++runs; }, 15, 15);
+
+    driver.run_for(100);
+
+    CHECK_EQ(driver.polls, 10);
+    CHECK_EQ(runs, 6);
+    CHECK(driver.longest_sleep_ms <= 10);
+}
+
+// waitForWork has to return as soon as another thread schedules a task.
+static void test_wake_up_ends_sleep()
+{
+    fake_clock_set_ms(1000);
+    TaskScheduler scheduler;
+    scheduler.setup();
+    scheduler.setNextPoll(MAIN_LOOP_MAX_SLEEP_MS);
+
+    std::thread other([&scheduler]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        scheduler.scheduleOnce("from other thread", []() {}, 0);
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    scheduler.waitForWork(MAIN_LOOP_MAX_SLEEP_MS);
+    auto waited = std::chrono::steady_clock::now() - start;
+    other.join();
+
+    CHECK(waited >= std::chrono::milliseconds(20));
+    CHECK(waited < std::chrono::milliseconds(MAIN_LOOP_MAX_SLEEP_MS / 2));
+    CHECK_EQ(scheduler.wake_ups, 1);
+    CHECK_EQ(scheduler.msUntilNextDeadline(MAIN_LOOP_MAX_SLEEP_MS), 0);
+}
+
+int main()
+{
+    RUN_TEST(test_poll_interval_caps_sleep);
+    RUN_TEST(test_task_deadline_caps_sleep);
+    RUN_TEST(test_idle_without_bricklets);
+    RUN_TEST(test_due_task_does_not_sleep);
+    RUN_TEST(test_clock_wrap_around);
+    RUN_TEST(test_wake_up_ends_sleep);
+
+    return TEST_EXIT_CODE;
+}
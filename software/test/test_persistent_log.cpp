@@ -0,0 +1,225 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "test.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "persistent_log.h"
+
+// Emulates NOR flash in a file: Erasing sets a segment to 0xFF, writing can only clear bits.
+// Reopening the file emulates a reboot.
+class FileFlash : public PersistentLogFlash {
+public:
+    FileFlash(const char *path, size_t size, bool create) : flash_size(size) {
+        if (create) {
+            f = fopen(path, "w+b");
+            std::vector<uint8_t> blank(size, 0xFF);
+            fwrite(blank.data(), 1, size, f);
+        } else {
+            f = fopen(path, "r+b");
+        }
+    }
+
+    ~FileFlash() {
+        fclose(f);
+    }
+
+    size_t size() override {
+        return flash_size;
+    }
+
+    bool read(size_t offset, void *buf, size_t len) override {
+        ++reads;
+        return offset + len <= flash_size && fseek(f, offset, SEEK_SET) == 0 && fread(buf, 1, len, f) == len;
+    }
+
+    bool write(size_t offset, const void *buf, size_t len) override {
+        if (fail_writes_after == 0)
+            return false;
+        if (fail_writes_after > 0)
+            --fail_writes_after;
+
+        std::vector<uint8_t> old(len);
+        if (!read(offset, old.data(), len))
+            return false;
+
+        for (size_t i = 0; i < len; ++i)
+            old[i] &= ((const uint8_t *)buf)[i];
+
+        return fseek(f, offset, SEEK_SET) == 0 && fwrite(old.data(), 1, len, f) == len;
+    }
+
+    bool erase_segment(size_t offset) override {
+        if (offset % PERSISTENT_LOG_SEGMENT_SIZE != 0 || offset + PERSISTENT_LOG_SEGMENT_SIZE > flash_size)
+            return false;
+
+        ++erases[offset / PERSISTENT_LOG_SEGMENT_SIZE];
+        std::vector<uint8_t> blank(PERSISTENT_LOG_SEGMENT_SIZE, 0xFF);
+        return fseek(f, offset, SEEK_SET) == 0 && fwrite(blank.data(), 1, blank.size(), f) == blank.size();
+    }
+
+    FILE *f;
+    size_t flash_size;
+    size_t reads = 0;
+    // Number of writes that still succeed; -1 for no limit.
+    int fail_writes_after = -1;
+    std::vector<int> erases = std::vector<int>(64, 0);
+};
+
+static char path[] = "/tmp/persistent_log_XXXXXX";
+
+static std::string read_boot(PersistentLog &log, uint32_t boot_id)
+{
+    std::string result;
+    log.read_boot(boot_id, [&result](const char *buf, size_t len) {
+        result.append(buf, len);
+    });
+    return result;
+}
+
+static void test_blank_flash()
+{
+    FileFlash flash(path, 16 * PERSISTENT_LOG_SEGMENT_SIZE, true);
+    PersistentLog log;
+
+    CHECK(log.mount(&flash));
+    CHECK_EQ(log.current_boot_id(), 1);
+    CHECK_EQ(log.previous_boot_id(), 0);
+    CHECK(read_boot(log, 1) == "");
+
+    CHECK(log.append("hello\n", 6));
+    CHECK(log.append("world\n", 6));
+    CHECK(read_boot(log, 1) == "hello\nworld\n");
+}
+
+static void test_too_small()
+{
+    FileFlash flash(path, PERSISTENT_LOG_SEGMENT_SIZE, true);
+    PersistentLog log;
+
+    CHECK(!log.mount(&flash));
+    CHECK(!log.is_mounted());
+    CHECK(!log.append("x", 1));
+}
+
+static void test_previous_boot_survives_reboot()
+{
+    std::string first;
+    {
+        FileFlash flash(path, 16 * PERSISTENT_LOG_SEGMENT_SIZE, true);
+        PersistentLog log;
+        CHECK(log.mount(&flash));
+
+        // Spans several segments.
+        for (int i = 0; i < 500; ++i) {
+            char line[32];
+            int len = snprintf(line, sizeof(line), "boot 1 line %d\n", i);
+            first.append(line, len);
+            CHECK(log.append(line, len));
+        }
+    }
+
+    FileFlash flash(path, 16 * PERSISTENT_LOG_SEGMENT_SIZE, false);
+    PersistentLog log;
+    CHECK(log.mount(&flash));
+    CHECK_EQ(log.current_boot_id(), 2);
+    CHECK_EQ(log.previous_boot_id(), 1);
+
+    CHECK(log.append("boot 2\n", 7));
+    CHECK(read_boot(log, 1) == first);
+    CHECK(read_boot(log, 2) == "boot 2\n");
+}
+
+// Older boots are overwritten segment by segment; the newest data is never lost.
+static void test_wrap_around_wear_levelling()
+{
+    const size_t segments = 8;
+    FileFlash flash(path, segments * PERSISTENT_LOG_SEGMENT_SIZE, true);
+    PersistentLog log;
+    CHECK(log.mount(&flash));
+
+    std::string line(100, 'x');
+    line.back() = '\n';
+    for (int i = 0; i < 1000; ++i)
+        CHECK(log.append(line.data(), line.size()));
+
+    std::string current = read_boot(log, 1);
+    // At most segment_count - 1 full segments and the current one are kept.
+    CHECK(current.size() <= segments * (PERSISTENT_LOG_SEGMENT_SIZE - 12));
+    CHECK(current.size() >= (segments - 1) * (PERSISTENT_LOG_SEGMENT_SIZE - 12) - line.size());
+    CHECK(current.compare(current.size() - line.size(), line.size(), line) == 0);
+
+    int min_erases = flash.erases[0];
+    int max_erases = flash.erases[0];
+    for (size_t i = 1; i < segments; ++i) {
+        min_erases = std::min(min_erases, flash.erases[i]);
+        max_erases = std::max(max_erases, flash.erases[i]);
+    }
+    CHECK(max_erases - min_erases <= 1);
+}
+
+// A reboot in the middle of starting a segment must not break the next mount.
+static void test_interrupted_segment_header()
+{
+    {
+        FileFlash flash(path, 4 * PERSISTENT_LOG_SEGMENT_SIZE, true);
+        PersistentLog log;
+        CHECK(log.mount(&flash));
+        CHECK(log.append("before\n", 7));
+
+        std::string fill(PERSISTENT_LOG_SEGMENT_SIZE, 'f');
+        // The next segment's header write (without the magic number) succeeds, the magic number write fails.
+        flash.fail_writes_after = 2;
+        CHECK(!log.append(fill.data(), fill.size()));
+    }
+
+    FileFlash flash(path, 4 * PERSISTENT_LOG_SEGMENT_SIZE, false);
+    PersistentLog log;
+    CHECK(log.mount(&flash));
+    CHECK_EQ(log.current_boot_id(), 2);
+
+    std::string previous = read_boot(log, 1);
+    CHECK(previous.compare(0, 7, "before\n") == 0);
+}
+
+int main()
+{
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    RUN_TEST(test_blank_flash);
+    RUN_TEST(test_too_small);
+    RUN_TEST(test_previous_boot_survives_reboot);
+    RUN_TEST(test_wrap_around_wear_levelling);
+    RUN_TEST(test_interrupted_segment_header);
+
+    unlink(path);
+    return TEST_EXIT_CODE;
+}
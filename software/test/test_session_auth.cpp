@@ -0,0 +1,217 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "test.h"
+
+#include <Arduino.h>
+
+#include <ctype.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "session_auth.h"
+
+#define LIFETIME_S 3600
+
+// The session module has global state: The tests run in order and build on each other.
+
+static std::string create()
+{
+    char buf[SESSION_TOKEN_LEN + 1];
+    if (!createSessionToken(buf))
+        return "";
+    return buf;
+}
+
+static bool check(const std::string &token)
+{
+    return checkSessionToken(token.data(), token.length());
+}
+
+static void revoke(const std::string &token)
+{
+    revokeSessionToken(token.data(), token.length());
+}
+
+static void test_disabled_by_default()
+{
+    fake_clock_set_ms(1000000);
+
+    char buf[SESSION_TOKEN_LEN + 1];
+    CHECK(!createSessionToken(buf));
+    CHECK_EQ(getSessionLifetime(), 0);
+    CHECK(!check("00000000.00000000.00000000000000000000000000000000"));
+}
+
+static void test_issue_and_verify()
+{
+    setSessionLifetime(LIFETIME_S);
+    CHECK_EQ(getSessionLifetime(), LIFETIME_S);
+
+    std::string a = create();
+    std::string b = create();
+    CHECK_EQ(a.length(), SESSION_TOKEN_LEN);
+    CHECK_EQ(b.length(), SESSION_TOKEN_LEN);
+    CHECK(a != b);
+
+    CHECK(check(a));
+    CHECK(check(b));
+
+    // The token does not have to be null-terminated.
+    std::string padded = a + "; other=cookie";
+    CHECK(checkSessionToken(padded.data(), SESSION_TOKEN_LEN));
+}
+
+static void test_tampered_tokens()
+{
+    std::string token = create();
+    CHECK(check(token));
+
+    // Changing any char of the expiry, the id or the MAC has to invalidate the token.
+    for (size_t i = 0; i < token.length(); ++i) {
+        std::string tampered = token;
+        tampered[i] = tampered[i] == '0' ? '1' : '0';
+        if (check(tampered))
+            fprintf(stderr, "tampered char %zu accepted\n", i);
+        CHECK(!check(tampered));
+    }
+
+    std::string upper = token;
+    for (char &c : upper)
+        c = toupper(c);
+    if (upper != token)
+        CHECK(!check(upper));
+
+    CHECK(!check(token.substr(0, SESSION_TOKEN_LEN - 1)));
+    CHECK(!check(token + "0"));
+    CHECK(!check(""));
+}
+
+static void test_expiry()
+{
+    std::string token = create();
+
+    fake_clock_advance_ms((LIFETIME_S - 1) * 1000);
+    CHECK(check(token));
+
+    fake_clock_advance_ms(1000);
+    CHECK(!check(token));
+
+    // New tokens are valid again.
+    CHECK(check(create()));
+}
+
+static void test_disabling_rejects_tokens()
+{
+    std::string token = create();
+
+    setSessionLifetime(0);
+    CHECK(!check(token));
+    CHECK(create().empty());
+
+    setSessionLifetime(LIFETIME_S);
+    CHECK(check(token));
+}
+
+static void test_revoke_one_token()
+{
+    std::string a = create();
+    std::string b = create();
+
+    revoke(a);
+    CHECK(!check(a));
+    CHECK(check(b));
+
+    // Revoking an invalid token changes nothing.
+    revoke("garbage");
+    revoke(a);
+    CHECK(check(b));
+}
+
+static void test_revoke_all_tokens()
+{
+    std::string a = create();
+    std::string b = create();
+
+    revokeAllSessionTokens();
+    CHECK(!check(a));
+    CHECK(!check(b));
+
+    CHECK(check(create()));
+}
+
+static void test_revocation_list_overflow_rotates_key()
+{
+    // Start with an empty revocation list.
+    revokeAllSessionTokens();
+
+    std::vector<std::string> tokens;
+    for (size_t i = 0; i < SESSION_REVOKED_COUNT + 1; ++i)
+        tokens.push_back(create());
+    std::string survivor = create();
+
+    for (size_t i = 0; i < SESSION_REVOKED_COUNT; ++i)
+        revoke(tokens[i]);
+
+    // The list is full, but nobody else was logged out.
+    CHECK(check(survivor));
+    CHECK(check(tokens[SESSION_REVOKED_COUNT]));
+    for (size_t i = 0; i < SESSION_REVOKED_COUNT; ++i)
+        CHECK(!check(tokens[i]));
+
+    // One more logout replaces the key.
+    revoke(tokens[SESSION_REVOKED_COUNT]);
+    CHECK(!check(tokens[SESSION_REVOKED_COUNT]));
+    CHECK(!check(survivor));
+    CHECK(check(create()));
+}
+
+static void test_expired_revocations_are_reused()
+{
+    revokeAllSessionTokens();
+
+    for (size_t i = 0; i < SESSION_REVOKED_COUNT; ++i)
+        revoke(create());
+
+    // The revoked tokens have expired, so their entries can be reused without replacing the key.
+    fake_clock_advance_ms(LIFETIME_S * 1000);
+
+    std::string a = create();
+    std::string b = create();
+    revoke(a);
+    CHECK(!check(a));
+    CHECK(check(b));
+}
+
+int main()
+{
+    RUN_TEST(test_disabled_by_default);
+    RUN_TEST(test_issue_and_verify);
+    RUN_TEST(test_tampered_tokens);
+    RUN_TEST(test_expiry);
+    RUN_TEST(test_disabling_rejects_tokens);
+    RUN_TEST(test_revoke_one_token);
+    RUN_TEST(test_revoke_all_tokens);
+    RUN_TEST(test_revocation_list_overflow_rotates_key);
+    RUN_TEST(test_expired_revocations_are_reused);
+
+    return TEST_EXIT_CODE;
+}
@@ -0,0 +1,143 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "test.h"
+
+#include <stdint.h>
+
+#include <thread>
+
+#include "spsc_queue.h"
+
+static void test_empty_queue()
+{
+    TF_SPSCQueue<uint32_t, 4> q;
+    uint32_t val = 123;
+
+    CHECK_EQ(q.used(), 0);
+    CHECK_EQ(q.size(), 4);
+    CHECK(!q.pop(&val));
+    CHECK_EQ(val, 123);
+    CHECK(q.peek() == nullptr);
+}
+
+static void test_full_queue()
+{
+    TF_SPSCQueue<uint32_t, 4> q;
+
+    for (uint32_t i = 0; i < 4; ++i)
+        CHECK(q.push(i));
+
+    CHECK_EQ(q.used(), 4);
+    CHECK(!q.push(4));
+
+    uint32_t val;
+    CHECK(q.pop(&val));
+    CHECK_EQ(val, 0);
+
+    // One slot is free again.
+    CHECK(q.push(4));
+    CHECK(!q.push(5));
+
+    for (uint32_t i = 1; i <= 4; ++i) {
+        CHECK(q.pop(&val));
+        CHECK_EQ(val, i);
+    }
+
+    CHECK(!q.pop(&val));
+    CHECK_EQ(q.used(), 0);
+}
+
+// head and tail run freely: Fill and drain the queue many times, so that
+// the indices wrap around the capacity with every possible fill level.
+static void test_wrap_around()
+{
+    TF_SPSCQueue<uint32_t, 4> q;
+    uint32_t next_push = 0;
+    uint32_t next_pop = 0;
+
+    for (int round = 0; round < 100; ++round) {
+        size_t fill = round % 5;
+
+        for (size_t i = 0; i < fill; ++i)
+            CHECK(q.push(next_push++));
+
+        CHECK_EQ(q.used(), fill);
+        if (fill == 4)
+            CHECK(!q.push(0));
+
+        if (fill > 0) {
+            uint32_t *oldest = q.peek();
+            CHECK(oldest != nullptr);
+            if (oldest != nullptr)
+                CHECK_EQ(*oldest, next_pop);
+        }
+
+        uint32_t val;
+        while (q.pop(&val))
+            CHECK_EQ(val, next_pop++);
+
+        CHECK_EQ(next_pop, next_push);
+        CHECK(q.peek() == nullptr);
+    }
+}
+
+// The producer pushes a sequence of numbers, the consumer has to pop all of them in order.
+// A small capacity makes both threads hit the full and empty cases constantly.
+static void test_producer_consumer_threads()
+{
+    static const uint32_t COUNT = 200000;
+    static TF_SPSCQueue<uint32_t, 8> q;
+
+    std::thread producer([]() {
+        for (uint32_t i = 0; i < COUNT; ++i)
+            while (!q.push(i))
+                std::this_thread::yield();
+    });
+
+    uint32_t expected = 0;
+    uint32_t out_of_order = 0;
+    while (expected < COUNT) {
+        uint32_t val;
+        if (!q.pop(&val)) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        if (val != expected)
+            ++out_of_order;
+        expected = val + 1;
+    }
+
+    producer.join();
+
+    CHECK_EQ(out_of_order, 0);
+    CHECK_EQ(expected, COUNT);
+    CHECK_EQ(q.used(), 0);
+}
+
+int main()
+{
+    RUN_TEST(test_empty_queue);
+    RUN_TEST(test_full_queue);
+    RUN_TEST(test_wrap_around);
+    RUN_TEST(test_producer_consumer_threads);
+
+    return TEST_EXIT_CODE;
+}
@@ -0,0 +1,189 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "test.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "task_scheduler.h"
+
+// Holds a worker busy until release() is called.
+struct Gate {
+    std::mutex m;
+    std::condition_variable cv;
+    bool open = false;
+
+    void wait() {
+        std::unique_lock<std::mutex> l{m};
+        cv.wait(l, [this]() { return open; });
+    }
+
+    void release() {
+        {
+            std::lock_guard<std::mutex> l{m};
+            open = true;
+        }
+        cv.notify_all();
+    }
+};
+
+static void test_jobs_run_on_worker_threads()
+{
+    TaskScheduler scheduler;
+    scheduler.setup();
+
+    std::thread::id job_thread;
+    std::thread::id done_thread;
+
+    scheduler.submit("job", [&job_thread]() {
+        job_thread = std::this_thread::get_id();
+    }, [&done_thread]() {
+        done_thread = std::this_thread::get_id();
+    });
+
+    CHECK(scheduler.waitForJobs(1000));
+    CHECK(job_thread != std::thread::id());
+    CHECK(job_thread != std::this_thread::get_id());
+
+    // on_done is scheduled on the main loop.
+    CHECK(done_thread == std::thread::id());
+    scheduler.loop();
+    CHECK(done_thread == std::this_thread::get_id());
+}
+
+static void test_priority_and_submission_order()
+{
+    TaskScheduler scheduler;
+    scheduler.setup();
+
+    Gate gate;
+    std::mutex order_mutex;
+    std::vector<int> order;
+    auto record = [&order_mutex, &order](int i) {
+        std::lock_guard<std::mutex> l{order_mutex};
+        order.push_back(i);
+    };
+
+    std::atomic<bool> started{false};
+    scheduler.submit("block", [&gate, &started]() {
+        started = true;
+        gate.wait();
+    }, nullptr);
+    // Wait until the worker took the blocking job, so that the following jobs are queued.
+    while (!started)
+        std::this_thread::yield();
+
+    scheduler.submit("low 1", [&record]() { record(1); }, nullptr, 0, 0);
+    scheduler.submit("low 2", [&record]() { record(2); }, nullptr, 0, 0);
+    scheduler.submit("high", [&record]() { record(3); }, nullptr, 0, 5);
+    scheduler.submit("low 3", [&record]() { record(4); }, nullptr, 0, 0);
+
+    gate.release();
+    CHECK(scheduler.waitForJobs(1000));
+
+    CHECK_EQ(order.size(), 4);
+    if (order.size() == 4) {
+        CHECK_EQ(order[0], 3);
+        CHECK_EQ(order[1], 1);
+        CHECK_EQ(order[2], 2);
+        CHECK_EQ(order[3], 4);
+    }
+}
+
+static void test_wait_for_jobs_times_out()
+{
+    TaskScheduler scheduler;
+    scheduler.setup();
+
+    // Nothing submitted: the workers are idle.
+    CHECK(scheduler.waitForJobs(0));
+
+    Gate gate;
+    scheduler.submit("block", [&gate]() { gate.wait(); }, nullptr);
+
+    auto start = std::chrono::steady_clock::now();
+    CHECK(!scheduler.waitForJobs(50));
+    CHECK(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(50));
+
+    gate.release();
+    CHECK(scheduler.waitForJobs(1000));
+}
+
+// A restart waits for every queued write, not only for the ones that happen
+// to share a worker and priority with the restart.
+static void test_wait_for_jobs_drains_all_workers()
+{
+    TaskScheduler scheduler;
+    scheduler.setup();
+
+    std::atomic<int> writes{0};
+    for (int core = 0; core < portNUM_PROCESSORS; ++core) {
+        for (int i = 0; i < 10; ++i) {
+            scheduler.submit("persist config", [&writes]() {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                ++writes;
+            }, nullptr, core, (uint8_t)(i % 3));
+        }
+    }
+
+    CHECK(scheduler.waitForJobs(5000));
+    CHECK_EQ(writes.load(), portNUM_PROCESSORS * 10);
+}
+
+static void test_no_affinity_uses_least_loaded_worker()
+{
+    TaskScheduler scheduler;
+    scheduler.setup();
+
+    Gate gate;
+    std::mutex ids_mutex;
+    std::vector<std::thread::id> ids;
+
+    scheduler.submit("block", [&gate]() { gate.wait(); }, nullptr, 0);
+    scheduler.submit("any", [&ids_mutex, &ids]() {
+        std::lock_guard<std::mutex> l{ids_mutex};
+        ids.push_back(std::this_thread::get_id());
+    }, nullptr, -1);
+
+    // Core 0 is blocked, so the job must have been given to the other worker.
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    {
+        std::lock_guard<std::mutex> l{ids_mutex};
+        CHECK_EQ(ids.size(), 1);
+    }
+
+    gate.release();
+    CHECK(scheduler.waitForJobs(1000));
+}
+
+int main()
+{
+    RUN_TEST(test_jobs_run_on_worker_threads);
+    RUN_TEST(test_priority_and_submission_order);
+    RUN_TEST(test_wait_for_jobs_times_out);
+    RUN_TEST(test_wait_for_jobs_drains_all_workers);
+    RUN_TEST(test_no_affinity_uses_least_loaded_worker);
+
+    return TEST_EXIT_CODE;
+}
@@ -0,0 +1,199 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "test.h"
+
+#include <string.h>
+
+#include "uri_router.h"
+
+// The router only passes handlers through.
+struct WebServerHandler {
+    int id;
+};
+
+// Same values as esp_http_server's httpd_method_t.
+#define GET 1
+#define POST 3
+#define PUT 4
+
+static WebServerHandler h1{1}, h2{2}, h3{3}, h4{4};
+
+static WebServerHandler *find(UriRouter &router, const char *path, int method, UriRouterParams *params = nullptr, bool *path_found = nullptr)
+{
+    bool found;
+    // Like the web server: The query string is not part of the path.
+    return router.find(path, strcspn(path, "?"), method, params, path_found != nullptr ? path_found : &found);
+}
+
+static bool param_is(const UriRouterParams &params, const char *name, const char *value)
+{
+    const UriRouterParam *p = params.get(name);
+    return p != nullptr && p->value_len == strlen(value) && memcmp(p->value, value, p->value_len) == 0;
+}
+
+static void test_exact_match()
+{
+    UriRouter router;
+    CHECK(router.add("/", GET, &h1));
+    CHECK(router.add("/evse/state", GET, &h2));
+    CHECK(router.add("/evse/start_charging", PUT, &h3));
+
+    CHECK(find(router, "/", GET) == &h1);
+    CHECK(find(router, "/evse/state", GET) == &h2);
+    CHECK(find(router, "/evse/start_charging", PUT) == &h3);
+
+    // Only complete segments match.
+    CHECK(find(router, "/evse", GET) == nullptr);
+    CHECK(find(router, "/evse/stat", GET) == nullptr);
+    CHECK(find(router, "/evse/state/x", GET) == nullptr);
+    CHECK(find(router, "/evse/state_x", GET) == nullptr);
+    CHECK(find(router, "evse/state", GET) == nullptr);
+
+    CHECK(router.contains("/evse/state", strlen("/evse/state")));
+    CHECK(!router.contains("/evse/states", strlen("/evse/states")));
+}
+
+static void test_not_found_vs_method_not_allowed()
+{
+    UriRouter router;
+    CHECK(router.add("/evse/state", GET, &h1));
+    CHECK(router.add("/evse/state", PUT, &h2));
+
+    bool path_found = true;
+    CHECK(find(router, "/meter/state", GET, nullptr, &path_found) == nullptr);
+    CHECK(!path_found);
+
+    path_found = false;
+    CHECK(find(router, "/evse/state", POST, nullptr, &path_found) == nullptr);
+    CHECK(path_found);
+
+    path_found = false;
+    CHECK(find(router, "/evse/state", PUT, nullptr, &path_found) == &h2);
+    CHECK(path_found);
+}
+
+static void test_duplicate_registration()
+{
+    UriRouter router;
+    CHECK(router.add("/evse/state", GET, &h1));
+    CHECK(!router.add("/evse/state", GET, &h2));
+    CHECK(router.add("/evse/state", PUT, &h2));
+
+    // The first registration stays.
+    CHECK(find(router, "/evse/state", GET) == &h1);
+
+    CHECK(router.add("/meter/:id", GET, &h3));
+    CHECK(!router.add("/meter/:id", GET, &h4));
+    // Parameters at the same position have to use the same name.
+    CHECK(!router.add("/meter/:name", PUT, &h4));
+
+    CHECK(router.add("/files/*", GET, &h3));
+    CHECK(!router.add("/files/*", GET, &h4));
+}
+
+static void test_invalid_patterns()
+{
+    UriRouter router;
+    CHECK(!router.add("", GET, &h1));
+    CHECK(!router.add("evse/state", GET, &h1));
+    CHECK(!router.add("/files/*/x", GET, &h1));
+    CHECK(!router.add("/:a/:b/:c/:d/:e", GET, &h1));
+    CHECK(router.add("/:a/:b/:c/:d", GET, &h1));
+}
+
+static void test_query_string_is_ignored()
+{
+    UriRouter router;
+    CHECK(router.add("/evse/state", GET, &h1));
+    CHECK(router.add("/meter/:id", GET, &h2));
+
+    CHECK(find(router, "/evse/state?", GET) == &h1);
+    CHECK(find(router, "/evse/state?foo=bar&x=/y", GET) == &h1);
+
+    UriRouterParams params;
+    CHECK(find(router, "/meter/3?values=all", GET, &params) == &h2);
+    CHECK_EQ(params.count, 1);
+    CHECK(param_is(params, "id", "3"));
+}
+
+static void test_path_params()
+{
+    UriRouter router;
+    CHECK(router.add("/meter/:id/values", GET, &h1));
+    CHECK(router.add("/meter/all/values", GET, &h2));
+    CHECK(router.add("/users/:user/keys/:key", GET, &h3));
+
+    UriRouterParams params;
+    CHECK(find(router, "/meter/1/values", GET, &params) == &h1);
+    CHECK_EQ(params.count, 1);
+    CHECK(param_is(params, "id", "1"));
+    CHECK(params.get("user") == nullptr);
+
+    // Static segments take precedence over parameters.
+    CHECK(find(router, "/meter/all/values", GET, &params) == &h2);
+    CHECK_EQ(params.count, 0);
+
+    CHECK(find(router, "/users/alice/keys/42", GET, &params) == &h3);
+    CHECK_EQ(params.count, 2);
+    CHECK(param_is(params, "user", "alice"));
+    CHECK(param_is(params, "key", "42"));
+
+    // A parameter never matches an empty segment.
+    CHECK(find(router, "/meter//values", GET) == nullptr);
+    CHECK(find(router, "/meter/1", GET) == nullptr);
+}
+
+static void test_wildcard()
+{
+    UriRouter router;
+    CHECK(router.add("/files/*", GET, &h1));
+    CHECK(router.add("/files/index.html", GET, &h2));
+    CHECK(router.add("/*", GET, &h3));
+
+    UriRouterParams params;
+    CHECK(find(router, "/files/a/b/c.txt", GET, &params) == &h1);
+    CHECK_EQ(params.count, 1);
+    CHECK(param_is(params, "*", "a/b/c.txt"));
+
+    CHECK(find(router, "/files/index.html", GET, &params) == &h2);
+    CHECK_EQ(params.count, 0);
+
+    CHECK(find(router, "/files/", GET, &params) == &h1);
+    CHECK(param_is(params, "*", ""));
+
+    // Falls back to the deepest wildcard seen on the way down.
+    CHECK(find(router, "/other/path", GET, &params) == &h3);
+    CHECK(param_is(params, "*", "other/path"));
+    CHECK(find(router, "/", GET, &params) == &h3);
+    CHECK(param_is(params, "*", ""));
+}
+
+int main()
+{
+    RUN_TEST(test_exact_match);
+    RUN_TEST(test_not_found_vs_method_not_allowed);
+    RUN_TEST(test_duplicate_registration);
+    RUN_TEST(test_invalid_patterns);
+    RUN_TEST(test_query_string_is_ignored);
+    RUN_TEST(test_path_params);
+    RUN_TEST(test_wildcard);
+
+    return TEST_EXIT_CODE;
+}
@@ -173,6 +173,138 @@ const RECONNECT_TIME = 12000;
 
 let eventTarget: EventTarget = null;
 
+// Paths of the states of the CBOR web socket protocol, indexed by topic id. Sent first on every connection.
+let wsTopics: string[] = [];
+
+const CBOR_TAG_EMBEDDED_JSON = 262;
+
+let float32 = new Float32Array(1);
+
+// Returns the shortest number that is the same single precision float, as the firmware prints it in JSON.
+function shortest_float32(value: number) {
+    for (let precision = 1; precision <= 9; ++precision) {
+        let candidate = parseFloat(value.toPrecision(precision));
+        float32[0] = candidate;
+        if (float32[0] == value)
+            return candidate;
+    }
+    return value;
+}
+
+// Decodes the items of a frame of the CBOR web socket protocol.
+// The firmware only uses definite lengths.
+function decode_cbor_sequence(buffer: ArrayBuffer) {
+    let view = new DataView(buffer);
+    let pos = 0;
+
+    let read_argument = (info: number) => {
+        let result: number;
+        if (info < 24) {
+            return info;
+        } else if (info == 24) {
+            result = view.getUint8(pos);
+            pos += 1;
+        } else if (info == 25) {
+            result = view.getUint16(pos);
+            pos += 2;
+        } else if (info == 26) {
+            result = view.getUint32(pos);
+            pos += 4;
+        } else if (info == 27) {
+            result = view.getUint32(pos) * 0x100000000 + view.getUint32(pos + 4);
+            pos += 8;
+        } else {
+            throw new Error("Unsupported CBOR argument " + info);
+        }
+        return result;
+    };
+
+    let read_item = (): any => {
+        let initial = view.getUint8(pos++);
+        let major = initial >> 5;
+        let info = initial & 0x1F;
+
+        if (major == 7) {
+            switch (info) {
+                case 20: return false;
+                case 21: return true;
+                case 22: return null;
+                case 26: {
+                    let value = shortest_float32(view.getFloat32(pos));
+                    pos += 4;
+                    return value;
+                }
+                case 27: {
+                    let value = view.getFloat64(pos);
+                    pos += 8;
+                    return value;
+                }
+                default:
+                    throw new Error("Unsupported CBOR simple value " + info);
+            }
+        }
+
+        let argument = read_argument(info);
+        switch (major) {
+            case 0:
+                return argument;
+            case 1:
+                return -1 - argument;
+            case 2:
+            case 3: {
+                let bytes = new Uint8Array(buffer, pos, argument);
+                pos += argument;
+                return major == 2 ? bytes : new TextDecoder().decode(bytes);
+            }
+            case 4: {
+                let result: any[] = [];
+                for (let i = 0; i < argument; ++i)
+                    result.push(read_item());
+                return result;
+            }
+            case 5: {
+                let result: any = {};
+                for (let i = 0; i < argument; ++i) {
+                    let key = read_item();
+                    result[key] = read_item();
+                }
+                return result;
+            }
+            case 6: {
+                let tagged = read_item();
+                if (argument == CBOR_TAG_EMBEDDED_JSON)
+                    return JSON.parse(new TextDecoder().decode(tagged));
+                return tagged;
+            }
+        }
+    };
+
+    let items: any[] = [];
+    while (pos < buffer.byteLength)
+        items.push(read_item());
+    return items;
+}
+
+function dispatch_cbor_message(message: any) {
+    if (!Array.isArray(message) || message.length != 2) {
+        console.log("Received malformed event", message);
+        return;
+    }
+
+    let topic = message[0];
+    let payload = message[1];
+
+    if (topic == "ws/topics") {
+        wsTopics = payload;
+        return;
+    }
+
+    if (typeof topic == "number")
+        topic = wsTopics[topic];
+
+    eventTarget.dispatchEvent(new MessageEvent(topic, {"data": JSON.stringify(payload)}));
+}
+
 export function setupEventSource(first: boolean, keep_as_first: boolean, continuation: (ws: WebSocket, eventTarget: EventTarget) => void) {
     if (!first) {
         add_alert("event_connection_lost", "alert-warning",  __("util.event_connection_lost_title"), __("util.event_connection_lost"))
@@ -181,8 +313,11 @@ export function setupEventSource(first: boolean, keep_as_first: boolean, continu
     if (ws != null) {
         ws.close();
     }
-    ws = new WebSocket('ws://' + location.host + '/ws');
+    // The binary protocol saves bandwidth and the firmware's JSON serialization of the states.
+    ws = new WebSocket('ws://' + location.host + '/ws', ["cbor"]);
+    ws.binaryType = "arraybuffer";
     eventTarget = new EventTarget();
+    wsTopics = [];
 
     if (wsReconnectTimeout != null) {
         clearTimeout(wsReconnectTimeout);
@@ -200,6 +335,12 @@ export function setupEventSource(first: boolean, keep_as_first: boolean, continu
         }
         wsReconnectTimeout = window.setTimeout(wsReconnectCallback, RECONNECT_TIME);
 
+        if (e.data instanceof ArrayBuffer) {
+            for (let message of decode_cbor_sequence(e.data))
+                dispatch_cbor_message(message);
+            return;
+        }
+
         for (let item of e.data.split("\n")) {
             if (item == "")
                 continue;